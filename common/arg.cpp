@@ -416,7 +416,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
                 params.draft_cpuparams.n_threads = std::thread::hardware_concurrency();
             }
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-tbd", "--threads-batch-draft"}, "N",
         "number of threads to use during batch and prompt processing (default: same as --threads-draft)",
@@ -426,7 +426,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
                 params.draft_cpuparams_batch.n_threads = std::thread::hardware_concurrency();
             }
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-C", "--cpu-mask"}, "M",
         "CPU affinity mask: arbitrarily long hex. Complements cpu-range (default: \"\")",
@@ -609,7 +609,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         [](common_params & params, int value) {
             params.n_draft = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-ps", "--p-split"}, "N",
         string_format("speculative decoding split probability (default: %.1f)", (double)params.p_split),
@@ -617,13 +617,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.p_split = std::stof(value);
         }
     ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    add_opt(common_arg(
+        {"--draft-p-min"}, "P",
+        string_format("minimum probability of a draft token to continue drafting (default: %.2f)", (double)params.p_draft_min),
+        [](common_params & params, const std::string & value) {
+            params.p_draft_min = std::stof(value);
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-lcs", "--lookup-cache-static"}, "FNAME",
         "path to static lookup cache to use for lookup decoding (not updated by generation)",
         [](common_params & params, const std::string & value) {
             params.lookup_cache_static = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-lcd", "--lookup-cache-dynamic"}, "FNAME",
         "path to dynamic lookup cache to use for lookup decoding (updated by generation)",
@@ -1353,10 +1360,49 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(common_arg(
+        {"--defrag-max-cells"}, "N",
+        string_format("max number of KV cells moved per defragmentation step, the rest is moved by the next decodes, 0 = no limit (default: %d)", params.defrag_max_cells),
+        [](common_params & params, int value) {
+            params.defrag_max_cells = value;
+        }
+    ).set_env("LLAMA_ARG_DEFRAG_MAX_CELLS"));
+    add_opt(common_arg(
+        {"-kvb", "--kv-block-size"}, "N",
+        string_format("KV cache block size for paged allocation, 0 = contiguous slots (default: %d)", params.kv_block_size),
+        [](common_params & params, int value) {
+            params.kv_block_size = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BLOCK_SIZE"));
+    add_opt(common_arg(
+        {"-kvs", "--kv-size-step"}, "N",
+        string_format("grow the KV cache on demand in steps of N cells up to the context size, 0 = allocate it up front (default: %d)", params.kv_size_step),
+        [](common_params & params, int value) {
+            params.kv_size_step = value;
+        }
+    ).set_env("LLAMA_ARG_KV_SIZE_STEP"));
+    add_opt(common_arg(
+        {"--kv-shrink"},
+        string_format("release the memory of a grown KV cache when it is cleared (default: %s)", params.kv_shrink ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.kv_shrink = true;
+        }
+    ).set_env("LLAMA_ARG_KV_SHRINK"));
+    add_opt(common_arg(
+        {"--swa-ring"},
+        string_format("store the sliding window attention layers in a cache sized to the window instead of the context (default: %s)", params.swa_ring ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.swa_ring = true;
+        }
+    ).set_env("LLAMA_ARG_SWA_RING"));
     add_opt(common_arg(
         {"-np", "--parallel"}, "N",
         string_format("number of parallel sequences to decode (default: %d)", params.n_parallel),
         [](common_params & params, int value) {
+            if (value > (int) llama_max_parallel_sequences()) {
+                throw std::invalid_argument(string_format(
+                    "at most %zu parallel sequences are supported", llama_max_parallel_sequences()));
+            }
             params.n_parallel = value;
         }
     ).set_env("LLAMA_ARG_N_PARALLEL"));
@@ -1454,7 +1500,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
                 fprintf(stderr, "warning: see main README.md for information on enabling GPU BLAS support\n");
             }
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-sm", "--split-mode"}, "{none,layer,row}",
         "how to split the model across multiple GPUs, one of:\n"
@@ -1581,6 +1627,29 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.model_alias = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ALIAS"));
+    add_opt(common_arg(
+        {"--models"}, "FNAME",
+        "router mode: JSON file of the models that the server loads on demand, {\"name\": \"path\", ...}. "
+        "requests select a model with their \"model\" field, or with the \"model\" query parameter for GET endpoints. "
+        "the model of -m, if any, is the default one",
+        [](common_params & params, const std::string & value) {
+            params.models = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MODELS"));
+    add_opt(common_arg(
+        {"--models-mem"}, "N",
+        string_format("router mode: memory (MiB) of the loaded models, the least recently used idle ones are unloaded to load another one (default: %d, 0 = no limit)", params.models_mem),
+        [](common_params & params, int value) {
+            params.models_mem = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MODELS_MEM"));
+    add_opt(common_arg(
+        {"--models-timeout"}, "N",
+        string_format("router mode: max time (seconds) a request waits for its model to be loaded, after which it is rejected with 503 (default: %d, 0 = no limit)", params.models_timeout),
+        [](common_params & params, int value) {
+            params.models_timeout = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MODELS_TIMEOUT"));
     add_opt(common_arg(
         {"-m", "--model"}, "FNAME",
         ex == LLAMA_EXAMPLE_EXPORT_LORA
@@ -1599,7 +1668,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         [](common_params & params, const std::string & value) {
             params.model_draft = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-mu", "--model-url"}, "MODEL_URL",
         "model download url (default: unused)",
@@ -1796,6 +1865,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.embedding = true;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_EMBEDDINGS"));
+    add_opt(common_arg(
+        {"--embd-cache"}, "N",
+        string_format("number of embeddings and rerank scores kept in an LRU cache, keyed by the input tokens (default: %d, 0 = disabled)", params.embd_cache),
+        [](common_params & params, int value) {
+            params.embd_cache = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_EMBD_CACHE"));
+    add_opt(common_arg(
+        {"--grammar-cache"}, "N",
+        string_format("number of compiled grammars and JSON schemas kept in an LRU cache, so that the requests with the same grammar or schema do not parse it again (default: %d, 0 = disabled)", params.grammar_cache),
+        [](common_params & params, int value) {
+            params.grammar_cache = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_GRAMMAR_CACHE"));
     add_opt(common_arg(
         {"--reranking", "--rerank"},
         string_format("enable reranking endpoint on server (default: %s)", params.reranking ? "enabled" : "disabled"),
@@ -1856,6 +1939,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_threads_http = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_THREADS_HTTP"));
+    add_opt(common_arg(
+        {"--threads-post"}, "N",
+        string_format("number of threads used to detokenize and format the results off the main loop (default: %d, 0 = main loop)", params.n_threads_post),
+        [](common_params & params, int value) {
+            params.n_threads_post = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_THREADS_POST"));
     add_opt(common_arg(
         {"--cache-reuse"}, "N",
         string_format("min chunk size to attempt reusing from the cache via KV shifting (default: %d)", params.n_cache_reuse),
@@ -1863,6 +1953,119 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--no-prefix-cache"},
+        string_format("disable reusing prompt prefixes cached by other slots (default: %s)", params.prefix_cache ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.prefix_cache = false;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_NO_PREFIX_CACHE"));
+    add_opt(common_arg(
+        {"--kv-pool"},
+        string_format("share the context between the slots instead of splitting it evenly: a slot can use up to the whole context, and a new prompt is processed once the KV cache has room for it (default: %s)", params.kv_pool ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.kv_pool = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_POOL"));
+    add_opt(common_arg(
+        {"--draft-lookup"},
+        string_format("speculative decoding without a draft model: draft tokens from the n-grams of the context of each slot (prompt lookup), optionally validated with --lookup-cache-static (default: %s)", params.draft_lookup ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.draft_lookup = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_LOOKUP"));
+    add_opt(common_arg(
+        {"--spill-ram"}, "N",
+        string_format("host memory in MiB for the KV cache of idle slots that is spilled to make room for new prompts (default: %d, 0 = disabled)", params.spill_ram),
+        [](common_params & params, int value) {
+            params.spill_ram = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SPILL_RAM"));
+    add_opt(common_arg(
+        {"--spill-disk"}, "N",
+        string_format("disk space in MiB for spilled KV cache that does not fit in --spill-ram (default: %d, 0 = disabled)", params.spill_disk),
+        [](common_params & params, int value) {
+            params.spill_disk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SPILL_DISK"));
+    add_opt(common_arg(
+        {"--spill-path"}, "PATH",
+        "directory for the spilled KV cache files (default: cache directory)",
+        [](common_params & params, const std::string & value) {
+            params.spill_path = value;
+            // if doesn't end with DIRECTORY_SEPARATOR, add it
+            if (!params.spill_path.empty() && params.spill_path[params.spill_path.size() - 1] != DIRECTORY_SEPARATOR) {
+                params.spill_path += DIRECTORY_SEPARATOR;
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SPILL_PATH"));
+    add_opt(common_arg(
+        {"--kv-cache-disk"}, "N",
+        string_format("disk space in MiB for the persistent KV cache of long prompts, reused across server restarts (default: %d, 0 = disabled)", params.kv_cache_disk),
+        [](common_params & params, int value) {
+            params.kv_cache_disk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_CACHE_DISK"));
+    add_opt(common_arg(
+        {"--kv-cache-disk-min"}, "N",
+        string_format("min number of processed prompt tokens to store a prompt in the persistent KV cache (default: %d)", params.kv_cache_disk_min),
+        [](common_params & params, int value) {
+            params.kv_cache_disk_min = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_CACHE_DISK_MIN"));
+    add_opt(common_arg(
+        {"--kv-cache-path"}, "PATH",
+        "directory for the persistent KV cache files (default: kv-cache in the cache directory)",
+        [](common_params & params, const std::string & value) {
+            params.kv_cache_path = value;
+            // if doesn't end with DIRECTORY_SEPARATOR, add it
+            if (!params.kv_cache_path.empty() && params.kv_cache_path[params.kv_cache_path.size() - 1] != DIRECTORY_SEPARATOR) {
+                params.kv_cache_path += DIRECTORY_SEPARATOR;
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_CACHE_PATH"));
+    add_opt(common_arg(
+        {"--ctx-shift-sink"}, "N",
+        string_format("rolling context shift: keep the first N tokens of a slot as attention sinks and evict --ctx-shift-step tokens at a time, instead of half of the context (default: %d, 0 = disabled)", params.ctx_shift_sink),
+        [](common_params & params, int value) {
+            params.ctx_shift_sink = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CTX_SHIFT_SINK"));
+    add_opt(common_arg(
+        {"--ctx-shift-step"}, "N",
+        string_format("number of tokens evicted at a time by the rolling context shift (default: %d)", params.ctx_shift_step),
+        [](common_params & params, int value) {
+            params.ctx_shift_step = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CTX_SHIFT_STEP"));
+    add_opt(common_arg(
+        {"--batch-budget"}, "N",
+        string_format("max number of tokens decoded per iteration, the tokens of the generating slots first and then the prompts (default: %d, 0 = batch size)", params.batch_budget),
+        [](common_params & params, int value) {
+            params.batch_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_BATCH_BUDGET"));
+    add_opt(common_arg(
+        {"--prefill-chunk"}, "N",
+        string_format("max number of prompt tokens of one slot per iteration, so that a long prompt is processed in chunks alongside the other slots (default: %d, 0 = no limit)", params.prefill_chunk),
+        [](common_params & params, int value) {
+            params.prefill_chunk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_CHUNK"));
+    add_opt(common_arg(
+        {"--queue-tokens"}, "N",
+        string_format("admission control: max KV cells of the requests in flight (the cells they hold and those they will still fill) and of the requests waiting for a slot (prompt + n_predict). beyond it, new requests shed the waiting ones of a lower priority, or are rejected with 503 and Retry-After (default: %d, 0 = no limit, -1 = context size)", params.queue_tokens),
+        [](common_params & params, int value) {
+            params.queue_tokens = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_QUEUE_TOKENS"));
+    add_opt(common_arg(
+        {"--queue-timeout"}, "N",
+        string_format("admission control: max time (seconds) a request waits for a slot, after which it is rejected with 503 (default: %d, 0 = no limit)", params.queue_timeout),
+        [](common_params & params, int value) {
+            params.queue_timeout = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_QUEUE_TIMEOUT"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
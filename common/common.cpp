@@ -1057,10 +1057,15 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.defrag_max_cells  = params.defrag_max_cells;
+    cparams.kv_block_size     = params.kv_block_size;
+    cparams.kv_size_step      = params.kv_size_step;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
     cparams.flash_attn        = params.flash_attn;
+    cparams.kv_shrink         = params.kv_shrink;
+    cparams.swa_ring          = params.swa_ring;
     cparams.no_perf           = params.no_perf;
 
     if (params.reranking) {
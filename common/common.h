@@ -164,6 +164,7 @@ struct common_params {
     int32_t n_parallel            =     1; // number of parallel sequences to decode
     int32_t n_sequences           =     1; // number of sequences to decode
     float   p_split               =  0.1f; // speculative decoding split probability
+    float   p_draft_min           = 0.75f; // minimum probability of a draft token to continue drafting (server)
     int32_t n_gpu_layers          =    -1; // number of layers to store in VRAM (-1 - use default)
     int32_t n_gpu_layers_draft    =    -1; // number of layers to store in VRAM for the draft model (-1 - use default)
     int32_t main_gpu              =     0; // the GPU that is used for scratch and small tensors
@@ -179,6 +180,9 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t defrag_max_cells      =   256; // max number of KV cells moved per defragmentation step (0 = no limit)
+    int32_t kv_block_size         =     0; // KV cache block size for paged allocation (0 = contiguous)
+    int32_t kv_size_step          =     0; // grow the KV cache in steps of this many cells (0 = allocate n_ctx up front)
 
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
@@ -267,6 +271,8 @@ struct common_params {
     bool display_prompt    = true;  // print prompt before generation
     bool dump_kv_cache     = false; // dump the KV cache contents for debugging purposes
     bool no_kv_offload     = false; // disable KV offloading
+    bool kv_shrink         = false; // release the grown KV cache memory when the cache is cleared
+    bool swa_ring          = false; // store the SWA layers in a cache sized to the attention window
     bool warmup            = true;  // warmup run
     bool check_tensors     = false; // validate tensor data
 
@@ -289,7 +295,25 @@ struct common_params {
     int32_t timeout_read   = 600;          // http read timeout in seconds
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
+    int32_t n_threads_post = 2;            // number of threads to format the results of the tasks off the main loop (0 = main loop)
+    int32_t embd_cache     = 0;            // number of embeddings kept in the LRU cache of the server (0 = disabled)
+    int32_t grammar_cache  = 64;           // number of compiled grammars and JSON schemas kept in the LRU cache of the server (0 = disabled)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    bool    prefix_cache   = true;         // attach new prompts to prefixes cached by any slot
+    bool    kv_pool        = false;        // the slots share the whole context instead of n_ctx/n_parallel each
+    bool    draft_lookup   = false;        // speculative decoding with drafts from the n-grams of the context (prompt lookup)
+    int32_t spill_ram      = 0;            // host memory (MiB) for the KV of idle sequences spilled out of the KV cache
+    int32_t spill_disk     = 0;            // disk space (MiB) for spilled KV that does not fit in spill_ram
+    int32_t kv_cache_disk  = 0;            // disk space (MiB) for the persistent KV cache of prompts (0 = disabled)
+    int32_t kv_cache_disk_min = 512;       // min number of processed prompt tokens to store a prompt in the persistent KV cache
+    int32_t ctx_shift_sink = 0;            // context shift: attention-sink tokens kept at the start of a slot, > 0 enables the rolling window
+    int32_t ctx_shift_step = 16;           // context shift: tokens evicted at a time with the rolling window
+    int32_t batch_budget   = 0;            // max tokens decoded per server iteration, generated tokens first (0 = n_batch)
+    int32_t prefill_chunk  = 0;            // max prompt tokens of one slot per server iteration (0 = no limit)
+    int32_t models_mem     = 0;            // router mode: memory (MiB) of the loaded models, the least recently used ones are unloaded (0 = no limit)
+    int32_t models_timeout = 60;           // router mode: max time (seconds) a request waits for its model to be loaded (0 = no limit)
+    int32_t queue_tokens   = 0;            // max estimated KV cells of the requests in flight and waiting for a slot, beyond which new ones are rejected (0 = no limit, -1 = context size)
+    int32_t queue_timeout  = 0;            // max time (seconds) a request waits for a slot before it is rejected (0 = no limit)
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -310,6 +334,9 @@ struct common_params {
     bool log_json = false;
 
     std::string slot_save_path;
+    std::string spill_path; // directory of the spilled KV files, defaults to the cache directory
+    std::string kv_cache_path; // directory of the persistent KV cache, defaults to the kv-cache subdirectory of the cache directory
+    std::string models;        // router mode: JSON file of the models loaded on demand, {"name": "path", ...}
 
     float slot_prompt_similarity = 0.5f;
 
@@ -36,7 +36,8 @@ struct common_sampler;
 
 // llama_sampler API overloads
 
-struct common_sampler * common_sampler_init(const struct llama_model * model, const struct common_sampler_params & params);
+// if grmr is not null, the grammar sampler is cloned from it instead of parsing params.grammar
+struct common_sampler * common_sampler_init(const struct llama_model * model, const struct common_sampler_params & params, const struct llama_sampler * grmr = nullptr);
 
 void common_sampler_free(struct common_sampler * gsmpl);
 
@@ -229,7 +229,7 @@ int main(int argc, char ** argv) {
         const uint64_t n_toks = inp.size();
 
         // encode if at capacity
-        if (batch.n_tokens + n_toks > n_batch) {
+        if (batch.n_tokens + n_toks > n_batch || s >= (int) llama_max_parallel_sequences()) {
             float * out = emb + p * n_embd;
             batch_decode(ctx, batch, out, s, n_embd);
             common_batch_clear(batch);
@@ -3,6 +3,7 @@
 #include "arg.h"
 #include "common.h"
 #include "log.h"
+#include "ngram-cache.h"
 #include "sampling.h"
 #include "json-schema-to-grammar.h"
 #include "llama.h"
@@ -23,10 +24,15 @@
 #include "deps_vue.esm-browser.js.hpp"
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstddef>
 #include <cinttypes>
+#include <cstdio>
 #include <deque>
+#include <fstream>
+#include <list>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <signal.h>
@@ -34,6 +40,14 @@
 #include <unordered_map>
 #include <unordered_set>
 
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
 using json = nlohmann::ordered_json;
 
 enum stop_type {
@@ -76,6 +90,16 @@ enum server_task_inf_type {
 struct server_task {
     int id        = -1; // to be filled by server_queue
     int id_target = -1; // used by SERVER_TASK_TYPE_CANCEL
+    int id_parent = -1; // with "n" > 1, the task of the first completion of the same prompt
+
+    // the inference tasks of a request are admitted and shed together
+    int id_request = -1; // the first task of the request
+    int n_request  = 1;  // number of tasks of the request
+
+    int32_t priority   = 0;  // scheduling class of an inference task, higher first
+    int64_t t_queued   = -1; // time the inference task was created, for the queue wait and the time to first token
+    int64_t t_tokenize = 0;  // us, time to tokenize the prompts of the request
+    int32_t n_tokens   = 0;  // estimated KV cells of an inference task, prompt + n_predict, for the admission control
 
     llama_tokens prompt_tokens;
     server_task_type type;
@@ -116,6 +140,8 @@ struct slot_params {
     int32_t n_discard =  0; // number of tokens after n_keep that may be discarded when shifting context, 0 defaults to half
     int32_t n_predict = -1; // new tokens to predict
     int32_t n_indent  =  0; // mininum line indentation for the generated text in number of whitespace characters
+    int32_t priority  =  0; // the prompts of higher priority requests are scheduled first
+    int32_t n_draft   =  0; // max number of tokens drafted with the draft model per step (0 = no speculative decoding)
 
     int64_t t_max_prompt_ms  = -1; // TODO: implement
     int64_t t_max_predict_ms = -1; // if positive, limit the generation phase to this time limit
@@ -126,6 +152,7 @@ struct slot_params {
 struct server_slot {
     int id;
     int id_task = -1;
+    int id_task_parent = -1; // with "n" > 1, the task of the first completion of the same prompt
 
     // the index relative to completion multi-task request
     size_t index = 0;
@@ -137,11 +164,16 @@ struct server_slot {
     // used to determine the slot that has been used the longest
     int64_t t_last_used = -1;
 
+    // the last time prompt tokens of this slot were batched, used to share the batch fairly between the prompts
+    int64_t t_last_sched = -1;
+
     // generation props
     int32_t n_ctx       = 0;  // context size per slot
     int32_t n_past      = 0;
+    int32_t n_pos_off   = 0;  // position of the first token in the KV cache, moved forward by the rolling context shifts
     int32_t n_decoded   = 0;
     int32_t n_remaining = -1;
+    int32_t n_tokens_task = 0; // estimated KV cells of the task, prompt + n_predict, for the admission control
     int32_t i_batch     = -1;
     int32_t n_predict   = -1; // TODO: disambiguate from params.n_predict
 
@@ -160,6 +192,11 @@ struct server_slot {
 
     server_task_inf_type inf_type = SERVER_TASK_INF_TYPE_COMPLETION;
 
+    // LoRA adapter of the request (index in server_context::loras, -1 = none), on top of the adapters of the server
+    // the KV cache of the slot is only valid for this adapter
+    int   lora_id    = -1;
+    float lora_scale = 0.0f;
+
     bool has_next_token = true;
     bool has_new_line   = false;
     bool truncated      = false;
@@ -180,15 +217,35 @@ struct server_slot {
 
     llama_token sampled;
 
+    // speculative decoding
+    llama_tokens spec_tokens;      // the tokens of the slot including the last sampled one, the context of the draft model
+    llama_tokens cache_tokens_dft; // the tokens in the KV cache of the draft model
+    llama_tokens drafted;          // the draft tokens verified in the current batch
+
+    int32_t i_batch_dft = -1;
+
+    // prompt lookup: the n-grams of spec_tokens, it can only be appended to and is rebuilt after a context shift
+    common_ngram_cache ngram_cache;
+    size_t n_ngram_tokens = 0;
+
     // stats
     size_t n_sent_text        = 0; // number of sent text character
     size_t n_sent_token_probs = 0;
 
+    int64_t t_queued = -1;
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
+    int64_t t_last_token; // time the first token of the last decode step was sampled, for the inter-token latency
+
+    double t_queue_wait        = 0; // ms, from the creation of the task to the start of the prompt processing
+    double t_first_token       = 0; // ms, from the creation of the task to the first generated token
+    double t_prompt_processing = 0; // ms
+    double t_token_generation  = 0; // ms
+    double t_tokenize = 0;      // ms
+    double t_sampling = 0;      // ms
 
-    double t_prompt_processing; // ms
-    double t_token_generation;  // ms
+    int32_t n_draft_total    = 0; // draft tokens verified with the target model
+    int32_t n_draft_accepted = 0; // draft tokens that matched the sampled tokens
 
     std::function<void(int)> callback_on_release;
 
@@ -208,8 +265,13 @@ struct server_slot {
         n_sent_text        = 0;
         n_sent_token_probs = 0;
         inf_type           = SERVER_TASK_INF_TYPE_COMPLETION;
+        n_draft_total      = 0;
+        n_draft_accepted   = 0;
+        t_tokenize         = 0;
+        t_sampling         = 0;
 
         generated_token_probs.clear();
+        drafted.clear();
     }
 
     bool has_budget(common_params &global_params) {
@@ -252,7 +314,10 @@ struct server_slot {
     }
 
     json get_formated_timings() const {
-        return json {
+        json timings = {
+            {"queued_ms",              t_queue_wait},
+            {"ttft_ms",                t_first_token},
+
             {"prompt_n",               n_prompt_tokens_processed},
             {"prompt_ms",              t_prompt_processing},
             {"prompt_per_token_ms",    t_prompt_processing / n_prompt_tokens_processed},
@@ -262,7 +327,17 @@ struct server_slot {
             {"predicted_ms",           t_token_generation},
             {"predicted_per_token_ms", t_token_generation / n_decoded},
             {"predicted_per_second",   1e3 / t_token_generation * n_decoded},
+
+            {"tokenize_ms",            t_tokenize},
+            {"sampling_ms",            t_sampling},
         };
+
+        if (n_draft_total > 0) {
+            timings["draft_n"]          = n_draft_total;
+            timings["draft_n_accepted"] = n_draft_accepted;
+        }
+
+        return timings;
     }
 
     size_t find_stopping_strings(const std::string & text, const size_t last_token_size, const stop_type type) {
@@ -302,12 +377,45 @@ struct server_slot {
 
         SLT_INF(*this,
                 "\n"
+                "\r      queue wait = %10.2f ms, time to first token = %10.2f ms\n"
                 "\rprompt eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
                 "\r       eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
                 "\r      total time = %10.2f ms / %5d tokens\n",
+                t_queue_wait, t_first_token,
                 t_prompt_processing, n_prompt_tokens_processed, t_prompt, n_prompt_second,
                 t_token_generation, n_decoded, t_gen, n_gen_second,
                 t_prompt_processing + t_token_generation, n_prompt_tokens_processed + n_decoded);
+
+        if (n_draft_total > 0) {
+            SLT_INF(*this, "draft acceptance rate = %0.5f (%5d accepted / %5d drafted)\n",
+                    (double) n_draft_accepted / n_draft_total, n_draft_accepted, n_draft_total);
+        }
+    }
+};
+
+// cumulative histogram in the format of Prometheus
+struct server_histogram {
+    std::vector<double>   bounds; // upper bounds of the buckets, without the last one (+Inf)
+    std::vector<uint64_t> counts; // observations per bucket, not cumulative
+
+    double   sum   = 0;
+    uint64_t count = 0;
+
+    server_histogram(std::vector<double> bounds) : bounds(std::move(bounds)), counts(this->bounds.size() + 1, 0) {}
+
+    void observe(double value) {
+        counts[std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin()]++;
+        sum   += value;
+        count += 1;
+    }
+
+    json to_json() const {
+        return json {
+            {"bounds", bounds},
+            {"counts", counts},
+            {"sum",    sum},
+            {"count",  count},
+        };
     }
 };
 
@@ -328,6 +436,29 @@ struct server_metrics {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    uint64_t n_draft_total          = 0;
+    uint64_t n_draft_accepted_total = 0;
+
+    // time spent in each phase of the requests, us
+    // the prompts are tokenized and the results post-processed outside of the main loop
+    std::atomic<uint64_t> t_tokenize_total {0};
+    std::atomic<uint64_t> t_serialize_total{0};
+
+    // admission control, the requests are admitted by the HTTP threads
+    std::atomic<uint64_t> n_rejected_total{0}; // no room in the queue
+    std::atomic<uint64_t> n_shed_total    {0}; // dropped from the queue for a request of a higher priority
+    std::atomic<uint64_t> n_expired_total {0}; // waited longer than the queue timeout
+    uint64_t t_prefill_total  = 0; // share of the llama_decode() time of the prompt tokens
+    uint64_t t_decode_total   = 0; // share of the llama_decode() time of the generated tokens
+    uint64_t t_sampling_total = 0;
+
+    server_histogram queue_wait        {{0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60}};       // s
+    server_histogram time_to_first_token{{0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60}};             // s
+    server_histogram inter_token_latency{{0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5}};      // s
+    server_histogram prompt_throughput  {{10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000}};           // tokens/s, per request
+    server_histogram batch_fill         {{0.05, 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 1}};                // tokens / n_batch, per llama_decode()
+    server_histogram kv_cache_usage     {{0.05, 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 0.95, 1}};          // used cells / n_ctx, per llama_decode()
+
     void init() {
         t_start = ggml_time_us();
     }
@@ -337,6 +468,16 @@ struct server_metrics {
         n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
         t_prompt_processing             += slot.t_prompt_processing;
         t_prompt_processing_total       += slot.t_prompt_processing;
+
+        queue_wait.observe(slot.t_queue_wait / 1e3);
+        time_to_first_token.observe(slot.t_first_token / 1e3);
+        if (slot.n_prompt_tokens_processed > 0 && slot.t_prompt_processing > 0) {
+            prompt_throughput.observe(1e3 / slot.t_prompt_processing * slot.n_prompt_tokens_processed);
+        }
+    }
+
+    void on_token(int64_t t_prev, int64_t t_cur) {
+        inter_token_latency.observe((t_cur - t_prev) / 1e6);
     }
 
     void on_prediction(const server_slot & slot) {
@@ -344,15 +485,42 @@ struct server_metrics {
         n_tokens_predicted         += slot.n_decoded;
         t_tokens_generation        += slot.t_token_generation;
         t_tokens_generation_total  += slot.t_token_generation;
+        n_draft_total              += slot.n_draft_total;
+        n_draft_accepted_total     += slot.n_draft_accepted;
+    }
+
+    void on_embd_batch(int n_tokens, double t_ms, float fill) {
+        n_prompt_tokens_processed_total += n_tokens;
+        n_prompt_tokens_processed       += n_tokens;
+        t_prompt_processing             += t_ms;
+        t_prompt_processing_total       += t_ms;
+        t_prefill_total                 += t_ms * 1e3;
+        n_decode_total++;
+
+        batch_fill.observe(fill);
     }
 
-    void on_decoded(const std::vector<server_slot> & slots) {
+    void on_decoded(const std::vector<server_slot> & slots, float fill, float kv_usage) {
         n_decode_total++;
         for (const auto & slot : slots) {
             if (slot.is_processing()) {
                 n_busy_slots_total++;
             }
         }
+
+        batch_fill.observe(fill);
+        kv_cache_usage.observe(kv_usage);
+    }
+
+    json histograms_to_json() const {
+        return json {
+            {"queue_wait_seconds",          queue_wait.to_json()},
+            {"time_to_first_token_seconds", time_to_first_token.to_json()},
+            {"inter_token_latency_seconds", inter_token_latency.to_json()},
+            {"prompt_tokens_per_request_per_second", prompt_throughput.to_json()},
+            {"batch_fill_ratio",            batch_fill.to_json()},
+            {"kv_cache_usage_per_decode",   kv_cache_usage.to_json()},
+        };
     }
 
     void reset_bucket() {
@@ -363,1126 +531,2978 @@ struct server_metrics {
     }
 };
 
-struct server_queue {
-    int id = 0;
-    bool running;
+// KV cache of sequences that were moved out of the llama_context, either to host memory or to disk
+// the state is serialized with llama_state_seq_get_data() and restored with llama_state_seq_set_data()
+struct server_spill_store {
+    struct entry {
+        llama_tokens tokens;
 
-    // queues
-    std::deque<server_task> queue_tasks;
-    std::deque<server_task> queue_tasks_deferred;
+        std::vector<uint8_t> data; // the serialized state, empty if the entry is on disk
+        std::string path;          // the file with the serialized state, if the entry is on disk
 
-    std::mutex mutex_tasks;
-    std::condition_variable condition_tasks;
+        size_t  size        = 0;
+        int64_t t_last_used = 0;
+    };
 
-    // callback functions
-    std::function<void(server_task)> callback_new_task;
-    std::function<void(void)>        callback_update_slots;
+    std::vector<entry> entries;
 
-    // Add a new task to the end of the queue
-    int post(server_task task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (task.id == -1) {
-            task.id = id++;
+    size_t ram_max  = 0;
+    size_t disk_max = 0;
+
+    size_t ram_used  = 0;
+    size_t disk_used = 0;
+
+    std::string path;
+
+    ~server_spill_store() {
+        while (!entries.empty()) {
+            remove(entries.size() - 1);
         }
-        QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
+    }
+
+    bool enabled() const {
+        return ram_max > 0 || disk_max > 0;
+    }
+
+    void remove(size_t i) {
+        entry & e = entries[i];
+        if (e.path.empty()) {
+            ram_used -= e.size;
         } else {
-            queue_tasks.push_back(std::move(task));
+            std::remove(e.path.c_str());
+            disk_used -= e.size;
         }
-        condition_tasks.notify_one();
-        return task.id;
+        entries.erase(entries.begin() + i);
     }
 
-    // multi-task version of post()
-    int post(std::vector<server_task> & tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        for (auto & task : tasks) {
-            if (task.id == -1) {
-                task.id = id++;
+    // index of the least recently used entry that is in memory (on_disk = false) or on disk (on_disk = true), -1 if none
+    int find_lru(bool on_disk) const {
+        int ret = -1;
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].path.empty() == on_disk) {
+                continue;
             }
-            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
+            if (ret == -1 || entries[i].t_last_used < entries[ret].t_last_used) {
+                ret = i;
             }
         }
-        condition_tasks.notify_one();
-        return 0;
+        return ret;
     }
 
-    // Add a new task, but defer until one slot is available
-    void defer(server_task task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        QUE_DBG("defer task, id = %d\n", task.id);
-        queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
-    }
+    // write the state of an entry to a new file, dropping the least recently used files to stay within disk_max
+    bool write_file(entry & e, const std::vector<uint8_t> & data) {
+        if (e.size > disk_max) {
+            return false;
+        }
 
-    // Get the next id for creating a new task
-    int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
-    }
+        while (disk_used + e.size > disk_max) {
+            remove(find_lru(true));
+        }
 
-    // Register function to process a new task
-    void on_new_task(std::function<void(server_task)> callback) {
-        callback_new_task = std::move(callback);
-    }
+        const std::string fname = path + "spill-" + random_string() + ".bin";
 
-    // Register the function to be called when all slots data is ready to be processed
-    void on_update_slots(std::function<void(void)> callback) {
-        callback_update_slots = std::move(callback);
+        std::ofstream file(fname, std::ios::binary);
+        file.write((const char *) data.data(), data.size());
+        file.close();
+        if (!file) {
+            SRV_WRN("failed to write spill file '%s'\n", fname.c_str());
+            std::remove(fname.c_str());
+            return false;
+        }
+
+        e.path = fname;
+        disk_used += e.size;
+
+        return true;
     }
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
-    void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
+    // serialize the state of seq_id, which holds the KV cache of the given tokens
+    bool spill(llama_context * ctx, llama_seq_id seq_id, const llama_tokens & tokens) {
+        const int64_t t_now = ggml_time_us();
+
+        // nothing to do if an entry already has these tokens, and the entries that are a prefix of them are no longer needed
+        for (size_t i = 0; i < entries.size(); ) {
+            const size_t n_match = longest_common_prefix(entries[i].tokens, tokens);
+            if (n_match == tokens.size()) {
+                entries[i].t_last_used = t_now;
+                return true;
+            }
+            if (n_match == entries[i].tokens.size()) {
+                remove(i);
+            } else {
+                i++;
+            }
         }
-        condition_tasks.notify_one();
-    }
 
-    // end the start_loop routine
-    void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        running = false;
-        condition_tasks.notify_all();
-    }
+        entry e;
+        e.tokens      = tokens;
+        e.size        = llama_state_seq_get_size(ctx, seq_id);
+        e.t_last_used = t_now;
 
-    /**
-     * Main loop consists of these steps:
-     * - Wait until a new task arrives
-     * - Process the task (i.e. maybe copy data into slot)
-     * - Check if multitask is finished
-     * - Update all slots
-     */
-    void start_loop() {
-        running = true;
+        if (e.size > ram_max && e.size > disk_max) {
+            return false;
+        }
 
-        while (true) {
-            QUE_DBG("%s", "processing new tasks\n");
+        std::vector<uint8_t> data(e.size);
+        if (llama_state_seq_get_data(ctx, data.data(), data.size(), seq_id) != e.size) {
+            return false;
+        }
 
-            while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (queue_tasks.empty()) {
-                    lock.unlock();
-                    break;
-                }
-                server_task task = queue_tasks.front();
-                queue_tasks.pop_front();
-                lock.unlock();
+        if (e.size > ram_max) {
+            if (!write_file(e, data)) {
+                return false;
+            }
+            entries.push_back(std::move(e));
+            return true;
+        }
 
-                QUE_DBG("processing task, id = %d\n", task.id);
-                callback_new_task(std::move(task));
+        // make room in memory by moving the least recently used entries to disk
+        while (ram_used + e.size > ram_max) {
+            const int i = find_lru(false);
+
+            entry old = std::move(entries[i]);
+            entries.erase(entries.begin() + i);
+            ram_used -= old.size;
+
+            // if it does not fit on disk either, it is dropped
+            const std::vector<uint8_t> old_data = std::move(old.data);
+            if (write_file(old, old_data)) {
+                entries.push_back(std::move(old));
             }
+        }
 
-            // all tasks in the current loop is processed, slots data is now ready
-            QUE_DBG("%s", "update slots\n");
+        e.data = std::move(data);
+        ram_used += e.size;
+        entries.push_back(std::move(e));
 
-            callback_update_slots();
+        return true;
+    }
 
-            QUE_DBG("%s", "waiting for new tasks\n");
-            {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (queue_tasks.empty()) {
-                    if (!running) {
-                        QUE_DBG("%s", "terminate\n");
-                        return;
-                    }
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
-                }
+    // index of the entry with the longest common prefix with the tokens, -1 if none
+    int find(const llama_tokens & tokens, size_t & n_match) const {
+        int ret = -1;
+        n_match = 0;
+        for (size_t i = 0; i < entries.size(); i++) {
+            const size_t n = longest_common_prefix(entries[i].tokens, tokens);
+            if (n > n_match) {
+                n_match = n;
+                ret     = i;
             }
         }
+        return ret;
     }
-};
 
-struct server_response {
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+    // restore entry i into seq_id and remove it from the store
+    bool load(llama_context * ctx, int i, llama_seq_id seq_id, llama_tokens & tokens) {
+        entry & e = entries[i];
 
-    // the main result queue
-    std::vector<server_task_result> queue_results;
+        std::vector<uint8_t> data;
+        if (e.path.empty()) {
+            data = std::move(e.data);
+        } else {
+            data.resize(e.size);
 
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+            std::ifstream file(e.path, std::ios::binary);
+            file.read((char *) data.data(), data.size());
+            if (!file) {
+                SRV_WRN("failed to read spill file '%s'\n", e.path.c_str());
+                remove(i);
+                return false;
+            }
+        }
 
-    // add the id_task to the list of tasks waiting for response
-    void add_waiting_task_id(int id_task) {
-        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+        const size_t nread = llama_state_seq_set_data(ctx, data.data(), data.size(), seq_id);
+        if (nread == 0) {
+            // no space in the KV cache - keep the entry for later
+            if (e.path.empty()) {
+                e.data = std::move(data);
+            }
+            return false;
+        }
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        tokens = std::move(e.tokens);
+        remove(i);
+
+        return true;
     }
+};
 
-    void add_waiting_tasks(const std::vector<server_task> & tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+// content-addressed KV cache of long prompts on disk, which outlives the server process
+// the files of a model are listed in a manifest, which also keeps the LRU order across restarts
+struct server_disk_cache {
+    static const uint32_t FILE_MAGIC   = 0x4b564346; // 'KVCF'
+    static const uint32_t FILE_VERSION = 1;
 
-        for (const auto & task : tasks) {
-            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
-        }
-    }
+    struct entry {
+        uint64_t     key = 0; // hash of the model configuration the state was computed with
+        llama_tokens tokens;
 
-    // when the request is finished, we can remove task associated with it
-    void remove_waiting_task_id(int id_task) {
-        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+        std::string fname; // relative to the directory
+        size_t      size        = 0;
+        int64_t     t_last_used = 0; // wall clock, in microseconds
+    };
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
-    }
+    struct job {
+        entry                e;
+        std::vector<uint8_t> data;
+    };
 
-    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+    // the state of an entry read for a slot, before its prompt is processed
+    struct prefetched {
+        int                  id_task = -1;
+        entry                e;
+        std::vector<uint8_t> data;
+        bool                 done = false;
+        bool                 ok   = false;
+    };
 
-        for (const auto & id_task : id_tasks) {
-            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
-            waiting_task_ids.erase(id_task);
+    std::string path;
+    std::string manifest;
+
+    size_t size_max  = 0;
+    size_t size_used = 0;
+
+    // guards everything below
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    std::vector<entry> entries;
+
+    std::deque<job> jobs;
+    size_t size_pending = 0;
+
+    std::map<llama_seq_id, prefetched> reads;
+    std::deque<llama_seq_id>     reads_pending;
+
+    bool manifest_dirty = false;
+    bool running        = false;
+
+    std::thread worker;
+
+    ~server_disk_cache() {
+        if (!running) {
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = false;
         }
+        cv.notify_all();
+        worker.join();
     }
 
-    // This function blocks the thread until there is a response for one of the id_tasks
-    server_task_result recv(const std::unordered_set<int> & id_tasks) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
+    bool enabled() const {
+        return size_max > 0;
+    }
 
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i].id) != id_tasks.end()) {
-                    server_task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
+    static uint64_t hash(uint64_t h, const void * data, size_t size) {
+        const uint8_t * p = (const uint8_t *) data;
+        for (size_t i = 0; i < size; i++) {
+            h ^= p[i];
+            h *= 0x100000001b3ULL;
         }
-
-        // should never reach here
+        return h;
     }
 
-    // single-task version of recv()
-    server_task_result recv(int id_task) {
-        std::unordered_set<int> id_tasks = {id_task};
-        return recv(id_tasks);
+    static uint64_t hash(const std::string & s) {
+        return hash(0xcbf29ce484222325ULL, s.data(), s.size());
     }
 
-    // Send a new result to a waiting id_task
-    void send(server_task_result & result) {
-        SRV_DBG("sending result for task id = %d\n", result.id);
-
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result.id == id_task) {
-                SRV_DBG("task id = %d moved to result queue\n", result.id);
+    // the identity of a model file: the GGUF header and metadata, which include the names, types and shapes of the
+    // tensors, and a sample of the tensor data - unlike a hash of the whole file, this is cheap for large models
+    static uint64_t hash_file(uint64_t h, const std::string & fname) {
+        std::ifstream file(fname, std::ios::binary | std::ios::ate);
+        if (!file) {
+            return hash(h, fname.data(), fname.size());
+        }
+        const size_t size = file.tellg();
 
-                queue_results.push_back(std::move(result));
-                condition_results.notify_all();
-                return;
+        size_t n_meta = 0;
+        {
+            struct gguf_init_params gparams = {
+                /*.no_alloc = */ true,
+                /*.ctx      = */ NULL,
+            };
+            struct gguf_context * gctx = gguf_init_from_file(fname.c_str(), gparams);
+            if (gctx != NULL) {
+                n_meta = std::min(gguf_get_data_offset(gctx), size);
+                gguf_free(gctx);
             }
         }
-    }
-};
 
-struct server_context {
-    llama_model * model = nullptr;
-    llama_context * ctx = nullptr;
-    std::vector<common_lora_adapter_container> loras;
+        h = hash(h, &size, sizeof(size));
 
-    common_params params;
+        std::vector<char> buf(n_meta);
+        file.seekg(0);
+        file.read(buf.data(), buf.size());
+        h = hash(h, buf.data(), file.gcount());
 
-    llama_batch batch = {};
+        const size_t n_sample = 64;
+        const size_t n_chunk  = 4096;
 
-    bool clean_kv_cache = true;
-    bool add_bos_token  = true;
-    bool has_eos_token  = false;
+        buf.resize(n_chunk);
+        for (size_t i = 0; i < n_sample; i++) {
+            file.clear();
+            file.seekg(n_meta + (size - n_meta) / n_sample * i);
+            file.read(buf.data(), buf.size());
+            h = hash(h, buf.data(), file.gcount());
+        }
 
-    int32_t n_ctx; // total context for all clients / slots
+        return h;
+    }
 
-    // slots / clients
-    std::vector<server_slot> slots;
-    json default_generation_settings_for_props;
+    static int64_t time_now_us() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
 
-    server_queue    queue_tasks;
-    server_response queue_results;
+    // the files of the model with the given hash in the directory
+    void init(const std::string & dir, size_t size_max_, uint64_t model_hash) {
+        path     = dir;
+        manifest = string_format("%016" PRIx64 ".manifest", model_hash);
+        size_max = size_max_;
+
+        std::ifstream file(path + manifest);
+        std::string fname;
+        size_t  size;
+        int64_t t_last_used;
+        while (file >> fname >> size >> t_last_used) {
+            entry e;
+            if (!read_header(fname, e) || e.size != size) {
+                continue;
+            }
+            e.t_last_used = t_last_used;
+            size_used += e.size;
+            entries.push_back(std::move(e));
+        }
 
-    server_metrics metrics;
+        SRV_INF("persistent KV cache in '%s', %zu entries, %.2f MiB\n", path.c_str(), entries.size(), size_used / 1024.0 / 1024.0);
 
-    // Necessary similarity of prompt for slot selection
-    float slot_prompt_similarity = 0.0f;
+        running = true;
+        worker  = std::thread(&server_disk_cache::run, this);
 
-    ~server_context() {
-        if (ctx) {
-            llama_free(ctx);
-            ctx = nullptr;
+        // the entries over the limit, if it was lowered since the last run
+        std::unique_lock<std::mutex> lock(mutex);
+        evict(0);
+        manifest_dirty = true;
+        cv.notify_one();
+    }
+
+    // read the key and the tokens of a cache file
+    bool read_header(const std::string & fname, entry & e) const {
+        std::ifstream file(path + fname, std::ios::binary | std::ios::ate);
+        if (!file) {
+            return false;
+        }
+        e.fname = fname;
+        e.size  = file.tellg();
+        file.seekg(0);
+
+        uint32_t magic    = 0;
+        uint32_t version  = 0;
+        uint32_t n_tokens = 0;
+        file.read((char *) &magic,    sizeof(magic));
+        file.read((char *) &version,  sizeof(version));
+        file.read((char *) &e.key,    sizeof(e.key));
+        file.read((char *) &n_tokens, sizeof(n_tokens));
+        if (!file || magic != FILE_MAGIC || version != FILE_VERSION) {
+            return false;
         }
+        e.tokens.resize(n_tokens);
+        file.read((char *) e.tokens.data(), n_tokens * sizeof(llama_token));
 
-        if (model) {
-            llama_free_model(model);
-            model = nullptr;
+        return (bool) file;
+    }
+
+    // drop the least recently used entries until size more bytes fit - must hold the lock
+    void evict(size_t size) {
+        while (!entries.empty() && size_used + size > size_max) {
+            size_t i_lru = 0;
+            for (size_t i = 1; i < entries.size(); i++) {
+                if (entries[i].t_last_used < entries[i_lru].t_last_used) {
+                    i_lru = i;
+                }
+            }
+            remove(i_lru);
         }
+    }
 
-        // Clear any sampling context
-        for (server_slot & slot : slots) {
-            if (slot.smpl != nullptr) {
-                common_sampler_free(slot.smpl);
+    // must hold the lock
+    void remove(size_t i) {
+        std::remove((path + entries[i].fname).c_str());
+        size_used -= entries[i].size;
+        entries.erase(entries.begin() + i);
+        manifest_dirty = true;
+    }
+
+    void write_manifest(const std::vector<entry> & snapshot) const {
+        const std::string tmp = path + manifest + ".tmp";
+        {
+            std::ofstream file(tmp);
+            for (const entry & e : snapshot) {
+                file << e.fname << " " << e.size << " " << e.t_last_used << "\n";
+            }
+            if (!file) {
+                SRV_WRN("failed to write KV cache manifest '%s'\n", tmp.c_str());
+                return;
             }
         }
+        std::rename(tmp.c_str(), (path + manifest).c_str());
+    }
 
-        llama_batch_free(batch);
+    bool write_file(const job & j) const {
+        const std::string fname = path + j.e.fname;
+        const std::string tmp   = fname + ".tmp";
+
+        const uint32_t magic    = FILE_MAGIC;
+        const uint32_t version  = FILE_VERSION;
+        const uint32_t n_tokens = j.e.tokens.size();
+        {
+            std::ofstream file(tmp, std::ios::binary);
+            file.write((const char *) &magic,    sizeof(magic));
+            file.write((const char *) &version,  sizeof(version));
+            file.write((const char *) &j.e.key,  sizeof(j.e.key));
+            file.write((const char *) &n_tokens, sizeof(n_tokens));
+            file.write((const char *) j.e.tokens.data(), n_tokens * sizeof(llama_token));
+            file.write((const char *) j.data.data(), j.data.size());
+            if (!file) {
+                SRV_WRN("failed to write KV cache file '%s'\n", tmp.c_str());
+                file.close();
+                std::remove(tmp.c_str());
+                return false;
+            }
+        }
+
+        return std::rename(tmp.c_str(), fname.c_str()) == 0;
     }
 
-    bool load_model(const common_params & params_) {
-        params = params_;
+    // the writer thread - files are written outside of the lock, so that the slots are not held up
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [&] { return !running || !reads_pending.empty() || !jobs.empty() || manifest_dirty; });
 
-        common_init_result llama_init = common_init_from_params(params);
+            // a prompt waits for the reads, so they go before the writes
+            if (!reads_pending.empty()) {
+                const llama_seq_id seq_id = reads_pending.front();
+                reads_pending.pop_front();
 
-        model = llama_init.model;
-        ctx   = llama_init.context;
-        loras = llama_init.lora_adapters;
+                auto it = reads.find(seq_id);
+                if (it == reads.end() || it->second.done) {
+                    continue;
+                }
+                const int   id_task = it->second.id_task;
+                const entry e       = it->second.e;
 
-        if (model == nullptr) {
-            SRV_ERR("failed to load model, '%s'\n", params.model.c_str());
-            return false;
-        }
+                lock.unlock();
+                std::vector<uint8_t> data;
+                const bool ok = read_file(e, data);
+                lock.lock();
+
+                // the slot may have moved on to another task in the meantime
+                it = reads.find(seq_id);
+                if (it != reads.end() && it->second.id_task == id_task) {
+                    it->second.data = std::move(data);
+                    it->second.done = true;
+                    it->second.ok   = ok;
+                }
+                continue;
+            }
 
-        n_ctx = llama_n_ctx(ctx);
+            if (!jobs.empty()) {
+                job j = std::move(jobs.front());
+                jobs.pop_front();
 
-        add_bos_token = llama_add_bos_token(model);
-        has_eos_token = !llama_add_eos_token(model);
+                lock.unlock();
+                const bool ok = write_file(j);
+                lock.lock();
 
-        return true;
-    }
+                size_pending -= j.data.size();
 
-    bool validate_model_chat_template() const {
-        std::vector<char> model_template(2048, 0); // longest known template is about 1200 bytes
-        std::string template_key = "tokenizer.chat_template";
-        int32_t res = llama_model_meta_val_str(model, template_key.c_str(), model_template.data(), model_template.size());
-        if (res >= 0) {
-            llama_chat_message chat[] = {{"user", "test"}};
-            std::string tmpl = std::string(model_template.data(), model_template.size());
-            int32_t chat_res = llama_chat_apply_template(model, tmpl.c_str(), chat, 1, true, nullptr, 0);
-            return chat_res > 0;
+                if (ok) {
+                    // the entries that are a prefix of the new one are no longer needed
+                    for (size_t i = 0; i < entries.size(); ) {
+                        if (entries[i].key == j.e.key && longest_common_prefix(entries[i].tokens, j.e.tokens) == entries[i].tokens.size()) {
+                            remove(i);
+                        } else {
+                            i++;
+                        }
+                    }
+                    evict(j.e.size);
+                    size_used += j.e.size;
+                    entries.push_back(std::move(j.e));
+                    manifest_dirty = true;
+                }
+                continue;
+            }
+
+            if (manifest_dirty) {
+                manifest_dirty = false;
+                const std::vector<entry> snapshot = entries;
+
+                lock.unlock();
+                write_manifest(snapshot);
+                lock.lock();
+                continue;
+            }
+
+            if (!running) {
+                break;
+            }
         }
-        return false;
     }
 
-    void init() {
-        const int32_t n_ctx_slot = n_ctx / params.n_parallel;
+    // the entry with the longest common prefix with the tokens, computed with the given key
+    bool find(uint64_t key, const llama_tokens & tokens, size_t & n_match, entry & res) {
+        std::unique_lock<std::mutex> lock(mutex);
 
-        SRV_INF("initializing slots, n_slots = %d\n", params.n_parallel);
+        n_match = 0;
+        for (const entry & e : entries) {
+            if (e.key != key) {
+                continue;
+            }
+            // the whole entry must match, as the state cannot be restored partially
+            const size_t n = longest_common_prefix(e.tokens, tokens);
+            if (n == e.tokens.size() && n > n_match) {
+                n_match = n;
+                res     = e;
+            }
+        }
 
-        for (int i = 0; i < params.n_parallel; i++) {
-            server_slot slot;
+        return n_match > 0;
+    }
 
-            slot.id = i;
-            slot.n_ctx = n_ctx_slot;
-            slot.n_predict = params.n_predict;
+    // read the state of an entry, after its header
+    bool read_file(const entry & e, std::vector<uint8_t> & data) const {
+        entry hdr;
+        if (!read_header(e.fname, hdr) || hdr.key != e.key || hdr.tokens != e.tokens) {
+            return false;
+        }
 
-            SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
+        const size_t offset = 3*sizeof(uint32_t) + sizeof(uint64_t) + e.tokens.size()*sizeof(llama_token);
 
-            slot.sparams = params.sparams;
+        data.resize(hdr.size - offset);
 
-            slot.callback_on_release = [this](int) {
-                queue_tasks.pop_deferred_task();
-            };
+        std::ifstream file(path + e.fname, std::ios::binary);
+        file.seekg(offset);
+        file.read((char *) data.data(), data.size());
 
-            slot.reset();
+        return (bool) file;
+    }
 
-            slots.push_back(slot);
+    // the file of the entry for the prompt of a task is read by the worker thread, so that the main loop is not held
+    // up - returns false while the read is pending, otherwise the read of the task, if any, is moved into res
+    bool fetch(llama_seq_id seq_id, int id_task, prefetched & res) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        auto it = reads.find(seq_id);
+        if (it == reads.end()) {
+            return true;
+        }
+        if (it->second.id_task != id_task) {
+            // left over by a task that was cancelled while it waited
+            reads.erase(it);
+            return true;
+        }
+        if (!it->second.done) {
+            return false;
         }
 
-        default_generation_settings_for_props = get_formated_generation(slots.front());
-        default_generation_settings_for_props["seed"] = -1;
+        res = std::move(it->second);
+        reads.erase(it);
 
-        // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
-        // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
-        {
-            const int32_t n_batch = llama_n_batch(ctx);
+        return true;
+    }
 
-            // only a single seq_id per token is needed
-            batch = llama_batch_init(std::max(n_batch, params.n_parallel), 0, 1);
-        }
+    // queue the read of an entry for the prompt of a task
+    void prefetch(llama_seq_id seq_id, int id_task, const entry & e) {
+        std::unique_lock<std::mutex> lock(mutex);
 
-        metrics.init();
+        prefetched & r = reads[seq_id];
+        r = prefetched();
+        r.id_task = id_task;
+        r.e       = e;
+
+        reads_pending.push_back(seq_id);
+        cv.notify_one();
     }
 
-    server_slot * get_slot_by_id(int id) {
-        for (server_slot & slot : slots) {
-            if (slot.id == id) {
-                return &slot;
+    // restore the state of a read into seq_id
+    bool load(llama_context * ctx, const prefetched & r, llama_seq_id seq_id) {
+        if (!r.ok || llama_state_seq_set_data(ctx, r.data.data(), r.data.size(), seq_id) == 0) {
+            return false;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        for (entry & other : entries) {
+            if (other.fname == r.e.fname) {
+                other.t_last_used = time_now_us();
+                manifest_dirty = true;
             }
         }
+        cv.notify_one();
 
-        return nullptr;
+        return true;
     }
 
-    server_slot * get_available_slot(const server_task & task) {
-        server_slot * ret = nullptr;
-
-        // find the slot that has at least n% prompt similarity
-        if (ret == nullptr && slot_prompt_similarity != 0.0f) {
-            int lcs_len = 0;
-            float similarity = 0;
+    // queue the state of seq_id, which holds the KV cache of the given tokens, to be written to disk
+    bool store(llama_context * ctx, uint64_t key, llama_seq_id seq_id, const llama_tokens & tokens) {
+        job j;
+        j.e.key         = key;
+        j.e.tokens      = tokens;
+        j.e.t_last_used = time_now_us();
 
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
-                    continue;
-                }
+        // the file name is the hash of the content, so equal prompts of different runs map to the same file
+        uint64_t h = hash(0xcbf29ce484222325ULL, &key, sizeof(key));
+        h = hash(h, tokens.data(), tokens.size()*sizeof(llama_token));
+        j.e.fname = string_format("%016" PRIx64 ".kvc", h);
 
-                // skip the slot if it does not contains cached tokens
-                if (slot.cache_tokens.empty()) {
-                    continue;
-                }
+        const size_t size = llama_state_seq_get_size(ctx, seq_id);
 
-                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
-                int cur_lcs_len = longest_common_subsequence(slot.cache_tokens, task.prompt_tokens);
+        j.e.size = 3*sizeof(uint32_t) + sizeof(uint64_t) + tokens.size()*sizeof(llama_token) + size;
+        if (j.e.size > size_max) {
+            return false;
+        }
 
-                // fraction of the common subsequence length compared to the current slot's prompt length
-                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
+        {
+            std::unique_lock<std::mutex> lock(mutex);
 
-                // select the current slot if the criteria match
-                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity) {
-                    lcs_len = cur_lcs_len;
-                    similarity = cur_similarity;
-                    ret = &slot;
+            for (const entry & e : entries) {
+                if (e.key == key && longest_common_prefix(e.tokens, tokens) == tokens.size()) {
+                    return false; // already on disk
+                }
+            }
+            for (const job & other : jobs) {
+                if (other.e.fname == j.e.fname) {
+                    return false;
                 }
             }
 
-            if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+            // do not let the writer fall too far behind
+            if (size_pending + size > std::max(size_max / 4, size)) {
+                return false;
             }
         }
 
-        // find the slot that has been least recently used
-        if (ret == nullptr) {
-            int64_t t_last = ggml_time_us();
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
-                    continue;
-                }
+        j.data.resize(size);
+        if (llama_state_seq_get_data(ctx, j.data.data(), j.data.size(), seq_id) != size) {
+            return false;
+        }
 
-                // select the current slot if the criteria match
-                if (slot.t_last_used < t_last) {
-                    t_last = slot.t_last_used;
-                    ret = &slot;
-                }
-            }
+        std::unique_lock<std::mutex> lock(mutex);
+        size_pending += size;
+        jobs.push_back(std::move(j));
+        cv.notify_one();
 
-            if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
-            }
+        return true;
+    }
+};
+
+// LRU of the outputs of embedding and rerank tasks, keyed by the type of the task and the input tokens
+struct server_embd_cache {
+    struct entry {
+        uint64_t             hash;
+        server_task_inf_type inf_type;
+        llama_tokens         tokens;
+        std::vector<float>   embd; // the embedding, or the score of a rerank task
+    };
+
+    size_t n_max = 0;
+
+    std::list<entry> entries; // most recently used first
+    std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+
+    static uint64_t hash(server_task_inf_type inf_type, const llama_tokens & tokens) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        h ^= (uint64_t) inf_type;
+        h *= 0x100000001b3ULL;
+        const uint8_t * p = (const uint8_t *) tokens.data();
+        for (size_t i = 0; i < tokens.size()*sizeof(llama_token); i++) {
+            h ^= p[i];
+            h *= 0x100000001b3ULL;
         }
+        return h;
+    }
 
-        return ret;
+    const std::vector<float> * get(server_task_inf_type inf_type, const llama_tokens & tokens) {
+        auto it = index.find(hash(inf_type, tokens));
+        if (it == index.end() || it->second->inf_type != inf_type || it->second->tokens != tokens) {
+            return nullptr;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        return &entries.front().embd;
     }
 
-    bool launch_slot_with_task(server_slot & slot, const server_task & task) {
-        slot_params default_params;
-        // Sampling parameter defaults are loaded from the global server context (but individual requests can still override them)
-        auto default_sparams = params.sparams;
-        const auto & data = task.data;
+    void put(server_task_inf_type inf_type, const llama_tokens & tokens, const std::vector<float> & embd) {
+        const uint64_t h = hash(inf_type, tokens);
 
-        if (data.count("__oaicompat") != 0) {
-            slot.oaicompat = true;
-            slot.oaicompat_model = json_value(data, "model", std::string(DEFAULT_OAICOMPAT_MODEL));
-        } else {
-            slot.oaicompat = false;
-            slot.oaicompat_model = "";
+        auto it = index.find(h);
+        if (it != index.end()) {
+            entries.erase(it->second);
+            index.erase(it);
         }
 
-        slot.params.stream              = json_value(data, "stream",             false);
-        slot.params.cache_prompt        = json_value(data, "cache_prompt",       false);
-        slot.params.n_predict           = json_value(data, "n_predict",          json_value(data, "max_tokens", default_params.n_predict));
-        slot.params.n_indent            = json_value(data, "n_indent",           default_params.n_indent);
-        slot.sparams.top_k              = json_value(data, "top_k",              default_sparams.top_k);
-        slot.sparams.top_p              = json_value(data, "top_p",              default_sparams.top_p);
-        slot.sparams.min_p              = json_value(data, "min_p",              default_sparams.min_p);
-        slot.sparams.xtc_probability    = json_value(data, "xtc_probability",    default_sparams.xtc_probability);
-        slot.sparams.xtc_threshold      = json_value(data, "xtc_threshold",      default_sparams.xtc_threshold);
-        slot.sparams.typ_p              = json_value(data, "typical_p",          default_sparams.typ_p);
-        slot.sparams.temp               = json_value(data, "temperature",        default_sparams.temp);
-        slot.sparams.dynatemp_range     = json_value(data, "dynatemp_range",     default_sparams.dynatemp_range);
-        slot.sparams.dynatemp_exponent  = json_value(data, "dynatemp_exponent",  default_sparams.dynatemp_exponent);
-        slot.sparams.penalty_last_n     = json_value(data, "repeat_last_n",      default_sparams.penalty_last_n);
-        slot.sparams.penalty_repeat     = json_value(data, "repeat_penalty",     default_sparams.penalty_repeat);
-        slot.sparams.penalty_freq       = json_value(data, "frequency_penalty",  default_sparams.penalty_freq);
-        slot.sparams.penalty_present    = json_value(data, "presence_penalty",   default_sparams.penalty_present);
-        slot.sparams.dry_multiplier     = json_value(data, "dry_multiplier",     default_sparams.dry_multiplier);
-        slot.sparams.dry_base           = json_value(data, "dry_base",           default_sparams.dry_base);
-        slot.sparams.dry_allowed_length = json_value(data, "dry_allowed_length", default_sparams.dry_allowed_length);
-        slot.sparams.dry_penalty_last_n = json_value(data, "dry_penalty_last_n", default_sparams.dry_penalty_last_n);
-        slot.sparams.mirostat           = json_value(data, "mirostat",           default_sparams.mirostat);
-        slot.sparams.mirostat_tau       = json_value(data, "mirostat_tau",       default_sparams.mirostat_tau);
-        slot.sparams.mirostat_eta       = json_value(data, "mirostat_eta",       default_sparams.mirostat_eta);
-        slot.sparams.penalize_nl        = json_value(data, "penalize_nl",        default_sparams.penalize_nl);
-        slot.params.n_keep              = json_value(data, "n_keep",             default_params.n_keep);
-        slot.params.n_discard           = json_value(data, "n_discard",          default_params.n_discard);
-        slot.sparams.seed               = json_value(data, "seed",               default_sparams.seed);
-        slot.sparams.n_probs            = json_value(data, "n_probs",            default_sparams.n_probs);
-        slot.sparams.min_keep           = json_value(data, "min_keep",           default_sparams.min_keep);
-      //slot.params.t_max_prompt_ms     = json_value(data, "t_max_prompt_ms",    default_params.t_max_prompt_ms); // TODO: implement
-        slot.params.t_max_predict_ms    = json_value(data, "t_max_predict_ms",   default_params.t_max_predict_ms);
-
-        if (slot.sparams.dry_base < 1.0f)
-        {
-           slot.sparams.dry_base = default_sparams.dry_base;
+        while (!entries.empty() && entries.size() >= n_max) {
+            index.erase(entries.back().hash);
+            entries.pop_back();
         }
 
-        // sequence breakers for DRY
-        {
-            // Currently, this is not compatible with TextGen WebUI, Koboldcpp and SillyTavern format
-            // Ref: https://github.com/oobabooga/text-generation-webui/blob/d1af7a41ade7bd3c3a463bfa640725edb818ebaf/extensions/openai/typing.py#L39
+        entries.push_front({h, inf_type, tokens, embd});
+        index[h] = entries.begin();
+    }
+};
 
-            if (data.contains("dry_sequence_breakers")) {
-                slot.sparams.dry_sequence_breakers = json_value(data, "dry_sequence_breakers", std::vector<std::string>());
-                if (slot.sparams.dry_sequence_breakers.empty()) {
-                    send_error(task, "Error: dry_sequence_breakers must be a non-empty array of strings", ERROR_TYPE_INVALID_REQUEST);
-                    return false;
-                }
-            }
-        }
+// the grammars of the requests, compiled once and shared by the requests with the same grammar or JSON schema
+// a slot clones the grammar sampler of the cache, which only copies the parse stacks since the rules are shared
+struct server_grammar_cache {
+    struct entry {
+        std::string key;
 
-        // process "json_schema" and "grammar"
-        if (data.contains("json_schema") && !data.at("json_schema").is_null() && data.contains("grammar") && !data.at("grammar").is_null()) {
-            send_error(task, "Either \"json_schema\" or \"grammar\" can be specified, but not both", ERROR_TYPE_INVALID_REQUEST);
-            return false;
-        }
-        if (data.contains("json_schema") && !data.contains("grammar")) {
-            try {
-                auto schema          = json_value(data, "json_schema", json::object());
-                slot.sparams.grammar = json_schema_to_grammar(schema);
-            } catch (const std::exception & e) {
-                send_error(task, std::string("\"json_schema\": ") + e.what(), ERROR_TYPE_INVALID_REQUEST);
-                return false;
-            }
-        } else {
-            slot.sparams.grammar = json_value(data, "grammar", default_sparams.grammar);
-        }
+        std::string grammar;                 // for a JSON schema, the grammar converted from it
+        std::shared_ptr<llama_sampler> smpl; // for a grammar, the sampler before any token is accepted
+    };
 
-        if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
-            // Might be better to reject the request with a 400 ?
-            slot.params.n_predict = slot.n_predict;
-            SLT_WRN(slot, "n_predict = %d exceeds server configuration, setting to %d", slot.n_predict, slot.n_predict);
-        }
+    size_t n_max = 0;
 
-        {
-            slot.sparams.logit_bias.clear();
+    // the schemas are converted by the HTTP threads, the grammars are compiled by the main loop
+    std::mutex mutex;
 
-            if (json_value(data, "ignore_eos", false) && has_eos_token) {
-                slot.sparams.logit_bias.push_back({llama_token_eos(model), -INFINITY});
-            }
+    std::list<entry> entries; // most recently used first
+    std::unordered_map<std::string, std::list<entry>::iterator> index;
 
-            const auto & logit_bias = data.find("logit_bias");
-            if (logit_bias != data.end() && logit_bias->is_array()) {
-                const int n_vocab = llama_n_vocab(model);
-                for (const auto & el : *logit_bias) {
-                    // TODO: we may want to throw errors here, in case "el" is incorrect
-                    if (el.is_array() && el.size() == 2) {
-                        float bias;
-                        if (el[1].is_number()) {
-                            bias = el[1].get<float>();
-                        } else if (el[1].is_boolean() && !el[1].get<bool>()) {
-                            bias = -INFINITY;
-                        } else {
-                            continue;
-                        }
+    // the grammar of a JSON schema, throws if the schema is not supported
+    std::string schema_to_grammar(const json & schema) {
+        if (n_max == 0) {
+            return json_schema_to_grammar(schema);
+        }
 
-                        if (el[0].is_number_integer()) {
-                            llama_token tok = el[0].get<llama_token>();
-                            if (tok >= 0 && tok < n_vocab) {
-                                slot.sparams.logit_bias.push_back({tok, bias});
-                            }
-                        } else if (el[0].is_string()) {
-                            auto toks = common_tokenize(model, el[0].get<std::string>(), false);
-                            for (auto tok : toks) {
-                                slot.sparams.logit_bias.push_back({tok, bias});
-                            }
-                        }
-                    }
-                }
+        const std::string key = "schema:" + schema.dump();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            entry * e = get(key);
+            if (e != nullptr) {
+                return e->grammar;
             }
         }
 
-        {
-            slot.params.antiprompt.clear();
+        entry e;
+        e.key     = key;
+        e.grammar = json_schema_to_grammar(schema);
 
-            const auto & stop = data.find("stop");
-            if (stop != data.end() && stop->is_array()) {
-                for (const auto & word : *stop) {
-                    if (!word.empty()) {
-                        slot.params.antiprompt.push_back(word);
-                    }
-                }
-            }
+        std::unique_lock<std::mutex> lock(mutex);
+        put(e);
+
+        return e.grammar;
+    }
+
+    // the compiled grammar to clone, nullptr for an empty grammar or if the cache is disabled
+    std::shared_ptr<llama_sampler> grammar(const llama_model * model, const std::string & grammar) {
+        if (n_max == 0 || grammar.empty()) {
+            return nullptr;
         }
 
+        const std::string key = "grammar:" + grammar;
         {
-            const auto & samplers = data.find("samplers");
-            if (samplers != data.end()) {
-                if (samplers->is_array()) {
-                    std::vector<std::string> sampler_names;
-                    for (const auto & name : *samplers) {
-                        if (name.is_string()) {
-                            sampler_names.emplace_back(name);
-                        }
-                    }
-                    slot.sparams.samplers = common_sampler_types_from_names(sampler_names, false);
-                } else if (samplers->is_string()){
-                    std::string sampler_string;
-                    for (const auto & name : *samplers) {
-                        sampler_string += name;
-                    }
-                    slot.sparams.samplers = common_sampler_types_from_chars(sampler_string);
-                }
-            } else {
-                slot.sparams.samplers = default_sparams.samplers;
+            std::unique_lock<std::mutex> lock(mutex);
+            entry * e = get(key);
+            if (e != nullptr) {
+                return e->smpl;
             }
         }
 
-        {
-            if (slot.smpl != nullptr) {
-                common_sampler_free(slot.smpl);
-            }
+        entry e;
+        e.key  = key;
+        e.smpl = std::shared_ptr<llama_sampler>(llama_sampler_init_grammar(model, grammar.c_str(), "root"), llama_sampler_free);
 
-            slot.smpl = common_sampler_init(model, slot.sparams);
-            if (slot.smpl == nullptr) {
-                // for now, the only error that may happen here is invalid grammar
-                send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
-                return false;
-            }
+        std::unique_lock<std::mutex> lock(mutex);
+        put(e);
+
+        return e.smpl;
+    }
+
+    // with the lock held
+    entry * get(const std::string & key) {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return nullptr;
         }
+        entries.splice(entries.begin(), entries, it->second);
+        return &entries.front();
+    }
 
-        slot.state = SLOT_STATE_STARTED;
+    // with the lock held
+    void put(const entry & e) {
+        auto it = index.find(e.key);
+        if (it != index.end()) {
+            entries.erase(it->second);
+            index.erase(it);
+        }
 
-        SLT_INF(slot, "%s", "processing task\n");
+        while (!entries.empty() && entries.size() >= n_max) {
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
 
-        return true;
+        entries.push_front(e);
+        index[e.key] = entries.begin();
     }
+};
 
-    void kv_cache_clear() {
-        SRV_DBG("%s", "clearing KV cache\n");
+struct server_queue {
+    bool running;
 
-        // clear the entire KV cache
-        llama_kv_cache_clear(ctx);
-        clean_kv_cache = false;
-    }
+    // queues
+    std::deque<server_task> queue_tasks;
+    std::deque<server_task> queue_tasks_deferred;
 
-    bool process_token(completion_token_output & result, server_slot & slot) {
-        // remember which tokens were sampled - used for repetition penalties during sampling
-        const std::string token_str = common_token_to_piece(ctx, result.tok, params.special);
-        slot.sampled = result.tok;
+    std::mutex mutex_tasks;
+    std::condition_variable condition_tasks;
 
-        // search stop word and delete it
-        slot.generated_text += token_str;
-        slot.has_next_token = true;
+    // admission control: max estimated KV cells of the inference tasks in flight and waiting for a slot (0 = no limit)
+    int64_t n_tokens_max = 0;
 
-        // check if there is incomplete UTF-8 character at the end
-        bool incomplete = false;
-        for (unsigned i = 1; i < 5 && i <= slot.generated_text.size(); ++i) {
-            unsigned char c = slot.generated_text[slot.generated_text.size() - i];
-            if ((c & 0xC0) == 0x80) {
-                // continuation byte: 10xxxxxx
-                continue;
-            }
-            if ((c & 0xE0) == 0xC0) {
-                // 2-byte character: 110xxxxx ...
-                incomplete = i < 2;
-            } else if ((c & 0xF0) == 0xE0) {
-                // 3-byte character: 1110xxxx ...
-                incomplete = i < 3;
-            } else if ((c & 0xF8) == 0xF0) {
-                // 4-byte character: 11110xxx ...
-                incomplete = i < 4;
-            }
-            // else 1-byte character or invalid byte
-            break;
-        }
+    // KV cells that the slots in flight hold, and those that they will still fill, set by the main loop
+    int64_t n_tokens_busy = 0;
 
-        if (!incomplete) {
-            size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
+    // tokens per second of the main loop, to estimate when the waiting tasks are done
+    double n_tokens_per_sec = 0;
 
-            const std::string str_test = slot.generated_text.substr(pos);
-            bool send_text = true;
+    // callback functions
+    std::function<void(server_task)> callback_new_task;
+    std::function<void(void)>        callback_update_slots;
 
-            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), STOP_TYPE_FULL);
-            if (stop_pos != std::string::npos) {
-                slot.generated_text.erase(
-                    slot.generated_text.begin() + pos + stop_pos,
-                    slot.generated_text.end());
-                pos = std::min(slot.n_sent_text, slot.generated_text.size());
-            } else if (slot.has_next_token) {
-                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), STOP_TYPE_PARTIAL);
-                send_text = stop_pos == std::string::npos;
-            }
+    // Add a new task to the end of the queue
+    int post(server_task task, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        if (task.id == -1) {
+            task.id = next_id();
+        }
+        QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
+        if (front) {
+            queue_tasks.push_front(std::move(task));
+        } else {
+            queue_tasks.push_back(std::move(task));
+        }
+        condition_tasks.notify_one();
+        return task.id;
+    }
 
-            // check if there is any token to predict
-            if (send_text) {
-                // no send the stop word in the response
-                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
-                slot.n_sent_text += result.text_to_send.size();
-                // add the token to slot queue and cache
+    // multi-task version of post()
+    int post(std::vector<server_task> & tasks, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        for (auto & task : tasks) {
+            if (task.id == -1) {
+                task.id = next_id();
             }
-
-            slot.add_token(result);
-            if (slot.params.stream) {
-                send_partial_response(slot, result);
+            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
+            if (front) {
+                queue_tasks.push_front(std::move(task));
+            } else {
+                queue_tasks.push_back(std::move(task));
             }
         }
+        condition_tasks.notify_one();
+        return 0;
+    }
 
-        if (incomplete) {
-            slot.has_next_token = true;
-        }
+    // post the inference tasks of a request, if the KV cells of the slots in flight and the estimated tokens of the
+    // waiting tasks leave room for them
+    // otherwise, the waiting requests of a lower priority are shed to make room, the newest first, and their tasks are
+    // moved to `shed` - only the requests with all their tasks deferred, none of them in a slot yet
+    // returns false if the tasks cannot be admitted, with the estimated seconds until there is room
+    bool post_admit(std::vector<server_task> & tasks, std::vector<server_task> & shed, int & retry_after) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
 
-        // check the limits
-        if (slot.n_decoded > 0 && slot.has_next_token && !slot.has_budget(params)) {
-            slot.stopped_limit  = true;
-            slot.has_next_token = false;
+        int64_t n_tokens = 0;
+        for (const auto & task : tasks) {
+            n_tokens += task.n_tokens;
+        }
 
-            SLT_DBG(slot, "stopped by limit, n_decoded = %d, n_predict = %d\n", slot.n_decoded, slot.params.n_predict);
+        int64_t n_waiting = 0;
+        for (const auto & task : queue_tasks) {
+            n_waiting += task.n_tokens;
+        }
+        for (const auto & task : queue_tasks_deferred) {
+            n_waiting += task.n_tokens;
         }
 
-        if (slot.has_new_line) {
-            // if we have already seen a new line, we stop after a certain time limit
-            if (slot.params.t_max_predict_ms > 0 && (ggml_time_us() - slot.t_start_generation > 1000.0f*slot.params.t_max_predict_ms)) {
-                slot.stopped_limit  = true;
-                slot.has_next_token = false;
+        int64_t n_pending = n_tokens_busy + n_waiting;
 
-                SLT_DBG(slot, "stopped by time limit, n_decoded = %d, t_max_predict_ms = %d ms\n", slot.n_decoded, (int) slot.params.t_max_predict_ms);
-            }
+        // a request is never rejected when nothing waits, however large it is
+        if (n_tokens_max > 0 && n_waiting > 0 && n_pending + n_tokens > n_tokens_max) {
+            const int32_t priority = tasks.empty() ? 0 : tasks[0].priority;
 
-            // require that each new line has a whitespace prefix (i.e. indentation) of at least slot.params.n_indent
-            if (slot.params.n_indent > 0) {
-                // check the current indentation
-                // TODO: improve by not doing it more than once for each new line
-                if (slot.last_nl_pos > 0) {
-                    size_t pos = slot.last_nl_pos;
-
-                    int n_indent = 0;
-                    while (pos < slot.generated_text.size() && (slot.generated_text[pos] == ' ' || slot.generated_text[pos] == '\t')) {
-                        n_indent++;
-                        pos++;
-                    }
-
-                    if (pos < slot.generated_text.size() && n_indent < slot.params.n_indent) {
-                        slot.stopped_limit  = true;
-                        slot.has_next_token = false;
+            // the deferred tasks of each waiting request of a lower priority
+            std::map<int, std::vector<size_t>> requests;
+            for (size_t i = 0; i < queue_tasks_deferred.size(); i++) {
+                if (queue_tasks_deferred[i].priority < priority) {
+                    requests[queue_tasks_deferred[i].id_request].push_back(i);
+                }
+            }
 
-                        // cut the last line
-                        slot.generated_text.erase(pos, std::string::npos);
+            // the requests to shed, lowest priority first, then newest first
+            std::vector<const std::vector<size_t> *> victims;
+            for (const auto & it : requests) {
+                if ((int) it.second.size() == queue_tasks_deferred[it.second[0]].n_request) {
+                    victims.push_back(&it.second);
+                }
+            }
+            std::sort(victims.begin(), victims.end(), [this](const std::vector<size_t> * a, const std::vector<size_t> * b) {
+                const server_task & ta = queue_tasks_deferred[a->front()];
+                const server_task & tb = queue_tasks_deferred[b->front()];
+                return ta.priority != tb.priority ? ta.priority < tb.priority : ta.t_queued > tb.t_queued;
+            });
 
-                        SLT_DBG(slot, "stopped by indentation limit, n_decoded = %d, n_indent = %d\n", slot.n_decoded, n_indent);
-                    }
+            std::vector<size_t> shed_idxs;
+            for (size_t k = 0; k < victims.size() && n_pending + n_tokens > n_tokens_max; k++) {
+                for (size_t i : *victims[k]) {
+                    n_pending -= queue_tasks_deferred[i].n_tokens;
+                    shed_idxs.push_back(i);
                 }
+            }
 
-                // find the next new line
-                {
-                    const size_t pos = slot.generated_text.find('\n', slot.last_nl_pos);
+            if (n_pending + n_tokens > n_tokens_max) {
+                retry_after = std::min(60, std::max(1, (int) std::ceil(n_pending / std::max(1.0, n_tokens_per_sec))));
+                QUE_DBG("rejecting %d tasks, n_tokens = %" PRId64 ", n_pending = %" PRId64 ", retry after %d s\n", (int) tasks.size(), n_tokens, n_pending, retry_after);
+                return false;
+            }
 
-                    if (pos != std::string::npos) {
-                        slot.last_nl_pos = pos + 1;
-                    }
-                }
+            std::sort(shed_idxs.begin(), shed_idxs.end());
+            for (size_t k = shed_idxs.size(); k-- > 0; ) {
+                const server_task & task = queue_tasks_deferred[shed_idxs[k]];
+                QUE_DBG("shedding task, id = %d, id_request = %d, priority = %d\n", task.id, task.id_request, task.priority);
+                shed.push_back(std::move(queue_tasks_deferred[shed_idxs[k]]));
+                queue_tasks_deferred.erase(queue_tasks_deferred.begin() + shed_idxs[k]);
             }
         }
 
-        // check if there is a new line in the generated text
-        if (result.text_to_send.find('\n') != std::string::npos) {
-            slot.has_new_line = true;
+        for (auto & task : tasks) {
+            if (task.id == -1) {
+                task.id = next_id();
+            }
+        }
+        for (auto & task : tasks) {
+            task.id_request = tasks[0].id;
+            task.n_request  = tasks.size();
+            QUE_DBG("new task, id = %d/%d\n", task.id, (int) tasks.size());
+            queue_tasks.push_back(std::move(task));
         }
+        condition_tasks.notify_one();
 
-        // if context shift is disabled, we stop when it reaches the context limit
-        if (slot.n_past >= slot.n_ctx) {
-            slot.truncated      = true;
-            slot.stopped_limit  = true;
-            slot.has_next_token = false;
+        return true;
+    }
 
-            SLT_DBG(slot, "stopped due to running out of context capacity, n_past = %d, n_prompt_tokens = %d, n_decoded = %d, n_ctx = %d\n",
-                    slot.n_decoded, slot.n_prompt_tokens, slot.n_past, slot.n_ctx);
-        }
+    void set_tokens_busy(int64_t n_tokens) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        n_tokens_busy = n_tokens;
+    }
 
-        if (llama_token_is_eog(model, result.tok)) {
-            slot.stopped_eos    = true;
-            slot.has_next_token = false;
+    // remove the deferred tasks queued before t_min (us)
+    std::vector<server_task> expire(int64_t t_min) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
 
-            SLT_DBG(slot, "%s", "stopped by EOS\n");
+        std::vector<server_task> expired;
+        for (auto it = queue_tasks_deferred.begin(); it != queue_tasks_deferred.end(); ) {
+            if (it->type == SERVER_TASK_TYPE_INFERENCE && it->t_queued < t_min) {
+                QUE_DBG("expiring task, id = %d\n", it->id);
+                expired.push_back(std::move(*it));
+                it = queue_tasks_deferred.erase(it);
+            } else {
+                ++it;
+            }
         }
 
-        const auto n_ctx_train = llama_n_ctx_train(model);
-
-        if (slot.params.n_predict < 1 && slot.n_predict < 1 && slot.n_prompt_tokens + slot.n_decoded >= n_ctx_train) {
-            slot.truncated      = true;
-            slot.stopped_limit  = true;
-            slot.has_next_token = false; // stop prediction
+        return expired;
+    }
 
-            SLT_WRN(slot,
-                    "n_predict (%d) is set for infinite generation. "
-                    "Limiting generated tokens to n_ctx_train (%d) to avoid EOS-less generation infinite loop\n",
-                    slot.params.n_predict, n_ctx_train);
+    // the throughput of one iteration of the main loop, averaged over the recent ones
+    void on_throughput(int n_tokens, int64_t t_us) {
+        if (n_tokens <= 0 || t_us <= 0) {
+            return;
         }
 
-        SLT_DBG(slot, "n_decoded = %d, n_remaining = %d, next token: %5d '%s'\n", slot.n_decoded, slot.n_remaining, result.tok, token_str.c_str());
+        std::unique_lock<std::mutex> lock(mutex_tasks);
 
-        return slot.has_next_token; // continue
+        const double cur = 1e6 * n_tokens / t_us;
+        n_tokens_per_sec = n_tokens_per_sec > 0 ? 0.9*n_tokens_per_sec + 0.1*cur : cur;
     }
 
-    json get_formated_generation(const server_slot & slot) const {
-        std::vector<std::string> samplers;
-        samplers.reserve(slot.sparams.samplers.size());
-        for (const auto & sampler : slot.sparams.samplers) {
-            samplers.emplace_back(common_sampler_type_to_str(sampler));
-        }
+    // Add a new task, but defer until one slot is available
+    void defer(server_task task) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        QUE_DBG("defer task, id = %d\n", task.id);
+        queue_tasks_deferred.push_back(std::move(task));
+        condition_tasks.notify_one();
+    }
 
-        return json {
-            {"n_ctx",                     slot.n_ctx},
-            {"n_predict",                 slot.n_predict},     // Server configured n_predict
-            {"model",                     params.model_alias},
-            {"seed",                      slot.sparams.seed},
-            {"seed_cur",                  slot.smpl ? common_sampler_get_seed(slot.smpl) : 0},
-            {"temperature",               slot.sparams.temp},
-            {"dynatemp_range",            slot.sparams.dynatemp_range},
-            {"dynatemp_exponent",         slot.sparams.dynatemp_exponent},
-            {"top_k",                     slot.sparams.top_k},
-            {"top_p",                     slot.sparams.top_p},
-            {"min_p",                     slot.sparams.min_p},
-            {"xtc_probability",           slot.sparams.xtc_probability},
-            {"xtc_threshold",             slot.sparams.xtc_threshold},
-            {"typical_p",                 slot.sparams.typ_p},
-            {"repeat_last_n",             slot.sparams.penalty_last_n},
-            {"repeat_penalty",            slot.sparams.penalty_repeat},
-            {"presence_penalty",          slot.sparams.penalty_present},
-            {"frequency_penalty",         slot.sparams.penalty_freq},
-            {"dry_multiplier",            slot.sparams.dry_multiplier},
-            {"dry_base",                  slot.sparams.dry_base},
-            {"dry_allowed_length",        slot.sparams.dry_allowed_length},
-            {"dry_penalty_last_n",        slot.sparams.dry_penalty_last_n},
-            {"dry_sequence_breakers",     slot.sparams.dry_sequence_breakers},
-            {"mirostat",                  slot.sparams.mirostat},
-            {"mirostat_tau",              slot.sparams.mirostat_tau},
-            {"mirostat_eta",              slot.sparams.mirostat_eta},
-            {"penalize_nl",               slot.sparams.penalize_nl},
-            {"stop",                      slot.params.antiprompt},
-            {"max_tokens",                slot.params.n_predict}, // User configured n_predict
-            {"n_keep",                    slot.params.n_keep},
-            {"n_discard",                 slot.params.n_discard},
-            {"ignore_eos",                slot.sparams.ignore_eos},
-            {"stream",                    slot.params.stream},
-          //{"logit_bias",                slot.sparams.logit_bias},
-            {"n_probs",                   slot.sparams.n_probs},
-            {"min_keep",                  slot.sparams.min_keep},
-            {"grammar",                   slot.sparams.grammar},
-            {"samplers",                  samplers},
-        };
+    // Get the next id for creating a new task
+    int get_new_id() {
+        return next_id();
     }
 
-    void send_error(const server_task & task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
-        send_error(task.id, error, type);
+    // the ids are unique across the queues, as the models of the router share the stream loop
+    static int next_id() {
+        static std::atomic<int> id{0};
+        return id++;
     }
 
-    void send_error(const server_slot & slot, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
-        send_error(slot.id_task, error, type);
+    // Register function to process a new task
+    void on_new_task(std::function<void(server_task)> callback) {
+        callback_new_task = std::move(callback);
     }
 
-    void send_error(const int id_task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
-        SRV_ERR("task id = %d, error: %s\n", id_task, error.c_str());
+    // Register the function to be called when all slots data is ready to be processed
+    void on_update_slots(std::function<void(void)> callback) {
+        callback_update_slots = std::move(callback);
+    }
 
-        server_task_result res;
-        res.id       = id_task;
-        res.stop     = false;
-        res.error    = true;
-        res.data     = format_error_response(error, type);
+    // Call when the state of one slot is changed, it will move one task from deferred to main queue
+    // the oldest task of the highest priority goes first
+    void pop_deferred_task() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        if (!queue_tasks_deferred.empty()) {
+            auto it = std::max_element(queue_tasks_deferred.begin(), queue_tasks_deferred.end(),
+                    [](const server_task & a, const server_task & b) { return a.priority < b.priority; });
+            queue_tasks.emplace_back(std::move(*it));
+            queue_tasks_deferred.erase(it);
+        }
+        condition_tasks.notify_one();
+    }
 
-        queue_results.send(res);
+    // end the start_loop routine
+    void terminate() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        running = false;
+        condition_tasks.notify_all();
     }
 
-    void send_partial_response(server_slot & slot, completion_token_output tkn) {
-        server_task_result res;
-        res.id       = slot.id_task;
-        res.error    = false;
-        res.stop     = false;
-        res.data     = json {
-            {"content",    tkn.text_to_send},
-            {"stop",       false},
-            {"id_slot",    slot.id},
-            {"multimodal", false},
-            {"index",      slot.index},
-        };
+    /**
+     * Main loop consists of these steps:
+     * - Wait until a new task arrives
+     * - Process the task (i.e. maybe copy data into slot)
+     * - Check if multitask is finished
+     * - Update all slots
+     */
+    void start_loop() {
+        running = true;
 
-        if (slot.sparams.n_probs > 0) {
-            const llama_tokens to_send_toks = common_tokenize(ctx, tkn.text_to_send, false);
-            const size_t probs_pos      = std::min(slot.n_sent_token_probs,                       slot.generated_token_probs.size());
-            const size_t probs_stop_pos = std::min(slot.n_sent_token_probs + to_send_toks.size(), slot.generated_token_probs.size());
+        while (true) {
+            QUE_DBG("%s", "processing new tasks\n");
 
-            std::vector<completion_token_output> probs_output;
-            if (probs_pos < probs_stop_pos) {
-                probs_output = std::vector<completion_token_output>(
-                        slot.generated_token_probs.begin() + probs_pos,
-                        slot.generated_token_probs.begin() + probs_stop_pos);
+            while (true) {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (queue_tasks.empty()) {
+                    lock.unlock();
+                    break;
+                }
+                server_task task = queue_tasks.front();
+                queue_tasks.pop_front();
+                lock.unlock();
+
+                QUE_DBG("processing task, id = %d\n", task.id);
+                callback_new_task(std::move(task));
             }
-            slot.n_sent_token_probs = probs_stop_pos;
 
-            res.data["completion_probabilities"] = probs_vector_to_json(ctx, probs_output);
+            // all tasks in the current loop is processed, slots data is now ready
+            QUE_DBG("%s", "update slots\n");
+
+            callback_update_slots();
+
+            QUE_DBG("%s", "waiting for new tasks\n");
+            {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (queue_tasks.empty()) {
+                    if (!running) {
+                        QUE_DBG("%s", "terminate\n");
+                        return;
+                    }
+                    condition_tasks.wait(lock, [&]{
+                        return (!queue_tasks.empty() || !running);
+                    });
+                }
+            }
         }
+    }
+};
 
-        if (slot.oaicompat) {
-            res.data["oaicompat_token_ctr"] = slot.n_decoded;
-            res.data["model"] = slot.oaicompat_model;
+// threads that run jobs off the main loop
+// the jobs with the same key run in the order they are posted, on the same thread
+struct server_worker_pool {
+    struct worker {
+        std::thread thread;
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::function<void()>> jobs;
+        bool running = true;
+    };
+
+    std::vector<std::unique_ptr<worker>> workers;
+
+    ~server_worker_pool() {
+        stop();
+    }
+
+    // run the jobs that are left and join the threads - the jobs use the server_context and its result handlers
+    void stop() {
+        for (auto & w : workers) {
+            {
+                std::unique_lock<std::mutex> lock(w->mutex);
+                w->running = false;
+            }
+            w->cv.notify_one();
         }
+        for (auto & w : workers) {
+            w->thread.join();
+        }
+        workers.clear();
+    }
+
+    void start(int n_threads) {
+        for (int i = 0; i < n_threads; i++) {
+            workers.emplace_back(new worker());
+
+            worker * w = workers.back().get();
+            w->thread = std::thread([w]() {
+                std::unique_lock<std::mutex> lock(w->mutex);
+                while (true) {
+                    w->cv.wait(lock, [w] { return !w->running || !w->jobs.empty(); });
+                    if (w->jobs.empty()) {
+                        break; // not running, and all jobs are done
+                    }
 
-        queue_results.send(res);
+                    std::function<void()> job = std::move(w->jobs.front());
+                    w->jobs.pop_front();
+
+                    lock.unlock();
+                    job();
+                    lock.lock();
+                }
+            });
+        }
     }
 
-    void send_final_response(const server_slot & slot) {
-        server_task_result res;
-        res.id       = slot.id_task;
-        res.error    = false;
-        res.stop     = true;
-        res.data     = json {
-            {"content",             !slot.params.stream ? slot.generated_text : ""},
-            {"id_slot",             slot.id},
-            {"stop",                true},
-            {"model",               params.model_alias},
-            {"tokens_predicted",    slot.n_decoded},
-            {"tokens_evaluated",    slot.n_prompt_tokens},
-            {"generation_settings", get_formated_generation(slot)},
-            {"prompt",              common_detokenize(ctx, slot.prompt_tokens)},
-            {"has_new_line",        slot.has_new_line},
-            {"truncated",           slot.truncated},
-            {"stopped_eos",         slot.stopped_eos},
-            {"stopped_word",        slot.stopped_word},
-            {"stopped_limit",       slot.stopped_limit},
-            {"stopping_word",       slot.stopping_word},
-            {"tokens_cached",       slot.n_past},
-            {"timings",             slot.get_formated_timings()},
-            {"index",               slot.index},
-        };
+    bool enabled() const {
+        return !workers.empty();
+    }
 
-        if (slot.sparams.n_probs > 0) {
-            std::vector<completion_token_output> probs;
-            if (!slot.params.stream && slot.stopped_word) {
-                const llama_tokens stop_word_toks = common_tokenize(ctx, slot.stopping_word, false);
+    void post(int key, std::function<void()> job) {
+        worker & w = *workers[(size_t) key % workers.size()];
+        {
+            std::unique_lock<std::mutex> lock(w.mutex);
+            w.jobs.push_back(std::move(job));
+        }
+        w.cv.notify_one();
+    }
+};
 
-                size_t safe_offset = std::min(slot.generated_token_probs.size(), stop_word_toks.size());
-                probs = std::vector<completion_token_output>(
-                        slot.generated_token_probs.begin(),
-                        slot.generated_token_probs.end() - safe_offset);
-            } else {
-                probs = std::vector<completion_token_output>(
-                        slot.generated_token_probs.begin(),
-                        slot.generated_token_probs.end());
-            }
+struct server_response {
+    // for keeping track of all tasks waiting for the result
+    std::unordered_set<int> waiting_task_ids;
 
-            res.data["completion_probabilities"] = probs_vector_to_json(ctx, probs);
-        }
+    // the main result queue
+    std::vector<server_task_result> queue_results;
 
-        if (slot.oaicompat) {
-            res.data["oaicompat_token_ctr"] = slot.n_decoded;
-            res.data["model"] = slot.oaicompat_model;
-        }
+    std::mutex mutex_results;
+    std::condition_variable condition_results;
+
+    // tasks whose results are passed to the stream handler instead of the result queue
+    std::unordered_set<int> stream_task_ids;
+    std::function<void(server_task_result &)> stream_handler;
+
+    // add the id_task to the list of tasks waiting for response
+    void add_waiting_task_id(int id_task) {
+        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
 
-        queue_results.send(res);
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.insert(id_task);
     }
 
-    void send_embedding(const server_slot & slot, const llama_batch & batch) {
-        server_task_result res;
-        res.id    = slot.id_task;
-        res.error = false;
-        res.stop  = true;
+    void add_waiting_tasks(const std::vector<server_task> & tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
 
-        const int n_embd = llama_n_embd(model);
+        for (const auto & task : tasks) {
+            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
+            waiting_task_ids.insert(task.id);
+        }
+    }
 
-        std::vector<float> embd_res(n_embd, 0.0f);
+    // when the request is finished, we can remove task associated with it
+    void remove_waiting_task_id(int id_task) {
+        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
 
-        for (int i = 0; i < batch.n_tokens; ++i) {
-            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id) {
-                continue;
-            }
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.erase(id_task);
+        stream_task_ids.erase(id_task);
+    }
 
-            const float * embd = llama_get_embeddings_seq(ctx, batch.seq_id[i][0]);
-            if (embd == NULL) {
-                embd = llama_get_embeddings_ith(ctx, i);
-            }
+    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
 
-            if (embd == NULL) {
-                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], batch.seq_id[i][0]);
+        for (const auto & id_task : id_tasks) {
+            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+            waiting_task_ids.erase(id_task);
+            stream_task_ids.erase(id_task);
+        }
+    }
+
+    // pass the results of the tasks to the stream handler from now on, including the ones that are already queued
+    void add_stream_tasks(const std::unordered_set<int> & id_tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
 
-                res.data = json {
-                    {"embedding", std::vector<float>(n_embd, 0.0f)},
-                    {"index",     slot.index},
-                };
+        for (const auto & id_task : id_tasks) {
+            stream_task_ids.insert(id_task);
+        }
 
-                continue;
+        for (size_t i = 0; i < queue_results.size(); ) {
+            if (id_tasks.find(queue_results[i].id) != id_tasks.end()) {
+                stream_handler(queue_results[i]);
+                queue_results.erase(queue_results.begin() + i);
+            } else {
+                i++;
             }
+        }
+    }
 
-            common_embd_normalize(embd, embd_res.data(), n_embd);
+    // This function blocks the thread until there is a response for one of the id_tasks
+    server_task_result recv(const std::unordered_set<int> & id_tasks) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            condition_results.wait(lock, [&]{
+                return !queue_results.empty();
+            });
 
-            res.data = json {
-                {"embedding", embd_res},
-                {"index",     slot.index},
-            };
+            for (int i = 0; i < (int) queue_results.size(); i++) {
+                if (id_tasks.find(queue_results[i].id) != id_tasks.end()) {
+                    server_task_result res = queue_results[i];
+                    queue_results.erase(queue_results.begin() + i);
+                    return res;
+                }
+            }
         }
 
-        SLT_DBG(slot, "%s", "sending embeddings\n");
+        // should never reach here
+    }
 
-        queue_results.send(res);
+    // single-task version of recv()
+    server_task_result recv(int id_task) {
+        std::unordered_set<int> id_tasks = {id_task};
+        return recv(id_tasks);
     }
 
-    void send_rerank(const server_slot & slot, const llama_batch & batch) {
-        server_task_result res;
-        res.id    = slot.id_task;
-        res.error = false;
-        res.stop  = true;
+    // Send a new result to a waiting id_task
+    void send(server_task_result & result) {
+        SRV_DBG("sending result for task id = %d\n", result.id);
 
-        for (int i = 0; i < batch.n_tokens; ++i) {
-            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id) {
-                continue;
-            }
+        std::unique_lock<std::mutex> lock(mutex_results);
+        for (const auto & id_task : waiting_task_ids) {
+            if (result.id == id_task) {
+                if (stream_task_ids.find(id_task) != stream_task_ids.end()) {
+                    stream_handler(result);
+                    return;
+                }
 
-            const float * embd = llama_get_embeddings_seq(ctx, batch.seq_id[i][0]);
-            if (embd == NULL) {
-                embd = llama_get_embeddings_ith(ctx, i);
-            }
+                SRV_DBG("task id = %d moved to result queue\n", result.id);
 
-            if (embd == NULL) {
-                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], batch.seq_id[i][0]);
+                queue_results.push_back(std::move(result));
+                condition_results.notify_all();
+                return;
+            }
+        }
+    }
+};
 
-                res.data = json {
-                    {"index", slot.index},
-                    {"score", -1e6},
-                };
+struct server_context {
+    llama_model * model = nullptr;
+    llama_context * ctx = nullptr;
+    std::vector<common_lora_adapter_container> loras;
 
-                continue;
-            }
+    // the draft model for speculative decoding, with one sequence per slot
+    llama_model * model_dft = nullptr;
+    llama_context * ctx_dft = nullptr;
 
-            res.data = json {
-                {"index", slot.index},
-                {"score", embd[0]},
-            };
-        }
+    // prompt lookup: n-gram statistics of a text corpus used to validate the drafts (--lookup-cache-static)
+    common_ngram_cache ngram_cache_static;
+    common_ngram_cache ngram_cache_dynamic; // unused, always empty
 
-        SLT_DBG(slot, "sending rerank result, res = '%s'\n", res.data.dump().c_str());
+    common_params params;
 
-        queue_results.send(res);
-    }
+    llama_batch batch     = {};
+    llama_batch batch_dft = {};
 
-    //
-    // Functions to create new task(s) and receive result(s)
-    //
+    bool clean_kv_cache = true;
+    bool add_bos_token  = true;
+    bool has_eos_token  = false;
 
-    // break the input "prompt" into multiple tasks if needed, then format and tokenize the input prompt(s)
-    std::vector<server_task> create_tasks_inference(json data, server_task_inf_type inf_type) {
-        std::vector<server_task> tasks;
-        auto create_task = [&](json & task_data, llama_tokens & prompt_tokens) {
-            SRV_DBG("create task, n_tokens = %d\n", (int) prompt_tokens.size());
-            server_task task;
-            task.id            = queue_tasks.get_new_id();
-            task.inf_type      = inf_type;
-            task.type          = SERVER_TASK_TYPE_INFERENCE;
-            task.data          = task_data;
-            task.prompt_tokens = std::move(prompt_tokens);
-            tasks.push_back(std::move(task));
-        };
+    int32_t n_ctx; // total context for all clients / slots
 
-        static constexpr const char * error_msg = "\"prompt\" must be a string, an array of token ids or an array of prompts";
-        if (!data.contains("prompt")) {
-            throw std::runtime_error(error_msg);
-        }
+    // slots / clients
+    std::vector<server_slot> slots;
+    json default_generation_settings_for_props;
 
-        // because llama_tokenize api is thread-safe, we can tokenize the prompt from HTTP thread
-        bool add_special = inf_type != SERVER_TASK_INF_TYPE_RERANK && inf_type != SERVER_TASK_INF_TYPE_INFILL;
-        std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx, data.at("prompt"), add_special, true);
-        switch (inf_type) {
-            case SERVER_TASK_INF_TYPE_RERANK:
-                {
-                    // prompts[0] is the question
-                    // the rest are the answers/documents
-                    GGML_ASSERT(tokenized_prompts.size() > 1);
-                    SRV_DBG("creating rerank tasks, n_prompts = %d\n", (int) tokenized_prompts.size() - 1);
-                    for (size_t i = 1; i < tokenized_prompts.size(); i++) {
-                        data["index"] = i - 1;
-                        auto tokens = format_rerank(model, tokenized_prompts[0], tokenized_prompts[i]);
-                        create_task(data, tokens);
-                    }
-                } break;
-            case SERVER_TASK_INF_TYPE_INFILL:
-                {
-                    SRV_DBG("creating infill tasks, n_prompts = %d\n", (int) tokenized_prompts.size());
-                    for (size_t i = 0; i < tokenized_prompts.size(); i++) {
-                        data["index"] = i;
-                        auto tokens = format_infill(
-                            ctx,
-                            data.at("input_prefix"),
-                            data.at("input_suffix"),
-                            data.at("input_extra"),
-                            params.n_batch,
-                            params.n_predict,
-                            slots[0].n_ctx, // TODO: there should be a better way
-                            params.spm_infill,
-                            tokenized_prompts[i]
-                        );
-                        create_task(data, tokens);
-                    }
-                } break;
-            default:
-                {
-                    SRV_DBG("creating multi-prompt tasks, n_prompts = %d\n", (int) tokenized_prompts.size());
-                    for (size_t i = 0; i < tokenized_prompts.size(); i++) {
-                        data["index"] = i;
-                        create_task(data, tokenized_prompts[i]);
-                    }
-                }
-        }
+    // prompt prefixes cached by the slots, used to share the KV cache across slots
+    server_prefix_tree prefix_cache;
 
-        return tasks;
-    }
+    // KV cache of idle slots that was moved out to make room for other prompts
+    server_spill_store spill_store;
 
-    void cancel_tasks(const std::unordered_set<int> & id_tasks) {
-        std::vector<server_task> cancel_tasks;
-        cancel_tasks.reserve(id_tasks.size());
-        for (const auto & id_task : id_tasks) {
-            SRV_WRN("cancel task, id_task = %d\n", id_task);
+    // KV cache of long prompts on disk, shared across server restarts
+    server_disk_cache disk_cache;
+    uint64_t          disk_cache_model = 0; // hash of the model and of the context parameters that affect its KV cache
 
-            server_task task;
-            task.type      = SERVER_TASK_TYPE_CANCEL;
-            task.id_target = id_task;
-            cancel_tasks.push_back(task);
-            queue_results.remove_waiting_task_id(id_task);
-        }
-        // push to beginning of the queue, so it has highest priority
-        queue_tasks.post(cancel_tasks, true);
-    }
+    server_queue    queue_tasks;
+    server_response queue_results;
 
-    // receive the results from task(s) created by create_tasks_inference
-    void receive_cmpl_results(
-            const std::unordered_set<int> & id_tasks,
-            const std::function<void(std::vector<server_task_result>&)> & result_handler,
-            const std::function<void(json)> & error_handler) {
-        // TODO: currently, there is no way to detect the client has cancelled the request
-        std::vector<server_task_result> results(id_tasks.size());
-        for (size_t i = 0; i < id_tasks.size(); i++) {
-            server_task_result result = queue_results.recv(id_tasks);
+    // detokenization and formatting of the results, off the main loop
+    server_worker_pool post_pool;
 
-            if (result.error) {
-                error_handler(result.data);
-                cancel_tasks(id_tasks);
-                return;
-            }
+    // embedding and rerank tasks waiting to be packed into a batch, and the LRU of their results
+    std::deque<server_task> embd_pending;
+    server_embd_cache       embd_cache;
 
-            const size_t idx = result.data["index"];
-            GGML_ASSERT(idx < results.size() && "index out of range");
+    server_grammar_cache grammar_cache;
 
-            results[idx] = result;
-        }
-        result_handler(results);
-    }
+    server_metrics metrics;
+
+    // Necessary similarity of prompt for slot selection
+    float slot_prompt_similarity = 0.0f;
+
+    // router mode: the models share one threadpool, so their graphs are computed one at a time under this lock
+    std::mutex * mutex_compute = nullptr;
+
+    ~server_context() {
+        // the pending jobs use the contexts below
+        post_pool.stop();
+
+        if (ctx) {
+            llama_free(ctx);
+            ctx = nullptr;
+        }
+
+        if (model) {
+            llama_free_model(model);
+            model = nullptr;
+        }
+
+        if (ctx_dft) {
+            llama_free(ctx_dft);
+            ctx_dft = nullptr;
+        }
+
+        if (model_dft) {
+            llama_free_model(model_dft);
+            model_dft = nullptr;
+        }
+
+        // Clear any sampling context
+        for (server_slot & slot : slots) {
+            if (slot.smpl != nullptr) {
+                common_sampler_free(slot.smpl);
+            }
+        }
+
+        llama_batch_free(batch);
+        llama_batch_free(batch_dft);
+    }
+
+    // the calls that compute a graph, with the compute lock of the router mode held
+    int decode(llama_context * ctx_decode, llama_batch batch_decode) {
+        std::unique_lock<std::mutex> lock;
+        if (mutex_compute) {
+            lock = std::unique_lock<std::mutex>(*mutex_compute);
+        }
+        return llama_decode(ctx_decode, batch_decode);
+    }
+
+    void kv_cache_update() {
+        std::unique_lock<std::mutex> lock;
+        if (mutex_compute) {
+            lock = std::unique_lock<std::mutex>(*mutex_compute);
+        }
+        llama_kv_cache_update(ctx);
+    }
+
+    bool load_model(const common_params & params_) {
+        params = params_;
+
+        common_init_result llama_init = common_init_from_params(params);
+
+        model = llama_init.model;
+        ctx   = llama_init.context;
+        loras = llama_init.lora_adapters;
+
+        if (model == nullptr) {
+            SRV_ERR("failed to load model, '%s'\n", params.model.c_str());
+            return false;
+        }
+
+        n_ctx = llama_n_ctx(ctx);
+
+        add_bos_token = llama_add_bos_token(model);
+        has_eos_token = !llama_add_eos_token(model);
+
+        if (params.ctx_shift && params.ctx_shift_sink > 0) {
+            const int32_t n_ctx_slot = params.kv_pool ? n_ctx : n_ctx / params.n_parallel;
+            if (params.ctx_shift_sink >= n_ctx_slot) {
+                SRV_ERR("--ctx-shift-sink (%d) must be smaller than the context size of a slot (%d)\n", params.ctx_shift_sink, n_ctx_slot);
+                return false;
+            }
+        }
+
+        // with --swa-ring, verifying the draft tokens evicts the cells out of the window of the last draft:
+        // once the rejected drafts are removed, the window of the accepted tokens is missing cells
+        if (params.swa_ring && llama_n_swa(model) > 0 && (!params.model_draft.empty() || params.draft_lookup)) {
+            SRV_WRN("%s", "speculative decoding is disabled: the sliding window cache of --swa-ring cannot roll back rejected draft tokens\n");
+
+            params.model_draft.clear();
+            params.draft_lookup = false;
+        }
+
+        if (!params.model_draft.empty()) {
+            SRV_INF("loading draft model '%s'\n", params.model_draft.c_str());
+
+            common_params params_dft = params;
+
+            params_dft.model           = params.model_draft;
+            params_dft.model_url       = "";
+            params_dft.hf_repo         = "";
+            params_dft.hf_file         = "";
+            params_dft.n_gpu_layers    = params.n_gpu_layers_draft;
+            params_dft.cpuparams       = params.draft_cpuparams;
+            params_dft.cpuparams_batch = params.draft_cpuparams_batch;
+            params_dft.n_ctx           = n_ctx; // the draft model follows the sequences of the target model
+            params_dft.lora_adapters.clear();
+            params_dft.control_vectors.clear();
+
+            common_init_result llama_init_dft = common_init_from_params(params_dft);
+
+            model_dft = llama_init_dft.model;
+            ctx_dft   = llama_init_dft.context;
+
+            if (model_dft == nullptr) {
+                SRV_ERR("failed to load draft model, '%s'\n", params.model_draft.c_str());
+                return false;
+            }
+
+            if (!validate_draft_model()) {
+                return false;
+            }
+        }
+
+        if (params.draft_lookup && !params.lookup_cache_static.empty()) {
+            try {
+                ngram_cache_static = common_ngram_cache_load(params.lookup_cache_static);
+            } catch (std::ifstream::failure const &) {
+                SRV_ERR("failed to open static lookup cache '%s'\n", params.lookup_cache_static.c_str());
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // speculative decoding drafts tokens with a draft model and/or from the n-grams of the context of the slots
+    bool spec_enabled() const {
+        return ctx_dft != nullptr || params.draft_lookup;
+    }
+
+    // the draft tokens are verified by the target model, so both models must tokenize the same way
+    bool validate_draft_model() const {
+        if (llama_vocab_type(model) != llama_vocab_type(model_dft)) {
+            SRV_ERR("%s", "the vocab type of the draft model does not match the target model\n");
+            return false;
+        }
+
+        if (llama_add_bos_token(model) != llama_add_bos_token(model_dft) ||
+            llama_add_eos_token(model) != llama_add_eos_token(model_dft) ||
+            llama_token_bos(model)     != llama_token_bos(model_dft) ||
+            llama_token_eos(model)     != llama_token_eos(model_dft)) {
+            SRV_ERR("%s", "the special tokens of the draft model do not match the target model\n");
+            return false;
+        }
+
+        const int n_vocab     = llama_n_vocab(model);
+        const int n_vocab_dft = llama_n_vocab(model_dft);
+
+        // allow a few extra (e.g. padding) tokens at the end of the vocab
+        if (std::abs(n_vocab - n_vocab_dft) > 128) {
+            SRV_ERR("the vocab size of the draft model (%d) does not match the target model (%d)\n", n_vocab_dft, n_vocab);
+            return false;
+        }
+
+        for (int i = 0; i < std::min(n_vocab, n_vocab_dft); ++i) {
+            if (std::strcmp(llama_token_get_text(model, i), llama_token_get_text(model_dft, i)) != 0) {
+                SRV_ERR("token %d of the draft model ('%s') does not match the target model ('%s')\n", i,
+                        llama_token_get_text(model_dft, i), llama_token_get_text(model, i));
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool validate_model_chat_template() const {
+        std::vector<char> model_template(2048, 0); // longest known template is about 1200 bytes
+        std::string template_key = "tokenizer.chat_template";
+        int32_t res = llama_model_meta_val_str(model, template_key.c_str(), model_template.data(), model_template.size());
+        if (res >= 0) {
+            llama_chat_message chat[] = {{"user", "test"}};
+            std::string tmpl = std::string(model_template.data(), model_template.size());
+            int32_t chat_res = llama_chat_apply_template(model, tmpl.c_str(), chat, 1, true, nullptr, 0);
+            return chat_res > 0;
+        }
+        return false;
+    }
+
+    void init() {
+        // with the shared context pool, each slot can use the whole context - the prompts are admitted by the free cells instead
+        const int32_t n_ctx_slot = params.kv_pool ? n_ctx : n_ctx / params.n_parallel;
+
+        SRV_INF("initializing slots, n_slots = %d\n", params.n_parallel);
+
+        for (int i = 0; i < params.n_parallel; i++) {
+            server_slot slot;
+
+            slot.id = i;
+            slot.n_ctx = n_ctx_slot;
+            slot.n_predict = params.n_predict;
+
+            SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
+
+            slot.sparams = params.sparams;
+
+            slot.callback_on_release = [this](int id) {
+                slot_pos_reset(slots[id]);
+                queue_tasks.pop_deferred_task();
+            };
+
+            slot.reset();
+
+            slots.push_back(slot);
+        }
+
+        default_generation_settings_for_props = get_formated_generation(slots.front());
+        default_generation_settings_for_props["seed"] = -1;
+
+        embd_cache.n_max    = params.embd_cache;
+        grammar_cache.n_max = params.grammar_cache;
+
+        queue_tasks.n_tokens_max = params.queue_tokens < 0 ? n_ctx : params.queue_tokens;
+
+        // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
+        // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
+        {
+            const int32_t n_batch = llama_n_batch(ctx);
+
+            // with speculative decoding, each generating slot also submits its draft tokens
+            const int32_t n_draft = spec_enabled() ? std::max(params.n_draft, 0) : 0;
+
+            // only a single seq_id per token is needed
+            batch = llama_batch_init(std::max(n_batch, params.n_parallel * (1 + n_draft)), 0, 1);
+
+            if (ctx_dft) {
+                batch_dft = llama_batch_init(std::max(llama_n_batch(ctx_dft), (uint32_t) params.n_parallel), 0, 1);
+            }
+        }
+
+        spill_store.ram_max  = (size_t) params.spill_ram  * 1024 * 1024;
+        spill_store.disk_max = (size_t) params.spill_disk * 1024 * 1024;
+
+        if (spill_store.disk_max > 0) {
+            spill_store.path = params.spill_path.empty() ? fs_get_cache_directory() : params.spill_path;
+            if (!fs_create_directory_with_parents(spill_store.path)) {
+                SRV_WRN("failed to create spill directory '%s', spilling to disk is disabled\n", spill_store.path.c_str());
+                spill_store.disk_max = 0;
+            }
+        }
+
+        if (params.kv_cache_disk > 0 && !llama_model_is_recurrent(model)) {
+            const std::string path = params.kv_cache_path.empty() ? fs_get_cache_directory() + "kv-cache" + DIRECTORY_SEPARATOR : params.kv_cache_path;
+            if (!fs_create_directory_with_parents(path)) {
+                SRV_WRN("failed to create KV cache directory '%s', the persistent KV cache is disabled\n", path.c_str());
+            } else {
+                // the model, the adapters and the control vectors are identified by their content, not by their file names
+                std::string key = string_format("%s|%s|%d|%g|%g|%d|%d",
+                        params.cache_type_k.c_str(), params.cache_type_v.c_str(), params.flash_attn,
+                        params.rope_freq_base, params.rope_freq_scale, params.control_vector_layer_start, params.control_vector_layer_end);
+
+                uint64_t h = server_disk_cache::hash(key);
+                h = server_disk_cache::hash_file(h, params.model);
+                for (const auto & la : params.lora_adapters) {
+                    h = server_disk_cache::hash_file(h, la.path);
+                }
+                for (const auto & cv : params.control_vectors) {
+                    h = server_disk_cache::hash_file(h, cv.fname);
+                    h = server_disk_cache::hash(h, &cv.strength, sizeof(cv.strength));
+                }
+
+                disk_cache_model = h;
+                disk_cache.init(path, (size_t) params.kv_cache_disk * 1024 * 1024, disk_cache_model);
+            }
+        }
+
+        if (params.n_threads_post > 0) {
+            post_pool.start(params.n_threads_post);
+        }
+
+        metrics.init();
+    }
+
+    server_slot * get_slot_by_id(int id) {
+        for (server_slot & slot : slots) {
+            if (slot.id == id) {
+                return &slot;
+            }
+        }
+
+        return nullptr;
+    }
+
+    server_slot * get_slot_by_task_id(int id_task) {
+        if (id_task == -1) {
+            return nullptr;
+        }
+
+        for (server_slot & slot : slots) {
+            if (slot.id_task == id_task && slot.is_processing()) {
+                return &slot;
+            }
+        }
+
+        return nullptr;
+    }
+
+    server_slot * get_available_slot(const server_task & task) {
+        server_slot * ret = nullptr;
+
+        // find the slot that has at least n% prompt similarity
+        if (ret == nullptr && slot_prompt_similarity != 0.0f) {
+            int lcs_len = 0;
+            float similarity = 0;
+
+            for (server_slot & slot : slots) {
+                // skip the slot if it is not available
+                if (slot.is_processing()) {
+                    continue;
+                }
+
+                // skip the slot if it does not contains cached tokens
+                if (slot.cache_tokens.empty()) {
+                    continue;
+                }
+
+                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
+                int cur_lcs_len = longest_common_subsequence(slot.cache_tokens, task.prompt_tokens);
+
+                // fraction of the common subsequence length compared to the current slot's prompt length
+                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
+
+                // select the current slot if the criteria match
+                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity) {
+                    lcs_len = cur_lcs_len;
+                    similarity = cur_similarity;
+                    ret = &slot;
+                }
+            }
+
+            if (ret != nullptr) {
+                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+            }
+        }
+
+        // find the slot that has been least recently used
+        if (ret == nullptr) {
+            int64_t t_last = ggml_time_us();
+            for (server_slot & slot : slots) {
+                // skip the slot if it is not available
+                if (slot.is_processing()) {
+                    continue;
+                }
+
+                // select the current slot if the criteria match
+                if (slot.t_last_used < t_last) {
+                    t_last = slot.t_last_used;
+                    ret = &slot;
+                }
+            }
+
+            if (ret != nullptr) {
+                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
+            }
+        }
+
+        return ret;
+    }
+
+    bool launch_slot_with_task(server_slot & slot, const server_task & task) {
+        slot_params default_params;
+        // Sampling parameter defaults are loaded from the global server context (but individual requests can still override them)
+        auto default_sparams = params.sparams;
+        const auto & data = task.data;
+
+        if (data.count("__oaicompat") != 0) {
+            slot.oaicompat = true;
+            slot.oaicompat_model = json_value(data, "model", std::string(DEFAULT_OAICOMPAT_MODEL));
+        } else {
+            slot.oaicompat = false;
+            slot.oaicompat_model = "";
+        }
+
+        slot.params.stream              = json_value(data, "stream",             false);
+        slot.params.cache_prompt        = json_value(data, "cache_prompt",       false);
+        slot.params.n_predict           = json_value(data, "n_predict",          json_value(data, "max_tokens", default_params.n_predict));
+        slot.params.n_indent            = json_value(data, "n_indent",           default_params.n_indent);
+        slot.params.priority            = task.priority;
+        slot.n_tokens_task              = task.n_tokens;
+        slot.params.n_draft             = spec_enabled() ? std::min(std::max(json_value(data, "n_draft", params.n_draft), 0), params.n_draft) : 0;
+        slot.sparams.top_k              = json_value(data, "top_k",              default_sparams.top_k);
+        slot.sparams.top_p              = json_value(data, "top_p",              default_sparams.top_p);
+        slot.sparams.min_p              = json_value(data, "min_p",              default_sparams.min_p);
+        slot.sparams.xtc_probability    = json_value(data, "xtc_probability",    default_sparams.xtc_probability);
+        slot.sparams.xtc_threshold      = json_value(data, "xtc_threshold",      default_sparams.xtc_threshold);
+        slot.sparams.typ_p              = json_value(data, "typical_p",          default_sparams.typ_p);
+        slot.sparams.temp               = json_value(data, "temperature",        default_sparams.temp);
+        slot.sparams.dynatemp_range     = json_value(data, "dynatemp_range",     default_sparams.dynatemp_range);
+        slot.sparams.dynatemp_exponent  = json_value(data, "dynatemp_exponent",  default_sparams.dynatemp_exponent);
+        slot.sparams.penalty_last_n     = json_value(data, "repeat_last_n",      default_sparams.penalty_last_n);
+        slot.sparams.penalty_repeat     = json_value(data, "repeat_penalty",     default_sparams.penalty_repeat);
+        slot.sparams.penalty_freq       = json_value(data, "frequency_penalty",  default_sparams.penalty_freq);
+        slot.sparams.penalty_present    = json_value(data, "presence_penalty",   default_sparams.penalty_present);
+        slot.sparams.dry_multiplier     = json_value(data, "dry_multiplier",     default_sparams.dry_multiplier);
+        slot.sparams.dry_base           = json_value(data, "dry_base",           default_sparams.dry_base);
+        slot.sparams.dry_allowed_length = json_value(data, "dry_allowed_length", default_sparams.dry_allowed_length);
+        slot.sparams.dry_penalty_last_n = json_value(data, "dry_penalty_last_n", default_sparams.dry_penalty_last_n);
+        slot.sparams.mirostat           = json_value(data, "mirostat",           default_sparams.mirostat);
+        slot.sparams.mirostat_tau       = json_value(data, "mirostat_tau",       default_sparams.mirostat_tau);
+        slot.sparams.mirostat_eta       = json_value(data, "mirostat_eta",       default_sparams.mirostat_eta);
+        slot.sparams.penalize_nl        = json_value(data, "penalize_nl",        default_sparams.penalize_nl);
+        slot.params.n_keep              = json_value(data, "n_keep",             default_params.n_keep);
+        slot.params.n_discard           = json_value(data, "n_discard",          default_params.n_discard);
+        slot.sparams.seed               = json_value(data, "seed",               default_sparams.seed);
+        slot.sparams.n_probs            = json_value(data, "n_probs",            default_sparams.n_probs);
+        slot.sparams.min_keep           = json_value(data, "min_keep",           default_sparams.min_keep);
+      //slot.params.t_max_prompt_ms     = json_value(data, "t_max_prompt_ms",    default_params.t_max_prompt_ms); // TODO: implement
+        slot.params.t_max_predict_ms    = json_value(data, "t_max_predict_ms",   default_params.t_max_predict_ms);
+
+        if (slot.sparams.dry_base < 1.0f)
+        {
+           slot.sparams.dry_base = default_sparams.dry_base;
+        }
+
+        // sequence breakers for DRY
+        {
+            // Currently, this is not compatible with TextGen WebUI, Koboldcpp and SillyTavern format
+            // Ref: https://github.com/oobabooga/text-generation-webui/blob/d1af7a41ade7bd3c3a463bfa640725edb818ebaf/extensions/openai/typing.py#L39
+
+            if (data.contains("dry_sequence_breakers")) {
+                slot.sparams.dry_sequence_breakers = json_value(data, "dry_sequence_breakers", std::vector<std::string>());
+                if (slot.sparams.dry_sequence_breakers.empty()) {
+                    send_error(task, "Error: dry_sequence_breakers must be a non-empty array of strings", ERROR_TYPE_INVALID_REQUEST);
+                    return false;
+                }
+            }
+        }
+
+        // process "json_schema" and "grammar"
+        if (data.contains("json_schema") && !data.at("json_schema").is_null() && data.contains("grammar") && !data.at("grammar").is_null()) {
+            send_error(task, "Either \"json_schema\" or \"grammar\" can be specified, but not both", ERROR_TYPE_INVALID_REQUEST);
+            return false;
+        }
+        if (data.contains("json_schema") && !data.contains("grammar")) {
+            try {
+                auto schema          = json_value(data, "json_schema", json::object());
+                slot.sparams.grammar = grammar_cache.schema_to_grammar(schema);
+            } catch (const std::exception & e) {
+                send_error(task, std::string("\"json_schema\": ") + e.what(), ERROR_TYPE_INVALID_REQUEST);
+                return false;
+            }
+        } else {
+            slot.sparams.grammar = json_value(data, "grammar", default_sparams.grammar);
+        }
+
+        if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
+            // Might be better to reject the request with a 400 ?
+            slot.params.n_predict = slot.n_predict;
+            SLT_WRN(slot, "n_predict = %d exceeds server configuration, setting to %d", slot.n_predict, slot.n_predict);
+        }
+
+        {
+            slot.sparams.logit_bias.clear();
+
+            if (json_value(data, "ignore_eos", false) && has_eos_token) {
+                slot.sparams.logit_bias.push_back({llama_token_eos(model), -INFINITY});
+            }
+
+            const auto & logit_bias = data.find("logit_bias");
+            if (logit_bias != data.end() && logit_bias->is_array()) {
+                const int n_vocab = llama_n_vocab(model);
+                for (const auto & el : *logit_bias) {
+                    // TODO: we may want to throw errors here, in case "el" is incorrect
+                    if (el.is_array() && el.size() == 2) {
+                        float bias;
+                        if (el[1].is_number()) {
+                            bias = el[1].get<float>();
+                        } else if (el[1].is_boolean() && !el[1].get<bool>()) {
+                            bias = -INFINITY;
+                        } else {
+                            continue;
+                        }
+
+                        if (el[0].is_number_integer()) {
+                            llama_token tok = el[0].get<llama_token>();
+                            if (tok >= 0 && tok < n_vocab) {
+                                slot.sparams.logit_bias.push_back({tok, bias});
+                            }
+                        } else if (el[0].is_string()) {
+                            auto toks = common_tokenize(model, el[0].get<std::string>(), false);
+                            for (auto tok : toks) {
+                                slot.sparams.logit_bias.push_back({tok, bias});
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        {
+            slot.params.antiprompt.clear();
+
+            const auto & stop = data.find("stop");
+            if (stop != data.end() && stop->is_array()) {
+                for (const auto & word : *stop) {
+                    if (!word.empty()) {
+                        slot.params.antiprompt.push_back(word);
+                    }
+                }
+            }
+        }
+
+        {
+            const auto & samplers = data.find("samplers");
+            if (samplers != data.end()) {
+                if (samplers->is_array()) {
+                    std::vector<std::string> sampler_names;
+                    for (const auto & name : *samplers) {
+                        if (name.is_string()) {
+                            sampler_names.emplace_back(name);
+                        }
+                    }
+                    slot.sparams.samplers = common_sampler_types_from_names(sampler_names, false);
+                } else if (samplers->is_string()){
+                    std::string sampler_string;
+                    for (const auto & name : *samplers) {
+                        sampler_string += name;
+                    }
+                    slot.sparams.samplers = common_sampler_types_from_chars(sampler_string);
+                }
+            } else {
+                slot.sparams.samplers = default_sparams.samplers;
+            }
+        }
+
+        {
+            if (slot.smpl != nullptr) {
+                common_sampler_free(slot.smpl);
+            }
+
+            slot.smpl = common_sampler_init(model, slot.sparams, grammar_cache.grammar(model, slot.sparams.grammar).get());
+            if (slot.smpl == nullptr) {
+                // for now, the only error that may happen here is invalid grammar
+                send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
+                return false;
+            }
+        }
+
+        // per-request LoRA adapter, evaluated in the same batches as the requests with other adapters
+        {
+            int   lora_id    = -1;
+            float lora_scale = 0.0f;
+
+            const auto & lora = data.find("lora");
+            if (lora != data.end() && lora->is_array()) {
+                for (const auto & el : *lora) {
+                    const int   id    = json_value(el, "id",    -1);
+                    const float scale = json_value(el, "scale", 1.0f);
+
+                    if (id < 0 || id >= (int) loras.size()) {
+                        send_error(task, "invalid LoRA adapter id: " + std::to_string(id), ERROR_TYPE_INVALID_REQUEST);
+                        return false;
+                    }
+                    if (scale == 0.0f) {
+                        continue;
+                    }
+                    if (lora_id != -1) {
+                        send_error(task, "only one LoRA adapter per request is supported", ERROR_TYPE_INVALID_REQUEST);
+                        return false;
+                    }
+
+                    lora_id    = id;
+                    lora_scale = scale;
+                }
+            }
+
+            if (lora_id != slot.lora_id || lora_scale != slot.lora_scale) {
+                // the KV cache of the slot was computed with another adapter
+                if (!slot.cache_tokens.empty()) {
+                    kv_cache_spill(slot);
+
+                    llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+                    slot.cache_tokens.clear();
+                    prefix_cache.erase(slot.id);
+                }
+
+                if (lora_id == -1) {
+                    llama_lora_adapter_seq_clear(ctx, slot.id);
+                } else if (llama_lora_adapter_seq_set(ctx, loras[lora_id].adapter, slot.id, lora_scale) != 0) {
+                    llama_lora_adapter_seq_clear(ctx, slot.id);
+                    slot.lora_id    = -1;
+                    slot.lora_scale = 0.0f;
+
+                    send_error(task, "failed to apply the LoRA adapter", ERROR_TYPE_SERVER);
+                    return false;
+                }
+
+                slot.lora_id    = lora_id;
+                slot.lora_scale = lora_scale;
+            }
+        }
+
+        slot.state = SLOT_STATE_STARTED;
+
+        SLT_INF(slot, "%s", "processing task\n");
+
+        return true;
+    }
+
+    void kv_cache_clear() {
+        SRV_DBG("%s", "clearing KV cache\n");
+
+        // clear the entire KV cache
+        llama_kv_cache_clear(ctx);
+        clean_kv_cache = false;
+
+        prefix_cache.clear();
+    }
+
+    // move the KV cache of a slot back to the positions [0, n_past) after the rolling context shifts,
+    // so that it can be reused as a prompt prefix, spilled or saved
+    void slot_pos_reset(server_slot & slot) {
+        if (slot.n_pos_off == 0) {
+            return;
+        }
+
+        llama_kv_cache_seq_add(ctx, slot.id, -1, -1, -slot.n_pos_off);
+        if (ctx_dft != nullptr) {
+            llama_kv_cache_seq_add(ctx_dft, slot.id, -1, -1, -slot.n_pos_off);
+        }
+
+        slot.n_pos_off = 0;
+    }
+
+    // make the tokens that the slot holds in the KV cache available to the other slots
+    void prefix_cache_update(const server_slot & slot) {
+        if (!params.prefix_cache || !slot.params.cache_prompt) {
+            prefix_cache.erase(slot.id);
+            return;
+        }
+
+        prefix_cache.insert(slot.id, slot.cache_tokens, slot.cache_tokens.size());
+    }
+
+    // the key of the KV cache on disk - the scales of the LoRA adapters can change at runtime
+    uint64_t disk_cache_key() const {
+        uint64_t key = disk_cache_model;
+        for (const auto & la : loras) {
+            key = server_disk_cache::hash(key, &la.scale, sizeof(la.scale));
+        }
+        return key;
+    }
+
+    // save the KV cache of the slot in the spill store, so that it can be restored when the conversation resumes
+    void kv_cache_spill(const server_slot & slot) {
+        // the spill store is shared by all slots, so it only holds KV cache computed without a per-request adapter
+        if (!spill_store.enabled() || slot.cache_tokens.empty() || slot.lora_id != -1) {
+            return;
+        }
+
+        // apply any pending K-shift before serializing the cells
+        kv_cache_update();
+
+        const int64_t t_start = ggml_time_us();
+
+        if (spill_store.spill(ctx, slot.id, slot.cache_tokens)) {
+            SLT_INF(slot, "spilled KV cache, n_tokens = %d, ram = %.2f MiB, disk = %.2f MiB, %.2f ms\n",
+                    (int) slot.cache_tokens.size(), spill_store.ram_used / 1024.0 / 1024.0, spill_store.disk_used / 1024.0 / 1024.0,
+                    (ggml_time_us() - t_start) / 1e3);
+        }
+    }
+
+    // release the KV cache of idle slots, least recently used first, until some cells are freed
+    bool kv_cache_evict_idle() {
+        const int n_used = llama_get_kv_cache_used_cells(ctx);
+
+        std::vector<server_slot *> idle;
+        for (server_slot & slot : slots) {
+            if (!slot.is_processing()) {
+                idle.push_back(&slot);
+            }
+        }
+
+        std::sort(idle.begin(), idle.end(), [](const server_slot * a, const server_slot * b) {
+            return a->t_last_used < b->t_last_used;
+        });
+
+        for (server_slot * slot : idle) {
+            if (llama_kv_cache_seq_pos_min(ctx, slot->id) < 0) {
+                continue;
+            }
+
+            SLT_INF(*slot, "evicting cached tokens, n_cache_tokens = %d\n", (int) slot->cache_tokens.size());
+
+            kv_cache_spill(*slot);
+
+            llama_kv_cache_seq_rm(ctx, slot->id, -1, -1);
+            slot->cache_tokens.clear();
+            prefix_cache.erase(slot->id);
+
+            if (llama_get_kv_cache_used_cells(ctx) < n_used) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // with the shared context pool: the KV cells that a new prompt can use, i.e. the free cells minus the ones
+    // that the current batch and the prompts being processed still need
+    int kv_pool_n_free() const {
+        int n_free = n_ctx - llama_get_kv_cache_used_cells(ctx) - batch.n_tokens;
+
+        for (const server_slot & slot : slots) {
+            if (slot.state == SLOT_STATE_PROCESSING_PROMPT) {
+                n_free -= slot.n_prompt_tokens - slot.n_past;
+            }
+        }
+
+        return n_free;
+    }
+
+    // with the shared context pool: check that the KV cache has room for the prompt of the slot, evicting the
+    // cached tokens of idle slots if needed
+    bool kv_pool_admit(const server_slot & slot) {
+        const int n_common = slot.params.cache_prompt ? (int) longest_common_prefix(slot.cache_tokens, slot.prompt_tokens) : 0;
+
+        // the cached tokens of the slot after the common prefix are removed when the prompt is processed
+        const int n_reused = (int) slot.cache_tokens.size() - n_common;
+        const int n_needed = std::min((int) slot.prompt_tokens.size(), slot.n_ctx - 1) - n_common;
+
+        while (kv_pool_n_free() + n_reused < n_needed) {
+            if (!kv_cache_evict_idle()) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // with the shared context pool: when the KV cache is full, stop the most recent request of the lowest priority
+    // to free its cells, instead of failing all of them
+    // returns the id of the stopped slot, or -1
+    int kv_pool_preempt() {
+        server_slot * victim = nullptr;
+        int n_running = 0;
+
+        for (server_slot & slot : slots) {
+            if (!slot.is_processing() || slot.state == SLOT_STATE_STARTED) {
+                continue;
+            }
+
+            n_running++;
+
+            if (victim == nullptr || slot.params.priority < victim->params.priority ||
+                (slot.params.priority == victim->params.priority && slot.t_start_process_prompt > victim->t_start_process_prompt)) {
+                victim = &slot;
+            }
+        }
+
+        // a single request has the whole pool
+        if (n_running < 2) {
+            return -1;
+        }
+
+        SLT_WRN(*victim, "preempted, the KV cache is full, n_past = %d\n", victim->n_past);
+
+        victim->release();
+
+        llama_kv_cache_seq_rm(ctx, victim->id, -1, -1);
+        victim->cache_tokens.clear();
+        prefix_cache.erase(victim->id);
+
+        send_error(*victim, "the request was stopped to free the shared context for the other requests. try again later", ERROR_TYPE_UNAVAILABLE);
+
+        return victim->id;
+    }
+
+    // remove the tokens of seq_id from the batch, from index i0 on, and update the batch indices of the slots
+    // n_front is the number of tokens at the start of the batch (the generated ones), updated for the removed tokens
+    void batch_remove_seq(llama_seq_id seq_id, int32_t i0, int32_t & n_front) {
+        std::vector<int32_t> i_new(batch.n_tokens, -1);
+
+        int32_t n       = i0;
+        int32_t n_kept0 = std::min(n_front, i0);
+
+        for (int32_t j = i0; j < batch.n_tokens; ++j) {
+            if (batch.seq_id[j][0] == seq_id) {
+                continue;
+            }
+
+            if (j < n_front) {
+                n_kept0++;
+            }
+
+            if (n != j) {
+                batch.token   [n] = batch.token   [j];
+                batch.pos     [n] = batch.pos     [j];
+                batch.n_seq_id[n] = batch.n_seq_id[j];
+                for (int32_t k = 0; k < batch.n_seq_id[j]; ++k) {
+                    batch.seq_id[n][k] = batch.seq_id[j][k];
+                }
+                batch.logits  [n] = batch.logits  [j];
+            }
+
+            i_new[j] = n++;
+        }
+
+        batch.n_tokens = n;
+        n_front = n_kept0;
+
+        for (server_slot & slot : slots) {
+            if (slot.i_batch >= i0 && slot.i_batch < (int32_t) i_new.size()) {
+                slot.i_batch = i_new[slot.i_batch];
+            }
+        }
+    }
+
+    // the most likely next token of the draft model and its probability
+    llama_token draft_top(int idx, float & p) const {
+        const float * logits = llama_get_logits_ith(ctx_dft, idx);
+        const int n_vocab = llama_n_vocab(model_dft);
+
+        llama_token id = 0;
+        for (int i = 1; i < n_vocab; ++i) {
+            if (logits[i] > logits[id]) {
+                id = i;
+            }
+        }
+
+        double sum = 0.0;
+        for (int i = 0; i < n_vocab; ++i) {
+            sum += std::exp(logits[i] - logits[id]);
+        }
+
+        p = 1.0 / sum;
+
+        return id;
+    }
+
+    // the max number of tokens to draft for the slot: the draft tokens must fit in the context of the slot and in the
+    // tokens left to predict
+    int n_draft_max(const server_slot & slot) const {
+        if (slot.state != SLOT_STATE_GENERATING || slot.params.n_draft <= 0) {
+            return 0;
+        }
+
+        int n_draft = std::min(slot.params.n_draft, slot.n_ctx - slot.n_past - 2);
+        if (slot.n_remaining > 0) {
+            n_draft = std::min(n_draft, slot.n_remaining - 1);
+        }
+
+        return n_draft;
+    }
+
+    // speculative decoding without a draft model (prompt lookup): draft the continuation of the longest n-gram at the
+    // end of the context that already occurred in the context, e.g. the spans of the prompt that the output copies
+    void draft_slots_lookup() {
+        for (server_slot & slot : slots) {
+            const int n_draft = n_draft_max(slot);
+
+            if (n_draft <= 0) {
+                continue;
+            }
+
+            if (slot.n_ngram_tokens > slot.spec_tokens.size()) {
+                slot.ngram_cache.clear();
+                slot.n_ngram_tokens = 0;
+            }
+
+            common_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.spec_tokens, slot.spec_tokens.size() - slot.n_ngram_tokens, false);
+            slot.n_ngram_tokens = slot.spec_tokens.size();
+
+            llama_tokens draft = { slot.spec_tokens.back() };
+
+            common_ngram_cache_draft(slot.spec_tokens, draft, n_draft, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_cache, ngram_cache_dynamic, ngram_cache_static);
+
+            slot.drafted.assign(draft.begin() + 1, draft.end());
+
+            if (!slot.drafted.empty()) {
+                SLT_DBG(slot, "drafted %d tokens from the context, n_past = %d\n", (int) slot.drafted.size(), slot.n_past);
+            }
+        }
+    }
+
+    // speculative decoding: bring the sequences of the draft model up to date with the generating slots, then draft
+    // the next tokens of the slots greedily, one token of each slot per llama_decode() call of the draft model
+    // the draft tokens are verified together with the sampled tokens in the next batch of the target model
+    void draft_slots() {
+        struct slot_draft {
+            server_slot * slot;
+            int n_draft;
+        };
+
+        std::vector<slot_draft> drafting;
+
+        const int32_t n_batch_dft = llama_n_batch(ctx_dft);
+        const int32_t n_vocab     = llama_n_vocab(model);
+
+        common_batch_clear(batch_dft);
+
+        for (server_slot & slot : slots) {
+            slot.i_batch_dft = -1;
+
+            const int n_draft = n_draft_max(slot);
+
+            // the slots with a draft from prompt lookup do not need the draft model
+            if (n_draft <= 0 || !slot.drafted.empty()) {
+                continue;
+            }
+
+            // keep the common part of the draft sequence, the logits of the last token are needed
+            size_t n_common = longest_common_prefix(slot.cache_tokens_dft, slot.spec_tokens);
+            if (n_common == slot.spec_tokens.size()) {
+                n_common--;
+            }
+
+            llama_kv_cache_seq_rm(ctx_dft, slot.id, slot.n_pos_off + n_common, -1);
+            slot.cache_tokens_dft.resize(n_common);
+
+            // after a new prompt the draft model catches up over a few iterations, within its batch size
+            while (slot.cache_tokens_dft.size() < slot.spec_tokens.size() && batch_dft.n_tokens < n_batch_dft) {
+                const llama_token tok = slot.spec_tokens[slot.cache_tokens_dft.size()];
+
+                common_batch_add(batch_dft, tok, slot.n_pos_off + slot.cache_tokens_dft.size(), { slot.id }, false);
+                slot.cache_tokens_dft.push_back(tok);
+            }
+
+            if (slot.cache_tokens_dft.size() < slot.spec_tokens.size()) {
+                continue;
+            }
+
+            batch_dft.logits[batch_dft.n_tokens - 1] = true;
+            slot.i_batch_dft = batch_dft.n_tokens - 1;
+
+            drafting.push_back({ &slot, n_draft });
+        }
+
+        while (batch_dft.n_tokens > 0) {
+            const int ret = decode(ctx_dft, batch_dft);
+
+            if (ret != 0) {
+                // drafting is only an optimization - start over with an empty KV cache for the draft model
+                SRV_WRN("failed to decode the draft batch, clearing the draft KV cache, n_tokens = %d, ret = %d\n", batch_dft.n_tokens, ret);
+
+                llama_kv_cache_clear(ctx_dft);
+
+                for (server_slot & slot : slots) {
+                    slot.cache_tokens_dft.clear();
+                }
+
+                for (auto & d : drafting) {
+                    d.slot->drafted.clear();
+                }
+
+                return;
+            }
+
+            common_batch_clear(batch_dft);
+
+            for (auto & d : drafting) {
+                server_slot & slot = *d.slot;
+
+                if (slot.i_batch_dft < 0) {
+                    continue;
+                }
+
+                float p = 0.0f;
+                const llama_token id = draft_top(slot.i_batch_dft, p);
+
+                slot.i_batch_dft = -1;
+
+                // stop drafting when the draft model is not confident enough
+                if (p < params.p_draft_min || id >= n_vocab) {
+                    continue;
+                }
+
+                slot.drafted.push_back(id);
+
+                if ((int) slot.drafted.size() >= d.n_draft || llama_token_is_eog(model_dft, id)) {
+                    continue;
+                }
+
+                slot.i_batch_dft = batch_dft.n_tokens;
+
+                common_batch_add(batch_dft, id, slot.n_pos_off + slot.cache_tokens_dft.size(), { slot.id }, true);
+                slot.cache_tokens_dft.push_back(id);
+            }
+        }
+
+        for (auto & d : drafting) {
+            SLT_DBG(*d.slot, "drafted %d tokens, n_past = %d\n", (int) d.slot->drafted.size(), d.slot->n_past);
+        }
+    }
+
+    bool process_token(completion_token_output & result, server_slot & slot) {
+        // remember which tokens were sampled - used for repetition penalties during sampling
+        const std::string token_str = common_token_to_piece(ctx, result.tok, params.special);
+        slot.sampled = result.tok;
+
+        // search stop word and delete it
+        slot.generated_text += token_str;
+        slot.has_next_token = true;
+
+        // check if there is incomplete UTF-8 character at the end
+        bool incomplete = false;
+        for (unsigned i = 1; i < 5 && i <= slot.generated_text.size(); ++i) {
+            unsigned char c = slot.generated_text[slot.generated_text.size() - i];
+            if ((c & 0xC0) == 0x80) {
+                // continuation byte: 10xxxxxx
+                continue;
+            }
+            if ((c & 0xE0) == 0xC0) {
+                // 2-byte character: 110xxxxx ...
+                incomplete = i < 2;
+            } else if ((c & 0xF0) == 0xE0) {
+                // 3-byte character: 1110xxxx ...
+                incomplete = i < 3;
+            } else if ((c & 0xF8) == 0xF0) {
+                // 4-byte character: 11110xxx ...
+                incomplete = i < 4;
+            }
+            // else 1-byte character or invalid byte
+            break;
+        }
+
+        if (!incomplete) {
+            size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
+
+            const std::string str_test = slot.generated_text.substr(pos);
+            bool send_text = true;
+
+            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), STOP_TYPE_FULL);
+            if (stop_pos != std::string::npos) {
+                slot.generated_text.erase(
+                    slot.generated_text.begin() + pos + stop_pos,
+                    slot.generated_text.end());
+                pos = std::min(slot.n_sent_text, slot.generated_text.size());
+            } else if (slot.has_next_token) {
+                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), STOP_TYPE_PARTIAL);
+                send_text = stop_pos == std::string::npos;
+            }
+
+            // check if there is any token to predict
+            if (send_text) {
+                // no send the stop word in the response
+                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
+                slot.n_sent_text += result.text_to_send.size();
+                // add the token to slot queue and cache
+            }
+
+            slot.add_token(result);
+            if (slot.params.stream) {
+                send_partial_response(slot, result);
+            }
+        }
+
+        if (incomplete) {
+            slot.has_next_token = true;
+        }
+
+        // check the limits
+        if (slot.n_decoded > 0 && slot.has_next_token && !slot.has_budget(params)) {
+            slot.stopped_limit  = true;
+            slot.has_next_token = false;
+
+            SLT_DBG(slot, "stopped by limit, n_decoded = %d, n_predict = %d\n", slot.n_decoded, slot.params.n_predict);
+        }
+
+        if (slot.has_new_line) {
+            // if we have already seen a new line, we stop after a certain time limit
+            if (slot.params.t_max_predict_ms > 0 && (ggml_time_us() - slot.t_start_generation > 1000.0f*slot.params.t_max_predict_ms)) {
+                slot.stopped_limit  = true;
+                slot.has_next_token = false;
+
+                SLT_DBG(slot, "stopped by time limit, n_decoded = %d, t_max_predict_ms = %d ms\n", slot.n_decoded, (int) slot.params.t_max_predict_ms);
+            }
+
+            // require that each new line has a whitespace prefix (i.e. indentation) of at least slot.params.n_indent
+            if (slot.params.n_indent > 0) {
+                // check the current indentation
+                // TODO: improve by not doing it more than once for each new line
+                if (slot.last_nl_pos > 0) {
+                    size_t pos = slot.last_nl_pos;
+
+                    int n_indent = 0;
+                    while (pos < slot.generated_text.size() && (slot.generated_text[pos] == ' ' || slot.generated_text[pos] == '\t')) {
+                        n_indent++;
+                        pos++;
+                    }
+
+                    if (pos < slot.generated_text.size() && n_indent < slot.params.n_indent) {
+                        slot.stopped_limit  = true;
+                        slot.has_next_token = false;
+
+                        // cut the last line
+                        slot.generated_text.erase(pos, std::string::npos);
+
+                        SLT_DBG(slot, "stopped by indentation limit, n_decoded = %d, n_indent = %d\n", slot.n_decoded, n_indent);
+                    }
+                }
+
+                // find the next new line
+                {
+                    const size_t pos = slot.generated_text.find('\n', slot.last_nl_pos);
+
+                    if (pos != std::string::npos) {
+                        slot.last_nl_pos = pos + 1;
+                    }
+                }
+            }
+        }
+
+        // check if there is a new line in the generated text
+        if (result.text_to_send.find('\n') != std::string::npos) {
+            slot.has_new_line = true;
+        }
+
+        // if context shift is disabled, we stop when it reaches the context limit
+        if (slot.n_past >= slot.n_ctx) {
+            slot.truncated      = true;
+            slot.stopped_limit  = true;
+            slot.has_next_token = false;
+
+            SLT_DBG(slot, "stopped due to running out of context capacity, n_past = %d, n_prompt_tokens = %d, n_decoded = %d, n_ctx = %d\n",
+                    slot.n_decoded, slot.n_prompt_tokens, slot.n_past, slot.n_ctx);
+        }
+
+        if (llama_token_is_eog(model, result.tok)) {
+            slot.stopped_eos    = true;
+            slot.has_next_token = false;
+
+            SLT_DBG(slot, "%s", "stopped by EOS\n");
+        }
+
+        const auto n_ctx_train = llama_n_ctx_train(model);
+
+        if (slot.params.n_predict < 1 && slot.n_predict < 1 && slot.n_prompt_tokens + slot.n_decoded >= n_ctx_train) {
+            slot.truncated      = true;
+            slot.stopped_limit  = true;
+            slot.has_next_token = false; // stop prediction
+
+            SLT_WRN(slot,
+                    "n_predict (%d) is set for infinite generation. "
+                    "Limiting generated tokens to n_ctx_train (%d) to avoid EOS-less generation infinite loop\n",
+                    slot.params.n_predict, n_ctx_train);
+        }
+
+        SLT_DBG(slot, "n_decoded = %d, n_remaining = %d, next token: %5d '%s'\n", slot.n_decoded, slot.n_remaining, result.tok, token_str.c_str());
+
+        return slot.has_next_token; // continue
+    }
+
+    json get_formated_generation(const server_slot & slot) const {
+        std::vector<std::string> samplers;
+        samplers.reserve(slot.sparams.samplers.size());
+        for (const auto & sampler : slot.sparams.samplers) {
+            samplers.emplace_back(common_sampler_type_to_str(sampler));
+        }
+
+        return json {
+            {"n_ctx",                     slot.n_ctx},
+            {"n_predict",                 slot.n_predict},     // Server configured n_predict
+            {"model",                     params.model_alias},
+            {"seed",                      slot.sparams.seed},
+            {"seed_cur",                  slot.smpl ? common_sampler_get_seed(slot.smpl) : 0},
+            {"temperature",               slot.sparams.temp},
+            {"dynatemp_range",            slot.sparams.dynatemp_range},
+            {"dynatemp_exponent",         slot.sparams.dynatemp_exponent},
+            {"top_k",                     slot.sparams.top_k},
+            {"top_p",                     slot.sparams.top_p},
+            {"min_p",                     slot.sparams.min_p},
+            {"xtc_probability",           slot.sparams.xtc_probability},
+            {"xtc_threshold",             slot.sparams.xtc_threshold},
+            {"typical_p",                 slot.sparams.typ_p},
+            {"repeat_last_n",             slot.sparams.penalty_last_n},
+            {"repeat_penalty",            slot.sparams.penalty_repeat},
+            {"presence_penalty",          slot.sparams.penalty_present},
+            {"frequency_penalty",         slot.sparams.penalty_freq},
+            {"dry_multiplier",            slot.sparams.dry_multiplier},
+            {"dry_base",                  slot.sparams.dry_base},
+            {"dry_allowed_length",        slot.sparams.dry_allowed_length},
+            {"dry_penalty_last_n",        slot.sparams.dry_penalty_last_n},
+            {"dry_sequence_breakers",     slot.sparams.dry_sequence_breakers},
+            {"mirostat",                  slot.sparams.mirostat},
+            {"mirostat_tau",              slot.sparams.mirostat_tau},
+            {"mirostat_eta",              slot.sparams.mirostat_eta},
+            {"penalize_nl",               slot.sparams.penalize_nl},
+            {"stop",                      slot.params.antiprompt},
+            {"max_tokens",                slot.params.n_predict}, // User configured n_predict
+            {"n_keep",                    slot.params.n_keep},
+            {"n_discard",                 slot.params.n_discard},
+            {"priority",                  slot.params.priority},
+            {"n_draft",                   slot.params.n_draft},
+            {"ignore_eos",                slot.sparams.ignore_eos},
+            {"stream",                    slot.params.stream},
+          //{"logit_bias",                slot.sparams.logit_bias},
+            {"n_probs",                   slot.sparams.n_probs},
+            {"min_keep",                  slot.sparams.min_keep},
+            {"grammar",                   slot.sparams.grammar},
+            {"samplers",                  samplers},
+        };
+    }
+
+    void send_error(const server_task & task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
+        send_error(task.id, error, type);
+    }
+
+    void send_error(const server_slot & slot, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
+        send_error(slot.id_task, error, type);
+    }
+
+    void send_error(const int id_task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
+        SRV_ERR("task id = %d, error: %s\n", id_task, error.c_str());
+
+        server_task_result res;
+        res.id       = id_task;
+        res.stop     = false;
+        res.error    = true;
+        res.data     = format_error_response(error, type);
+
+        send_result(res);
+    }
+
+    // send a result, once the post-processing that is left to the worker pool is done
+    // the results of a task are sent in order
+    void send_result(server_task_result & res, const std::function<void(json &)> & post = nullptr) {
+        if (!post_pool.enabled()) {
+            if (post) {
+                const int64_t t_start = ggml_time_us();
+                post(res.data);
+                metrics.t_serialize_total += ggml_time_us() - t_start;
+            }
+            queue_results.send(res);
+            return;
+        }
+
+        std::shared_ptr<server_task_result> ptr = std::make_shared<server_task_result>(std::move(res));
+        post_pool.post(ptr->id, [this, ptr, post]() {
+            if (post) {
+                const int64_t t_start = ggml_time_us();
+                post(ptr->data);
+                metrics.t_serialize_total += ggml_time_us() - t_start;
+            }
+            queue_results.send(*ptr);
+        });
+    }
+
+    void send_partial_response(server_slot & slot, completion_token_output tkn) {
+        server_task_result res;
+        res.id       = slot.id_task;
+        res.error    = false;
+        res.stop     = false;
+        res.data     = json {
+            {"content",    tkn.text_to_send},
+            {"stop",       false},
+            {"id_slot",    slot.id},
+            {"multimodal", false},
+            {"index",      slot.index},
+        };
+
+        if (slot.sparams.n_probs > 0) {
+            const llama_tokens to_send_toks = common_tokenize(ctx, tkn.text_to_send, false);
+            const size_t probs_pos      = std::min(slot.n_sent_token_probs,                       slot.generated_token_probs.size());
+            const size_t probs_stop_pos = std::min(slot.n_sent_token_probs + to_send_toks.size(), slot.generated_token_probs.size());
+
+            std::vector<completion_token_output> probs_output;
+            if (probs_pos < probs_stop_pos) {
+                probs_output = std::vector<completion_token_output>(
+                        slot.generated_token_probs.begin() + probs_pos,
+                        slot.generated_token_probs.begin() + probs_stop_pos);
+            }
+            slot.n_sent_token_probs = probs_stop_pos;
+
+            if (slot.oaicompat) {
+                res.data["oaicompat_token_ctr"] = slot.n_decoded;
+                res.data["model"] = slot.oaicompat_model;
+            }
+
+            llama_context * ctx = this->ctx;
+            send_result(res, [ctx, probs_output](json & data) {
+                data["completion_probabilities"] = probs_vector_to_json(ctx, probs_output);
+            });
+            return;
+        }
+
+        if (slot.oaicompat) {
+            res.data["oaicompat_token_ctr"] = slot.n_decoded;
+            res.data["model"] = slot.oaicompat_model;
+        }
+
+        send_result(res);
+    }
+
+    void send_final_response(const server_slot & slot) {
+        server_task_result res;
+        res.id       = slot.id_task;
+        res.error    = false;
+        res.stop     = true;
+        res.data     = json {
+            {"content",             !slot.params.stream ? slot.generated_text : ""},
+            {"id_slot",             slot.id},
+            {"stop",                true},
+            {"model",               params.model_alias},
+            {"tokens_predicted",    slot.n_decoded},
+            {"tokens_evaluated",    slot.n_prompt_tokens},
+            {"generation_settings", get_formated_generation(slot)},
+            {"prompt",              ""}, // filled in by the post-processing
+            {"has_new_line",        slot.has_new_line},
+            {"truncated",           slot.truncated},
+            {"stopped_eos",         slot.stopped_eos},
+            {"stopped_word",        slot.stopped_word},
+            {"stopped_limit",       slot.stopped_limit},
+            {"stopping_word",       slot.stopping_word},
+            {"tokens_cached",       slot.n_past},
+            {"timings",             slot.get_formated_timings()},
+            {"index",               slot.index},
+        };
+
+        const bool with_probs = slot.sparams.n_probs > 0;
+
+        std::vector<completion_token_output> probs;
+        if (with_probs) {
+            if (!slot.params.stream && slot.stopped_word) {
+                const llama_tokens stop_word_toks = common_tokenize(ctx, slot.stopping_word, false);
+
+                size_t safe_offset = std::min(slot.generated_token_probs.size(), stop_word_toks.size());
+                probs = std::vector<completion_token_output>(
+                        slot.generated_token_probs.begin(),
+                        slot.generated_token_probs.end() - safe_offset);
+            } else {
+                probs = std::vector<completion_token_output>(
+                        slot.generated_token_probs.begin(),
+                        slot.generated_token_probs.end());
+            }
+        }
+
+        if (slot.oaicompat) {
+            res.data["oaicompat_token_ctr"] = slot.n_decoded;
+            res.data["model"] = slot.oaicompat_model;
+        }
+
+        // the prompt can be long, so it is copied and detokenized by the worker pool
+        llama_context * ctx = this->ctx;
+        std::shared_ptr<llama_tokens> prompt_tokens = std::make_shared<llama_tokens>(slot.prompt_tokens);
+        send_result(res, [ctx, prompt_tokens, probs, with_probs](json & data) {
+            data["prompt"] = common_detokenize(ctx, *prompt_tokens);
+            if (with_probs) {
+                data["completion_probabilities"] = probs_vector_to_json(ctx, probs);
+            }
+        });
+    }
+
+    // the output of a sequence of the batch: its pooled embedding, or the embedding of its last token without pooling
+    // empty if the embeddings are not available
+    std::vector<float> get_embd(llama_seq_id seq_id, const llama_batch & batch, int n_out) {
+        for (int i = batch.n_tokens - 1; i >= 0; --i) {
+            if (!batch.logits[i] || batch.seq_id[i][0] != seq_id) {
+                continue;
+            }
+
+            const float * embd = llama_get_embeddings_seq(ctx, seq_id);
+            if (embd == NULL) {
+                embd = llama_get_embeddings_ith(ctx, i);
+            }
+
+            if (embd == NULL) {
+                SRV_ERR("failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], seq_id);
+                return {};
+            }
+
+            return std::vector<float>(embd, embd + n_out);
+        }
+
+        return {};
+    }
+
+    void send_embedding(const server_slot & slot, const llama_batch & batch) {
+        SLT_DBG(slot, "%s", "sending embeddings\n");
+
+        send_embedding(slot.id_task, slot.index, get_embd(slot.id, batch, llama_n_embd(model)));
+    }
+
+    void send_embedding(int id_task, int index, const std::vector<float> & embd) {
+        server_task_result res;
+        res.id    = id_task;
+        res.error = false;
+        res.stop  = true;
+
+        const int n_embd = llama_n_embd(model);
+
+        // the embedding is normalized and converted to JSON by the worker pool
+        std::shared_ptr<std::vector<float>> embd_res = std::make_shared<std::vector<float>>(embd);
+        send_result(res, [embd_res, index, n_embd](json & data) {
+            std::vector<float> embd_norm(n_embd, 0.0f);
+            if ((int) embd_res->size() == n_embd) {
+                common_embd_normalize(embd_res->data(), embd_norm.data(), n_embd);
+            }
+
+            data = json {
+                {"embedding", embd_norm},
+                {"index",     index},
+            };
+        });
+    }
+
+    void send_rerank(const server_slot & slot, const llama_batch & batch) {
+        send_rerank(slot.id_task, slot.index, get_embd(slot.id, batch, 1));
+    }
+
+    void send_rerank(int id_task, int index, const std::vector<float> & score) {
+        server_task_result res;
+        res.id    = id_task;
+        res.error = false;
+        res.stop  = true;
+        res.data  = json {
+            {"index", index},
+            {"score", score.empty() ? -1e6 : score[0]},
+        };
+
+        SRV_DBG("sending rerank result, res = '%s'\n", res.data.dump().c_str());
+
+        send_result(res);
+    }
+
+    //
+    // Functions to create new task(s) and receive result(s)
+    //
+
+    // the KV cells that a request will use, up to the context of a slot
+    int32_t estimate_n_tokens(const json & data, server_task_inf_type inf_type, size_t n_prompt_tokens) const {
+        const int32_t n_ctx_slot = slots.front().n_ctx;
+
+        int32_t n_predict = 0;
+        if (inf_type == SERVER_TASK_INF_TYPE_COMPLETION || inf_type == SERVER_TASK_INF_TYPE_INFILL) {
+            n_predict = json_value(data, "n_predict", json_value(data, "max_tokens", params.n_predict));
+            if (n_predict < 0) {
+                n_predict = n_ctx_slot;
+            }
+        }
+
+        return std::min<int64_t>(n_ctx_slot, n_prompt_tokens + n_predict);
+    }
+
+    // admission control: the KV cells held by the slots in flight, and those that they will still fill
+    // the cells of the prompts cached by the idle slots are not counted, as they are freed for the new requests
+    void update_tokens_busy() {
+        if (queue_tasks.n_tokens_max <= 0) {
+            return;
+        }
+
+        int64_t n_idle      = 0;
+        int64_t n_remaining = 0;
+        for (const auto & slot : slots) {
+            if (slot.is_processing()) {
+                n_remaining += std::max(0, slot.n_tokens_task - slot.n_past);
+            } else {
+                n_idle += slot.cache_tokens.size();
+            }
+        }
+
+        queue_tasks.set_tokens_busy(std::max<int64_t>(0, llama_get_kv_cache_used_cells(ctx) - n_idle) + n_remaining);
+    }
+
+    // admission control: post the tasks of a request, or return false with the seconds after which to retry
+    // the waiting tasks that are shed for it get an error
+    bool post_tasks(std::vector<server_task> & tasks, int & retry_after) {
+        std::vector<server_task> shed;
+        if (!queue_tasks.post_admit(tasks, shed, retry_after)) {
+            metrics.n_rejected_total++;
+            return false;
+        }
+
+        for (const auto & task : shed) {
+            if (task.id == task.id_request) {
+                metrics.n_shed_total++;
+            }
+            send_error(task.id, "the request was dropped for requests of a higher priority, try again later", ERROR_TYPE_UNAVAILABLE);
+        }
+
+        return true;
+    }
+
+    // break the input "prompt" into multiple tasks if needed, then format and tokenize the input prompt(s)
+    std::vector<server_task> create_tasks_inference(json data, server_task_inf_type inf_type) {
+        std::vector<server_task> tasks;
+        int64_t t_tokenize = 0;
+        auto create_task = [&](json & task_data, llama_tokens & prompt_tokens) {
+            SRV_DBG("create task, n_tokens = %d\n", (int) prompt_tokens.size());
+            server_task task;
+            task.id            = queue_tasks.get_new_id();
+            task.inf_type      = inf_type;
+            task.type          = SERVER_TASK_TYPE_INFERENCE;
+            task.data          = task_data;
+            task.priority      = json_value(task_data, "priority", 0);
+            task.t_queued      = ggml_time_us();
+            task.t_tokenize    = t_tokenize;
+            task.n_tokens      = estimate_n_tokens(task_data, inf_type, prompt_tokens.size());
+            task.prompt_tokens = std::move(prompt_tokens);
+            tasks.push_back(std::move(task));
+        };
+
+        static constexpr const char * error_msg = "\"prompt\" must be a string, an array of token ids or an array of prompts";
+        if (!data.contains("prompt")) {
+            throw std::runtime_error(error_msg);
+        }
+
+        // the parameters that are costly to prepare are converted here, so that the main loop gets them ready to use
+        if (data.contains("json_schema") && !data.at("json_schema").is_null() && !data.contains("grammar")) {
+            try {
+                data["grammar"] = grammar_cache.schema_to_grammar(json_value(data, "json_schema", json::object()));
+                data.erase("json_schema");
+            } catch (const std::exception &) {
+                // reported by launch_slot_with_task
+            }
+        }
+
+        const auto & logit_bias = data.find("logit_bias");
+        if (logit_bias != data.end() && logit_bias->is_array()) {
+            json logit_bias_tokens = json::array();
+            for (const auto & el : *logit_bias) {
+                if (el.is_array() && el.size() == 2 && el[0].is_string()) {
+                    for (const llama_token tok : common_tokenize(model, el[0].get<std::string>(), false)) {
+                        logit_bias_tokens.push_back(json::array({tok, el[1]}));
+                    }
+                } else {
+                    logit_bias_tokens.push_back(el);
+                }
+            }
+            data["logit_bias"] = logit_bias_tokens;
+        }
+
+        // because llama_tokenize api is thread-safe, we can tokenize the prompt from HTTP thread
+        bool add_special = inf_type != SERVER_TASK_INF_TYPE_RERANK && inf_type != SERVER_TASK_INF_TYPE_INFILL;
+        const int64_t t_start = ggml_time_us();
+        std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx, data.at("prompt"), add_special, true);
+        t_tokenize = ggml_time_us() - t_start;
+        metrics.t_tokenize_total += t_tokenize;
+        switch (inf_type) {
+            case SERVER_TASK_INF_TYPE_RERANK:
+                {
+                    // prompts[0] is the question
+                    // the rest are the answers/documents
+                    GGML_ASSERT(tokenized_prompts.size() > 1);
+                    SRV_DBG("creating rerank tasks, n_prompts = %d\n", (int) tokenized_prompts.size() - 1);
+                    for (size_t i = 1; i < tokenized_prompts.size(); i++) {
+                        data["index"] = i - 1;
+                        auto tokens = format_rerank(model, tokenized_prompts[0], tokenized_prompts[i]);
+                        create_task(data, tokens);
+                    }
+                } break;
+            case SERVER_TASK_INF_TYPE_INFILL:
+                {
+                    SRV_DBG("creating infill tasks, n_prompts = %d\n", (int) tokenized_prompts.size());
+                    for (size_t i = 0; i < tokenized_prompts.size(); i++) {
+                        data["index"] = i;
+                        auto tokens = format_infill(
+                            ctx,
+                            data.at("input_prefix"),
+                            data.at("input_suffix"),
+                            data.at("input_extra"),
+                            params.n_batch,
+                            params.n_predict,
+                            slots[0].n_ctx, // TODO: there should be a better way
+                            params.spm_infill,
+                            tokenized_prompts[i]
+                        );
+                        create_task(data, tokens);
+                    }
+                } break;
+            default:
+                {
+                    // with "n" > 1, each prompt is completed n times - the first task processes the prompt and
+                    // the other ones fork its KV cache (see update_slots)
+                    const int n_cmpl = inf_type == SERVER_TASK_INF_TYPE_COMPLETION ? std::max(1, json_value(data, "n", 1)) : 1;
+                    const uint32_t seed = json_value(data, "seed", LLAMA_DEFAULT_SEED);
+
+                    SRV_DBG("creating multi-prompt tasks, n_prompts = %d, n = %d\n", (int) tokenized_prompts.size(), n_cmpl);
+                    for (size_t i = 0; i < tokenized_prompts.size(); i++) {
+                        for (int j = 0; j < n_cmpl; j++) {
+                            data["index"] = i*n_cmpl + j;
+                            if (seed != LLAMA_DEFAULT_SEED) {
+                                // the completions of the same prompt must not be identical
+                                data["seed"] = seed + j;
+                            }
+
+                            llama_tokens tokens = tokenized_prompts[i];
+                            create_task(data, tokens);
+
+                            if (j > 0) {
+                                tasks.back().id_parent = tasks[tasks.size() - 1 - j].id;
+                            }
+                        }
+                    }
+                }
+        }
+
+        return tasks;
+    }
+
+    void cancel_tasks(const std::unordered_set<int> & id_tasks) {
+        std::vector<server_task> cancel_tasks;
+        cancel_tasks.reserve(id_tasks.size());
+        for (const auto & id_task : id_tasks) {
+            SRV_WRN("cancel task, id_task = %d\n", id_task);
+
+            server_task task;
+            task.type      = SERVER_TASK_TYPE_CANCEL;
+            task.id_target = id_task;
+            cancel_tasks.push_back(task);
+            queue_results.remove_waiting_task_id(id_task);
+        }
+        // push to beginning of the queue, so it has highest priority
+        queue_tasks.post(cancel_tasks, true);
+    }
+
+    // receive the results from task(s) created by create_tasks_inference
+    void receive_cmpl_results(
+            const std::unordered_set<int> & id_tasks,
+            const std::function<void(std::vector<server_task_result>&)> & result_handler,
+            const std::function<void(json)> & error_handler) {
+        // TODO: currently, there is no way to detect the client has cancelled the request
+        std::vector<server_task_result> results(id_tasks.size());
+        for (size_t i = 0; i < id_tasks.size(); i++) {
+            server_task_result result = queue_results.recv(id_tasks);
+
+            if (result.error) {
+                error_handler(result.data);
+                cancel_tasks(id_tasks);
+                return;
+            }
+
+            const size_t idx = result.data["index"];
+            GGML_ASSERT(idx < results.size() && "index out of range");
+
+            results[idx] = result;
+        }
+        result_handler(results);
+    }
 
     // receive the results from task(s) created by create_tasks_inference, in stream mode
     void receive_cmpl_results_stream(
@@ -1497,727 +3517,2101 @@ struct server_context {
                 break;
             }
 
-            if (result.error) {
-                error_handler(result.data);
-                cancel_tasks(id_tasks);
-                break;
-            }
+            if (result.error) {
+                error_handler(result.data);
+                cancel_tasks(id_tasks);
+                break;
+            }
+
+            if (result.stop) {
+                if (++n_finished == id_tasks.size()) {
+                    break;
+                }
+            }
+        }
+    }
+
+    //
+    // Functions to process the task
+    //
+
+    void process_single_task(server_task task) {
+        switch (task.type) {
+            case SERVER_TASK_TYPE_INFERENCE:
+                {
+                    if (embd_batching() && (task.inf_type == SERVER_TASK_INF_TYPE_EMBEDDING || task.inf_type == SERVER_TASK_INF_TYPE_RERANK)) {
+                        const std::vector<float> * embd = embd_cache.n_max > 0 ? embd_cache.get(task.inf_type, task.prompt_tokens) : nullptr;
+                        if (embd != nullptr) {
+                            SRV_DBG("embedding cache hit, id_task = %d, n_tokens = %d\n", task.id, (int) task.prompt_tokens.size());
+
+                            const int index = json_value(task.data, "index", 0);
+                            if (task.inf_type == SERVER_TASK_INF_TYPE_EMBEDDING) {
+                                send_embedding(task.id, index, *embd);
+                            } else {
+                                send_rerank(task.id, index, *embd);
+                            }
+                            break;
+                        }
+
+                        // packed with the other pending inputs by update_embeddings()
+                        embd_pending.push_back(std::move(task));
+                        break;
+                    }
+
+                    const int id_slot = json_value(task.data, "id_slot", -1);
+
+                    server_slot * slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
+
+                    if (slot == nullptr) {
+                        // if no slot is available, we defer this task for processing later
+                        SRV_DBG("no slot is available, defer task, id_task = %d\n", task.id);
+                        queue_tasks.defer(task);
+                        break;
+                    }
+                    if (slot->is_processing()) {
+                        // if requested slot is unavailable, we defer this task for processing later
+                        SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
+                        queue_tasks.defer(task);
+                        break;
+                    }
+
+                    slot->reset();
+
+                    slot->id_task        = task.id;
+                    slot->id_task_parent = task.id_parent;
+                    slot->t_queued       = task.t_queued;
+                    slot->t_tokenize     = task.t_tokenize / 1e3;
+                    slot->inf_type       = task.inf_type;
+                    slot->index         = json_value(task.data, "index", 0);
+                    slot->prompt_tokens = std::move(task.prompt_tokens);
+
+                    if (!launch_slot_with_task(*slot, task)) {
+                        SRV_ERR("failed to launch slot with task, id_task = %d\n", task.id);
+                        break;
+                    }
+                } break;
+            case SERVER_TASK_TYPE_CANCEL:
+                {
+                    embd_pending.erase(std::remove_if(embd_pending.begin(), embd_pending.end(), [&](const server_task & t) {
+                        return t.id == task.id_target;
+                    }), embd_pending.end());
+
+                    // release slot linked with the task id
+                    for (auto & slot : slots) {
+                        if (slot.id_task == task.id_target) {
+                            slot.release();
+                            prefix_cache_update(slot);
+                            break;
+                        }
+                    }
+                } break;
+            case SERVER_TASK_TYPE_NEXT_RESPONSE:
+                {
+                    // do nothing
+                } break;
+            case SERVER_TASK_TYPE_METRICS:
+                {
+                    json slots_data = json::array();
+
+                    int n_idle_slots       = 0;
+                    int n_processing_slots = 0;
+
+                    // the prompts are detokenized by the worker pool
+                    std::shared_ptr<std::vector<llama_tokens>> prompts = std::make_shared<std::vector<llama_tokens>>();
+
+                    for (server_slot & slot : slots) {
+                        prompts->push_back(slot.prompt_tokens);
+
+                        json slot_data = get_formated_generation(slot);
+                        slot_data["id"]            = slot.id;
+                        slot_data["id_task"]       = slot.id_task;
+                        slot_data["is_processing"] = slot.is_processing();
+                        slot_data["prompt"]        = "";
+                        slot_data["timings"]       = slot.get_formated_timings();
+                        slot_data["next_token"]    = {
+                            {"has_next_token", slot.has_next_token},
+                            {"has_new_line",   slot.has_new_line},
+                            {"n_remain",       slot.n_remaining},
+                            {"n_decoded",      slot.n_decoded},
+                            {"stopped_eos",    slot.stopped_eos},
+                            {"stopped_word",   slot.stopped_word},
+                            {"stopped_limit",  slot.stopped_limit},
+                            {"stopping_word",  slot.stopping_word},
+                        };
+
+                        if (slot.is_processing()) {
+                            n_processing_slots++;
+                        } else {
+                            n_idle_slots++;
+                        }
+
+                        slots_data.push_back(slot_data);
+                    }
+                    SRV_DBG("n_idle_slots = %d, n_processing_slots = %d\n", n_idle_slots, n_processing_slots);
+
+                    server_task_result res;
+                    res.id       = task.id;
+                    res.stop     = true;
+                    res.error    = false;
+                    res.data     = {
+                        { "idle",                            n_idle_slots       },
+                        { "processing",                      n_processing_slots },
+                        { "deferred",                        queue_tasks.queue_tasks_deferred.size() },
+                        { "t_start",                         metrics.t_start},
+
+                        { "n_prompt_tokens_processed_total", metrics.n_prompt_tokens_processed_total},
+                        { "t_tokens_generation_total",       metrics.t_tokens_generation_total},
+                        { "n_tokens_predicted_total",        metrics.n_tokens_predicted_total},
+                        { "t_prompt_processing_total",       metrics.t_prompt_processing_total},
+
+                        { "n_prompt_tokens_processed",       metrics.n_prompt_tokens_processed},
+                        { "t_prompt_processing",             metrics.t_prompt_processing},
+                        { "n_tokens_predicted",              metrics.n_tokens_predicted},
+                        { "t_tokens_generation",             metrics.t_tokens_generation},
+
+                        { "n_decode_total",                  metrics.n_decode_total},
+                        { "n_busy_slots_total",              metrics.n_busy_slots_total},
+
+                        { "n_draft_total",                   metrics.n_draft_total},
+                        { "n_draft_accepted_total",          metrics.n_draft_accepted_total},
+
+                        { "t_tokenize_total",                metrics.t_tokenize_total.load()},
+                        { "t_prefill_total",                 metrics.t_prefill_total},
+                        { "t_decode_total",                  metrics.t_decode_total},
+                        { "t_sampling_total",                metrics.t_sampling_total},
+                        { "t_serialize_total",               metrics.t_serialize_total.load()},
+
+                        { "n_rejected_total",                metrics.n_rejected_total.load()},
+                        { "n_shed_total",                    metrics.n_shed_total.load()},
+                        { "n_expired_total",                 metrics.n_expired_total.load()},
+
+                        { "histograms",                      metrics.histograms_to_json()},
+
+                        { "kv_cache_tokens_count",           llama_get_kv_cache_token_count(ctx)},
+                        { "kv_cache_used_cells",             llama_get_kv_cache_used_cells(ctx)},
+
+                        { "slots",                           slots_data },
+                    };
+
+                    if (json_value(task.data, "reset_bucket", false)) {
+                        metrics.reset_bucket();
+                    }
+
+                    llama_context * ctx = this->ctx;
+                    send_result(res, [ctx, prompts](json & data) {
+                        for (size_t i = 0; i < prompts->size(); i++) {
+                            data["slots"][i]["prompt"] = common_detokenize(ctx, (*prompts)[i]);
+                        }
+                    });
+                } break;
+            case SERVER_TASK_TYPE_SLOT_SAVE:
+                {
+                    int id_slot = task.data.at("id_slot");
+                    server_slot * slot = get_slot_by_id(id_slot);
+                    if (slot == nullptr) {
+                        send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
+                        break;
+                    }
+                    if (slot->is_processing()) {
+                        // if requested slot is unavailable, we defer this task for processing later
+                        SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
+                        queue_tasks.defer(task);
+                        break;
+                    }
+
+                    const size_t token_count = slot->cache_tokens.size();
+                    const int64_t t_start = ggml_time_us();
+
+                    std::string filename = task.data.at("filename");
+                    std::string filepath = task.data.at("filepath");
+
+                    const size_t nwrite = llama_state_seq_save_file(ctx, filepath.c_str(), slot->id, slot->cache_tokens.data(), token_count);
+
+                    const int64_t t_end = ggml_time_us();
+                    const double t_save_ms = (t_end - t_start) / 1000.0;
+
+                    server_task_result result;
+                    result.id = task.id;
+                    result.stop = true;
+                    result.error = false;
+                    result.data = json {
+                        { "id_slot",   id_slot },
+                        { "filename",  filename },
+                        { "n_saved",   token_count }, // tokens saved
+                        { "n_written", nwrite },      // bytes written
+                        { "timings", {
+                            { "save_ms", t_save_ms }
+                        } }
+                    };
+                    queue_results.send(result);
+                } break;
+            case SERVER_TASK_TYPE_SLOT_RESTORE:
+                {
+                    int id_slot = task.data.at("id_slot");
+                    server_slot * slot = get_slot_by_id(id_slot);
+                    if (slot == nullptr) {
+                        send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
+                        break;
+                    }
+                    if (slot->is_processing()) {
+                        // if requested slot is unavailable, we defer this task for processing later
+                        SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
+                        queue_tasks.defer(task);
+                        break;
+                    }
+
+                    const int64_t t_start = ggml_time_us();
+
+                    std::string filename = task.data.at("filename");
+                    std::string filepath = task.data.at("filepath");
+
+                    slot->cache_tokens.resize(slot->n_ctx);
+                    prefix_cache.erase(slot->id);
+                    size_t token_count = 0;
+                    size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, slot->cache_tokens.data(), slot->cache_tokens.size(), &token_count);
+                    if (nread == 0) {
+                        slot->cache_tokens.resize(0);
+                        send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
+                        break;
+                    }
+                    slot->cache_tokens.resize(token_count);
+                    if (params.prefix_cache) {
+                        prefix_cache.insert(slot->id, slot->cache_tokens, token_count);
+                    }
+
+                    const int64_t t_end = ggml_time_us();
+                    const double t_restore_ms = (t_end - t_start) / 1000.0;
+
+                    server_task_result result;
+                    result.id = task.id;
+                    result.stop = true;
+                    result.error = false;
+                    result.data = json {
+                        { "id_slot",    id_slot },
+                        { "filename",   filename },
+                        { "n_restored", token_count }, // tokens restored
+                        { "n_read",     nread },       // bytes read
+                        { "timings", {
+                            { "restore_ms", t_restore_ms }
+                        } }
+                    };
+                    queue_results.send(result);
+                } break;
+            case SERVER_TASK_TYPE_SLOT_ERASE:
+                {
+                    int id_slot = task.data.at("id_slot");
+                    server_slot * slot = get_slot_by_id(id_slot);
+                    if (slot == nullptr) {
+                        send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
+                        break;
+                    }
+                    if (slot->is_processing()) {
+                        // if requested slot is unavailable, we defer this task for processing later
+                        SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
+                        queue_tasks.defer(task);
+                        break;
+                    }
+
+                    // Erase token cache
+                    const size_t n_erased = slot->cache_tokens.size();
+                    llama_kv_cache_seq_rm(ctx, slot->id, -1, -1);
+                    slot->cache_tokens.clear();
+                    prefix_cache.erase(slot->id);
+
+                    server_task_result result;
+                    result.id = task.id;
+                    result.stop = true;
+                    result.error = false;
+                    result.data = json {
+                        { "id_slot",  id_slot },
+                        { "n_erased", n_erased }
+                    };
+                    queue_results.send(result);
+                } break;
+            case SERVER_TASK_TYPE_SET_LORA:
+                {
+                    common_lora_adapters_apply(ctx, loras);
+                    server_task_result result;
+                    result.id = task.id;
+                    result.stop = true;
+                    result.error = false;
+                    result.data = json{{ "success", true }};
+                    queue_results.send(result);
+                } break;
+        }
+    }
+
+    // with --embeddings or --reranking, the inputs are packed into shared batches instead of going through the slots
+    bool embd_batching() const {
+        return params.embedding || params.reranking;
+    }
+
+    // decode as many pending embedding or rerank inputs as fit in one physical batch, one sequence per input
+    // the whole input of a non-causal model must be in the same ubatch, so the batch is limited to n_ubatch tokens
+    void update_embeddings() {
+        if (embd_pending.empty()) {
+            return;
+        }
+
+        const int32_t n_ubatch = llama_n_ubatch(ctx);
+
+        struct packed {
+            server_task  task;
+            llama_seq_id seq_id;
+        };
+
+        std::vector<packed> batched;
+
+        common_batch_clear(batch);
+
+        for (auto & slot : slots) {
+            if (slot.is_processing()) {
+                continue;
+            }
+
+            while (!embd_pending.empty()) {
+                server_task & task = embd_pending.front();
+
+                const int n_tokens = task.prompt_tokens.size();
+
+                const int   id_task = task.id;
+                const int   index   = json_value(task.data, "index", 0);
+                const bool  rerank  = task.inf_type == SERVER_TASK_INF_TYPE_RERANK;
+
+                if (n_tokens > n_ubatch) {
+                    embd_pending.pop_front();
+                    send_error(id_task, "input is too large to process. increase the physical batch size", ERROR_TYPE_SERVER);
+                    continue;
+                }
+
+                if (n_tokens > slot.n_ctx) {
+                    embd_pending.pop_front();
+                    send_error(id_task, "input is larger than the max context size. skipping", ERROR_TYPE_SERVER);
+                    continue;
+                }
+
+                if (n_tokens == 0) {
+                    embd_pending.pop_front();
+                    if (rerank) {
+                        send_rerank(id_task, index, {});
+                    } else {
+                        send_embedding(id_task, index, {});
+                    }
+                    continue;
+                }
+
+                break;
+            }
+
+            if (embd_pending.empty() || batch.n_tokens + (int) embd_pending.front().prompt_tokens.size() > n_ubatch) {
+                break;
+            }
+
+            // the KV cache of the slot is reused for the input, it will have to process its next prompt from scratch
+            if (!slot.cache_tokens.empty()) {
+                llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+                slot.cache_tokens.clear();
+                prefix_cache.erase(slot.id);
+            }
+
+            server_task task = std::move(embd_pending.front());
+            embd_pending.pop_front();
+
+            for (size_t i = 0; i < task.prompt_tokens.size(); ++i) {
+                common_batch_add(batch, task.prompt_tokens[i], i, { slot.id }, true);
+            }
+
+            batched.push_back({ std::move(task), slot.id });
+        }
+
+        if (batched.empty()) {
+            return;
+        }
+
+        SRV_DBG("decoding %d embedding inputs, n_tokens = %d, pending = %d\n", (int) batched.size(), batch.n_tokens, (int) embd_pending.size());
+
+        const int64_t t_start = ggml_time_us();
+
+        const int ret = decode(ctx, batch);
+        if (ret != 0) {
+            SRV_ERR("failed to decode the embedding batch, ret = %d\n", ret);
+        }
+
+        for (auto & p : batched) {
+            const int  index  = json_value(p.task.data, "index", 0);
+            const bool rerank = p.task.inf_type == SERVER_TASK_INF_TYPE_RERANK;
+
+            if (ret != 0) {
+                send_error(p.task.id, "failed to decode the input", ERROR_TYPE_SERVER);
+            } else {
+                std::vector<float> embd = get_embd(p.seq_id, batch, rerank ? 1 : llama_n_embd(model));
+                if (embd_cache.n_max > 0 && !embd.empty()) {
+                    embd_cache.put(p.task.inf_type, p.task.prompt_tokens, embd);
+                }
+
+                if (rerank) {
+                    send_rerank(p.task.id, index, embd);
+                } else {
+                    send_embedding(p.task.id, index, embd);
+                }
+            }
+
+            llama_kv_cache_seq_rm(ctx, p.seq_id, -1, -1);
+        }
+
+        metrics.on_embd_batch(batch.n_tokens, (ggml_time_us() - t_start) / 1e3, (float) batch.n_tokens / llama_n_batch(ctx));
+
+        // come back for the inputs that did not fit
+        if (!embd_pending.empty()) {
+            server_task task;
+            task.type      = SERVER_TASK_TYPE_NEXT_RESPONSE;
+            task.id_target = -1;
+
+            queue_tasks.post(task);
+        }
+    }
+
+    void update_slots() {
+        if (params.queue_timeout > 0) {
+            for (const auto & task : queue_tasks.expire(ggml_time_us() - (int64_t) params.queue_timeout * 1000000)) {
+                metrics.n_expired_total++;
+                send_error(task.id, "the request waited too long for a slot, try again later", ERROR_TYPE_UNAVAILABLE);
+            }
+        }
+
+        update_embeddings();
+
+        update_tokens_busy();
+
+        // check if all slots are idle
+        {
+            bool all_idle = true;
+
+            for (auto & slot : slots) {
+                if (slot.is_processing()) {
+                    all_idle = false;
+                    break;
+                }
+            }
+
+            if (all_idle) {
+                // finish a pending KV cache defragmentation while there is nothing to decode, one bounded step at a
+                // time: the posted task brings us back here after the requests that arrived in the meantime
+                if (!clean_kv_cache && llama_kv_cache_defrag_pending(ctx)) {
+                    SRV_DBG("%s", "defragmenting the KV cache\n");
+                    kv_cache_update();
+
+                    server_task task;
+                    task.type      = SERVER_TASK_TYPE_NEXT_RESPONSE;
+                    task.id_target = -1;
+
+                    queue_tasks.post(task);
+
+                    return;
+                }
+
+                SRV_INF("%s", "all slots are idle\n");
+                if (clean_kv_cache) {
+                    kv_cache_clear();
+                }
+
+                return;
+            }
+        }
+
+        {
+            SRV_DBG("%s", "posting NEXT_RESPONSE\n");
+
+            server_task task;
+            task.type      = SERVER_TASK_TYPE_NEXT_RESPONSE;
+            task.id_target = -1;
+
+            queue_tasks.post(task);
+        }
+
+        // apply context-shift if needed
+        // TODO: simplify and improve
+        for (server_slot & slot : slots) {
+            if (slot.is_processing() && slot.n_past + 1 >= slot.n_ctx) {
+                if (!params.ctx_shift) {
+                    // this check is redundant (for good)
+                    // we should never get here, because generation should already stopped in process_token()
+                    slot.release();
+                    send_error(slot, "context shift is disabled", ERROR_TYPE_SERVER);
+                    continue;
+                }
+
+                // Shift context
+                // the cells shared with other slots are copied by the KV cache before they are shifted
+                // with the rolling window (--ctx-shift-sink), the first tokens are kept as attention sinks and only a few
+                // tokens are evicted at a time
+                const bool rolling  = params.ctx_shift_sink > 0;
+                const int n_keep    = std::max(slot.params.n_keep + add_bos_token, rolling ? params.ctx_shift_sink : 0);
+                const int n_left    = slot.n_past - n_keep;
+                const int n_discard = std::min(n_left, slot.params.n_discard ? slot.params.n_discard : rolling ? std::max(1, params.ctx_shift_step) : (n_left / 2));
+
+                if (n_discard <= 0) {
+                    slot.release();
+                    send_error(slot, "context shift is not possible, the kept tokens fill the context", ERROR_TYPE_SERVER);
+                    continue;
+                }
+
+                if (rolling) {
+                    SLT_DBG(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
+                } else {
+                    SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
+                }
+
+                // the attention only depends on the distance between the positions, so the gap can be closed either by
+                // moving the tokens after it back, or by moving the kept tokens forward - the smaller side is re-roped.
+                // with the rolling window, this is the few sinks instead of the whole window
+                const int  p0        = slot.n_pos_off;
+                const bool move_kept = n_keep < n_left - n_discard;
+
+                llama_kv_cache_seq_rm(ctx, slot.id, p0 + n_keep, p0 + n_keep + n_discard);
+
+                if (move_kept) {
+                    llama_kv_cache_seq_add(ctx, slot.id, p0, p0 + n_keep, n_discard);
+                    slot.n_pos_off += n_discard;
+                } else {
+                    llama_kv_cache_seq_add(ctx, slot.id, p0 + n_keep + n_discard, p0 + slot.n_past, -n_discard);
+                }
+
+                // the kept tokens are no longer at the start of the sequence until the slot is released
+                prefix_cache.truncate(slot.id, slot.n_pos_off == 0 ? n_keep : 0);
+
+                if (slot.params.cache_prompt) {
+                    for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
+                        slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
+                    }
+
+                    slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+                }
+
+                if (ctx_dft != nullptr) {
+                    // apply the same shift to the sequence of the draft model
+                    const int n_dft = (int) slot.cache_tokens_dft.size();
+
+                    llama_kv_cache_seq_rm(ctx_dft, slot.id, p0 + n_keep, p0 + n_keep + n_discard);
+
+                    if (move_kept) {
+                        llama_kv_cache_seq_add(ctx_dft, slot.id, p0, p0 + n_keep, n_discard);
+                    } else {
+                        llama_kv_cache_seq_add(ctx_dft, slot.id, p0 + n_keep + n_discard, -1, -n_discard);
+                    }
+
+                    if (n_dft > n_keep) {
+                        slot.cache_tokens_dft.erase(slot.cache_tokens_dft.begin() + n_keep, slot.cache_tokens_dft.begin() + std::min(n_dft, n_keep + n_discard));
+                    }
+                }
+
+                if (spec_enabled()) {
+                    slot.spec_tokens.erase(slot.spec_tokens.begin() + n_keep, slot.spec_tokens.begin() + n_keep + n_discard);
+
+                    slot.ngram_cache.clear();
+                    slot.n_ngram_tokens = 0;
+                }
+
+                slot.n_past -= n_discard;
+
+                slot.truncated = true;
+            }
+        }
+
+        // draft the next tokens of the generating slots, from the context first and then with the draft model
+        if (params.draft_lookup) {
+            draft_slots_lookup();
+        }
+
+        if (ctx_dft != nullptr) {
+            draft_slots();
+        }
+
+        // start populating the batch for this iteration
+        common_batch_clear(batch);
+
+        // frist, add sampled tokens from any ongoing sequences
+        for (auto & slot : slots) {
+            if (slot.state != SLOT_STATE_GENERATING) {
+                continue;
+            }
+
+            slot.i_batch = batch.n_tokens;
+
+            common_batch_add(batch, slot.sampled, slot.n_pos_off + slot.n_past, { slot.id }, true);
+
+            slot.n_past += 1;
+
+            if (slot.params.cache_prompt) {
+                slot.cache_tokens.push_back(slot.sampled);
+            }
+
+            // the draft tokens are verified in the same batch - the cells of the rejected ones are removed afterwards
+            for (size_t j = 0; j < slot.drafted.size(); ++j) {
+                common_batch_add(batch, slot.drafted[j], slot.n_pos_off + slot.n_past + j, { slot.id }, true);
+            }
+
+            SLT_DBG(slot, "slot decode token, n_ctx = %d, n_past = %d, n_cache_tokens = %d, truncated = %d\n",
+                    slot.n_ctx, slot.n_past, (int) slot.cache_tokens.size(), slot.truncated);
+        }
+
+        // the tokens of the generating slots are at the start of the batch, the prompt tokens follow
+        int32_t n_tokens_gen = batch.n_tokens;
+
+        // process in chunks of params.n_batch
+        int32_t n_batch  = llama_n_batch(ctx);
+        int32_t n_ubatch = llama_n_ubatch(ctx);
+
+        // track if this is an embedding or non-embedding batch
+        // if we've added sampled tokens above, we are in non-embedding mode
+        // -1: none, 0: non-embedding, 1: embedding
+        // TODO: make enum
+        int32_t batch_type = batch.n_tokens > 0 ? 0 : -1;
+
+        // the token budget of this iteration: the tokens of the generating slots are always decoded and the prompts
+        // share the rest, so that a long prompt does not stall the generation of the other slots
+        // at least one prompt token is batched, so that the prompts still progress when the generating slots use up the budget
+        const int32_t n_budget = std::min(n_batch, std::max(params.batch_budget > 0 ? params.batch_budget : n_batch, batch.n_tokens + 1));
+
+        // the prompts that wait for their KV cache to be read from disk
+        int32_t n_disk_wait = 0;
+
+        // next, batch any pending prompts without exceeding the budget
+        if (params.cont_batching || batch.n_tokens == 0) {
+            // higher priority first, then the prompt that waited the longest for a chunk
+            std::vector<server_slot *> slots_prompt;
+            for (auto & slot : slots) {
+                if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) {
+                    slots_prompt.push_back(&slot);
+                }
+            }
+
+            std::stable_sort(slots_prompt.begin(), slots_prompt.end(), [](const server_slot * a, const server_slot * b) {
+                if (a->params.priority != b->params.priority) {
+                    return a->params.priority > b->params.priority;
+                }
+                return a->t_last_sched < b->t_last_sched;
+            });
+
+            for (server_slot * slot_prompt : slots_prompt) {
+                auto & slot = *slot_prompt;
+
+                // this slot still has a prompt to be processed
+                if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) {
+                    auto & prompt_tokens = slot.prompt_tokens;
+
+                    // TODO: maybe move branch to outside of this loop in the future
+                    if (slot.state == SLOT_STATE_STARTED) {
+                        // an additional completion of a request with "n" > 1 waits until the slot of the first completion
+                        // has processed the prompt, then forks its KV cache instead of processing the prompt again
+                        server_slot * parent = get_slot_by_task_id(slot.id_task_parent);
+                        if (parent != nullptr && parent->state != SLOT_STATE_GENERATING) {
+                            continue;
+                        }
+
+                        // with the shared context pool, the prompt waits until the KV cache has room for it
+                        // (the other completions of a prompt fork its cells instead)
+                        if (params.kv_pool && parent == nullptr && !kv_pool_admit(slot)) {
+                            bool other_running = false;
+                            for (const auto & other : slots) {
+                                other_running = other_running || (other.id != slot.id && other.is_processing() && other.state != SLOT_STATE_STARTED);
+                            }
+
+                            if (other_running) {
+                                SLT_DBG(slot, "waiting for free KV cells, n_prompt_tokens = %d\n", (int) prompt_tokens.size());
+                                continue;
+                            }
+                        }
+
+                        // the state of a prompt in the persistent KV cache is read off the main loop, the prompt waits for it
+                        server_disk_cache::prefetched disk_read;
+                        if (disk_cache.enabled() && slot.params.cache_prompt && slot.lora_id == -1 && parent == nullptr &&
+                                slot.inf_type != SERVER_TASK_INF_TYPE_EMBEDDING && slot.inf_type != SERVER_TASK_INF_TYPE_RERANK) {
+                            if (!disk_cache.fetch(slot.id, slot.id_task, disk_read)) {
+                                n_disk_wait++;
+                                continue;
+                            }
+
+                            size_t n_disk = 0;
+                            server_disk_cache::entry disk_entry;
+                            if (disk_read.e.fname.empty() && disk_cache.find(disk_cache_key(), prompt_tokens, n_disk, disk_entry) &&
+                                    n_disk > longest_common_prefix(slot.cache_tokens, prompt_tokens)) {
+                                SLT_DBG(slot, "reading KV cache from disk, file '%s'\n", disk_entry.fname.c_str());
+
+                                disk_cache.prefetch(slot.id, slot.id_task, disk_entry);
+                                n_disk_wait++;
+                                continue;
+                            }
+                        }
+
+                        slot.t_start_process_prompt = ggml_time_us();
+                        slot.t_start_generation = 0;
+                        slot.t_queue_wait = (slot.t_start_process_prompt - slot.t_queued) / 1e3;
+                        slot.t_first_token = 0;
+
+                        slot.n_past = 0;
+                        slot.n_prompt_tokens = prompt_tokens.size();
+                        slot.state = SLOT_STATE_PROCESSING_PROMPT;
+
+                        SLT_INF(slot, "new prompt, n_ctx_slot = %d, n_keep = %d, n_prompt_tokens = %d\n", slot.n_ctx, slot.params.n_keep, slot.n_prompt_tokens);
+
+                        // print prompt tokens (for debugging)
+                        if (1) {
+                            // first 16 tokens (avoid flooding logs)
+                            for (int i = 0; i < std::min<int>(16, prompt_tokens.size()); i++) {
+                                SLT_DBG(slot, "prompt token %3d: %6d '%s'\n", i, prompt_tokens[i], common_token_to_piece(ctx, prompt_tokens[i]).c_str());
+                            }
+                        } else {
+                            // all
+                            for (int i = 0; i < (int) prompt_tokens.size(); i++) {
+                                SLT_DBG(slot, "prompt token %3d: %6d '%s'\n", i, prompt_tokens[i], common_token_to_piece(ctx, prompt_tokens[i]).c_str());
+                            }
+                        }
+
+                        // empty prompt passed -> release the slot and send empty response
+                        if (prompt_tokens.empty()) {
+                            SLT_WRN(slot, "%s", "empty prompt - releasing slot\n");
+
+                            slot.release();
+                            slot.print_timings();
+                            send_final_response(slot);
+                            continue;
+                        }
+
+                        if (slot.inf_type == SERVER_TASK_INF_TYPE_EMBEDDING || slot.inf_type == SERVER_TASK_INF_TYPE_RERANK) {
+                            if (slot.n_prompt_tokens > n_ubatch) {
+                                slot.release();
+                                send_error(slot, "input is too large to process. increase the physical batch size", ERROR_TYPE_SERVER);
+                                continue;
+                            }
+
+                            if (slot.n_prompt_tokens > slot.n_ctx) {
+                                slot.release();
+                                send_error(slot, "input is larger than the max context size. skipping", ERROR_TYPE_SERVER);
+                                continue;
+                            }
+                        } else {
+                            if (!params.ctx_shift) {
+                                // if context shift is disabled, we make sure prompt size is smaller than KV size
+                                // TODO: there should be a separate parameter that control prompt truncation
+                                //       context shift should be applied only during the generation phase
+                                if (slot.n_prompt_tokens >= slot.n_ctx) {
+                                    slot.release();
+                                    send_error(slot, "the request exceeds the available context size. try increasing the context size or enable context shift", ERROR_TYPE_INVALID_REQUEST);
+                                    continue;
+                                }
+                            }
+                            if (slot.params.n_keep < 0) {
+                                slot.params.n_keep = slot.n_prompt_tokens;
+                            }
+                            slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
+
+                            // if input prompt is too big, truncate it
+                            if (slot.n_prompt_tokens >= slot.n_ctx) {
+                                const int n_left = slot.n_ctx - slot.params.n_keep;
+
+                                const int n_block_size = n_left / 2;
+                                const int erased_blocks = (slot.n_prompt_tokens - slot.params.n_keep - n_block_size) / n_block_size;
+
+                                llama_tokens new_tokens(
+                                        prompt_tokens.begin(),
+                                        prompt_tokens.begin() + slot.params.n_keep);
+
+                                new_tokens.insert(
+                                        new_tokens.end(),
+                                        prompt_tokens.begin() + slot.params.n_keep + erased_blocks * n_block_size,
+                                        prompt_tokens.end());
+
+                                prompt_tokens = std::move(new_tokens);
+
+                                slot.truncated = true;
+                                slot.n_prompt_tokens = prompt_tokens.size();
+
+                                SLT_WRN(slot, "input truncated, n_ctx = %d, n_keep = %d, n_left = %d, n_prompt_tokens = %d\n", slot.n_ctx, slot.params.n_keep, n_left, slot.n_prompt_tokens);
+
+                                GGML_ASSERT(slot.n_prompt_tokens < slot.n_ctx);
+                            }
+
+                            if (slot.params.cache_prompt) {
+                                // reuse any previously computed tokens that are common with the new prompt
+                                slot.n_past = longest_common_prefix(slot.cache_tokens, prompt_tokens);
+
+                                // the slot switches to a different conversation - keep the old one in the spill store
+                                if (slot.n_past < (int) slot.cache_tokens.size() / 2) {
+                                    kv_cache_spill(slot);
+                                }
+
+                                // find a longer prefix of the prompt in the KV cache of other slots or in the spill store
+                                int id_src = -1;
+                                int n_tree = 0;
+                                if (params.prefix_cache && !llama_model_is_recurrent(model)) {
+                                    // only the KV cache of the slots with the same adapter can be shared
+                                    n_tree = (int) prefix_cache.find(prompt_tokens, slot.id, id_src, [&](int id) {
+                                        const server_slot * other = get_slot_by_id(id);
+                                        return other->lora_id == slot.lora_id && other->lora_scale == slot.lora_scale;
+                                    });
+                                    if (id_src == -1 || id_src == slot.id) {
+                                        n_tree = 0;
+                                    }
+                                }
+
+                                size_t n_spill = 0;
+                                const int i_spill = slot.lora_id == -1 ? spill_store.find(prompt_tokens, n_spill) : -1;
+
+                                // the whole entry must still match, after the truncation of the prompt
+                                size_t n_disk = 0;
+                                if (disk_read.ok && longest_common_prefix(disk_read.e.tokens, prompt_tokens) == disk_read.e.tokens.size()) {
+                                    n_disk = disk_read.e.tokens.size();
+                                }
+
+                                if (n_disk > 0 && (int) n_disk > std::max(slot.n_past, n_tree) && n_disk > n_spill) {
+                                    const int64_t t_start = ggml_time_us();
+
+                                    llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+
+                                    if (disk_cache.load(ctx, disk_read, slot.id)) {
+                                        SLT_INF(slot, "restored KV cache from disk, n_past = %d -> %d, %.2f ms\n",
+                                                slot.n_past, (int) n_disk, (ggml_time_us() - t_start) / 1000.0);
+
+                                        slot.cache_tokens = std::move(disk_read.e.tokens);
+                                        slot.n_past = n_disk;
+                                    } else {
+                                        SLT_WRN(slot, "failed to restore KV cache from disk, file '%s'\n", disk_read.e.fname.c_str());
+
+                                        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+                                        slot.cache_tokens.clear();
+                                        slot.n_past = 0;
+                                    }
+
+                                    prefix_cache_update(slot);
+                                } else if (i_spill != -1 && (int) n_spill > std::max(slot.n_past, n_tree)) {
+                                    llama_tokens tokens;
+                                    if (spill_store.load(ctx, i_spill, slot.id, tokens)) {
+                                        SLT_INF(slot, "restored spilled KV cache, n_past = %d -> %d\n", slot.n_past, (int) n_spill);
+
+                                        slot.cache_tokens = std::move(tokens);
+                                        slot.n_past = n_spill;
+                                    } else {
+                                        SLT_WRN(slot, "%s", "failed to restore spilled KV cache\n");
+
+                                        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+                                        slot.cache_tokens.clear();
+                                        slot.n_past = 0;
+                                    }
+
+                                    prefix_cache_update(slot);
+                                } else if (n_tree > slot.n_past) {
+                                    // attach to the longer prefix of the prompt that another slot has in the KV cache
+                                    server_slot & src = *get_slot_by_id(id_src);
+
+                                    SLT_INF(slot, "attaching cached prefix of slot %d, n_past = %d -> %d\n", id_src, slot.n_past, n_tree);
+
+                                    llama_kv_cache_seq_fork(ctx, src.id, slot.id, 0, n_tree);
+
+                                    slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_tree);
+                                    slot.n_past = n_tree;
+
+                                    prefix_cache_update(slot);
+                                }
+
+                                // reuse chunks from the cached prompt by shifting their KV cache in the new position
+                                if (params.n_cache_reuse > 0) {
+                                    size_t head_c = slot.n_past; // cache
+                                    size_t head_p = slot.n_past; // current prompt
+
+                                    prefix_cache.truncate(slot.id, slot.n_past);
+
+                                    SLT_DBG(slot, "trying to reuse chunks with size > %d, slot.n_past = %d\n", params.n_cache_reuse, slot.n_past);
+
+                                    while (head_c < slot.cache_tokens.size() &&
+                                           head_p < prompt_tokens.size()) {
+
+                                        size_t n_match = 0;
+                                        while (head_c + n_match < slot.cache_tokens.size() &&
+                                               head_p + n_match < prompt_tokens.size()     &&
+                                               slot.cache_tokens[head_c + n_match] == prompt_tokens[head_p + n_match]) {
+
+                                            n_match++;
+                                        }
+
+                                        if (n_match >= (size_t) params.n_cache_reuse) {
+                                            SLT_INF(slot, "reusing chunk with size %zu, shifting KV cache [%zu, %zu) -> [%zu, %zu)\n", n_match, head_c, head_c + n_match, head_p, head_p + n_match);
+                                            //for (size_t i = head_p; i < head_p + n_match; i++) {
+                                            //    SLT_DBG(slot, "cache token %3zu: %6d '%s'\n", i, prompt_tokens[i], common_token_to_piece(ctx, prompt_tokens[i]).c_str());
+                                            //}
+
+                                            const int64_t kv_shift = (int64_t) head_p - (int64_t) head_c;
+
+                                            llama_kv_cache_seq_rm (ctx, slot.id, head_p, head_c);
+                                            llama_kv_cache_seq_add(ctx, slot.id, head_c, -1,     kv_shift);
+
+                                            for (size_t i = 0; i < n_match; i++) {
+                                                slot.cache_tokens[head_p + i] = slot.cache_tokens[head_c + i];
+                                                slot.n_past++;
+                                            }
+
+                                            head_c += n_match;
+                                            head_p += n_match;
+                                        } else {
+                                            head_c += 1;
+                                        }
+                                    }
+
+                                    SLT_DBG(slot, "after context reuse, new slot.n_past = %d\n", slot.n_past);
+                                }
+                            }
+                        }
+
+                        // the prompt is still at the start of the KV cache of the first completion if it has not been shifted
+                        // (its sampled tokens are added to the batch before the prompts)
+                        if (parent != nullptr && parent->n_past == parent->n_prompt_tokens + parent->n_decoded) {
+                            const int n_fork = longest_common_prefix(parent->prompt_tokens, prompt_tokens);
+
+                            if (n_fork > slot.n_past) {
+                                SLT_INF(slot, "forking the KV cache of slot %d, n_past = %d -> %d\n", parent->id, slot.n_past, n_fork);
+
+                                llama_kv_cache_seq_fork(ctx, parent->id, slot.id, 0, n_fork);
+
+                                slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_fork);
+                                slot.n_past = n_fork;
+
+                                prefix_cache_update(slot);
+                            }
+                        }
+
+                        if (slot.n_past == slot.n_prompt_tokens && slot.n_past > 0) {
+                            // we have to evaluate at least 1 token to generate logits.
+                            SLT_WRN(slot, "need to evaluate at least 1 token to generate logits, n_past = %d, n_prompt_tokens = %d\n", slot.n_past, slot.n_prompt_tokens);
+
+                            slot.n_past--;
+                        }
+
+                        // with a sliding window KV cache, the old positions can have been evicted
+                        // the tokens after n_past need the cells of the last n_swa positions
+                        if (slot.n_past > 0 && llama_n_swa(model) > 0) {
+                            const llama_pos pos_min = llama_kv_cache_seq_pos_min(ctx, slot.id);
+
+                            if (pos_min > 0 && pos_min > slot.n_past - llama_n_swa(model) + 1) {
+                                SLT_WRN(slot, "the SWA cache does not cover n_past = %d (pos_min = %d), reprocessing the prompt\n", slot.n_past, pos_min);
+
+                                llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+
+                                slot.n_past = 0;
+                            }
+                        }
+
+                        slot.n_prompt_tokens_processed = 0;
+                    }
+
+                    const bool is_non_causal =
+                        slot.inf_type == SERVER_TASK_INF_TYPE_EMBEDDING ||
+                        slot.inf_type == SERVER_TASK_INF_TYPE_RERANK;
+
+                    // non-causal tasks require to fit the entire prompt in the physical batch
+                    if (is_non_causal) {
+                        // cannot fit the prompt in the current batch - will try next iter
+                        if (batch.n_tokens + slot.n_prompt_tokens > n_batch) {
+                            continue;
+                        }
+                    }
+
+                    // check that we are in the right batch_type, if not defer the slot
+                    const bool slot_type = is_non_causal ? 1 : 0;
+
+                    if (batch_type == -1) {
+                        batch_type = slot_type;
+                    } else if (batch_type != slot_type) {
+                        continue;
+                    }
+
+                    // keep only the common part
+                    if (!llama_kv_cache_seq_rm(ctx, slot.id, slot.n_past, -1)) {
+                        // could not partially delete (likely using a non-Transformer model)
+                        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+
+                        // there is no common part left
+                        slot.n_past = 0;
+                    }
+
+                    SLT_INF(slot, "kv cache rm [%d, end)\n", slot.n_past);
 
-            if (result.stop) {
-                if (++n_finished == id_tasks.size()) {
+                    // remove the non-common part from the cache
+                    slot.cache_tokens.resize(slot.n_past);
+                    prefix_cache.truncate(slot.id, slot.n_past);
+
+                    // add prompt tokens for processing in the current batch, up to prefill_chunk tokens per slot
+                    // the prompt of a non-causal task cannot be split, it is not limited by the budget or the chunk size
+                    const int32_t n_end =
+                        is_non_causal            ? n_batch :
+                        params.prefill_chunk > 0 ? std::min(n_budget, batch.n_tokens + params.prefill_chunk) : n_budget;
+
+                    slot.t_last_sched = ggml_time_us();
+
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_end) {
+                        common_batch_add(batch, prompt_tokens[slot.n_past], slot.n_past, { slot.id }, false);
+
+                        if (slot.params.cache_prompt) {
+                            slot.cache_tokens.push_back(prompt_tokens[slot.n_past]);
+                        }
+
+                        slot.n_prompt_tokens_processed++;
+                        slot.n_past++;
+                    }
+
+                    SLT_INF(slot, "prompt processing progress, n_past = %d, n_tokens = %d, progress = %f\n", slot.n_past, batch.n_tokens, (float) slot.n_prompt_tokens_processed / slot.n_prompt_tokens);
+
+                    // entire prompt has been processed
+                    if (slot.n_past == slot.n_prompt_tokens) {
+                        slot.state = SLOT_STATE_DONE_PROMPT;
+
+                        GGML_ASSERT(batch.n_tokens > 0);
+
+                        common_sampler_reset(slot.smpl);
+
+                        // Process all prompt tokens through sampler system
+                        for (int i = 0; i < slot.n_prompt_tokens; ++i) {
+                            common_sampler_accept(slot.smpl, prompt_tokens[i], false);
+                        }
+
+                        if (spec_enabled()) {
+                            slot.spec_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + slot.n_prompt_tokens);
+
+                            slot.ngram_cache.clear();
+                            slot.n_ngram_tokens = 0;
+                        }
+
+                        // extract the logits only for the last token
+                        batch.logits[batch.n_tokens - 1] = true;
+
+                        slot.n_decoded = 0;
+                        slot.i_batch   = batch.n_tokens - 1;
+
+                        SLT_INF(slot, "prompt done, n_past = %d, n_tokens = %d\n", slot.n_past, batch.n_tokens);
+                    }
+                }
+
+                if (batch.n_tokens >= n_budget) {
                     break;
                 }
             }
         }
-    }
 
-    //
-    // Functions to process the task
-    //
+        if (batch.n_tokens == 0) {
+            if (n_disk_wait == 0) {
+                SRV_WRN("%s", "no tokens to decode\n");
+            }
+            return;
+        }
 
-    void process_single_task(server_task task) {
-        switch (task.type) {
-            case SERVER_TASK_TYPE_INFERENCE:
-                {
-                    const int id_slot = json_value(task.data, "id_slot", -1);
+        SRV_DBG("decoding batch, n_tokens = %d\n", batch.n_tokens);
 
-                    server_slot * slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
+        // make sure we're in the right embedding mode
+        llama_set_embeddings(ctx, batch_type == 1);
 
-                    if (slot == nullptr) {
-                        // if no slot is available, we defer this task for processing later
-                        SRV_DBG("no slot is available, defer task, id_task = %d\n", task.id);
-                        queue_tasks.defer(task);
-                        break;
+        const int64_t t_start_batch = ggml_time_us();
+
+        // process the created batch of tokens
+        for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
+            const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
+
+            llama_batch batch_view = {
+                n_tokens,
+                batch.token    + i,
+                nullptr,
+                batch.pos      + i,
+                batch.n_seq_id + i,
+                batch.seq_id   + i,
+                batch.logits   + i,
+            };
+
+            const int64_t t_start_decode = ggml_time_us();
+
+            const int ret = decode(ctx, batch_view);
+
+            // the time of the view is split between the generated and the prompt tokens
+            const int64_t t_decode   = ggml_time_us() - t_start_decode;
+            const int64_t t_decode_g = t_decode * std::max(0, std::min(n_tokens_gen - i, n_tokens)) / n_tokens;
+
+            metrics.t_decode_total  += t_decode_g;
+            metrics.t_prefill_total += t_decode - t_decode_g;
+            metrics.on_decoded(slots, (float) n_tokens / llama_n_batch(ctx), (float) llama_get_kv_cache_used_cells(ctx) / llama_n_ctx(ctx));
+
+            if (ret != 0) {
+                if (ret > 0 && kv_cache_evict_idle()) {
+                    SRV_WRN("freed KV cache of idle slots, retrying, i = %d, n_batch = %d, ret = %d\n", i, n_batch, ret);
+
+                    i -= n_batch;
+
+                    continue; // continue loop of n_batch
+                }
+
+                if (n_batch == 1 || ret < 0) {
+                    // with the shared context pool, make room by stopping one of the requests
+                    const int id_preempted = ret > 0 && params.kv_pool ? kv_pool_preempt() : -1;
+                    if (id_preempted >= 0) {
+                        // retry without the tokens of the stopped request, so that they do not take its cells again
+                        batch_remove_seq(id_preempted, i, n_tokens_gen);
+
+                        i -= n_batch;
+
+                        continue; // continue loop of n_batch
                     }
-                    if (slot->is_processing()) {
-                        // if requested slot is unavailable, we defer this task for processing later
-                        SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
-                        queue_tasks.defer(task);
-                        break;
+
+                    // if you get here, it means the KV cache is full - try increasing it via the context size
+                    SRV_ERR("failed to decode the batch: KV cache is full - try increasing it via the context size, i = %d, n_batch = %d, ret = %d\n", i, n_batch, ret);
+                    for (auto & slot : slots) {
+                        slot.release();
+                        prefix_cache.erase(slot.id);
+                        send_error(slot, "Input prompt is too big compared to KV size. Please try increasing KV size.");
                     }
+                    break; // break loop of n_batch
+                }
 
-                    slot->reset();
+                // retry with half the batch size to try to find a free slot in the KV cache
+                n_batch /= 2;
+                i -= n_batch;
 
-                    slot->id_task       = task.id;
-                    slot->inf_type      = task.inf_type;
-                    slot->index         = json_value(task.data, "index", 0);
-                    slot->prompt_tokens = std::move(task.prompt_tokens);
+                SRV_WRN("failed to find free space in the KV cache, retrying with smaller batch size - try increasing it via the context size or enable defragmentation, i = %d, n_batch = %d, ret = %d\n", i, n_batch, ret);
 
-                    if (!launch_slot_with_task(*slot, task)) {
-                        SRV_ERR("failed to launch slot with task, id_task = %d\n", task.id);
-                        break;
+                continue; // continue loop of n_batch
+            }
+
+            for (auto & slot : slots) {
+                if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
+                    continue; // continue loop of slots
+                }
+
+                if (slot.state == SLOT_STATE_DONE_PROMPT) {
+                    if (slot.inf_type == SERVER_TASK_INF_TYPE_EMBEDDING) {
+                        // prompt evaluated for embedding
+                        send_embedding(slot, batch_view);
+                        slot.release();
+                        slot.i_batch = -1;
+                        continue; // continue loop of slots
                     }
-                } break;
-            case SERVER_TASK_TYPE_CANCEL:
-                {
-                    // release slot linked with the task id
-                    for (auto & slot : slots) {
-                        if (slot.id_task == task.id_target) {
-                            slot.release();
-                            break;
-                        }
+
+                    if (slot.inf_type == SERVER_TASK_INF_TYPE_RERANK) {
+                        send_rerank(slot, batch_view);
+                        slot.release();
+                        slot.i_batch = -1;
+                        continue; // continue loop of slots
                     }
-                } break;
-            case SERVER_TASK_TYPE_NEXT_RESPONSE:
-                {
-                    // do nothing
-                } break;
-            case SERVER_TASK_TYPE_METRICS:
-                {
-                    json slots_data = json::array();
 
-                    int n_idle_slots       = 0;
-                    int n_processing_slots = 0;
+                    // prompt evaluated for next-token prediction
+                    slot.state = SLOT_STATE_GENERATING;
 
-                    for (server_slot & slot : slots) {
-                        json slot_data = get_formated_generation(slot);
-                        slot_data["id"]            = slot.id;
-                        slot_data["id_task"]       = slot.id_task;
-                        slot_data["is_processing"] = slot.is_processing();
-                        slot_data["prompt"]        = common_detokenize(ctx, slot.prompt_tokens);
-                        slot_data["next_token"]    = {
-                            {"has_next_token", slot.has_next_token},
-                            {"has_new_line",   slot.has_new_line},
-                            {"n_remain",       slot.n_remaining},
-                            {"n_decoded",      slot.n_decoded},
-                            {"stopped_eos",    slot.stopped_eos},
-                            {"stopped_word",   slot.stopped_word},
-                            {"stopped_limit",  slot.stopped_limit},
-                            {"stopping_word",  slot.stopping_word},
-                        };
+                    prefix_cache_update(slot);
 
-                        if (slot.is_processing()) {
-                            n_processing_slots++;
-                        } else {
-                            n_idle_slots++;
+                    // keep long prompts on disk, so that they do not need to be processed again after a restart
+                    if (disk_cache.enabled() && slot.params.cache_prompt && slot.lora_id == -1 && slot.n_prompt_tokens_processed >= params.kv_cache_disk_min) {
+                        const llama_tokens tokens(slot.cache_tokens.begin(), slot.cache_tokens.begin() + slot.n_past);
+                        if (disk_cache.store(ctx, disk_cache_key(), slot.id, tokens)) {
+                            SLT_INF(slot, "storing KV cache on disk, n_tokens = %d\n", slot.n_past);
                         }
+                    }
+                } else if (slot.state != SLOT_STATE_GENERATING) {
+                    continue; // continue loop of slots
+                }
 
-                        slots_data.push_back(slot_data);
+                // the draft tokens with logits in this view of the batch
+                const int n_drafted = std::min((int) slot.drafted.size(), (int) (i + n_tokens) - slot.i_batch - 1);
+
+                slot.n_draft_total += n_drafted;
+
+                // sample from the logits of the last token and of each draft token, for as long as the sampled tokens
+                // match the draft - each accepted draft token is already in the KV cache
+                for (int j = 0; ; ++j) {
+                    completion_token_output result;
+                    const int64_t t_start_sampling = ggml_time_us();
+
+                    const llama_token id = common_sampler_sample(slot.smpl, ctx, slot.i_batch - i + j);
+
+                    common_sampler_accept(slot.smpl, id, true);
+
+                    const int64_t t_sampled = ggml_time_us();
+                    slot.t_sampling          += (t_sampled - t_start_sampling) / 1e3;
+                    metrics.t_sampling_total += t_sampled - t_start_sampling;
+
+                    slot.n_decoded += 1;
+                    if (slot.n_decoded == 1) {
+                        slot.t_start_generation = t_sampled;
+                        slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
+                        slot.t_first_token       = (slot.t_start_generation - slot.t_queued) / 1e3;
+                        metrics.on_prompt_eval(slot);
+                    } else if (j == 0) {
+                        // the accepted draft tokens come with the token of the same decode step: the latency is
+                        // observed once per step
+                        metrics.on_token(slot.t_last_token, t_sampled);
+                    }
+                    if (j == 0) {
+                        slot.t_last_token = t_sampled;
                     }
-                    SRV_DBG("n_idle_slots = %d, n_processing_slots = %d\n", n_idle_slots, n_processing_slots);
 
-                    server_task_result res;
-                    res.id       = task.id;
-                    res.stop     = true;
-                    res.error    = false;
-                    res.data     = {
-                        { "idle",                            n_idle_slots       },
-                        { "processing",                      n_processing_slots },
-                        { "deferred",                        queue_tasks.queue_tasks_deferred.size() },
-                        { "t_start",                         metrics.t_start},
+                    result.tok = id;
+
+                    const auto * cur_p = common_sampler_get_candidates(slot.smpl);
+
+                    for (size_t i = 0; i < (size_t) slot.sparams.n_probs; ++i) {
+                        result.probs.push_back({
+                            cur_p->data[i].id,
+                            i >= cur_p->size ? 0.0f : cur_p->data[i].p,
+                        });
+                    }
+
+                    if (spec_enabled()) {
+                        slot.spec_tokens.push_back(id);
+                    }
+
+                    if (!process_token(result, slot)) {
+                        // release slot because of stop condition
+                        slot.release();
+                        prefix_cache_update(slot);
+                        slot.print_timings();
+                        send_final_response(slot);
+                        metrics.on_prediction(slot);
+                        break;
+                    }
+
+                    if (j >= n_drafted || slot.drafted[j] != id) {
+                        break;
+                    }
+
+                    slot.n_past += 1;
+                    slot.n_draft_accepted += 1;
+
+                    if (slot.params.cache_prompt) {
+                        slot.cache_tokens.push_back(id);
+                    }
+                }
+
+                slot.i_batch = -1;
+            }
+        }
+
+        queue_tasks.on_throughput(batch.n_tokens, ggml_time_us() - t_start_batch);
+
+        // remove the cells of the rejected draft tokens
+        // (done after the whole batch is decoded, in case the draft tokens of a slot were split across the views)
+        for (auto & slot : slots) {
+            if (!slot.drafted.empty()) {
+                llama_kv_cache_seq_rm(ctx, slot.id, slot.n_pos_off + slot.n_past, -1);
+                slot.drafted.clear();
+            }
+        }
+
+        SRV_DBG("%s", "run slots completed\n");
+    }
+
+    json model_meta() const {
+        return json {
+            {"vocab_type",  llama_vocab_type    (model)},
+            {"n_vocab",     llama_n_vocab       (model)},
+            {"n_ctx_train", llama_n_ctx_train   (model)},
+            {"n_embd",      llama_n_embd        (model)},
+            {"n_params",    llama_model_n_params(model)},
+            {"size",        llama_model_size    (model)},
+        };
+    }
+};
+
+// router mode: a registry of models that are loaded on the first request that names them, each into its own
+// server_context with its own main loop thread, and unloaded in LRU order to stay within a memory budget
+// the models share one CPU threadpool, so their graphs are computed one at a time
+struct server_models {
+    struct model {
+        std::string path;
+        size_t      n_bytes = 0; // memory of the loaded model: the size of the file until the model is loaded once,
+                                 // then the size of its weights and of the buffers of its context (KV cache, compute)
+
+        std::unique_ptr<server_context> ctx; // nullptr while unloaded
+        std::thread                     thread;
+
+        int64_t t_last_used = 0;
+        int     n_refs      = 0; // requests in flight
+        bool    loading     = false;
+        bool    unloading   = false; // detached, its memory is freed once the context is torn down
+    };
+
+    common_params params;
+
+    std::string name_default; // the model of -m, used by the requests that do not name a model
+
+    size_t mem_max  = 0; // 0 = no limit
+    size_t mem_used = 0;
+
+    ggml_threadpool_t threadpool       = nullptr;
+    ggml_threadpool_t threadpool_batch = nullptr;
 
-                        { "n_prompt_tokens_processed_total", metrics.n_prompt_tokens_processed_total},
-                        { "t_tokens_generation_total",       metrics.t_tokens_generation_total},
-                        { "n_tokens_predicted_total",        metrics.n_tokens_predicted_total},
-                        { "t_prompt_processing_total",       metrics.t_prompt_processing_total},
+    // held by the main loops of the models around the calls that use the threadpools, not around the whole iteration
+    std::mutex mutex_compute;
 
-                        { "n_prompt_tokens_processed",       metrics.n_prompt_tokens_processed},
-                        { "t_prompt_processing",             metrics.t_prompt_processing},
-                        { "n_tokens_predicted",              metrics.n_tokens_predicted},
-                        { "t_tokens_generation",             metrics.t_tokens_generation},
+    // called for each model once it is loaded, before its main loop starts
+    std::function<void(server_context &)> on_load;
 
-                        { "n_decode_total",                  metrics.n_decode_total},
-                        { "n_busy_slots_total",              metrics.n_busy_slots_total},
+    // guards the models
+    std::mutex              mutex;
+    std::condition_variable cv;
 
-                        { "kv_cache_tokens_count",           llama_get_kv_cache_token_count(ctx)},
-                        { "kv_cache_used_cells",             llama_get_kv_cache_used_cells(ctx)},
+    std::map<std::string, model> models;
 
-                        { "slots",                           slots_data },
-                    };
+    ~server_models() {
+        unload_all();
 
-                    if (json_value(task.data, "reset_bucket", false)) {
-                        metrics.reset_bucket();
-                    }
-                    queue_results.send(res);
-                } break;
-            case SERVER_TASK_TYPE_SLOT_SAVE:
-                {
-                    int id_slot = task.data.at("id_slot");
-                    server_slot * slot = get_slot_by_id(id_slot);
-                    if (slot == nullptr) {
-                        send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
-                        break;
-                    }
-                    if (slot->is_processing()) {
-                        // if requested slot is unavailable, we defer this task for processing later
-                        SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
-                        queue_tasks.defer(task);
-                        break;
-                    }
+        if (threadpool) {
+            ggml_threadpool_free(threadpool);
+        }
+        if (threadpool_batch) {
+            ggml_threadpool_free(threadpool_batch);
+        }
+    }
 
-                    const size_t token_count = slot->cache_tokens.size();
-                    const int64_t t_start = ggml_time_us();
+    bool init(const common_params & params_) {
+        params = params_;
 
-                    std::string filename = task.data.at("filename");
-                    std::string filepath = task.data.at("filepath");
+        mem_max = (size_t) params.models_mem * 1024 * 1024;
 
-                    const size_t nwrite = llama_state_seq_save_file(ctx, filepath.c_str(), slot->id, slot->cache_tokens.data(), token_count);
+        // adapters and draft models are specific to one base model
+        params.lora_adapters.clear();
+        params.control_vectors.clear();
+        params.model_draft.clear();
 
-                    const int64_t t_end = ggml_time_us();
-                    const double t_save_ms = (t_end - t_start) / 1000.0;
+        try {
+            std::ifstream file(params.models);
+            if (!file) {
+                SRV_ERR("failed to open the models file '%s'\n", params.models.c_str());
+                return false;
+            }
 
-                    server_task_result result;
-                    result.id = task.id;
-                    result.stop = true;
-                    result.error = false;
-                    result.data = json {
-                        { "id_slot",   id_slot },
-                        { "filename",  filename },
-                        { "n_saved",   token_count }, // tokens saved
-                        { "n_written", nwrite },      // bytes written
-                        { "timings", {
-                            { "save_ms", t_save_ms }
-                        } }
-                    };
-                    queue_results.send(result);
-                } break;
-            case SERVER_TASK_TYPE_SLOT_RESTORE:
-                {
-                    int id_slot = task.data.at("id_slot");
-                    server_slot * slot = get_slot_by_id(id_slot);
-                    if (slot == nullptr) {
-                        send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
-                        break;
-                    }
-                    if (slot->is_processing()) {
-                        // if requested slot is unavailable, we defer this task for processing later
-                        SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
-                        queue_tasks.defer(task);
-                        break;
-                    }
+            const json data = json::parse(file);
+            for (const auto & el : data.items()) {
+                add(el.key(), el.value().get<std::string>());
+            }
+        } catch (const std::exception & e) {
+            SRV_ERR("failed to parse the models file '%s': %s\n", params.models.c_str(), e.what());
+            return false;
+        }
 
-                    const int64_t t_start = ggml_time_us();
+        if (add(params.model_alias, params.model)) {
+            name_default = params.model_alias;
+        }
 
-                    std::string filename = task.data.at("filename");
-                    std::string filepath = task.data.at("filepath");
+        if (models.empty()) {
+            SRV_ERR("%s", "no model to serve\n");
+            return false;
+        }
 
-                    slot->cache_tokens.resize(slot->n_ctx);
-                    size_t token_count = 0;
-                    size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, slot->cache_tokens.data(), slot->cache_tokens.size(), &token_count);
-                    if (nread == 0) {
-                        slot->cache_tokens.resize(0);
-                        send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
-                        break;
-                    }
-                    slot->cache_tokens.resize(token_count);
+        struct ggml_threadpool_params tpp_batch = ggml_threadpool_params_from_cpu_params(params.cpuparams_batch);
+        struct ggml_threadpool_params tpp       = ggml_threadpool_params_from_cpu_params(params.cpuparams);
 
-                    const int64_t t_end = ggml_time_us();
-                    const double t_restore_ms = (t_end - t_start) / 1000.0;
+        if (!ggml_threadpool_params_match(&tpp, &tpp_batch)) {
+            threadpool_batch = ggml_threadpool_new(&tpp_batch);
+            if (!threadpool_batch) {
+                SRV_ERR("batch threadpool create failed : n_threads %d\n", tpp_batch.n_threads);
+                return false;
+            }
 
-                    server_task_result result;
-                    result.id = task.id;
-                    result.stop = true;
-                    result.error = false;
-                    result.data = json {
-                        { "id_slot",    id_slot },
-                        { "filename",   filename },
-                        { "n_restored", token_count }, // tokens restored
-                        { "n_read",     nread },       // bytes read
-                        { "timings", {
-                            { "restore_ms", t_restore_ms }
-                        } }
-                    };
-                    queue_results.send(result);
-                } break;
-            case SERVER_TASK_TYPE_SLOT_ERASE:
-                {
-                    int id_slot = task.data.at("id_slot");
-                    server_slot * slot = get_slot_by_id(id_slot);
-                    if (slot == nullptr) {
-                        send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
-                        break;
-                    }
-                    if (slot->is_processing()) {
-                        // if requested slot is unavailable, we defer this task for processing later
-                        SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
-                        queue_tasks.defer(task);
-                        break;
-                    }
+            // start the non-batch threadpool in the paused state
+            tpp.paused = true;
+        }
 
-                    // Erase token cache
-                    const size_t n_erased = slot->cache_tokens.size();
-                    llama_kv_cache_seq_rm(ctx, slot->id, -1, -1);
-                    slot->cache_tokens.clear();
+        threadpool = ggml_threadpool_new(&tpp);
+        if (!threadpool) {
+            SRV_ERR("threadpool create failed : n_threads %d\n", tpp.n_threads);
+            return false;
+        }
 
-                    server_task_result result;
-                    result.id = task.id;
-                    result.stop = true;
-                    result.error = false;
-                    result.data = json {
-                        { "id_slot",  id_slot },
-                        { "n_erased", n_erased }
-                    };
-                    queue_results.send(result);
-                } break;
-            case SERVER_TASK_TYPE_SET_LORA:
-                {
-                    common_lora_adapters_apply(ctx, loras);
-                    server_task_result result;
-                    result.id = task.id;
-                    result.stop = true;
-                    result.error = false;
-                    result.data = json{{ "success", true }};
-                    queue_results.send(result);
-                } break;
+        return true;
+    }
+
+    bool add(const std::string & name, const std::string & path) {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file) {
+            return false;
         }
+
+        model & m = models[name];
+        m.path    = path;
+        m.n_bytes = file.tellg();
+
+        SRV_INF("model '%s': '%s', %.2f MiB\n", name.c_str(), path.c_str(), m.n_bytes / 1024.0 / 1024.0);
+
+        return true;
     }
 
-    void update_slots() {
-        // check if all slots are idle
-        {
-            bool all_idle = true;
+    // the server_context of the model, loaded if needed, which stays loaded as long as the returned reference is held
+    // nullptr with an error if there is no such model, if it fails to load, or if the other models do not make room for
+    // it before the timeout (ERROR_TYPE_UNAVAILABLE)
+    std::shared_ptr<server_context> acquire(const std::string & name, std::string & err, error_type & err_type) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        auto it = models.find(name.empty() ? name_default : name);
+        if (it == models.end()) {
+            err      = name.empty() ? "no model specified" : "model '" + name + "' not found";
+            err_type = ERROR_TYPE_INVALID_REQUEST;
+            return nullptr;
+        }
 
-            for (auto & slot : slots) {
-                if (slot.is_processing()) {
-                    all_idle = false;
-                    break;
-                }
+        model & m = it->second;
+
+        const auto t_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(params.models_timeout);
+        const auto wait = [&]() {
+            if (params.models_timeout <= 0) {
+                cv.wait(lock);
+                return true;
             }
+            return cv.wait_until(lock, t_deadline) == std::cv_status::no_timeout;
+        };
 
-            if (all_idle) {
-                SRV_INF("%s", "all slots are idle\n");
-                if (clean_kv_cache) {
-                    kv_cache_clear();
-                }
+        bool expired = false;
 
-                return;
+        while (!m.ctx) {
+            if (expired) {
+                err      = "timed out waiting for model '" + it->first + "' to be loaded, try again later";
+                err_type = ERROR_TYPE_UNAVAILABLE;
+                return nullptr;
             }
-        }
 
-        {
-            SRV_DBG("%s", "posting NEXT_RESPONSE\n");
+            if (m.loading || m.unloading) {
+                // another request is loading it, or it is still being torn down
+                expired = !wait();
+                continue;
+            }
 
-            server_task task;
-            task.type      = SERVER_TASK_TYPE_NEXT_RESPONSE;
-            task.id_target = -1;
+            if (mem_max > 0 && mem_used + m.n_bytes > mem_max) {
+                // make room for the model, unloading the least recently used idle ones
+                model * lru = lru_idle();
+                if (lru != nullptr) {
+                    unload(lock, name_of(*lru), *lru);
+                    continue;
+                }
 
-            queue_tasks.post(task);
-        }
+                bool any = false;
+                for (const auto & other : models) {
+                    const model & o = other.second;
+                    any = any || o.ctx || o.loading || o.unloading;
+                }
 
-        // apply context-shift if needed
-        // TODO: simplify and improve
-        for (server_slot & slot : slots) {
-            if (slot.is_processing() && slot.n_past + 1 >= slot.n_ctx) {
-                if (!params.ctx_shift) {
-                    // this check is redundant (for good)
-                    // we should never get here, because generation should already stopped in process_token()
-                    slot.release();
-                    send_error(slot, "context shift is disabled", ERROR_TYPE_SERVER);
+                if (any) {
+                    // wait for the requests of the loaded models to finish
+                    expired = !wait();
                     continue;
                 }
 
-                // Shift context
-                const int n_keep    = slot.params.n_keep + add_bos_token;
-                const int n_left    = slot.n_past - n_keep;
-                const int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
+                // the model alone is larger than the budget
+            }
 
-                SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
+            m.loading = true;
+            mem_used += m.n_bytes;
 
-                llama_kv_cache_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
-                llama_kv_cache_seq_add(ctx, slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
+            lock.unlock();
+            std::unique_ptr<server_context> ctx = load(it->first, m.path);
+            lock.lock();
 
-                if (slot.params.cache_prompt) {
-                    for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
-                        slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
-                    }
+            m.loading = false;
+            cv.notify_all();
 
-                    slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
-                }
+            if (!ctx) {
+                mem_used -= m.n_bytes;
+                err      = "failed to load model '" + it->first + "'";
+                err_type = ERROR_TYPE_INVALID_REQUEST;
+                return nullptr;
+            }
 
-                slot.n_past -= n_discard;
+            // the memory of the loaded model replaces the estimate, which is exact for its next loads
+            const size_t n_bytes = llama_model_size(ctx->model) + llama_context_size(ctx->ctx);
+            mem_used  = mem_used - m.n_bytes + n_bytes;
+            m.n_bytes = n_bytes;
 
-                slot.truncated = true;
+            SRV_INF("loaded model '%s', %.2f MiB, memory of the loaded models = %.2f MiB\n", it->first.c_str(), n_bytes / 1024.0 / 1024.0, mem_used / 1024.0 / 1024.0);
+
+            m.ctx = std::move(ctx);
+
+            server_context * ctx_server = m.ctx.get();
+            m.thread = std::thread([ctx_server]() {
+                ctx_server->queue_tasks.start_loop();
+            });
+
+            m.n_refs++;
+
+            // the estimate was too low: unload other idle models to get back within the budget
+            while (mem_max > 0 && mem_used > mem_max) {
+                model * lru = lru_idle();
+                if (lru == nullptr) {
+                    if (mem_used > m.n_bytes) {
+                        SRV_WRN("memory of the loaded models = %.2f MiB, over the budget, no idle model to unload\n", mem_used / 1024.0 / 1024.0);
+                    }
+                    break;
+                }
+                unload(lock, name_of(*lru), *lru);
             }
+
+            m.n_refs--;
         }
 
-        // start populating the batch for this iteration
-        common_batch_clear(batch);
+        m.n_refs++;
+        m.t_last_used = ggml_time_us();
 
-        // frist, add sampled tokens from any ongoing sequences
-        for (auto & slot : slots) {
-            if (slot.state != SLOT_STATE_GENERATING) {
-                continue;
-            }
+        const std::string name_model = it->first;
+        return std::shared_ptr<server_context>(m.ctx.get(), [this, name_model](server_context *) {
+            release(name_model);
+        });
+    }
 
-            slot.i_batch = batch.n_tokens;
+    void release(const std::string & name) {
+        std::unique_lock<std::mutex> lock(mutex);
 
-            common_batch_add(batch, slot.sampled, slot.n_past, { slot.id }, true);
+        model & m = models.at(name);
+        m.n_refs--;
+        m.t_last_used = ggml_time_us();
 
-            slot.n_past += 1;
+        cv.notify_all();
+    }
 
-            if (slot.params.cache_prompt) {
-                slot.cache_tokens.push_back(slot.sampled);
-            }
+    std::unique_ptr<server_context> load(const std::string & name, const std::string & path) {
+        SRV_INF("loading model '%s'\n", name.c_str());
 
-            SLT_DBG(slot, "slot decode token, n_ctx = %d, n_past = %d, n_cache_tokens = %d, truncated = %d\n",
-                    slot.n_ctx, slot.n_past, (int) slot.cache_tokens.size(), slot.truncated);
+        const int64_t t_start = ggml_time_us();
+
+        common_params params_model = params;
+        params_model.model       = path;
+        params_model.model_alias = name;
+
+        std::unique_ptr<server_context> ctx(new server_context());
+        if (!ctx->load_model(params_model)) {
+            SRV_ERR("failed to load model '%s'\n", name.c_str());
+            return nullptr;
         }
 
-        // process in chunks of params.n_batch
-        int32_t n_batch  = llama_n_batch(ctx);
-        int32_t n_ubatch = llama_n_ubatch(ctx);
+        ctx->init();
+        ctx->slot_prompt_similarity = params.slot_prompt_similarity;
 
-        // track if this is an embedding or non-embedding batch
-        // if we've added sampled tokens above, we are in non-embedding mode
-        // -1: none, 0: non-embedding, 1: embedding
-        // TODO: make enum
-        int32_t batch_type = batch.n_tokens > 0 ? 0 : -1;
+        if (params.chat_template.empty() && !ctx->validate_model_chat_template()) {
+            SRV_WRN("the chat template of model '%s' is not supported, falling back to chatml\n", name.c_str());
+            ctx->params.chat_template = "chatml";
+        }
+
+        llama_attach_threadpool(ctx->ctx, threadpool, threadpool_batch);
+        if (ctx->ctx_dft) {
+            llama_attach_threadpool(ctx->ctx_dft, threadpool, threadpool_batch);
+        }
+
+        server_context * ctx_server = ctx.get();
+        ctx->queue_tasks.on_new_task(std::bind(
+                    &server_context::process_single_task, ctx_server, std::placeholders::_1));
+        ctx->queue_tasks.on_update_slots(std::bind(
+                    &server_context::update_slots, ctx_server));
+        ctx->mutex_compute = &mutex_compute;
+
+        if (on_load) {
+            on_load(*ctx);
+        }
+
+        SRV_INF("loaded model '%s', %.2f s\n", name.c_str(), (ggml_time_us() - t_start) / 1e6);
 
-        // next, batch any pending prompts without exceeding n_batch
-        if (params.cont_batching || batch.n_tokens == 0) {
-            for (auto & slot : slots) {
-                // this slot still has a prompt to be processed
-                if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) {
-                    auto & prompt_tokens = slot.prompt_tokens;
+        return ctx;
+    }
 
-                    // TODO: maybe move branch to outside of this loop in the future
-                    if (slot.state == SLOT_STATE_STARTED) {
-                        slot.t_start_process_prompt = ggml_time_us();
-                        slot.t_start_generation = 0;
+    // the least recently used loaded model without a request in flight, with the lock held
+    model * lru_idle() {
+        model * lru = nullptr;
+        for (auto & it : models) {
+            model & o = it.second;
+            if (o.ctx && o.n_refs == 0 && (lru == nullptr || o.t_last_used < lru->t_last_used)) {
+                lru = &o;
+            }
+        }
+        return lru;
+    }
 
-                        slot.n_past = 0;
-                        slot.n_prompt_tokens = prompt_tokens.size();
-                        slot.state = SLOT_STATE_PROCESSING_PROMPT;
+    // called with the lock held, which is released while the main loop of the model is joined and its context is
+    // torn down, so that the other models are not blocked meanwhile
+    void unload(std::unique_lock<std::mutex> & lock, const std::string & name, model & m) {
+        SRV_INF("unloading model '%s'\n", name.c_str());
 
-                        SLT_INF(slot, "new prompt, n_ctx_slot = %d, n_keep = %d, n_prompt_tokens = %d\n", slot.n_ctx, slot.params.n_keep, slot.n_prompt_tokens);
+        std::unique_ptr<server_context> ctx = std::move(m.ctx);
+        std::thread thread = std::move(m.thread);
+        m.unloading = true;
 
-                        // print prompt tokens (for debugging)
-                        if (1) {
-                            // first 16 tokens (avoid flooding logs)
-                            for (int i = 0; i < std::min<int>(16, prompt_tokens.size()); i++) {
-                                SLT_DBG(slot, "prompt token %3d: %6d '%s'\n", i, prompt_tokens[i], common_token_to_piece(ctx, prompt_tokens[i]).c_str());
-                            }
-                        } else {
-                            // all
-                            for (int i = 0; i < (int) prompt_tokens.size(); i++) {
-                                SLT_DBG(slot, "prompt token %3d: %6d '%s'\n", i, prompt_tokens[i], common_token_to_piece(ctx, prompt_tokens[i]).c_str());
-                            }
-                        }
+        lock.unlock();
+        ctx->queue_tasks.terminate();
+        thread.join();
+        ctx.reset();
+        lock.lock();
 
-                        // empty prompt passed -> release the slot and send empty response
-                        if (prompt_tokens.empty()) {
-                            SLT_WRN(slot, "%s", "empty prompt - releasing slot\n");
+        m.unloading = false;
+        mem_used -= m.n_bytes;
 
-                            slot.release();
-                            slot.print_timings();
-                            send_final_response(slot);
-                            continue;
-                        }
+        cv.notify_all();
+    }
 
-                        if (slot.inf_type == SERVER_TASK_INF_TYPE_EMBEDDING || slot.inf_type == SERVER_TASK_INF_TYPE_RERANK) {
-                            if (slot.n_prompt_tokens > n_ubatch) {
-                                slot.release();
-                                send_error(slot, "input is too large to process. increase the physical batch size", ERROR_TYPE_SERVER);
-                                continue;
-                            }
+    void unload_all() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (auto & it : models) {
+            if (it.second.ctx) {
+                unload(lock, it.first, it.second);
+            }
+        }
+    }
 
-                            if (slot.n_prompt_tokens > slot.n_ctx) {
-                                slot.release();
-                                send_error(slot, "input is larger than the max context size. skipping", ERROR_TYPE_SERVER);
-                                continue;
-                            }
-                        } else {
-                            if (!params.ctx_shift) {
-                                // if context shift is disabled, we make sure prompt size is smaller than KV size
-                                // TODO: there should be a separate parameter that control prompt truncation
-                                //       context shift should be applied only during the generation phase
-                                if (slot.n_prompt_tokens >= slot.n_ctx) {
-                                    slot.release();
-                                    send_error(slot, "the request exceeds the available context size. try increasing the context size or enable context shift", ERROR_TYPE_INVALID_REQUEST);
-                                    continue;
-                                }
-                            }
-                            if (slot.params.n_keep < 0) {
-                                slot.params.n_keep = slot.n_prompt_tokens;
-                            }
-                            slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
+    const std::string & name_of(const model & m) const {
+        for (const auto & it : models) {
+            if (&it.second == &m) {
+                return it.first;
+            }
+        }
+        GGML_ABORT("unknown model");
+    }
 
-                            // if input prompt is too big, truncate it
-                            if (slot.n_prompt_tokens >= slot.n_ctx) {
-                                const int n_left = slot.n_ctx - slot.params.n_keep;
+    // for GET /models
+    json list() {
+        std::unique_lock<std::mutex> lock(mutex);
 
-                                const int n_block_size = n_left / 2;
-                                const int erased_blocks = (slot.n_prompt_tokens - slot.params.n_keep - n_block_size) / n_block_size;
+        json data = json::array();
+        for (const auto & it : models) {
+            const model & m = it.second;
 
-                                llama_tokens new_tokens(
-                                        prompt_tokens.begin(),
-                                        prompt_tokens.begin() + slot.params.n_keep);
+            json entry = {
+                {"id",       it.first},
+                {"object",   "model"},
+                {"created",  std::time(0)},
+                {"owned_by", "llamacpp"},
+                {"loaded",   m.ctx != nullptr},
+            };
+            if (m.ctx) {
+                entry["meta"]   = m.ctx->model_meta();
+                entry["memory"] = m.n_bytes;
+            }
 
-                                new_tokens.insert(
-                                        new_tokens.end(),
-                                        prompt_tokens.begin() + slot.params.n_keep + erased_blocks * n_block_size,
-                                        prompt_tokens.end());
+            data.push_back(entry);
+        }
 
-                                prompt_tokens = std::move(new_tokens);
+        return data;
+    }
+};
 
-                                slot.truncated = true;
-                                slot.n_prompt_tokens = prompt_tokens.size();
+// formats a streamed result as server-sent events
+using server_stream_format = std::function<std::string(const server_task_result &)>;
 
-                                SLT_WRN(slot, "input truncated, n_ctx = %d, n_keep = %d, n_left = %d, n_prompt_tokens = %d\n", slot.n_ctx, slot.params.n_keep, n_left, slot.n_prompt_tokens);
+// a streamed response whose headers are sent, and whose events are still to come
+struct server_stream {
+    std::unordered_set<int> id_tasks;
+    server_stream_format    format;
+    std::string             tail; // sent after the last result
 
-                                GGML_ASSERT(slot.n_prompt_tokens < slot.n_ctx);
-                            }
+    // registers the tasks with their server_response, so that their results are pushed to the loop
+    std::function<void(const std::unordered_set<int> &)> on_open;
+    // releases the tasks once the stream is closed, with cancel = true if they did not finish
+    std::function<void(const std::unordered_set<int> &, bool)> on_close;
 
-                            if (slot.params.cache_prompt) {
-                                // reuse any previously computed tokens that are common with the new prompt
-                                slot.n_past = longest_common_prefix(slot.cache_tokens, prompt_tokens);
+    int      fd = -1;
+    uint64_t id = 0;
 
-                                // reuse chunks from the cached prompt by shifting their KV cache in the new position
-                                if (params.n_cache_reuse > 0) {
-                                    size_t head_c = slot.n_past; // cache
-                                    size_t head_p = slot.n_past; // current prompt
+    std::string buf;    // pending output
+    size_t n_sent     = 0;
+    size_t n_finished = 0;
 
-                                    SLT_DBG(slot, "trying to reuse chunks with size > %d, slot.n_past = %d\n", params.n_cache_reuse, slot.n_past);
+    bool    done       = false; // close the connection once the output is sent
+    bool    released   = false; // the tasks are no longer waited for
+    bool    want_write = false;
+    int64_t t_blocked  = 0;     // since when the socket does not accept more output
+};
 
-                                    while (head_c < slot.cache_tokens.size() &&
-                                           head_p < prompt_tokens.size()) {
+// the response of the current request of this thread that is to be handed over to the stream loop, if any
+static thread_local bool                           stream_handover_enabled = false;
+static thread_local std::unique_ptr<server_stream> stream_handover;
+
+// called by the content provider of a streamed response once the headers are sent
+// returns false if the response must be streamed by the thread of the connection
+static bool server_stream_handover(
+        const std::unordered_set<int> & id_tasks, const server_stream_format & format, const std::string & tail,
+        std::function<void(const std::unordered_set<int> &)> on_open,
+        std::function<void(const std::unordered_set<int> &, bool)> on_close) {
+    if (!stream_handover_enabled) {
+        return false;
+    }
 
-                                        size_t n_match = 0;
-                                        while (head_c + n_match < slot.cache_tokens.size() &&
-                                               head_p + n_match < prompt_tokens.size()     &&
-                                               slot.cache_tokens[head_c + n_match] == prompt_tokens[head_p + n_match]) {
+    stream_handover.reset(new server_stream());
+    stream_handover->id_tasks = id_tasks;
+    stream_handover->format   = format;
+    stream_handover->tail     = tail;
+    stream_handover->on_open  = std::move(on_open);
+    stream_handover->on_close = std::move(on_close);
 
-                                            n_match++;
-                                        }
+    return true;
+}
 
-                                        if (n_match >= (size_t) params.n_cache_reuse) {
-                                            SLT_INF(slot, "reusing chunk with size %zu, shifting KV cache [%zu, %zu) -> [%zu, %zu)\n", n_match, head_c, head_c + n_match, head_p, head_p + n_match);
-                                            //for (size_t i = head_p; i < head_p + n_match; i++) {
-                                            //    SLT_DBG(slot, "cache token %3zu: %6d '%s'\n", i, prompt_tokens[i], common_token_to_piece(ctx, prompt_tokens[i]).c_str());
-                                            //}
+#if defined(__linux__)
 
-                                            const int64_t kv_shift = (int64_t) head_p - (int64_t) head_c;
+// epoll loop that writes the streamed responses of all connections, so that a streaming client does not hold a thread
+// the results are pushed by server_response as soon as they are sent, and written with non-blocking sockets
+struct server_stream_loop {
+    // the output a client may leave unread before it is dropped, instead of buffering until the write timeout
+    static const size_t STREAM_BUF_MAX = 4*1024*1024;
 
-                                            llama_kv_cache_seq_rm (ctx, slot.id, head_p, head_c);
-                                            llama_kv_cache_seq_add(ctx, slot.id, head_c, -1,     kv_shift);
+    int fd_epoll = -1;
+    int fd_event = -1;
 
-                                            for (size_t i = 0; i < n_match; i++) {
-                                                slot.cache_tokens[head_p + i] = slot.cache_tokens[head_c + i];
-                                                slot.n_past++;
-                                            }
+    int64_t t_write_timeout_us = 0;
 
-                                            head_c += n_match;
-                                            head_p += n_match;
-                                        } else {
-                                            head_c += 1;
-                                        }
-                                    }
+    std::thread thread;
 
-                                    SLT_DBG(slot, "after context reuse, new slot.n_past = %d\n", slot.n_past);
-                                }
-                            }
-                        }
+    // guards the members until the next comment
+    std::mutex mutex;
+    bool running = false;
+    std::vector<std::unique_ptr<server_stream>> incoming;
+    std::vector<server_task_result>             results;
 
-                        if (slot.n_past == slot.n_prompt_tokens && slot.n_past > 0) {
-                            // we have to evaluate at least 1 token to generate logits.
-                            SLT_WRN(slot, "need to evaluate at least 1 token to generate logits, n_past = %d, n_prompt_tokens = %d\n", slot.n_past, slot.n_prompt_tokens);
+    // used by the loop thread only
+    uint64_t id_next = 1; // 0 is the event fd
+    std::unordered_map<uint64_t, std::unique_ptr<server_stream>> streams;
+    std::unordered_map<int, uint64_t> stream_by_task;
 
-                            slot.n_past--;
-                        }
+    ~server_stream_loop() {
+        stop();
+    }
 
-                        slot.n_prompt_tokens_processed = 0;
-                    }
+    bool enabled() const {
+        return fd_epoll >= 0;
+    }
 
-                    // non-causal tasks require to fit the entire prompt in the physical batch
-                    if (slot.inf_type == SERVER_TASK_INF_TYPE_EMBEDDING || slot.inf_type == SERVER_TASK_INF_TYPE_RERANK) {
-                        // cannot fit the prompt in the current batch - will try next iter
-                        if (batch.n_tokens + slot.n_prompt_tokens > n_batch) {
-                            continue;
-                        }
-                    }
+    bool start(int timeout_write_sec) {
+        fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+        fd_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd_epoll < 0 || fd_event < 0) {
+            SRV_WRN("failed to create the stream loop: %s\n", strerror(errno));
+            if (fd_epoll >= 0) {
+                close(fd_epoll);
+                fd_epoll = -1;
+            }
+            if (fd_event >= 0) {
+                close(fd_event);
+                fd_event = -1;
+            }
+            return false;
+        }
 
-                    // check that we are in the right batch_type, if not defer the slot
-                    const bool slot_type =
-                        slot.inf_type == SERVER_TASK_INF_TYPE_EMBEDDING ||
-                        slot.inf_type == SERVER_TASK_INF_TYPE_RERANK     ? 1 : 0;
+        epoll_event ev = {};
+        ev.events   = EPOLLIN;
+        ev.data.u64 = 0;
+        epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_event, &ev);
 
-                    if (batch_type == -1) {
-                        batch_type = slot_type;
-                    } else if (batch_type != slot_type) {
-                        continue;
-                    }
+        t_write_timeout_us = (int64_t) timeout_write_sec * 1000000;
 
-                    // keep only the common part
-                    if (!llama_kv_cache_seq_rm(ctx, slot.id, slot.n_past, -1)) {
-                        // could not partially delete (likely using a non-Transformer model)
-                        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+        running = true;
+        thread  = std::thread(&server_stream_loop::run, this);
 
-                        // there is no common part left
-                        slot.n_past = 0;
-                    }
+        return true;
+    }
 
-                    SLT_INF(slot, "kv cache rm [%d, end)\n", slot.n_past);
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!running) {
+                return;
+            }
+            running = false;
+        }
+        wake();
+        thread.join();
 
-                    // remove the non-common part from the cache
-                    slot.cache_tokens.resize(slot.n_past);
+        for (auto & it : streams) {
+            close_stream(*it.second, true);
+        }
+        streams.clear();
 
-                    // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
-                        common_batch_add(batch, prompt_tokens[slot.n_past], slot.n_past, { slot.id }, false);
+        close(fd_event);
+        close(fd_epoll);
+    }
 
-                        if (slot.params.cache_prompt) {
-                            slot.cache_tokens.push_back(prompt_tokens[slot.n_past]);
-                        }
+    void wake() {
+        const uint64_t one = 1;
+        if (write(fd_event, &one, sizeof(one)) < 0) {
+            // the counter is already non-zero
+        }
+    }
 
-                        slot.n_prompt_tokens_processed++;
-                        slot.n_past++;
-                    }
+    // take over the socket of a response whose headers are sent
+    void add(int fd, std::unique_ptr<server_stream> s) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        s->fd = fd;
 
-                    SLT_INF(slot, "prompt processing progress, n_past = %d, n_tokens = %d, progress = %f\n", slot.n_past, batch.n_tokens, (float) slot.n_prompt_tokens_processed / slot.n_prompt_tokens);
+        const std::unordered_set<int> id_tasks = s->id_tasks;
+        const auto on_open = s->on_open;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            incoming.push_back(std::move(s));
+        }
 
-                    // entire prompt has been processed
-                    if (slot.n_past == slot.n_prompt_tokens) {
-                        slot.state = SLOT_STATE_DONE_PROMPT;
+        // the loop registers the stream before it handles any of its results
+        on_open(id_tasks);
+        wake();
+    }
 
-                        GGML_ASSERT(batch.n_tokens > 0);
+    // called by server_response, with its lock held
+    void push(server_task_result & result) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            results.push_back(std::move(result));
+        }
+        wake();
+    }
 
-                        common_sampler_reset(slot.smpl);
+    void close_stream(server_stream & s, bool cancel) {
+        if (s.fd < 0) {
+            return;
+        }
 
-                        // Process all prompt tokens through sampler system
-                        for (int i = 0; i < slot.n_prompt_tokens; ++i) {
-                            common_sampler_accept(slot.smpl, prompt_tokens[i], false);
-                        }
+        epoll_ctl(fd_epoll, EPOLL_CTL_DEL, s.fd, nullptr);
+        shutdown(s.fd, SHUT_RDWR);
+        close(s.fd);
+        s.fd = -1;
 
-                        // extract the logits only for the last token
-                        batch.logits[batch.n_tokens - 1] = true;
+        for (const int id_task : s.id_tasks) {
+            stream_by_task.erase(id_task);
+        }
 
-                        slot.n_decoded = 0;
-                        slot.i_batch   = batch.n_tokens - 1;
+        if (!s.released) {
+            s.released = true;
+            s.on_close(s.id_tasks, cancel);
+        }
+    }
 
-                        SLT_INF(slot, "prompt done, n_past = %d, n_tokens = %d\n", slot.n_past, batch.n_tokens);
-                    }
-                }
+    // add an HTTP chunk to the output of the stream
+    static void append_chunk(server_stream & s, const std::string & data) {
+        if (data.empty()) {
+            return;
+        }
+        s.buf += string_format("%zx\r\n", data.size());
+        s.buf += data;
+        s.buf += "\r\n";
+    }
 
-                if (batch.n_tokens >= n_batch) {
-                    break;
-                }
+    void append_result(server_stream & s, const server_task_result & result) {
+        if (s.done) {
+            return;
+        }
+
+        if (result.error) {
+            append_chunk(s, format_sse("error", result.data));
+            s.done = true;
+        } else {
+            append_chunk(s, s.format(result));
+            if (result.stop && ++s.n_finished == s.id_tasks.size()) {
+                s.done = true;
             }
         }
 
-        if (batch.n_tokens == 0) {
-            SRV_WRN("%s", "no tokens to decode\n");
-            return;
+        if (s.done) {
+            append_chunk(s, s.tail);
+            s.buf += "0\r\n\r\n";
+
+            // an error cancels the other tasks of the request
+            s.released = true;
+            s.on_close(s.id_tasks, result.error);
         }
+    }
 
-        SRV_DBG("decoding batch, n_tokens = %d\n", batch.n_tokens);
+    void flush(server_stream & s) {
+        while (s.n_sent < s.buf.size()) {
+            const ssize_t n = send(s.fd, s.buf.data() + s.n_sent, s.buf.size() - s.n_sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                s.n_sent   += n;
+                s.t_blocked = 0;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (s.t_blocked == 0) {
+                    s.t_blocked = ggml_time_us();
+                }
+                // keep only the pending output
+                if (s.n_sent > s.buf.size() / 2) {
+                    s.buf.erase(0, s.n_sent);
+                    s.n_sent = 0;
+                }
+                set_want_write(s, true);
+                return;
+            }
 
-        // make sure we're in the right embedding mode
-        llama_set_embeddings(ctx, batch_type == 1);
+            // the client is gone
+            close_stream(s, true);
+            return;
+        }
 
-        // process the created batch of tokens
-        for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
-            const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
+        s.buf.clear();
+        s.n_sent = 0;
+        set_want_write(s, false);
 
-            llama_batch batch_view = {
-                n_tokens,
-                batch.token    + i,
-                nullptr,
-                batch.pos      + i,
-                batch.n_seq_id + i,
-                batch.seq_id   + i,
-                batch.logits   + i,
-            };
+        if (s.done) {
+            close_stream(s, false);
+        }
+    }
 
-            const int ret = llama_decode(ctx, batch_view);
-            metrics.on_decoded(slots);
+    void set_want_write(server_stream & s, bool want_write) {
+        if (s.want_write == want_write) {
+            return;
+        }
+        s.want_write = want_write;
 
-            if (ret != 0) {
-                if (n_batch == 1 || ret < 0) {
-                    // if you get here, it means the KV cache is full - try increasing it via the context size
-                    SRV_ERR("failed to decode the batch: KV cache is full - try increasing it via the context size, i = %d, n_batch = %d, ret = %d\n", i, n_batch, ret);
-                    for (auto & slot : slots) {
-                        slot.release();
-                        send_error(slot, "Input prompt is too big compared to KV size. Please try increasing KV size.");
+        epoll_event ev = {};
+        ev.events   = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+        ev.data.u64 = s.id;
+        epoll_ctl(fd_epoll, EPOLL_CTL_MOD, s.fd, &ev);
+    }
+
+    void run() {
+        std::vector<epoll_event> events(256);
+
+        while (true) {
+            const int n_events = epoll_wait(fd_epoll, events.data(), events.size(), 1000);
+
+            for (int i = 0; i < n_events; i++) {
+                const uint64_t id = events[i].data.u64;
+                if (id == 0) {
+                    uint64_t value;
+                    if (read(fd_event, &value, sizeof(value)) < 0) {
+                        // already reset
                     }
-                    break; // break loop of n_batch
+                    continue;
                 }
 
-                // retry with half the batch size to try to find a free slot in the KV cache
-                n_batch /= 2;
-                i -= n_batch;
-
-                SRV_WRN("failed to find free space in the KV cache, retrying with smaller batch size - try increasing it via the context size or enable defragmentation, i = %d, n_batch = %d, ret = %d\n", i, n_batch, ret);
+                auto it = streams.find(id);
+                if (it == streams.end() || it->second->fd < 0) {
+                    continue;
+                }
+                server_stream & s = *it->second;
 
-                continue; // continue loop of n_batch
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    close_stream(s, true);
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                    // nothing more is expected from the client, except for the end of the connection
+                    char tmp[1024];
+                    const ssize_t n = recv(s.fd, tmp, sizeof(tmp), 0);
+                    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                        close_stream(s, true);
+                        continue;
+                    }
+                }
+                if (events[i].events & EPOLLOUT) {
+                    flush(s);
+                }
             }
 
-            for (auto & slot : slots) {
-                if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
-                    continue; // continue loop of slots
+            std::vector<std::unique_ptr<server_stream>> new_streams;
+            std::vector<server_task_result>             new_results;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (!running) {
+                    break;
                 }
+                new_streams.swap(incoming);
+                new_results.swap(results);
+            }
 
-                if (slot.state == SLOT_STATE_DONE_PROMPT) {
-                    if (slot.inf_type == SERVER_TASK_INF_TYPE_EMBEDDING) {
-                        // prompt evaluated for embedding
-                        send_embedding(slot, batch_view);
-                        slot.release();
-                        slot.i_batch = -1;
-                        continue; // continue loop of slots
-                    }
+            for (auto & s : new_streams) {
+                const uint64_t id = id_next++;
+                s->id = id;
 
-                    if (slot.inf_type == SERVER_TASK_INF_TYPE_RERANK) {
-                        send_rerank(slot, batch_view);
-                        slot.release();
-                        slot.i_batch = -1;
-                        continue; // continue loop of slots
-                    }
+                epoll_event ev = {};
+                ev.events   = EPOLLIN | EPOLLRDHUP;
+                ev.data.u64 = id;
+                epoll_ctl(fd_epoll, EPOLL_CTL_ADD, s->fd, &ev);
 
-                    // prompt evaluated for next-token prediction
-                    slot.state = SLOT_STATE_GENERATING;
-                } else if (slot.state != SLOT_STATE_GENERATING) {
-                    continue; // continue loop of slots
+                for (const int id_task : s->id_tasks) {
+                    stream_by_task[id_task] = id;
                 }
+                streams[id] = std::move(s);
+            }
 
-                completion_token_output result;
-                const llama_token id = common_sampler_sample(slot.smpl, ctx, slot.i_batch - i);
+            // the streams with new output
+            std::unordered_set<uint64_t> touched;
+            for (const auto & result : new_results) {
+                auto it = stream_by_task.find(result.id);
+                if (it == stream_by_task.end()) {
+                    continue; // the stream is closed
+                }
+                server_stream & s = *streams[it->second];
+                append_result(s, result);
+                if (s.buf.size() - s.n_sent > STREAM_BUF_MAX) {
+                    SRV_WRN("%s", "stream output buffer is full, closing the connection\n");
+                    close_stream(s, true);
+                    continue;
+                }
+                touched.insert(it->second);
+            }
 
-                common_sampler_accept(slot.smpl, id, true);
+            const int64_t t_now = ggml_time_us();
+            for (auto & it : streams) {
+                server_stream & s = *it.second;
+                if (s.fd < 0) {
+                    continue;
+                }
+                if (touched.find(it.first) != touched.end() && !s.want_write) {
+                    flush(s);
+                }
+                if (s.fd >= 0 && s.t_blocked > 0 && t_write_timeout_us > 0 && t_now - s.t_blocked > t_write_timeout_us) {
+                    SRV_WRN("%s", "stream write timeout, closing the connection\n");
+                    close_stream(s, true);
+                }
+            }
 
-                slot.n_decoded += 1;
-                if (slot.n_decoded == 1) {
-                    slot.t_start_generation = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
+            for (auto it = streams.begin(); it != streams.end(); ) {
+                if (it->second->fd < 0) {
+                    it = streams.erase(it);
+                } else {
+                    ++it;
                 }
+            }
+        }
+    }
+};
 
-                result.tok = id;
+// HTTP server that hands the connections of streamed responses over to the stream loop, instead of holding a thread of
+// the pool for each of them until the generation is done
+struct server_http : public httplib::Server {
+    server_stream_loop & loop;
 
-                const auto * cur_p = common_sampler_get_candidates(slot.smpl);
+    server_http(server_stream_loop & loop) : loop(loop) {}
 
-                for (size_t i = 0; i < (size_t) slot.sparams.n_probs; ++i) {
-                    result.probs.push_back({
-                        cur_p->data[i].id,
-                        i >= cur_p->size ? 0.0f : cur_p->data[i].p,
-                    });
-                }
+    // same as httplib::Server::process_and_close_socket, except for the sockets that are handed over
+    bool process_and_close_socket(socket_t sock) override {
+        bool ret = false;
 
-                if (!process_token(result, slot)) {
-                    // release slot because of stop condition
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
-                    metrics.on_prediction(slot);
-                }
+        size_t count = keep_alive_max_count_;
+        while (svr_sock_ != INVALID_SOCKET && count > 0 && httplib::detail::keep_alive(sock, keep_alive_timeout_sec_)) {
+            const bool close_connection = count == 1;
+            bool connection_closed = false;
 
-                slot.i_batch = -1;
+            httplib::detail::SocketStream strm(sock, read_timeout_sec_, read_timeout_usec_, write_timeout_sec_, write_timeout_usec_);
+
+            stream_handover_enabled = loop.enabled();
+            ret = process_request(strm, close_connection, connection_closed, nullptr);
+            stream_handover_enabled = false;
+
+            if (stream_handover) {
+                loop.add(sock, std::move(stream_handover));
+                return true;
+            }
+
+            if (!ret || connection_closed) {
+                break;
             }
+            count--;
         }
 
-        SRV_DBG("%s", "run slots completed\n");
-    }
+        httplib::detail::shutdown_socket(sock);
+        httplib::detail::close_socket(sock);
 
-    json model_meta() const {
-        return json {
-            {"vocab_type",  llama_vocab_type    (model)},
-            {"n_vocab",     llama_n_vocab       (model)},
-            {"n_ctx_train", llama_n_ctx_train   (model)},
-            {"n_embd",      llama_n_embd        (model)},
-            {"n_params",    llama_model_n_params(model)},
-            {"size",        llama_model_size    (model)},
-        };
+        return ret;
     }
 };
 
+#endif // __linux__
+
 static void log_server_request(const httplib::Request & req, const httplib::Response & res) {
     // skip GH copilot requests when using default port
     if (req.path == "/v1/health" || req.path == "/v1/completions") {
@@ -2261,6 +5655,9 @@ int main(int argc, char ** argv) {
     // struct that contains llama context and inference
     server_context ctx_server;
 
+    // router mode: the models loaded on demand, each with its own server_context
+    const bool router = !params.models.empty();
+
     if (params.model_alias == "unknown") {
         params.model_alias = params.model;
     }
@@ -2283,6 +5680,33 @@ int main(int argc, char ** argv) {
         { "/deps_vue.esm-browser.js", { deps_vue_esm_browser_js, deps_vue_esm_browser_js_len, "text/javascript; charset=utf-8" }},
     };
 
+    // must outlive the streams, which hold references to the models
+    server_models registry;
+
+#if defined(__linux__)
+    // must outlive the HTTP server, which hands the streamed responses over to it
+    server_stream_loop stream_loop;
+
+    const auto new_server = [&]() -> httplib::Server * {
+        // the task ids are unique across the models, so one loop serves the streams of all of them
+        stream_loop.start(params.timeout_write);
+
+        const auto stream_handler = [&stream_loop](server_task_result & result) {
+            stream_loop.push(result);
+        };
+        ctx_server.queue_results.stream_handler = stream_handler;
+        registry.on_load = [stream_handler](server_context & ctx) {
+            ctx.queue_results.stream_handler = stream_handler;
+        };
+
+        return new server_http(stream_loop);
+    };
+#else
+    const auto new_server = []() -> httplib::Server * {
+        return new httplib::Server();
+    };
+#endif
+
     std::unique_ptr<httplib::Server> svr;
 #ifdef CPPHTTPLIB_OPENSSL_SUPPORT
     if (params.ssl_file_key != "" && params.ssl_file_cert != "") {
@@ -2292,14 +5716,14 @@ int main(int argc, char ** argv) {
         );
     } else {
         LOG_INF("Running without SSL\n");
-        svr.reset(new httplib::Server());
+        svr.reset(new_server());
     }
 #else
     if (params.ssl_file_key != "" && params.ssl_file_cert != "") {
         LOG_ERR("Server is built without SSL support\n");
         return 1;
     }
-    svr.reset(new httplib::Server());
+    svr.reset(new_server());
 #endif
 
     std::atomic<server_state> state{SERVER_STATE_LOADING_MODEL};
@@ -2318,6 +5742,80 @@ int main(int argc, char ** argv) {
         res.status = 200;
     };
 
+    // too many tokens are waiting for a slot, the client is told when to retry
+    auto res_overloaded = [&res_error](httplib::Response & res, int retry_after) {
+        res.set_header("Retry-After", std::to_string(retry_after));
+        res_error(res, format_error_response("the server is overloaded, try again later", ERROR_TYPE_UNAVAILABLE));
+    };
+
+    // the server_context of the model named by a request, nullptr with an error response if there is none
+    // in router mode, the model stays loaded as long as the returned reference is held
+    auto get_model = [&](const std::string & name, httplib::Response & res) -> std::shared_ptr<server_context> {
+        if (!router) {
+            return std::shared_ptr<server_context>(&ctx_server, [](server_context *) {});
+        }
+
+        std::string err;
+        error_type  err_type = ERROR_TYPE_SERVER;
+        std::shared_ptr<server_context> ref = registry.acquire(name, err, err_type);
+        if (!ref) {
+            res_error(res, format_error_response(err, err_type));
+        }
+
+        return ref;
+    };
+
+    // stream the results of the tasks as server-sent events
+    // when the connection can be handed over to the stream loop, this thread is released as soon as the headers are sent
+    // the stream holds the reference to the model until it is closed
+    auto res_stream = [](httplib::Response & res, std::shared_ptr<server_context> ref, const std::unordered_set<int> & task_ids, const server_stream_format & format, const std::string & tail) {
+        if (stream_handover_enabled) {
+            // the loop closes the connection at the end of the stream
+            res.set_header("Connection", "close");
+        }
+
+        std::shared_ptr<bool> handed_over = std::make_shared<bool>(false);
+
+        const auto chunked_content_provider = [task_ids, format, tail, handed_over, ref](size_t, httplib::DataSink & sink) {
+            server_context & ctx_server = *ref;
+
+            const auto on_open = [ref](const std::unordered_set<int> & id_tasks) {
+                ref->queue_results.add_stream_tasks(id_tasks);
+            };
+            const auto on_close = [ref](const std::unordered_set<int> & id_tasks, bool cancel) {
+                if (cancel) {
+                    ref->cancel_tasks(id_tasks);
+                }
+                ref->queue_results.remove_waiting_task_ids(id_tasks);
+            };
+
+            if (server_stream_handover(task_ids, format, tail, on_open, on_close)) {
+                *handed_over = true;
+                return false;
+            }
+
+            ctx_server.receive_cmpl_results_stream(task_ids, [&](const server_task_result & result) -> bool {
+                const std::string str = format(result);
+                return str.empty() || sink.write(str.data(), str.size());
+            }, [&](const json & error_data) {
+                server_sent_event(sink, "error", error_data);
+            });
+            if (!tail.empty()) {
+                sink.write(tail.data(), tail.size());
+            }
+            sink.done();
+            return true;
+        };
+
+        auto on_complete = [task_ids, handed_over, ref] (bool) {
+            if (!*handed_over) {
+                ref->queue_results.remove_waiting_task_ids(task_ids);
+            }
+        };
+
+        res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+    };
+
     svr->set_exception_handler([&res_error](const httplib::Request &, httplib::Response & res, std::exception_ptr ep) {
         std::string message;
         try {
@@ -2359,6 +5857,11 @@ int main(int argc, char ** argv) {
     // Necessary similarity of prompt for slot selection
     ctx_server.slot_prompt_similarity = params.slot_prompt_similarity;
 
+    if (router && !registry.init(params)) {
+        LOG_ERR("%s: failed to initialize the models\n", __func__);
+        return 1;
+    }
+
     //
     // Middlewares
     //
@@ -2450,6 +5953,12 @@ int main(int argc, char ** argv) {
             return;
         }
 
+        const auto ref = get_model(req.get_param_value("model"), res);
+        if (!ref) {
+            return;
+        }
+        server_context & ctx_server = *ref;
+
         // request slots data using task queue
         server_task task;
         task.id = ctx_server.queue_tasks.get_new_id();
@@ -2474,12 +5983,18 @@ int main(int argc, char ** argv) {
         res_ok(res, result.data.at("slots"));
     };
 
-    const auto handle_metrics = [&](const httplib::Request &, httplib::Response & res) {
+    const auto handle_metrics = [&](const httplib::Request & req, httplib::Response & res) {
         if (!params.endpoint_metrics) {
             res_error(res, format_error_response("This server does not support metrics endpoint. Start it with `--metrics`", ERROR_TYPE_NOT_SUPPORTED));
             return;
         }
 
+        const auto ref = get_model(req.get_param_value("model"), res);
+        if (!ref) {
+            return;
+        }
+        server_context & ctx_server = *ref;
+
         // request slots data using task queue
         server_task task;
         task.id = ctx_server.queue_tasks.get_new_id();
@@ -2505,6 +6020,9 @@ int main(int argc, char ** argv) {
         const uint64_t n_decode_total     = data.at("n_decode_total");
         const uint64_t n_busy_slots_total = data.at("n_busy_slots_total");
 
+        const uint64_t n_draft_total          = data.at("n_draft_total");
+        const uint64_t n_draft_accepted_total = data.at("n_draft_accepted_total");
+
         const int32_t kv_cache_used_cells = data.at("kv_cache_used_cells");
 
         // metrics definition: https://prometheus.io/docs/practices/naming/#metric-names
@@ -2533,6 +6051,46 @@ int main(int argc, char ** argv) {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) n_busy_slots_total / (float) n_decode_total}
+            }, {
+                    {"name",  "n_draft_total"},
+                    {"help",  "Number of draft tokens verified with speculative decoding."},
+                    {"value",  n_draft_total}
+            }, {
+                    {"name",  "n_draft_accepted_total"},
+                    {"help",  "Number of draft tokens accepted with speculative decoding."},
+                    {"value",  n_draft_accepted_total}
+            }, {
+                    {"name",  "tokenize_seconds_total"},
+                    {"help",  "Time spent tokenizing the prompts."},
+                    {"value",  (uint64_t) data.at("t_tokenize_total") / 1.e6}
+            }, {
+                    {"name",  "prefill_seconds_total"},
+                    {"help",  "Share of the llama_decode() time spent on the prompt tokens."},
+                    {"value",  (uint64_t) data.at("t_prefill_total") / 1.e6}
+            }, {
+                    {"name",  "decode_seconds_total"},
+                    {"help",  "Share of the llama_decode() time spent on the generated tokens."},
+                    {"value",  (uint64_t) data.at("t_decode_total") / 1.e6}
+            }, {
+                    {"name",  "sampling_seconds_total"},
+                    {"help",  "Time spent sampling the generated tokens."},
+                    {"value",  (uint64_t) data.at("t_sampling_total") / 1.e6}
+            }, {
+                    {"name",  "serialize_seconds_total"},
+                    {"help",  "Time spent formatting the results."},
+                    {"value",  (uint64_t) data.at("t_serialize_total") / 1.e6}
+            }, {
+                    {"name",  "requests_rejected_total"},
+                    {"help",  "Number of requests rejected because too many tokens were waiting for a slot."},
+                    {"value",  (uint64_t) data.at("n_rejected_total")}
+            }, {
+                    {"name",  "requests_shed_total"},
+                    {"help",  "Number of waiting requests dropped for requests of a higher priority."},
+                    {"value",  (uint64_t) data.at("n_shed_total")}
+            }, {
+                    {"name",  "requests_expired_total"},
+                    {"help",  "Number of requests that waited longer than the queue timeout."},
+                    {"value",  (uint64_t) data.at("n_expired_total")}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -2542,6 +6100,10 @@ int main(int argc, char ** argv) {
                     {"name",  "predicted_tokens_seconds"},
                     {"help",  "Average generation throughput in tokens/s."},
                     {"value",  n_tokens_predicted ? 1.e3 / t_tokens_generation * n_tokens_predicted : 0.}
+            },{
+                    {"name",  "draft_acceptance_ratio"},
+                    {"help",  "Ratio of the draft tokens accepted with speculative decoding."},
+                    {"value",  n_draft_total ? 1. * n_draft_accepted_total / n_draft_total : 0.}
             },{
                     {"name",  "kv_cache_usage_ratio"},
                     {"help",  "KV-cache usage. 1 means 100 percent usage."},
@@ -2558,6 +6120,31 @@ int main(int argc, char ** argv) {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of request deferred."},
                     {"value",  (uint64_t) data.at("deferred")}
+            }}},
+            {"histogram", {{
+                    {"name",  "queue_wait_seconds"},
+                    {"help",  "Time from the arrival of a request to the start of its prompt processing."},
+                    {"value",  data.at("histograms").at("queue_wait_seconds")}
+            },{
+                    {"name",  "time_to_first_token_seconds"},
+                    {"help",  "Time from the arrival of a request to its first generated token."},
+                    {"value",  data.at("histograms").at("time_to_first_token_seconds")}
+            },{
+                    {"name",  "inter_token_latency_seconds"},
+                    {"help",  "Time between two consecutive decode steps of a request, which generate one token, or more with accepted draft tokens."},
+                    {"value",  data.at("histograms").at("inter_token_latency_seconds")}
+            },{
+                    {"name",  "prompt_tokens_per_request_per_second"},
+                    {"help",  "Prompt throughput of each request."},
+                    {"value",  data.at("histograms").at("prompt_tokens_per_request_per_second")}
+            },{
+                    {"name",  "batch_fill_ratio"},
+                    {"help",  "Tokens of each llama_decode() call, relative to the batch size."},
+                    {"value",  data.at("histograms").at("batch_fill_ratio")}
+            },{
+                    {"name",  "kv_cache_usage_per_decode"},
+                    {"help",  "KV-cache usage at each llama_decode() call. 1 means 100 percent usage."},
+                    {"value",  data.at("histograms").at("kv_cache_usage_per_decode")}
             }}}
         };
 
@@ -2571,10 +6158,28 @@ int main(int argc, char ** argv) {
                 const std::string name = metric_def.at("name");
                 const std::string help = metric_def.at("help");
 
-                auto value = json_value(metric_def, "value", 0.);
                 prometheus << "# HELP llamacpp:" << name << " " << help  << "\n"
-                            << "# TYPE llamacpp:" << name << " " << type  << "\n"
-                            << "llamacpp:"        << name << " " << value << "\n";
+                           << "# TYPE llamacpp:" << name << " " << type  << "\n";
+
+                if (type == "histogram") {
+                    const json & hist = metric_def.at("value");
+
+                    const std::vector<double>   bounds = hist.at("bounds");
+                    const std::vector<uint64_t> counts = hist.at("counts");
+
+                    uint64_t n = 0;
+                    for (size_t i = 0; i < counts.size(); ++i) {
+                        n += counts[i];
+                        const std::string le = i < bounds.size() ? string_format("%g", bounds[i]) : "+Inf";
+                        prometheus << "llamacpp:" << name << "_bucket{le=\"" << le << "\"} " << n << "\n";
+                    }
+                    prometheus << "llamacpp:" << name << "_sum "   << hist.at("sum").get<double>() << "\n"
+                               << "llamacpp:" << name << "_count " << n << "\n";
+                    continue;
+                }
+
+                auto value = json_value(metric_def, "value", 0.);
+                prometheus << "llamacpp:" << name << " " << value << "\n";
             }
         }
 
@@ -2585,8 +6190,15 @@ int main(int argc, char ** argv) {
         res.status = 200; // HTTP OK
     };
 
-    const auto handle_slots_save = [&ctx_server, &res_error, &res_ok, &params](const httplib::Request & req, httplib::Response & res, int id_slot) {
+    const auto handle_slots_save = [&get_model, &res_error, &res_ok, &params](const httplib::Request & req, httplib::Response & res, int id_slot) {
         json request_data = json::parse(req.body);
+
+        const auto ref = get_model(json_value(request_data, "model", std::string()), res);
+        if (!ref) {
+            return;
+        }
+        server_context & ctx_server = *ref;
+
         std::string filename = request_data.at("filename");
         if (!fs_validate_filename(filename)) {
             res_error(res, format_error_response("Invalid filename", ERROR_TYPE_INVALID_REQUEST));
@@ -2615,8 +6227,15 @@ int main(int argc, char ** argv) {
         }
     };
 
-    const auto handle_slots_restore = [&ctx_server, &res_error, &res_ok, &params](const httplib::Request & req, httplib::Response & res, int id_slot) {
+    const auto handle_slots_restore = [&get_model, &res_error, &res_ok, &params](const httplib::Request & req, httplib::Response & res, int id_slot) {
         json request_data = json::parse(req.body);
+
+        const auto ref = get_model(json_value(request_data, "model", std::string()), res);
+        if (!ref) {
+            return;
+        }
+        server_context & ctx_server = *ref;
+
         std::string filename = request_data.at("filename");
         if (!fs_validate_filename(filename)) {
             res_error(res, format_error_response("Invalid filename", ERROR_TYPE_INVALID_REQUEST));
@@ -2645,7 +6264,13 @@ int main(int argc, char ** argv) {
         }
     };
 
-    const auto handle_slots_erase = [&ctx_server, &res_error, &res_ok](const httplib::Request & /* req */, httplib::Response & res, int id_slot) {
+    const auto handle_slots_erase = [&get_model, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res, int id_slot) {
+        const auto ref = get_model(req.get_param_value("model"), res);
+        if (!ref) {
+            return;
+        }
+        server_context & ctx_server = *ref;
+
         server_task task;
         task.type = SERVER_TASK_TYPE_SLOT_ERASE;
         task.data = {
@@ -2694,7 +6319,13 @@ int main(int argc, char ** argv) {
         }
     };
 
-    const auto handle_props = [&ctx_server, &res_ok](const httplib::Request &, httplib::Response & res) {
+    const auto handle_props = [&get_model, &res_ok](const httplib::Request & req, httplib::Response & res) {
+        const auto ref = get_model(req.get_param_value("model"), res);
+        if (!ref) {
+            return;
+        }
+        server_context & ctx_server = *ref;
+
         json data = {
             { "default_generation_settings", ctx_server.default_generation_settings_for_props },
             { "total_slots",                 ctx_server.params.n_parallel },
@@ -2704,8 +6335,8 @@ int main(int argc, char ** argv) {
         res_ok(res, data);
     };
 
-    const auto handle_props_change = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
-        if (!ctx_server.params.endpoint_props) {
+    const auto handle_props_change = [&params, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
+        if (!params.endpoint_props) {
             res_error(res, format_error_response("This server does not support changing global properties. Start it with `--props`", ERROR_TYPE_NOT_SUPPORTED));
             return;
         }
@@ -2717,7 +6348,13 @@ int main(int argc, char ** argv) {
         res_ok(res, {{ "success", true }});
     };
 
-    const auto handle_completions_generic = [&ctx_server, &res_error, &res_ok](server_task_inf_type inf_type, json & data, httplib::Response & res) {
+    const auto handle_completions_generic = [&get_model, &res_error, &res_ok, &res_overloaded, &res_stream](server_task_inf_type inf_type, json & data, httplib::Response & res) {
+        const auto ref = get_model(json_value(data, "model", std::string()), res);
+        if (!ref) {
+            return;
+        }
+        server_context & ctx_server = *ref;
+
         if (ctx_server.params.embedding) {
             res_error(res, format_error_response("This server does not support completions. Start it without `--embeddings`", ERROR_TYPE_NOT_SUPPORTED));
             return;
@@ -2725,7 +6362,12 @@ int main(int argc, char ** argv) {
 
         std::vector<server_task> tasks = ctx_server.create_tasks_inference(data, inf_type);
         ctx_server.queue_results.add_waiting_tasks(tasks);
-        ctx_server.queue_tasks.post(tasks);
+        int retry_after = 0;
+        if (!ctx_server.post_tasks(tasks, retry_after)) {
+            ctx_server.queue_results.remove_waiting_task_ids(server_task::get_list_id(tasks));
+            res_overloaded(res, retry_after);
+            return;
+        }
 
         bool stream = json_value(data, "stream", false);
         const auto task_ids = server_task::get_list_id(tasks);
@@ -2749,21 +6391,11 @@ int main(int argc, char ** argv) {
 
             ctx_server.queue_results.remove_waiting_task_ids(task_ids);
         } else {
-            const auto chunked_content_provider = [task_ids, &ctx_server](size_t, httplib::DataSink & sink) {
-                ctx_server.receive_cmpl_results_stream(task_ids, [&](const server_task_result & result) -> bool {
-                    return server_sent_event(sink, "data", result.data);
-                }, [&](const json & error_data) {
-                    server_sent_event(sink, "error", error_data);
-                });
-                sink.done();
-                return false;
-            };
-
-            auto on_complete = [task_ids, &ctx_server] (bool) {
-                ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+            const auto format = [](const server_task_result & result) {
+                return format_sse("data", result.data);
             };
 
-            res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+            res_stream(res, ref, task_ids, format, "");
         }
     };
 
@@ -2772,7 +6404,15 @@ int main(int argc, char ** argv) {
         return handle_completions_generic(SERVER_TASK_INF_TYPE_COMPLETION, data, res);
     };
 
-    const auto handle_infill = [&ctx_server, &res_error, &handle_completions_generic](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_infill = [&get_model, &res_error, &handle_completions_generic](const httplib::Request & req, httplib::Response & res) {
+        json data = json::parse(req.body);
+
+        const auto ref = get_model(json_value(data, "model", std::string()), res);
+        if (!ref) {
+            return;
+        }
+        server_context & ctx_server = *ref;
+
         // check model compatibility
         std::string err;
         if (llama_token_fim_pre(ctx_server.model) == LLAMA_TOKEN_NULL) {
@@ -2789,8 +6429,6 @@ int main(int argc, char ** argv) {
             return;
         }
 
-        json data = json::parse(req.body);
-
         // validate input
         if (!data.contains("input_prefix")) {
             res_error(res, format_error_response("\"input_prefix\" is required", ERROR_TYPE_INVALID_REQUEST));
@@ -2823,17 +6461,30 @@ int main(int argc, char ** argv) {
     };
 
     // TODO: maybe merge this function with "handle_completions_generic"
-    const auto handle_chat_completions = [&ctx_server, &params, &res_error, &res_ok, verbose](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_chat_completions = [&get_model, &res_error, &res_ok, &res_overloaded, &res_stream, verbose](const httplib::Request & req, httplib::Response & res) {
+        const json body = json::parse(req.body);
+
+        const auto ref = get_model(json_value(body, "model", std::string()), res);
+        if (!ref) {
+            return;
+        }
+        server_context & ctx_server = *ref;
+
         if (ctx_server.params.embedding) {
             res_error(res, format_error_response("This server does not support completions. Start it without `--embeddings`", ERROR_TYPE_NOT_SUPPORTED));
             return;
         }
 
-        json data = oaicompat_completion_params_parse(ctx_server.model, json::parse(req.body), params.chat_template);
+        json data = oaicompat_completion_params_parse(ctx_server.model, body, ctx_server.params.chat_template);
 
         std::vector<server_task> tasks = ctx_server.create_tasks_inference(data, SERVER_TASK_INF_TYPE_COMPLETION);
         ctx_server.queue_results.add_waiting_tasks(tasks);
-        ctx_server.queue_tasks.post(tasks);
+        int retry_after = 0;
+        if (!ctx_server.post_tasks(tasks, retry_after)) {
+            ctx_server.queue_results.remove_waiting_task_ids(server_task::get_list_id(tasks));
+            res_overloaded(res, retry_after);
+            return;
+        }
 
         bool stream = json_value(data, "stream", false);
         const auto task_ids = server_task::get_list_id(tasks);
@@ -2850,36 +6501,32 @@ int main(int argc, char ** argv) {
 
             ctx_server.queue_results.remove_waiting_task_ids(task_ids);
         } else {
-            const auto chunked_content_provider = [task_ids, &ctx_server, completion_id](size_t, httplib::DataSink & sink) {
-                ctx_server.receive_cmpl_results_stream(task_ids, [&](const server_task_result & result) -> bool {
-                    std::vector<json> result_array = format_partial_response_oaicompat(result.data, completion_id);
-                    for (auto & event_data : result_array) {
-                        if (event_data.empty()) {
-                            continue; // skip the stop token
-                        }
-                        if (!server_sent_event(sink, "data", event_data)) {
-                            return false; // connection is closed
-                        }
+            const auto format = [completion_id](const server_task_result & result) {
+                std::string str;
+                for (const auto & event_data : format_partial_response_oaicompat(result.data, completion_id)) {
+                    if (event_data.empty()) {
+                        continue; // skip the stop token
                     }
-                    return true; // ok
-                }, [&](const json & error_data) {
-                    server_sent_event(sink, "error", error_data);
-                });
-                static const std::string ev_done = "data: [DONE]\n\n";
-                sink.write(ev_done.data(), ev_done.size());
-                sink.done();
-                return true;
+                    str += format_sse("data", event_data);
+                }
+                return str;
             };
 
-            auto on_complete = [task_ids, &ctx_server] (bool) {
-                ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+            res_stream(res, ref, task_ids, format, "data: [DONE]\n\n");
+        }
+    };
+
+    const auto handle_models = [&params, &ctx_server, &registry, router](const httplib::Request &, httplib::Response & res) {
+        if (router) {
+            const json data = {
+                {"object", "list"},
+                {"data",   registry.list()},
             };
 
-            res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+            res.set_content(data.dump(), MIMETYPE_JSON);
+            return;
         }
-    };
 
-    const auto handle_models = [&params, &ctx_server](const httplib::Request &, httplib::Response & res) {
         json models = {
             {"object", "list"},
             {"data", {
@@ -2896,9 +6543,16 @@ int main(int argc, char ** argv) {
         res.set_content(models.dump(), MIMETYPE_JSON);
     };
 
-    const auto handle_tokenize = [&ctx_server, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_tokenize = [&get_model, &res_ok](const httplib::Request & req, httplib::Response & res) {
         const json body = json::parse(req.body);
 
+        const auto ref = get_model(json_value(body, "model", std::string()), res);
+        if (!ref) {
+            return;
+        }
+        server_context & ctx_server = *ref;
+
+
         json tokens_response = json::array();
         if (body.count("content") != 0) {
             const bool add_special = json_value(body, "add_special", false);
@@ -2936,9 +6590,16 @@ int main(int argc, char ** argv) {
         res_ok(res, data);
     };
 
-    const auto handle_detokenize = [&ctx_server, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_detokenize = [&get_model, &res_ok](const httplib::Request & req, httplib::Response & res) {
         const json body = json::parse(req.body);
 
+        const auto ref = get_model(json_value(body, "model", std::string()), res);
+        if (!ref) {
+            return;
+        }
+        server_context & ctx_server = *ref;
+
+
         std::string content;
         if (body.count("tokens") != 0) {
             const llama_tokens tokens = body.at("tokens");
@@ -2949,8 +6610,15 @@ int main(int argc, char ** argv) {
         res_ok(res, data);
     };
 
-    const auto handle_embeddings = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_embeddings = [&get_model, &res_error, &res_ok, &res_overloaded](const httplib::Request & req, httplib::Response & res) {
         const json body = json::parse(req.body);
+
+        const auto ref = get_model(json_value(body, "model", std::string()), res);
+        if (!ref) {
+            return;
+        }
+        server_context & ctx_server = *ref;
+
         bool is_openai = false;
 
         // an input prompt can be a string or a list of tokens (integer)
@@ -2972,7 +6640,12 @@ int main(int argc, char ** argv) {
         {
             std::vector<server_task> tasks = ctx_server.create_tasks_inference({{"prompt", prompt}}, SERVER_TASK_INF_TYPE_EMBEDDING);
             ctx_server.queue_results.add_waiting_tasks(tasks);
-            ctx_server.queue_tasks.post(tasks);
+            int retry_after = 0;
+            if (!ctx_server.post_tasks(tasks, retry_after)) {
+                ctx_server.queue_results.remove_waiting_task_ids(server_task::get_list_id(tasks));
+                res_overloaded(res, retry_after);
+                return;
+            }
 
             // get the result
             std::unordered_set<int> task_ids = server_task::get_list_id(tasks);
@@ -3000,14 +6673,20 @@ int main(int argc, char ** argv) {
         res_ok(res, root);
     };
 
-    const auto handle_rerank = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_rerank = [&get_model, &res_error, &res_ok, &res_overloaded](const httplib::Request & req, httplib::Response & res) {
+        const json body = json::parse(req.body);
+
+        const auto ref = get_model(json_value(body, "model", std::string()), res);
+        if (!ref) {
+            return;
+        }
+        server_context & ctx_server = *ref;
+
         if (!ctx_server.params.reranking || ctx_server.params.embedding) {
             res_error(res, format_error_response("This server does not support reranking. Start it with `--reranking` and without `--embedding`", ERROR_TYPE_NOT_SUPPORTED));
             return;
         }
 
-        const json body = json::parse(req.body);
-
         // TODO: implement
         //int top_n = 1;
         //if (body.count("top_n") != 1) {
@@ -3050,7 +6729,12 @@ int main(int argc, char ** argv) {
         {
             std::vector<server_task> tasks = ctx_server.create_tasks_inference({{"prompt", prompt}}, SERVER_TASK_INF_TYPE_RERANK);
             ctx_server.queue_results.add_waiting_tasks(tasks);
-            ctx_server.queue_tasks.post(tasks);
+            int retry_after = 0;
+            if (!ctx_server.post_tasks(tasks, retry_after)) {
+                ctx_server.queue_results.remove_waiting_task_ids(server_task::get_list_id(tasks));
+                res_overloaded(res, retry_after);
+                return;
+            }
 
             // get the result
             std::unordered_set<int> task_ids = server_task::get_list_id(tasks);
@@ -3089,6 +6773,11 @@ int main(int argc, char ** argv) {
     };
 
     const auto handle_lora_adapters_apply = [&](const httplib::Request & req, httplib::Response & res) {
+        if (router) {
+            res_error(res, format_error_response("This server does not support LoRA adapters in router mode", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+
         const std::vector<json> body = json::parse(req.body);
         int max_idx = ctx_server.loras.size();
 
@@ -3183,8 +6872,11 @@ int main(int argc, char ** argv) {
     svr->new_task_queue = [&params] { return new httplib::ThreadPool(params.n_threads_http); };
 
     // clean up function, to be called before exit
-    auto clean_up = [&svr]() {
+    auto clean_up = [&svr, &ctx_server, &registry]() {
         svr->stop();
+        // the worker pools push results to the stream loop, which is destroyed before the contexts
+        ctx_server.post_pool.stop();
+        registry.unload_all();
         llama_backend_free();
     };
 
@@ -3203,6 +6895,31 @@ int main(int argc, char ** argv) {
 
     LOG_INF("%s: HTTP server is listening, hostname: %s, port: %d, http threads: %d\n", __func__, params.hostname.c_str(), params.port, params.n_threads_http);
 
+    if (router) {
+        // the models are loaded by the requests that name them, each runs its main loop in its own thread
+        state.store(SERVER_STATE_READY);
+
+        std::mutex              mutex_shutdown;
+        std::condition_variable cv_shutdown;
+        bool                    shutdown = false;
+
+        shutdown_handler = [&](int) {
+            std::unique_lock<std::mutex> lock(mutex_shutdown);
+            shutdown = true;
+            cv_shutdown.notify_all();
+        };
+
+        LOG_INF("%s: server is listening on http://%s:%d - serving %zu models\n", __func__, params.hostname.c_str(), params.port, registry.models.size());
+
+        std::unique_lock<std::mutex> lock(mutex_shutdown);
+        cv_shutdown.wait(lock, [&shutdown] { return shutdown; });
+
+        clean_up();
+        t.join();
+
+        return 0;
+    }
+
     // load the model
     LOG_INF("%s: loading model\n", __func__);
 
@@ -3225,6 +6942,7 @@ int main(int argc, char ** argv) {
             params.chat_template = "chatml";
         }
     }
+    ctx_server.params.chat_template = params.chat_template;
 
     // print sample chat example to make it clear which template is used
     LOG_INF("%s: chat template, built_in: %d, chat_example: '%s'\n", __func__, params.chat_template.empty(), common_chat_format_example(ctx_server.model, params.chat_template).c_str());
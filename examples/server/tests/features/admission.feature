@@ -0,0 +1,45 @@
+@llama.cpp
+@admission
+Feature: llama.cpp server admission control
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   42 as server seed
+    And   256 KV cache size
+    And   1 slots
+    And   continuous batching
+    And   prometheus compatible metrics exposed
+    # the request in flight counts for the whole slot, 256 cells, and each waiting prompt for about 110
+    And   500 as queue tokens
+    And   100 max tokens to predict
+
+  Scenario: A request that does not fit is rejected, and the newest waiting request of a lower priority is shed
+    Given the server is starting
+    Then  the server is healthy
+    Given a streamed completion request kept open
+    And   a completion request of 2 prompts with priority 0 waiting for a slot
+    # only with the KV cells of the request in flight the queue is full
+    Then  a completion request with priority 0 is rejected with Retry-After
+    # the request of a higher priority sheds the whole waiting request, with its two prompts
+    Given a completion request with priority 1 waiting for a slot
+    Then  the waiting request 1 is answered with status 503
+    And   1 tasks are waiting for a slot
+    Given the stream is closed
+    Then  the waiting request 2 is answered with status 200
+    Then  prometheus metrics are exposed
+    And   metric llamacpp:requests_rejected is 1
+    And   metric llamacpp:requests_shed is 1
+
+  Scenario: A request that waits longer than the queue timeout is rejected
+    Given 1 seconds as queue timeout
+    And   the server is starting
+    Then  the server is healthy
+    Given a streamed completion request kept open
+    And   a completion request with priority 0 waiting for a slot
+    Then  the waiting request 1 is answered with status 503
+    And   0 tasks are waiting for a slot
+    Then  prometheus metrics are exposed
+    And   metric llamacpp:requests_expired is 1
+    Given the stream is closed
@@ -33,6 +33,34 @@ Feature: llama.cpp server
     And   the completion is  truncated
     And   109 prompt tokens are processed
 
+  # with 4 attention sinks, the context is shifted 8 tokens at a time
+  Scenario: Inference with the rolling context shift
+    And   4 attention sinks with a rolling context shift of 8 tokens
+    And   64 server max tokens to predict
+    Then  the server is starting
+    Then  the server is healthy
+    Given a prompt:
+    """
+    Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.
+    Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.
+    Duis aute irure dolor in reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla pariatur.
+    Excepteur sint occaecat cupidatat non proident, sunt in culpa qui officia deserunt mollit anim id est laborum.
+    """
+    And   a completion request with no api error
+    Then  64 tokens are predicted
+    And   the completion is  truncated
+    # the slot is reused after the shifts moved its positions
+    Given a prompt:
+    """
+    Lorem ipsum dolor sit amet
+    """
+    And   a completion request with no api error
+    Then  64 tokens are predicted
+
+  Scenario: The attention sinks do not fit in the context of a slot
+    And   128 attention sinks with a rolling context shift of 8 tokens
+    Then  the server exits with an error
+
   Scenario Outline: Inference without context shift
     And   <n_predict> server max tokens to predict
     And   disable context shifting
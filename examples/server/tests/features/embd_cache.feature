@@ -0,0 +1,49 @@
+@llama.cpp
+@embd_cache
+Feature: llama.cpp server embedding cache
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model url https://huggingface.co/ggml-org/models/resolve/main/bert-bge-small/ggml-model-f16.gguf
+    And   a model file bert-bge-small.gguf
+    And   a model alias bert-bge-small
+    And   42 as server seed
+    And   2 slots
+    And   128 as batch size
+    And   128 as ubatch size
+    And   512 KV cache size
+    And   enable embeddings endpoint
+    And   8 cached embeddings
+    And   prometheus compatible metrics exposed
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: A repeated input is answered from the cache
+    When embeddings are computed for:
+    """
+    What is the capital of Bulgaria ?
+    """
+    Then embeddings are generated
+    When embeddings are computed for:
+    """
+    What is the capital of Bulgaria ?
+    """
+    Then embeddings are generated
+    And  the embeddings are the same as the previous ones
+    # the second input is not decoded
+    Then prometheus metrics are exposed
+    And  metric llamacpp:n_decode is 1
+
+  Scenario: A different input is decoded
+    When embeddings are computed for:
+    """
+    What is the capital of Bulgaria ?
+    """
+    Then embeddings are generated
+    When embeddings are computed for:
+    """
+    What is the capital of France ?
+    """
+    Then embeddings are generated
+    Then prometheus metrics are exposed
+    And  metric llamacpp:n_decode is 2
@@ -0,0 +1,29 @@
+@llama.cpp
+@kv_cache_disk
+Feature: llama.cpp server persistent KV cache
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   prompt caching is enabled
+    And   1 slots
+    And   2048 KV cache size
+    And   42 as server seed
+    And   24 max tokens to predict
+    And   a persistent KV cache of 64 MiB for prompts of at least 16 tokens
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: The KV cache of a prompt is restored after a restart
+    Given a user prompt "What is the capital of France?"
+    And   a completion request with no api error
+    Then  24 tokens are predicted matching (Lily|cake)
+    And   22 prompt tokens are processed
+    When  the server is restarted
+    Then  the server is healthy
+    # only the last token of the prompt is decoded again, for its logits
+    Given a user prompt "What is the capital of France?"
+    And   a completion request with no api error
+    Then  24 tokens are predicted matching (Lily|cake)
+    And   1 prompt tokens are processed
+
@@ -0,0 +1,30 @@
+@llama.cpp
+@kv_pool
+Feature: llama.cpp server shared context pool
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   a model alias tinyllama-2
+    And   42 as server seed
+    And   256 KV cache size
+    And   32 as batch size
+    And   4 slots
+    And   a shared KV cache pool
+    And   continuous batching
+    Then  the server is starting
+    Then  the server is healthy
+
+  # with 4 slots, the prompt would not fit in a 64 tokens slot of an evenly split context
+  Scenario: A slot uses more than its share of the context
+    Given a prompt:
+      """
+      Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.
+      Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.
+      """
+    And   32 max tokens to predict
+    And   a completion request with no api error
+    Then  32 tokens are predicted
+    And   the completion is not truncated
+
@@ -0,0 +1,38 @@
+@llama.cpp
+@lookup
+Feature: llama.cpp server prompt lookup decoding
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   a model alias tinyllama-2
+    And   prompt lookup drafting with 8 draft tokens
+    And   42 as server seed
+    And   512 KV cache size
+    And   2 slots
+    And   continuous batching
+    Then  the server is starting
+    Then  the server is healthy
+
+  # the drafts are verified by the model, the output is the same as without speculative decoding
+  Scenario: Drafts from the context of the slot
+    Given a prompt:
+      """
+      Once upon a time, there was a little girl. Once upon a time, there was a little boy. Once upon a time, there was
+      """
+    And   32 max tokens to predict
+    And   a completion request with no api error
+    Then  32 tokens are predicted
+    And   the timings report the accepted draft tokens
+    And   1 or more draft tokens are accepted
+    Given prompt lookup drafting is disabled
+    Then  the server is restarted
+    Then  the server is healthy
+    Given a prompt:
+      """
+      Once upon a time, there was a little girl. Once upon a time, there was a little boy. Once upon a time, there was
+      """
+    And   a completion request with no api error
+    Then  32 tokens are predicted
+    And   the content is the same as the previous completion
@@ -0,0 +1,45 @@
+@llama.cpp
+@models
+Feature: llama.cpp server router of several models
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   the models alpha,beta of the model file
+    And   42 as server seed
+    And   256 KV cache size
+    And   1 slots
+
+  Scenario: The requests are routed to the model they name
+    Given the server is starting
+    Then  the server is healthy
+    And   the loaded models are none
+    Given a completion request for model alpha with status 200
+    Then  the loaded models are alpha
+    Given a completion request for model beta with status 200
+    Then  the loaded models are alpha,beta
+    Given a completion request for model gamma with status 400
+
+  Scenario: The memory of a model includes its KV cache and compute buffers
+    Given the server is starting
+    Then  the server is healthy
+    Given a completion request for model alpha with status 200
+    Then  the memory of model alpha is larger than its file
+
+  Scenario: The idle models are unloaded to stay within the memory budget
+    # a budget smaller than one model: the idle models are unloaded to load another one
+    Given a memory budget of 1 MiB for the models
+    And   a model load timeout of 2 seconds
+    Then  the server is starting
+    Then  the server is healthy
+    Given a completion request for model alpha with status 200
+    Then  the loaded models are alpha
+    Given a completion request for model beta with status 200
+    Then  the loaded models are beta
+    # a model with a request in flight is not unloaded, the other requests wait for it until the timeout
+    Given a streamed completion request for model beta kept open
+    And   a completion request for model alpha with status 503
+    Then  the loaded models are beta
+    Given the stream is closed
+    And   a completion request for model alpha with status 200
+    Then  the loaded models are alpha
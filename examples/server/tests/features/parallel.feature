@@ -33,6 +33,16 @@ Feature: Parallel
       | n_predict |
       | 128       |
 
+  Scenario: Multiple completions of the same prompt
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And 32 max tokens to predict
+    And 2 completions per prompt
+    Given a completion request with no api error
+    Then 2 completions are predicted with 32 tokens
+
   Scenario Outline: Multi users OAI completions compatibility
     Given a system prompt You are a writer.
     And   a model tinyllama-2
@@ -0,0 +1,58 @@
+@llama.cpp
+@scheduler
+Feature: llama.cpp server scheduler
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   a model alias tinyllama-2
+    And   42 as server seed
+    And   512 KV cache size
+    And   64 as batch size
+    And   24 as batch budget
+    And   8 as prefill chunk
+    And   2 slots
+    And   continuous batching
+    And   prometheus compatible metrics exposed
+    Then  the server is starting
+    Then  the server is healthy
+
+  # each iteration decodes at most 24 tokens, and at most 8 prompt tokens of each slot
+  Scenario: Prompts processed in chunks alongside each other
+    Given a prompt:
+      """
+      Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.
+      Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.
+      """
+    And a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And 32 max tokens to predict
+    Given concurrent completion requests
+    Then the server is busy
+    Then the server is idle
+    And  all slots are idle
+    Then all prompts are predicted with 32 tokens
+
+  Scenario: A long prompt is decoded in chunks
+    Given a prompt:
+      """
+      Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.
+      """
+    And   1 max tokens to predict
+    And   a completion request with no api error
+    Then  1 tokens are predicted
+    Then  prometheus metrics are exposed
+    And   the prompt tokens are decoded in chunks of at most 8 tokens
+
+  Scenario: Queue wait and time to first token
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And   16 max tokens to predict
+    And   a completion request with no api error
+    Then  16 tokens are predicted
+    And   the timings report the queue wait and the time to first token
@@ -34,6 +34,8 @@ Feature: llama.cpp server
     And   <n_prompt> prompt tokens are processed
     And   prometheus metrics are exposed
     And   metric llamacpp:tokens_predicted is <n_predicted>
+    And   histogram llamacpp:time_to_first_token_seconds has 1 observations
+    And   the inter-token latency is observed once per decode step
 
     Examples: Prompts
       | prompt                                                                    | n_predict | re_content                                  | n_prompt | n_predicted | truncated |
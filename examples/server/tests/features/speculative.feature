@@ -0,0 +1,45 @@
+@llama.cpp
+@speculative
+Feature: llama.cpp server speculative decoding
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   a model alias tinyllama-2
+    And   the model as its own draft model with 4 draft tokens
+    And   42 as server seed
+    And   512 KV cache size
+    And   2 slots
+    And   continuous batching
+    And   prometheus compatible metrics exposed
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Draft tokens verified by the target model
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And   32 max tokens to predict
+    And   a completion request with no api error
+    Then  32 tokens are predicted
+    And   the timings report the accepted draft tokens
+    And   prometheus metrics are exposed
+    And   the inter-token latency is observed once per decode step
+
+  Scenario: Drafts of concurrent requests
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And a prompt:
+      """
+      Write another very long music lyrics.
+      """
+    And 32 max tokens to predict
+    Given concurrent completion requests
+    Then the server is busy
+    Then the server is idle
+    And  all slots are idle
+    Then all prompts are predicted with 32 tokens
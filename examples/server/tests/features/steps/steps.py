@@ -3,11 +3,14 @@
 
 import asyncio
 import json
+import math
 import os
 import re
+import signal
 import socket
 import subprocess
 import sys
+import tempfile
 import threading
 import time
 import requests
@@ -62,6 +65,7 @@ def step_server_config(context, server_fqdn: str, server_port: str):
     context.slot_save_path = None
     context.id_slot = None
     context.cache_prompt = None
+    context.n_cmpl = None
     context.n_slots = None
     context.prompt_prefix = None
     context.prompt_suffix = None
@@ -79,6 +83,26 @@ def step_server_config(context, server_fqdn: str, server_port: str):
     context.temperature = None
     context.lora_file = None
     context.disable_ctx_shift = False
+    context.ctx_shift_sink = None
+    context.ctx_shift_step = None
+    context.batch_budget = None
+    context.prefill_chunk = None
+    context.kv_pool = False
+    context.n_threads_http = None
+    context.embd_cache = None
+    context.kv_cache_disk = None
+    context.kv_cache_disk_min = None
+    context.kv_cache_path = None
+    context.model_draft = None
+    context.n_draft = None
+    context.draft_lookup = False
+    context.models_file = None
+    context.models_mem = None
+    context.models_timeout = None
+    context.open_streams = []
+    context.queue_tokens = None
+    context.queue_timeout = None
+    context.background_requests = []
 
     # infill
     context.infill_input_extra = None
@@ -142,6 +166,11 @@ def step_n_threads(context, n_threads: int):
     context.n_thread = n_threads
 
 
+@step('{n_threads_http:d} HTTP threads')
+def step_n_threads_http(context, n_threads_http: int):
+    context.n_threads_http = n_threads_http
+
+
 @step('{draft:d} as draft')
 def step_draft(context, draft: int):
     context.draft = draft
@@ -177,6 +206,11 @@ def step_enable_prompt_cache(context):
     context.cache_prompt = True
 
 
+@step('{n_cmpl:d} completions per prompt')
+def step_n_cmpl(context, n_cmpl: int):
+    context.n_cmpl = n_cmpl
+
+
 @step('continuous batching')
 def step_server_continuous_batching(context):
     context.server_continuous_batching = True
@@ -186,6 +220,11 @@ def step_server_continuous_batching(context):
 def step_server_embeddings(context):
     context.server_embeddings = True
 
+@step('{embd_cache:d} cached embeddings')
+def step_embd_cache(context, embd_cache: int):
+    context.embd_cache = embd_cache
+
+
 @step('enable reranking endpoint')
 def step_server_reranking(context):
     context.server_reranking = True
@@ -198,6 +237,76 @@ def step_server_metrics(context):
 def step_server_disable_ctx_shift(context):
     context.disable_ctx_shift = True
 
+
+@step('{n_sink:d} attention sinks with a rolling context shift of {n_step:d} tokens')
+def step_server_ctx_shift_sink(context, n_sink: int, n_step: int):
+    context.ctx_shift_sink = n_sink
+    context.ctx_shift_step = n_step
+
+
+@step('{batch_budget:d} as batch budget')
+def step_batch_budget(context, batch_budget: int):
+    context.batch_budget = batch_budget
+
+
+@step('{prefill_chunk:d} as prefill chunk')
+def step_prefill_chunk(context, prefill_chunk: int):
+    context.prefill_chunk = prefill_chunk
+
+
+@step('a shared KV cache pool')
+def step_kv_pool(context):
+    context.kv_pool = True
+
+
+@step('a persistent KV cache of {kv_cache_disk:d} MiB for prompts of at least {kv_cache_disk_min:d} tokens')
+def step_kv_cache_disk(context, kv_cache_disk: int, kv_cache_disk_min: int):
+    context.kv_cache_disk = kv_cache_disk
+    context.kv_cache_disk_min = kv_cache_disk_min
+    context.kv_cache_path = tempfile.mkdtemp(prefix='llama-kv-cache-')
+
+
+@step('the model as its own draft model with {n_draft:d} draft tokens')
+def step_draft_model(context, n_draft: int):
+    context.model_draft = context.model_file
+    context.n_draft = n_draft
+
+
+@step('prompt lookup drafting with {n_draft:d} draft tokens')
+def step_draft_lookup(context, n_draft: int):
+    context.draft_lookup = True
+    context.n_draft = n_draft
+
+
+@step('prompt lookup drafting is disabled')
+def step_draft_lookup_disabled(context):
+    context.draft_lookup = False
+
+@step('the models {names} of the model file')
+def step_models(context, names: str):
+    # the models of the router are local files, loaded on demand
+    if not os.path.exists(context.model_file):
+        with open(context.model_file, 'wb') as f:
+            f.write(requests.get(f'https://huggingface.co/{context.model_hf_repo}/resolve/main/{context.model_hf_file}').content)
+    path = os.path.abspath(context.model_file)
+    context.models_file = os.path.join(tempfile.mkdtemp(prefix='llama-models-'), 'models.json')
+    with open(context.models_file, 'w') as f:
+        json.dump({name.strip(): path for name in names.split(',')}, f)
+    context.model_file = None
+    context.model_hf_repo = None
+    context.model_hf_file = None
+
+
+@step('a memory budget of {models_mem:d} MiB for the models')
+def step_models_mem(context, models_mem: int):
+    context.models_mem = models_mem
+
+
+@step('a model load timeout of {models_timeout:d} seconds')
+def step_models_timeout(context, models_timeout: int):
+    context.models_timeout = models_timeout
+
+
 @step("the server is starting")
 def step_start_server(context):
     start_server_background(context)
@@ -222,6 +331,24 @@ def step_start_server(context):
             time.sleep(0.1)
 
 
+@step("the server is restarted")
+def step_restart_server(context):
+    # the pending writes of the persistent KV cache are finished before the server exits
+    context.server_process.send_signal(signal.CTRL_C_EVENT if os.name == 'nt' else signal.SIGINT)
+    context.server_process.wait(timeout=30)
+    step_start_server(context)
+
+
+@step("the server exits with an error")
+def step_server_exits_with_error(context):
+    start_server_background(context)
+    try:
+        exit_code = context.server_process.wait(timeout=30)
+    except subprocess.TimeoutExpired:
+        assert False, "server did not exit"
+    assert exit_code != 0, "server exited without an error"
+
+
 async def wait_for_server_status_with_timeout(context, expecting_status: Literal['healthy', 'ready', 'idle', 'busy'] | str, timeout: int):
     match expecting_status:
         case 'healthy':
@@ -271,6 +398,173 @@ async def step_all_slots_status(context, expected_slot_status_string: Literal['i
     await request_slots_status(context, expected_slots)
 
 
+@step('a streamed completion request closed after {n_events:d} events')
+def step_request_completion_closed(context, n_events: int):
+    with requests.post(f'{context.base_url}/completion',
+                       json={
+                           "prompt": context.prompts.pop(),
+                           "n_predict": context.n_predict,
+                           "stream": True,
+                       },
+                       stream=True) as response:
+        assert response.status_code == 200
+        n = 0
+        for line in response.iter_lines():
+            if line.startswith(b'data: '):
+                n += 1
+                if n == n_events:
+                    break
+        assert n == n_events, f"only {n} events received"
+    # the connection is closed with the response, while the completion still runs
+
+
+@step('a completion request for model {model} with status {status:d}')
+def step_request_completion_model(context, model: str, status: int):
+    response = requests.post(f'{context.base_url}/completion',
+                             json={
+                                 "model": model,
+                                 "prompt": "Once upon a time",
+                                 "n_predict": 4,
+                             })
+    assert response.status_code == status, f"expected status {status}, got {response.status_code}: {response.text}"
+
+
+@step('a streamed completion request for model {model} kept open')
+def step_request_completion_model_open(context, model: str):
+    # the stream holds the model until it is closed
+    open_completion_stream(context, {"model": model})
+
+
+@step('a streamed completion request kept open')
+def step_request_completion_open(context):
+    # the stream holds its slot until it is closed
+    open_completion_stream(context, {})
+
+
+def open_completion_stream(context, payload):
+    # the completion does not end by itself, with the context shift
+    response = requests.post(f'{context.base_url}/completion',
+                             json={
+                                 **payload,
+                                 "prompt": "Once upon a time",
+                                 "n_predict": -1,
+                                 "stream": True,
+                             },
+                             stream=True)
+    assert response.status_code == 200
+    for line in response.iter_lines():
+        if line.startswith(b'data: '):
+            break
+    context.open_streams.append(response)
+
+
+@step('the stream is closed')
+def step_close_stream(context):
+    for response in context.open_streams:
+        response.close()
+    context.open_streams = []
+
+
+@step('the loaded models are {names}')
+def step_loaded_models(context, names: str):
+    response = requests.get(f'{context.base_url}/v1/models')
+    assert response.status_code == 200
+    loaded = sorted(m['id'] for m in response.json()['data'] if m['loaded'])
+    expected = sorted(name.strip() for name in names.split(',')) if names != 'none' else []
+    assert loaded == expected, f"loaded models: {loaded}, expected: {expected}"
+
+
+@step('the memory of model {model} is larger than its file')
+def step_model_memory(context, model: str):
+    response = requests.get(f'{context.base_url}/v1/models')
+    assert response.status_code == 200
+    entry = next(m for m in response.json()['data'] if m['id'] == model)
+    # the KV cache and the compute buffers are counted with the weights
+    n_file = os.path.getsize(json.load(open(context.models_file))[model])
+    assert entry['memory'] > n_file, f"memory of model {model}: {entry['memory']}, file: {n_file}"
+
+
+def completion_payload(context, priority, n_prompts=1):
+    prompt = "Write a very long story about AI."
+    return {
+        "prompt": prompt if n_prompts == 1 else [prompt] * n_prompts,
+        "n_predict": context.n_predict,
+        "priority": priority,
+    }
+
+
+def metrics_values(context):
+    response = requests.get(f'{context.base_url}/metrics')
+    assert response.status_code == 200
+    return {metric.name: metric.samples[0].value for metric in parser.text_string_to_metric_families(response.text)}
+
+
+def n_requests_admitted(context):
+    # the waiting tasks, and those that were shed after they waited
+    values = metrics_values(context)
+    return int(values['llamacpp:requests_deferred'] + values['llamacpp:requests_shed'])
+
+
+@step('a completion request with priority {priority:d} waiting for a slot')
+def step_request_completion_waiting(context, priority: int):
+    request_completion_waiting(context, priority, 1)
+
+
+@step('a completion request of {n_prompts:d} prompts with priority {priority:d} waiting for a slot')
+def step_request_completion_waiting_prompts(context, n_prompts: int, priority: int):
+    request_completion_waiting(context, priority, n_prompts)
+
+
+def request_completion_waiting(context, priority, n_prompts):
+    n_admitted = n_requests_admitted(context)
+    result = {}
+
+    def request():
+        result['response'] = requests.post(f'{context.base_url}/completion', json=completion_payload(context, priority, n_prompts))
+
+    thread = threading.Thread(target=request)
+    thread.start()
+    context.background_requests.append((thread, result))
+
+    for _ in range(100):
+        if n_requests_admitted(context) > n_admitted:
+            return
+        time.sleep(0.1)
+    assert False, "the request is not waiting for a slot"
+
+
+@step('{n_tasks:d} tasks are waiting for a slot')
+def step_tasks_waiting(context, n_tasks: int):
+    n_deferred = int(metrics_values(context)['llamacpp:requests_deferred'])
+    assert n_deferred == n_tasks, f"{n_deferred} tasks are waiting for a slot, expected {n_tasks}"
+
+
+@step('a completion request with priority {priority:d} is rejected with Retry-After')
+def step_request_completion_rejected(context, priority: int):
+    response = requests.post(f'{context.base_url}/completion', json=completion_payload(context, priority))
+    assert response.status_code == 503, f"expected status 503, got {response.status_code}: {response.text}"
+    assert int(response.headers['Retry-After']) >= 1, f"invalid Retry-After: {response.headers}"
+
+
+@step('the waiting request {i_request:d} is answered with status {status:d}')
+def step_request_waiting_status(context, i_request: int, status: int):
+    thread, result = context.background_requests[i_request - 1]
+    thread.join(timeout=60)
+    assert not thread.is_alive(), f"the waiting request {i_request} is not answered"
+    response = result['response']
+    assert response.status_code == status, f"expected status {status}, got {response.status_code}: {response.text}"
+
+
+@step('{queue_tokens:d} as queue tokens')
+def step_queue_tokens(context, queue_tokens: int):
+    context.queue_tokens = queue_tokens
+
+
+@step('{queue_timeout:d} seconds as queue timeout')
+def step_queue_timeout(context, queue_timeout: int):
+    context.queue_timeout = queue_timeout
+
+
 @step('a completion request with {api_error} api error')
 @async_run_until_complete
 async def step_request_completion(context, api_error: Literal['raised'] | str):
@@ -283,6 +577,7 @@ async def step_request_completion(context, api_error: Literal['raised'] | str):
                                           n_predict=context.n_predict,
                                           cache_prompt=context.cache_prompt,
                                           id_slot=context.id_slot,
+                                          n_cmpl=context.n_cmpl,
                                           expect_api_error=expect_api_error,
                                           user_api_key=context.user_api_key,
                                           temperature=context.temperature)
@@ -318,6 +613,16 @@ async def step_request_completion(context, api_error: Literal['raised'] | str):
             context.tasks_result = [await response.json()]
 
 
+@step('{n_cmpl:d} completions are predicted with {predicted_n:d} tokens')
+def step_n_completions_predicted(context, n_cmpl: int, predicted_n: int):
+    completions = context.tasks_result.pop()
+    assert isinstance(completions, list), f"expected a list of completions: {completions}"
+    assert len(completions) == n_cmpl, f"expected {n_cmpl} completions, got {len(completions)}"
+    for i, completion in enumerate(completions):
+        assert completion['index'] == i
+        assert_n_tokens_predicted(completion, predicted_n)
+
+
 @step('{predicted_n:d} tokens are predicted matching {re_content}')
 def step_n_tokens_predicted_with_content(context, predicted_n, re_content):
     context.completion = context.tasks_result.pop()
@@ -326,10 +631,38 @@ def step_n_tokens_predicted_with_content(context, predicted_n, re_content):
 
 @step('{predicted_n:d} tokens are predicted')
 def step_n_tokens_predicted(context, predicted_n):
+    context.completion_prev = context.completion if hasattr(context, 'completion') else None
     context.completion = context.tasks_result.pop()
     assert_n_tokens_predicted(context.completion, predicted_n)
 
 
+@step('the content is the same as the previous completion')
+def step_content_prev(context):
+    assert context.completion_prev is not None, "no previous completion"
+    assert context.completion['content'] == context.completion_prev['content'], \
+        f"the content differs: {context.completion['content']!r} vs {context.completion_prev['content']!r}"
+
+
+@step('the timings report the queue wait and the time to first token')
+def step_timings_queue_ttft(context):
+    timings = context.completion['timings']
+    assert timings['queued_ms'] >= 0, f"invalid queue wait: {timings}"
+    assert timings['ttft_ms'] >= timings['queued_ms'] + timings['prompt_ms'] - 1, f"invalid time to first token: {timings}"
+
+
+@step('the timings report the accepted draft tokens')
+def step_timings_draft(context):
+    timings = context.completion['timings']
+    assert timings['draft_n'] > 0, f"no draft tokens: {timings}"
+    assert 0 <= timings['draft_n_accepted'] <= timings['draft_n'], f"invalid accepted draft tokens: {timings}"
+
+
+@step('{n_accepted:d} or more draft tokens are accepted')
+def step_draft_accepted(context, n_accepted: int):
+    timings = context.completion['timings']
+    assert timings['draft_n_accepted'] >= n_accepted, f"{timings['draft_n_accepted']} accepted draft tokens: {timings}"
+
+
 @step('all predictions are equal')
 @async_run_until_complete
 async def step_predictions_equal(context):
@@ -678,6 +1011,7 @@ async def all_prompts_are_predicted(context, expected_predicted_n=None):
 @async_run_until_complete
 async def step_compute_embedding(context):
     context.n_prompts = 1
+    context.embeddings_prev = context.embeddings if hasattr(context, 'embeddings') else None
     context.embeddings = await request_embedding(context_text(context), None, base_url=context.base_url)
 
 
@@ -730,6 +1064,11 @@ def step_assert_embeddings(context):
     for embedding in context.embeddings:
         assert_embeddings(embedding)
 
+@step('the embeddings are the same as the previous ones')
+def step_assert_embeddings_prev(context):
+    assert context.embeddings_prev is not None, "no previous embeddings"
+    assert np.array_equal(np.array(context.embeddings), np.array(context.embeddings_prev)), "the embeddings differ"
+
 @step('embeddings request with {api_error_code:d} api error')
 def step_assert_embeddings(context, api_error_code: int):
     assert context.embeddings == api_error_code, f"embeddings request must return code {api_error_code}, but got {context.embeddings}"
@@ -924,6 +1263,41 @@ def step_assert_metric_value(context, metric_name, metric_value):
     assert context.metrics[metric_name].samples[0].value == metric_value, f"metric: {context.metrics[metric_name]}"
 
 
+@step('histogram {metric_name} has {n_observations:d} observations')
+def step_assert_histogram_count(context, metric_name, n_observations):
+    assert_histogram(context, metric_name, n_observations)
+
+
+@step('the inter-token latency is observed once per decode step')
+def step_assert_itl_per_step(context):
+    # the accepted draft tokens are generated by the decode step of the token before them
+    timings = context.completion['timings']
+    n_steps = context.completion['tokens_predicted'] - timings.get('draft_n_accepted', 0)
+    assert_histogram(context, 'llamacpp:inter_token_latency_seconds', n_steps - 1)
+
+
+def assert_histogram(context, metric_name, n_observations):
+    if metric_name not in context.metrics:
+        assert False, f"no metric {metric_name} in {context.metrics.keys()}"
+    metric = context.metrics[metric_name]
+    assert metric.type == 'histogram', f"metric {metric_name} is a {metric.type}"
+    buckets = [sample for sample in metric.samples if sample.name == f'{metric_name}_bucket']
+    count = next(sample.value for sample in metric.samples if sample.name == f'{metric_name}_count')
+    # the buckets are cumulative, up to the +Inf one which holds all the observations
+    assert len(buckets) > 1 and buckets[-1].labels['le'] == '+Inf', f"buckets: {buckets}"
+    assert all(a.value <= b.value for a, b in zip(buckets, buckets[1:])), f"buckets not cumulative: {buckets}"
+    assert buckets[-1].value == count, f"+Inf bucket: {buckets[-1].value}, count: {count}"
+    assert count == n_observations, f"metric {metric_name}: {count} observations, expected {n_observations}"
+
+
+@step('the prompt tokens are decoded in chunks of at most {n_chunk:d} tokens')
+def step_prompt_decoded_in_chunks(context, n_chunk):
+    n_prompt = int(context.metrics['llamacpp:prompt_tokens'].samples[0].value)
+    n_decode = int(context.metrics['llamacpp:n_decode'].samples[0].value)
+    assert n_prompt > n_chunk, f"the prompt has only {n_prompt} tokens"
+    assert n_decode >= math.ceil(n_prompt / n_chunk), f"{n_prompt} prompt tokens decoded in {n_decode} batches"
+
+
 @step('available models')
 def step_available_models(context):
     # openai client always expects an api_key
@@ -1022,6 +1396,7 @@ async def request_completion(prompt,
                              n_predict=None,
                              cache_prompt=False,
                              id_slot=None,
+                             n_cmpl=None,
                              expect_api_error=None,
                              user_api_key=None,
                              temperature=None) -> int | dict[str, Any]:
@@ -1045,6 +1420,7 @@ async def request_completion(prompt,
                                     "n_predict": n_predict if n_predict is not None else -1,
                                     "cache_prompt": cache_prompt,
                                     "id_slot": id_slot,
+                                    "n": n_cmpl if n_cmpl is not None else 1,
                                     "seed": seed if seed is not None else 42,
                                     "temperature": temperature if temperature is not None else 0.8,
                                     "n_probs": 2,
@@ -1486,6 +1862,36 @@ def start_server_background(context):
         server_args.extend(['--lora', context.lora_file])
     if context.disable_ctx_shift:
         server_args.extend(['--no-context-shift'])
+    if context.ctx_shift_sink:
+        server_args.extend(['--ctx-shift-sink', context.ctx_shift_sink, '--ctx-shift-step', context.ctx_shift_step])
+    if context.batch_budget:
+        server_args.extend(['--batch-budget', context.batch_budget])
+    if context.prefill_chunk:
+        server_args.extend(['--prefill-chunk', context.prefill_chunk])
+    if context.kv_pool:
+        server_args.append('--kv-pool')
+    if context.embd_cache:
+        server_args.extend(['--embd-cache', context.embd_cache])
+    if context.n_threads_http:
+        server_args.extend(['--threads-http', context.n_threads_http])
+    if context.kv_cache_disk:
+        server_args.extend(['--kv-cache-disk', context.kv_cache_disk, '--kv-cache-disk-min', context.kv_cache_disk_min,
+                            '--kv-cache-path', context.kv_cache_path])
+    if context.model_draft:
+        # draft every token, whatever its probability
+        server_args.extend(['--model-draft', context.model_draft, '--draft', context.n_draft, '--draft-p-min', 0])
+    if context.draft_lookup:
+        server_args.extend(['--draft-lookup', '--draft', context.n_draft])
+    if context.models_file:
+        server_args.extend(['--models', context.models_file])
+    if context.queue_tokens:
+        server_args.extend(['--queue-tokens', context.queue_tokens])
+    if context.queue_timeout:
+        server_args.extend(['--queue-timeout', context.queue_timeout])
+    if context.models_mem:
+        server_args.extend(['--models-mem', context.models_mem])
+    if context.models_timeout:
+        server_args.extend(['--models-timeout', context.models_timeout])
 
     args = [str(arg) for arg in [context.server_path, *server_args]]
     print(f"bench: starting server with: {' '.join(args)}")
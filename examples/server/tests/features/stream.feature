@@ -0,0 +1,52 @@
+@llama.cpp
+@stream
+Feature: llama.cpp server streamed responses
+
+  # the streams are handed over to the stream loop once their headers are sent, so they do not hold the HTTP threads
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   42 as server seed
+    And   512 KV cache size
+    And   4 slots
+    And   2 HTTP threads
+    And   continuous batching
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: More streams than HTTP threads
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And a prompt:
+      """
+      Write another very long music lyrics.
+      """
+    And a prompt:
+      """
+      Write a very long poem.
+      """
+    And a prompt:
+      """
+      Write a very long joke.
+      """
+    And 64 max tokens to predict
+    And streaming is enabled
+    Given concurrent completion requests
+    Then the server is busy
+    Then the server is idle
+    And  all slots are idle
+    Then all prompts are predicted with 64 tokens
+
+  Scenario: A client that goes away cancels its completion
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    # the generation would not end by itself, with the context shift
+    And  -1 max tokens to predict
+    Given a streamed completion request closed after 4 events
+    Then the server is idle
+    And  all slots are idle
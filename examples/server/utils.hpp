@@ -16,9 +16,14 @@
 #define JSON_ASSERT GGML_ASSERT
 #include "json.hpp"
 
+#include <functional>
+#include <map>
+#include <memory>
 #include <random>
+#include <set>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #define DEFAULT_OAICOMPAT_MODEL "gpt-3.5-turbo-0613"
@@ -495,6 +500,179 @@ static size_t longest_common_subsequence(const llama_tokens & a, const llama_tok
     return max_length;
 }
 
+//
+// prefix cache
+//
+
+// radix tree over the token sequences that the slots currently hold in the KV cache
+// each node keeps the ids of all slots whose cached tokens contain the full path from the root to that node
+struct server_prefix_tree {
+    struct node {
+        llama_tokens tokens; // edge label
+
+        std::set<int> ids;
+        std::map<llama_token, std::unique_ptr<node>> children;
+    };
+
+    node root;
+
+    // the tokens registered for each slot id
+    std::unordered_map<int, llama_tokens> entries;
+
+    // register the first n tokens as the cache of slot id, replacing its previous entry
+    void insert(int id, const llama_tokens & tokens, size_t n) {
+        erase(id);
+
+        n = std::min(n, tokens.size());
+        if (n == 0) {
+            return;
+        }
+
+        entries[id].assign(tokens.begin(), tokens.begin() + n);
+
+        node * cur = &root;
+        size_t i = 0;
+        while (i < n) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                auto leaf = std::make_unique<node>();
+                leaf->tokens.assign(tokens.begin() + i, tokens.begin() + n);
+                leaf->ids.insert(id);
+                cur->children[tokens[i]] = std::move(leaf);
+                return;
+            }
+
+            node * child = it->second.get();
+
+            size_t k = 0;
+            while (k < child->tokens.size() && i + k < n && child->tokens[k] == tokens[i + k]) {
+                k++;
+            }
+
+            if (k < child->tokens.size()) {
+                // split the edge at the first mismatch
+                auto mid = std::make_unique<node>();
+                mid->tokens.assign(child->tokens.begin(), child->tokens.begin() + k);
+                mid->ids = child->ids;
+
+                child->tokens.erase(child->tokens.begin(), child->tokens.begin() + k);
+                mid->children[child->tokens[0]] = std::move(it->second);
+
+                it->second = std::move(mid);
+                child = it->second.get();
+            }
+
+            child->ids.insert(id);
+
+            cur = child;
+            i  += k;
+        }
+    }
+
+    // keep only the first n tokens of the entry of slot id
+    void truncate(int id, size_t n) {
+        auto it = entries.find(id);
+        if (it == entries.end() || it->second.size() <= n) {
+            return;
+        }
+
+        const llama_tokens tokens = it->second;
+        insert(id, tokens, n);
+    }
+
+    void erase(int id) {
+        auto it = entries.find(id);
+        if (it == entries.end()) {
+            return;
+        }
+
+        const llama_tokens & tokens = it->second;
+
+        std::vector<node *> path = { &root };
+        for (size_t i = 0; i < tokens.size(); ) {
+            node * child = path.back()->children.at(tokens[i]).get();
+            child->ids.erase(id);
+            path.push_back(child);
+            i += child->tokens.size();
+        }
+
+        // drop the nodes no longer used by any slot and merge the edges that do not branch anymore
+        for (size_t j = path.size() - 1; j > 0; --j) {
+            node * cur = path[j];
+            if (cur->ids.empty()) {
+                path[j - 1]->children.erase(cur->tokens[0]);
+                continue;
+            }
+            if (cur->children.size() == 1 && cur->children.begin()->second->ids == cur->ids) {
+                std::unique_ptr<node> next = std::move(cur->children.begin()->second);
+                cur->tokens.insert(cur->tokens.end(), next->tokens.begin(), next->tokens.end());
+                cur->children = std::move(next->children);
+            }
+        }
+
+        entries.erase(it);
+    }
+
+    void clear() {
+        root.children.clear();
+        entries.clear();
+    }
+
+    // length of the longest prefix of tokens that is cached by any slot
+    // id is set to a slot that holds this prefix, preferring id_pref when it is one of them
+    size_t find(const llama_tokens & tokens, int id_pref, int & id) const {
+        return find(tokens, id_pref, id, [](int) { return true; });
+    }
+
+    // same, among the slots for which accept returns true
+    size_t find(const llama_tokens & tokens, int id_pref, int & id, const std::function<bool(int)> & accept) const {
+        id = -1;
+
+        const node * cur = &root;
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            const node * child = it->second.get();
+
+            // the slots below a node are a subset of the slots of the node
+            int id_child = -1;
+            if (child->ids.count(id_pref) && accept(id_pref)) {
+                id_child = id_pref;
+            } else {
+                for (const int other : child->ids) {
+                    if (accept(other)) {
+                        id_child = other;
+                        break;
+                    }
+                }
+            }
+            if (id_child == -1) {
+                break;
+            }
+
+            size_t k = 0;
+            while (k < child->tokens.size() && i + k < tokens.size() && child->tokens[k] == tokens[i + k]) {
+                k++;
+            }
+
+            id = id_child;
+            i += k;
+
+            if (k < child->tokens.size()) {
+                break;
+            }
+
+            cur = child;
+        }
+
+        return i;
+    }
+};
+
 static bool ends_with(const std::string & str, const std::string & suffix) {
     return str.size() >= suffix.size() && 0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
 }
@@ -579,7 +757,7 @@ static json probs_vector_to_json(const llama_context * ctx, const std::vector<co
     return out;
 }
 
-static bool server_sent_event(httplib::DataSink & sink, const char * event, const json & data) {
+static std::string format_sse(const char * event, const json & data) {
     const std::string str =
         std::string(event) + ": " +
         data.dump(-1, ' ', false, json::error_handler_t::replace) +
@@ -587,6 +765,12 @@ static bool server_sent_event(httplib::DataSink & sink, const char * event, cons
 
     LOG_DBG("data stream, to_send: %s", str.c_str());
 
+    return str;
+}
+
+static bool server_sent_event(httplib::DataSink & sink, const char * event, const json & data) {
+    const std::string str = format_sse(event, data);
+
     return sink.write(str.c_str(), str.size());
 }
 
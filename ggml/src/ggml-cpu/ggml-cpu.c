@@ -2916,17 +2916,17 @@ static void ggml_compute_forward_dup_same_cont(
     const int ith = params->ith; // thread index
     const int nth = params->nth; // number of threads
 
-    // parallelize by elements
-    const int ne = ggml_nelements(dst);
-    const int dr = (ne + nth - 1) / nth;
-    const int ie0 = dr * ith;
-    const int ie1 = MIN(ie0 + dr, ne);
+    // parallelize by blocks (a single element for the non-quantized types)
+    const int nk = ggml_nelements(src0)/ggml_blck_size(src0->type);
+    const int dr = (nk + nth - 1) / nth;
+    const int k0 = dr * ith;
+    const int k1 = MIN(k0 + dr, nk);
 
-    if (ie0 < ie1) {
+    if (k0 < k1) {
         memcpy(
-            ((char *)  dst->data + ie0*nb0),
-            ((char *) src0->data + ie0*nb0),
-            (ie1 - ie0) * nb0);
+            ((char *)  dst->data + k0*nb0),
+            ((char *) src0->data + k0*nb0),
+            (k1 - k0) * nb0);
     }
 }
 
@@ -3891,7 +3891,7 @@ static void ggml_compute_forward_dup_bytes(
         ne00 == ne0 &&
         nb00 == type_size && nb0 == type_size) {
         // copy by rows
-        const size_t rs = ne00 * type_size;
+        const size_t rs = ggml_row_size(src0->type, ne00);
         for (int64_t i03 = 0; i03 < ne03; i03++) {
             for (int64_t i02 = 0; i02 < ne02; i02++) {
                 for (int64_t i01 = ir0; i01 < ir1; i01++) {
@@ -4005,6 +4005,54 @@ static void ggml_compute_forward_dup_bytes(
     }
 }
 
+// convert between a quantized and an F32 tensor of the same shape, one row at a time
+// the rows can be strided, e.g. the per-head views of a quantized KV cache
+static void ggml_compute_forward_dup_q(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    const bool to_f32 = dst->type == GGML_TYPE_F32;
+
+    ggml_to_float_t   const dequantize_row_q = to_f32 ? ggml_get_type_traits(src0->type)->to_float : NULL;
+    ggml_from_float_t const quantize_row_q   = to_f32 ? NULL : ggml_get_type_traits_cpu(dst->type)->from_float;
+
+    GGML_ASSERT(to_f32 ? dequantize_row_q != NULL : quantize_row_q != NULL);
+    GGML_ASSERT(to_f32 ? nb0 == sizeof(float) : nb00 == sizeof(float));
+    GGML_ASSERT(ne00 % ggml_blck_size(to_f32 ? src0->type : dst->type) == 0);
+
+    const int ith = params->ith; // thread index
+    const int nth = params->nth; // number of threads
+
+    // parallelize by rows
+    const int64_t nr = ne01*ne02*ne03;
+    // number of rows per thread
+    const int64_t dr = (nr + nth - 1) / nth;
+    // row range for this thread
+    const int64_t ir0 = dr * ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        const char * src0_ptr = (const char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03;
+              char * dst_ptr  = (char *)        dst->data + i01*nb1  + i02*nb2  + i03*nb3;
+
+        if (to_f32) {
+            dequantize_row_q(src0_ptr, (float *) dst_ptr, ne00);
+        } else {
+            quantize_row_q((const float *) src0_ptr, dst_ptr, ne00);
+        }
+    }
+}
+
 static void ggml_compute_forward_dup(
         const struct ggml_compute_params * params,
         struct ggml_tensor * dst) {
@@ -4016,6 +4064,13 @@ static void ggml_compute_forward_dup(
         return;
     }
 
+    // dequantize, or quantize into a strided view (e.g. the K-shift of a quantized K cache)
+    if ((ggml_is_quantized(src0->type) && dst->type == GGML_TYPE_F32) ||
+        (src0->type == GGML_TYPE_F32 && ggml_is_quantized(dst->type) && !ggml_is_contiguous(dst) && ggml_are_same_shape(src0, dst))) {
+        ggml_compute_forward_dup_q(params, dst);
+        return;
+    }
+
     switch (src0->type) {
         case GGML_TYPE_F16:
             {
@@ -7867,12 +7922,13 @@ static void ggml_compute_forward_out_prod_f32(
     const int ith = params->ith;
     const int nth = params->nth;
 
-    GGML_ASSERT(ne0  == ne00);
-    GGML_ASSERT(ne1  == ne10);
-    GGML_ASSERT(ne2  == ne02);
-    GGML_ASSERT(ne02 == ne12);
-    GGML_ASSERT(ne3  == ne13);
-    GGML_ASSERT(ne03 == ne13);
+    GGML_ASSERT(ne0 == ne00);
+    GGML_ASSERT(ne1 == ne10);
+    GGML_ASSERT(ne2 == ne12);
+    GGML_ASSERT(ne3 == ne13);
+
+    GGML_ASSERT(ne2 % ne02 == 0);
+    GGML_ASSERT(ne3 % ne03 == 0);
 
     // we don't support permuted src0 or src1
     GGML_ASSERT(nb00 == sizeof(float));
@@ -7914,6 +7970,10 @@ static void ggml_compute_forward_out_prod_f32(
     const int64_t blck_0 = MAX(GGML_VEC_MAD_UNROLL, 32);
     const int64_t blck_1 = 16;
 
+    // dps == dst per src0, used for group query attention
+    const int64_t dps2 = ne2 / ne02;
+    const int64_t dps3 = ne3 / ne03;
+
     for (int64_t bir = ir0; bir < ir1; bir += blck_1) {
         const int64_t bir1 = MIN(bir + blck_1, ir1);
         for (int64_t bi01 = 0; bi01 < ne01; bi01 += blck_0) {
@@ -7924,8 +7984,8 @@ static void ggml_compute_forward_out_prod_f32(
                 const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
                 const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
 
-                const int64_t i02 = i2;
-                const int64_t i03 = i3;
+                const int64_t i02 = i2 / dps2;
+                const int64_t i03 = i3 / dps3;
 
                 //const int64_t i10 = i1;
                 const int64_t i12 = i2;
@@ -7982,10 +8042,11 @@ static void ggml_compute_forward_out_prod_q_f32(
     const enum ggml_type type = src0->type;
     ggml_to_float_t const dequantize_row_q = ggml_get_type_traits(type)->to_float;
 
-    GGML_ASSERT(ne02 == ne12);
-    GGML_ASSERT(ne03 == ne13);
-    GGML_ASSERT(ne2  == ne12);
-    GGML_ASSERT(ne3  == ne13);
+    GGML_ASSERT(ne2 == ne12);
+    GGML_ASSERT(ne3 == ne13);
+
+    GGML_ASSERT(ne2 % ne02 == 0);
+    GGML_ASSERT(ne3 % ne03 == 0);
 
     // we don't support permuted src0 dim0
     GGML_ASSERT(nb00 == ggml_type_size(type));
@@ -7998,8 +8059,6 @@ static void ggml_compute_forward_out_prod_q_f32(
 
     GGML_ASSERT(ne0 == ne00);
     GGML_ASSERT(ne1 == ne10);
-    GGML_ASSERT(ne2 == ne02);
-    GGML_ASSERT(ne3 == ne03);
 
     // nb01 >= nb00 - src0 is not transposed
     //   compute by src0 rows
@@ -8030,14 +8089,22 @@ static void ggml_compute_forward_out_prod_q_f32(
 
     float * wdata = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32) * ith;
 
-    for (int64_t ir = ir0; ir < ir1; ++ir) {
+    // dps == dst per src0, used for group query attention
+    const int64_t dps2 = ne2 / ne02;
+    const int64_t dps3 = ne3 / ne03;
+
+    // the rows of the thread with the same i2, i3 are processed together,
+    // so that each src0 row is dequantized once for all of them
+    for (int64_t ir = ir0; ir < ir1;) {
         // dst indices
         const int64_t i3 = ir/(ne2*ne1);
         const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
         const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
 
-        const int64_t i02 = i2;
-        const int64_t i03 = i3;
+        const int64_t n1 = MIN(ir1 - ir, ne1 - i1);
+
+        const int64_t i02 = i2 / dps2;
+        const int64_t i03 = i3 / dps3;
 
         //const int64_t i10 = i1;
         const int64_t i12 = i2;
@@ -8046,13 +8113,19 @@ static void ggml_compute_forward_out_prod_q_f32(
         for (int64_t i01 = 0; i01 < ne01; ++i01) {
             const int64_t i11 = i01;
 
-            float * s0 = (float *) ((char *) src0->data + (          i01*nb01 + i02*nb02 + i03*nb03));
-            float * s1 = (float *) ((char *) src1->data + (i1*nb10 + i11*nb11 + i12*nb12 + i13*nb13));
-            float * d  = (float *) ((char *)  dst->data + (          i1*nb1 + i2*nb2 + i3*nb3));
+            float * s0 = (float *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
 
             dequantize_row_q(s0, wdata, ne0);
-            ggml_vec_mad_f32(ne0, d, wdata, *s1);
+
+            for (int64_t j1 = i1; j1 < i1 + n1; ++j1) {
+                float * s1 = (float *) ((char *) src1->data + (j1*nb10 + i11*nb11 + i12*nb12 + i13*nb13));
+                float * d  = (float *) ((char *)  dst->data + (          j1*nb1 + i2*nb2 + i3*nb3));
+
+                ggml_vec_mad_f32(ne0, d, wdata, *s1);
+            }
         }
+
+        ir += n1;
     }
 }
 
@@ -1370,11 +1370,13 @@ static bool ggml_backend_kompute_device_supports_op(ggml_backend_dev_t dev, cons
         case GGML_OP_ADD:
         case GGML_OP_MUL:
         case GGML_OP_SCALE:
-        case GGML_OP_SOFT_MAX:
         case GGML_OP_RMS_NORM:
         case GGML_OP_NORM:
         case GGML_OP_ROPE:
             return true;
+        case GGML_OP_SOFT_MAX:
+            // TODO: F16 mask support in ggml_vk_soft_max
+            return op->src[1] == nullptr || op->src[1]->type == GGML_TYPE_F32;
         case GGML_OP_DUP:
         case GGML_OP_CPY:
         case GGML_OP_CONT:
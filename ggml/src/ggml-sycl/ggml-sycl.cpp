@@ -4448,8 +4448,10 @@ static bool ggml_backend_sycl_device_supports_op(ggml_backend_dev_t dev, const g
         case GGML_OP_CONT:
             return op->src[0]->type != GGML_TYPE_BF16;
         case GGML_OP_DIAG_MASK_INF:
-        case GGML_OP_SOFT_MAX:
             return true;
+        case GGML_OP_SOFT_MAX:
+            // TODO: F16 mask support in ggml_sycl_op_soft_max
+            return op->src[1] == nullptr || op->src[1]->type == GGML_TYPE_F32;
         case GGML_OP_ROPE:
             return ggml_is_contiguous(op->src[0]);
         case GGML_OP_IM2COL:
@@ -325,6 +325,9 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        uint32_t defrag_max_cells; // max number of KV cells moved per defragmentation step, 0 = no limit (default)
+        uint32_t kv_block_size;    // KV cache block size for paged cell allocation, 0 = contiguous slots (default) [EXPERIMENTAL]
+        uint32_t kv_size_step;     // grow the KV cache on demand in steps of this many cells, 0 = allocate n_ctx cells up front (default) [EXPERIMENTAL]
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -339,6 +342,8 @@ extern "C" {
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
         bool no_perf;     // whether to measure performance timings
+        bool kv_shrink;   // release the memory of a grown KV cache in llama_kv_cache_clear (with kv_size_step) [EXPERIMENTAL]
+        bool swa_ring;    // store the sliding window attention layers in a cache sized to their window [EXPERIMENTAL]
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
@@ -422,6 +427,7 @@ extern "C" {
     LLAMA_API int64_t llama_time_us(void);
 
     LLAMA_API size_t llama_max_devices(void);
+    LLAMA_API size_t llama_max_parallel_sequences(void); // max number of distinct sequence ids in a batch
 
     LLAMA_API bool llama_supports_mmap       (void);
     LLAMA_API bool llama_supports_mlock      (void);
@@ -433,11 +439,15 @@ extern "C" {
     LLAMA_API uint32_t llama_n_ubatch   (const struct llama_context * ctx);
     LLAMA_API uint32_t llama_n_seq_max  (const struct llama_context * ctx);
 
+    // Returns the size in bytes of the buffers of the context: KV cache, outputs, LoRA stacks and compute buffers
+    LLAMA_API uint64_t llama_context_size(const struct llama_context * ctx);
+
     LLAMA_API int32_t llama_n_vocab    (const struct llama_model * model);
     LLAMA_API int32_t llama_n_ctx_train(const struct llama_model * model);
     LLAMA_API int32_t llama_n_embd     (const struct llama_model * model);
     LLAMA_API int32_t llama_n_layer    (const struct llama_model * model);
     LLAMA_API int32_t llama_n_head     (const struct llama_model * model);
+    LLAMA_API int32_t llama_n_swa      (const struct llama_model * model); // sliding window attention size, 0 = none
 
     LLAMA_API const struct llama_model * llama_get_model(const struct llama_context * ctx);
 
@@ -519,6 +529,24 @@ extern "C" {
     LLAMA_API void llama_lora_adapter_clear(
             struct llama_context * ctx);
 
+    // Apply a loaded LoRA adapter to the tokens of one sequence only, on top of the adapters of the whole context
+    // Each sequence has at most one such adapter, which replaces the previous one
+    // The weights of all the adapters selected this way are stacked into one extra copy, so that the sequences of a
+    // batch with different adapters are evaluated together. An adapter stays in the copy while a sequence selects it,
+    // and must not be freed before that
+    // The KV cache of a sequence depends on its adapter: it is up to the caller to not reuse it with another one
+    LLAMA_API int32_t llama_lora_adapter_seq_set(
+            struct llama_context * ctx,
+            struct llama_lora_adapter * adapter,
+            llama_seq_id seq_id,
+            float scale);
+
+    // Remove the LoRA adapter of a sequence
+    // seq_id < 0 : remove the adapters of all sequences and free their stacked weights
+    LLAMA_API void llama_lora_adapter_seq_clear(
+            struct llama_context * ctx,
+            llama_seq_id seq_id);
+
     // Manually free a LoRA adapter
     // Note: loaded adapters will be free when the associated model is deleted
     LLAMA_API void llama_lora_adapter_free(struct llama_lora_adapter * adapter);
@@ -613,6 +641,7 @@ extern "C" {
 
     // Copy all tokens that belong to the specified sequence to another sequence
     // Note that this does not allocate extra KV cache memory - it simply assigns the tokens to the new sequence
+    // The tokens are shared until one of the sequences changes their positions (see llama_kv_cache_seq_fork)
     // p0 < 0 : [0,  p1]
     // p1 < 0 : [p0, inf)
     LLAMA_API void llama_kv_cache_seq_cp(
@@ -622,6 +651,21 @@ extern "C" {
                        llama_pos   p0,
                        llama_pos   p1);
 
+    // Fork a sequence: replace the tokens of seq_id_dst with the tokens of seq_id_src in [p0, p1)
+    // The tokens are shared by both sequences, so that the memory used by the forked sequence grows
+    // only with the tokens that it adds after the fork
+    // When llama_kv_cache_seq_add() or llama_kv_cache_seq_div() changes the positions of shared tokens for one
+    // sequence, that sequence gets its own copy of these tokens (copy-on-write), the other sequences are not affected
+    // With kv_block_size > 0, the copies are made per block: a block with shared tokens is copied as a whole
+    // p0 < 0 : [0,  p1]
+    // p1 < 0 : [p0, inf)
+    LLAMA_API void llama_kv_cache_seq_fork(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id_src,
+                    llama_seq_id   seq_id_dst,
+                       llama_pos   p0,
+                       llama_pos   p1);
+
     // Removes all tokens that do not belong to the specified sequence
     LLAMA_API void llama_kv_cache_seq_keep(
             struct llama_context * ctx,
@@ -658,12 +702,25 @@ extern "C" {
             struct llama_context * ctx,
                     llama_seq_id   seq_id);
 
+    // Returns the smallest position present in the KV cache for the specified sequence, -1 if it has no cells
+    // With swa_ring, the positions out of the sliding window are evicted: unless nothing was evicted (pos_min == 0),
+    // the sequence can only be continued from a position p with p - llama_n_swa() + 1 >= pos_min
+    LLAMA_API llama_pos llama_kv_cache_seq_pos_min(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id);
+
     // Defragment the KV cache
     // This will be applied:
     //   - lazily on next llama_decode()
     //   - explicitly with llama_kv_cache_update()
+    // With defrag_max_cells > 0, each of these moves at most that many cells and the rest of the
+    // defragmentation is continued by the next ones (see llama_kv_cache_defrag_pending())
     LLAMA_API void llama_kv_cache_defrag(struct llama_context * ctx);
 
+    // Returns true if a defragmentation of the KV cache is queued or in progress
+    // Can be used to run the remaining steps with llama_kv_cache_update() while there is nothing to decode
+    LLAMA_API bool llama_kv_cache_defrag_pending(const struct llama_context * ctx);
+
     // Apply the KV cache updates (such as K-shifts, defragmentation, etc.)
     LLAMA_API void llama_kv_cache_update(struct llama_context * ctx);
 
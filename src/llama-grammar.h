@@ -3,6 +3,7 @@
 #include "llama-impl.h"
 
 #include <map>
+#include <memory>
 
 struct llama_vocab;
 
@@ -110,8 +111,12 @@ struct llama_grammar {
     // note: allow null vocab for testing (not great)
     const llama_vocab * vocab;
 
-    const llama_grammar_rules  rules;  // TODO: shared ptr
-          llama_grammar_stacks stacks;
+    // the rules and the initial stacks are immutable and shared by the clones of the grammar,
+    // so that a clone or a reset only copies the stacks
+    std::shared_ptr<const llama_grammar_rules>  rules;
+    std::shared_ptr<const llama_grammar_stacks> stacks_init;
+
+    llama_grammar_stacks stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
@@ -134,6 +139,9 @@ void llama_grammar_free_impl(struct llama_grammar * grammar);
 
 struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & grammar);
 
+// back to the state before any token was accepted
+void llama_grammar_reset_impl(struct llama_grammar & grammar);
+
 // TODO: move the API below as member functions of llama_grammar
 void llama_grammar_apply_impl(
         const struct llama_grammar & grammar,
@@ -1323,10 +1323,7 @@ static void llama_sampler_grammar_reset(struct llama_sampler * smpl) {
         return;
     }
 
-    auto * grammar_new = llama_grammar_init_impl(ctx->grammar->vocab, ctx->grammar_str.c_str(), ctx->grammar_root.c_str());
-
-    llama_grammar_free_impl(ctx->grammar);
-    ctx->grammar = grammar_new;
+    llama_grammar_reset_impl(*ctx->grammar);
 }
 
 static struct llama_sampler * llama_sampler_grammar_clone(const struct llama_sampler * smpl) {
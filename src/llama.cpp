@@ -45,6 +45,7 @@
 
 #include <algorithm>
 #include <array>
+#include <bitset>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
@@ -79,6 +80,7 @@
 // bump if necessary
 #define LLAMA_MAX_LAYERS  512
 #define LLAMA_MAX_EXPERTS 160  // DeepSeekV2
+#define LLAMA_MAX_SEQ     256
 
 //
 // helpers
@@ -2389,6 +2391,8 @@ struct llama_hparams {
     std::array<uint32_t, LLAMA_MAX_LAYERS> n_head_kv_arr;
     std::array<uint32_t, LLAMA_MAX_LAYERS> n_ff_arr;
 
+    std::array<bool, LLAMA_MAX_LAYERS> swa_layers; // the layers that attend only within n_swa
+
     uint32_t n_layer_dense_lead = 0;
     uint32_t n_lora_q = 0;
     uint32_t n_lora_kv = 0;
@@ -2459,6 +2463,7 @@ struct llama_hparams {
         if (this->n_head_arr    != other.n_head_arr)    return true;
         if (this->n_head_kv_arr != other.n_head_kv_arr) return true;
         if (this->n_ff_arr      != other.n_ff_arr)      return true;
+        if (this->swa_layers    != other.swa_layers)    return true;
 
         if (this->n_rel_attn_bkts    != other.n_rel_attn_bkts)    return true;
         if (this->n_layer_dense_lead != other.n_layer_dense_lead) return true;
@@ -2516,6 +2521,14 @@ struct llama_hparams {
         GGML_ABORT("fatal error");
     }
 
+    bool is_swa(uint32_t il) const {
+        if (il < n_layer) {
+            return n_swa > 0 && swa_layers[il];
+        }
+
+        GGML_ABORT("fatal error");
+    }
+
     uint32_t n_ff(uint32_t il = 0) const {
         if (il < n_layer) {
             return n_ff_arr[il];
@@ -2592,11 +2605,18 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t defrag_max_cells;
+    uint32_t kv_block_size;
+    uint32_t kv_size_step;
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
     bool flash_attn;
     bool no_perf;
+    bool kv_shrink;
+    bool swa_ring;
+    bool kq_mask_f16; // all the backends take an F16 mask in ggml_soft_max_ext
 
     enum llama_pooling_type pooling_type;
 
@@ -2774,16 +2794,163 @@ struct llama_ubatch {
     int8_t       *  output;   // [n_tokens]
 };
 
+// fixed-size set of sequence ids in [0, LLAMA_MAX_SEQ)
+struct llama_kv_seq_mask {
+    static constexpr int n_words = (LLAMA_MAX_SEQ + 63)/64;
+
+    uint64_t bits[n_words] = {};
+
+    bool test(llama_seq_id id) const {
+        return 0 <= id && id < LLAMA_MAX_SEQ && (bits[id/64] >> (id%64)) & 1;
+    }
+
+    void set(llama_seq_id id) {
+        GGML_ASSERT(0 <= id && id < LLAMA_MAX_SEQ);
+        bits[id/64] |= uint64_t(1) << (id%64);
+    }
+
+    void reset(llama_seq_id id) {
+        if (0 <= id && id < LLAMA_MAX_SEQ) {
+            bits[id/64] &= ~(uint64_t(1) << (id%64));
+        }
+    }
+
+    void clear() {
+        for (auto & w : bits) {
+            w = 0;
+        }
+    }
+
+    bool empty() const {
+        for (auto w : bits) {
+            if (w) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint32_t size() const {
+        uint32_t n = 0;
+        for (auto w : bits) {
+            n += std::bitset<64>(w).count();
+        }
+        return n;
+    }
+
+    bool operator==(const llama_kv_seq_mask & other) const {
+        return std::equal(std::begin(bits), std::end(bits), std::begin(other.bits));
+    }
+
+    // call f(seq_id) for each sequence in the set, in increasing order
+    template <typename F>
+    void for_each(F && f) const {
+        for (int i = 0; i < n_words; ++i) {
+            for (uint64_t w = bits[i]; w != 0; ) {
+                const uint64_t lsb = w & (~w + 1);
+                f((llama_seq_id) (i*64 + std::bitset<64>(lsb - 1).count()));
+                w ^= lsb;
+            }
+        }
+    }
+};
+
+// number of cells of a sequence at each of its positions, sorted by position
+// a flat array, so that adding a cell does not allocate once the sequence has reached its size:
+// new positions are normally appended at the end, and cells are removed at either end
+struct llama_kv_seq_pos {
+    std::vector<std::pair<llama_pos, uint32_t>> data;
+
+    size_t beg = 0; // the entries before beg have been removed
+
+    bool empty() const {
+        return beg == data.size();
+    }
+
+    void clear() {
+        data.clear();
+        beg = 0;
+    }
+
+    llama_pos min() const {
+        return data[beg].first;
+    }
+
+    llama_pos max() const {
+        return data.back().first;
+    }
+
+    // the first entry with a position >= pos
+    std::vector<std::pair<llama_pos, uint32_t>>::const_iterator lower_bound(llama_pos pos) const {
+        if (empty() || pos > max()) {
+            return data.end();
+        }
+        return std::lower_bound(data.begin() + beg, data.end(), pos,
+                [](const std::pair<llama_pos, uint32_t> & e, llama_pos p) { return e.first < p; });
+    }
+
+    std::vector<std::pair<llama_pos, uint32_t>>::const_iterator end() const {
+        return data.end();
+    }
+
+    void add(llama_pos pos) {
+        if (empty()) {
+            clear();
+        }
+
+        if (empty() || pos > max()) {
+            data.emplace_back(pos, 1);
+            return;
+        }
+
+        auto it = data.begin() + (lower_bound(pos) - data.begin());
+        if (it->first == pos) {
+            it->second++;
+        } else if (it == data.begin() + beg && beg > 0) {
+            data[--beg] = std::make_pair(pos, 1);
+        } else {
+            data.emplace(it, pos, 1);
+        }
+    }
+
+    // returns false if the sequence has no cell at pos
+    bool rm(llama_pos pos) {
+        auto it = data.begin() + (lower_bound(pos) - data.begin());
+        if (it == data.end() || it->first != pos) {
+            return false;
+        }
+
+        if (--it->second > 0) {
+            return true;
+        }
+
+        if (it == data.begin() + beg) {
+            beg++;
+            if (2*beg > data.size()) {
+                // reclaim the removed entries from time to time, keeping the capacity
+                data.erase(data.begin(), data.begin() + beg);
+                beg = 0;
+            }
+        } else if (it + 1 == data.end()) {
+            data.pop_back();
+        } else {
+            data.erase(it);
+        }
+
+        return true;
+    }
+};
+
 struct llama_kv_cell {
     llama_pos pos   = -1;
     llama_pos delta = 0;
     int32_t   src   = -1; // used by recurrent state models to copy states
     int32_t   tail  = -1;
 
-    std::set<llama_seq_id> seq_id;
+    llama_kv_seq_mask seq_id;
 
     bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return seq_id.test(id);
     }
 
     bool is_empty() const {
@@ -2795,6 +2962,20 @@ struct llama_kv_cell {
     }
 };
 
+// a run of consecutive ubatch tokens stored in consecutive KV cells
+struct llama_kv_cache_run {
+    uint32_t i_token; // index of the first token in the ubatch
+    uint32_t i_cell;  // index of the first cell in the cache
+    uint32_t n;       // number of tokens (and cells) in the run
+};
+
+// a copy of the K and V data of n consecutive KV cells
+struct llama_kv_cache_copy {
+    uint32_t i_src;
+    uint32_t i_dst;
+    uint32_t n;
+};
+
 // ring-buffer of cached KV data
 struct llama_kv_cache {
     bool has_shift = false;
@@ -2809,21 +2990,62 @@ struct llama_kv_cache {
     uint32_t size = 0;
     uint32_t used = 0; // used cells (i.e. at least one seq_id)
 
+    // lazy allocation (size_step > 0): the cache starts with size_step cells and
+    // the buffers are grown by size_step cells when a ubatch does not fit, up to size_max
+    uint32_t size_step = 0;
+    uint32_t size_max  = 0;
+
+    // sliding window cache (n_swa > 0): only holds the SWA layers, the cells older than the window
+    // of their sequence are evicted (see llama_kv_cache_swa_evict), so that it can be much smaller than n_ctx
+    uint32_t n_swa = 0;
+
     // computed before each graph build
     uint32_t n = 0;
 
+    // with has_shift, all the cells with a pending K-shift (delta != 0) are in [shift_beg, shift_end)
+    // the K-shift graph only rotates this range
+    uint32_t shift_beg = 0;
+    uint32_t shift_end = 0;
+
     ggml_type type_k = GGML_TYPE_F16;
     ggml_type type_v = GGML_TYPE_F16;
 
+    // paged mode (block_size > 0): the cells are grouped in blocks of block_size cells
+    // new tokens of a sequence go to the last block of its block table, then to a free block,
+    // so that a ubatch can be placed in any free cells instead of one contiguous slot
+    uint32_t block_size = 0;
+    uint32_t n_runs_max = 1; // max number of runs per ubatch, limited by the graph size
+
+    std::unordered_map<llama_seq_id, std::vector<uint32_t>> block_table; // blocks used by each sequence
+
+    // copy-on-write: when the position of a cell shared by several sequences is changed for one of them,
+    // that sequence is moved to a copy of the cell (see llama_kv_cache_cell_unshare)
+    // the K and V data of the copies is copied by llama_kv_cache_update, before the K-shift
+    std::map<uint32_t, uint32_t> cow_dst; // pending copies: destination cell -> source cell
+    std::map<uint32_t, uint32_t> cow_src; // number of pending copies from each source cell
+
+    // placement of the current ubatch when it is not contiguous (empty: cells [head, head + n_tokens))
+    std::vector<llama_kv_cache_run> runs;
+
     std::vector<llama_kv_cell> cells;
 
-    std::vector<struct ggml_tensor *> k_l; // per layer
+    // per-sequence index, kept in sync with the cells by the llama_kv_cache_cell_* helpers
+    // so that the seq_* operations do not need to scan the whole cache
+    std::array<llama_kv_seq_pos, LLAMA_MAX_SEQ> seq_pos; // number of cells of the sequence at each position
+    std::array<uint32_t, LLAMA_MAX_SEQ> seq_cell_beg; // all cells of the sequence are in [seq_cell_beg, seq_cell_end)
+    std::array<uint32_t, LLAMA_MAX_SEQ> seq_cell_end;
+
+    // F16 KQ mask row of each sequence: 0.0f for the cells of the sequence, -INFINITY for the others
+    // allocated while the sequence has cells, copied into inp_KQ_mask by llama_set_inputs
+    std::array<std::vector<ggml_fp16_t>, LLAMA_MAX_SEQ> seq_mask;
+
+    std::vector<struct ggml_tensor *> k_l; // per layer, nullptr for the layers stored in another cache
     std::vector<struct ggml_tensor *> v_l;
 
     std::vector<ggml_context_ptr> ctxs;
     std::vector<ggml_backend_buffer_ptr> bufs;
 
-    size_t total_size() {
+    size_t total_size() const {
         size_t size = 0;
         for (auto & buf : bufs) {
             size += ggml_backend_buffer_get_size(buf.get());
@@ -2856,6 +3078,79 @@ struct llama_control_vector {
     }
 };
 
+// LoRA adapters selected per sequence with llama_lora_adapter_seq_set()
+// the weights of all of them are stacked by base tensor, so that a single ggml_mul_mat_id() applies to each row of the
+// batch the adapter of its own sequence - the rows without an adapter select the first one, with a scale of 0
+struct llama_lora_seq {
+    struct stack {
+        std::string name; // of the base tensor
+
+        struct ggml_tensor * a = nullptr; // F16 [n_in, rank, n_max], rank is the largest one of the adapters
+        struct ggml_tensor * b = nullptr; // F16 [rank, n_out, n_max], with the alpha/rank scale of each adapter
+    };
+
+    // the adapters in use, by index in the stacks - nullptr for an index that is free
+    // an adapter is released once no sequence selects it, so there are at most as many as sequences
+    std::vector<struct llama_lora_adapter *> adapters;
+
+    // the indices whose slices are to be written by the next decode
+    std::set<int32_t> pending;
+
+    int64_t n_max = 0; // number of slices of the stacks
+
+    std::unordered_map<const struct ggml_tensor *, stack> stacks; // by base tensor
+    std::vector<ggml_context_ptr> ctxs;
+    std::vector<ggml_backend_buffer_ptr> bufs;
+
+    // adapter index and scale of each sequence
+    std::map<llama_seq_id, std::pair<int32_t, float>> seqs;
+
+    // set by llama_build_graph(): the ubatch has rows with an adapter, and the number of rows before and after the
+    // unused outputs are skipped
+    bool    active    = false;
+    int64_t n_tokens  = 0;
+    int64_t n_outputs = 0;
+
+    const stack * stack_for(const struct ggml_tensor * w) const {
+        if (!active) {
+            return nullptr;
+        }
+        auto it = stacks.find(w);
+        return it == stacks.end() ? nullptr : &it->second;
+    }
+
+    // free the indices of the adapters that no sequence selects, and the stacks once there are none left
+    void release_unused() {
+        std::vector<bool> used(adapters.size(), false);
+        for (const auto & it : seqs) {
+            used[it.second.first] = true;
+        }
+        for (size_t i = 0; i < adapters.size(); ++i) {
+            if (!used[i]) {
+                adapters[i] = nullptr;
+                pending.erase(i);
+            }
+        }
+        while (!adapters.empty() && adapters.back() == nullptr) {
+            adapters.pop_back();
+        }
+
+        if (adapters.empty()) {
+            clear();
+        }
+    }
+
+    void clear() {
+        seqs.clear();
+        adapters.clear();
+        pending.clear();
+        stacks.clear();
+        bufs.clear();
+        ctxs.clear();
+        n_max = 0;
+    }
+};
+
 struct llama_model {
     e_model     type  = MODEL_UNKNOWN;
     llm_arch    arch  = LLM_ARCH_UNKNOWN;
@@ -3263,9 +3558,11 @@ struct llama_context {
     struct llama_cparams        cparams;
     struct llama_sbatch         sbatch;
     struct llama_kv_cache       kv_self;
+    struct llama_kv_cache       kv_swa; // with cparams.swa_ring: the SWA layers, sized to their window (size == 0 otherwise)
     struct llama_control_vector cvec;
 
     std::unordered_map<struct llama_lora_adapter *, float> lora_adapters;
+    struct llama_lora_seq lora_seq;
 
     std::vector<ggml_backend_ptr> backends;
     std::vector<std::pair<ggml_backend_t, ggml_backend_set_n_threads_t>> set_n_threads_fns;
@@ -3329,9 +3626,10 @@ struct llama_context {
     struct ggml_tensor * inp_embd;        // F32 [n_embd, n_batch]
     struct ggml_tensor * inp_pos;         // I32 [n_batch]
     struct ggml_tensor * inp_out_ids;     // I32 [n_outputs]
-    struct ggml_tensor * inp_KQ_mask;     // F32 [kv_size, n_batch]
-    struct ggml_tensor * inp_KQ_mask_swa; // F32 [kv_size, n_batch]
+    struct ggml_tensor * inp_KQ_mask;     // F16 (F32 with ALiBi or without cparams.kq_mask_f16) [kv_size, n_batch]
+    struct ggml_tensor * inp_KQ_mask_swa; // F16 (F32 with ALiBi or without cparams.kq_mask_f16) [kv_size, n_batch]
     struct ggml_tensor * inp_K_shift;     // I32 [kv_size]
+    struct ggml_tensor * inp_K_shift_swa; // I32 [kv_size]
     struct ggml_tensor * inp_mean;        // F32 [n_batch, n_batch]
     struct ggml_tensor * inp_cls;         // I32 [n_batch]
     struct ggml_tensor * inp_s_copy;      // I32 [kv_size]
@@ -3340,6 +3638,10 @@ struct llama_context {
     struct ggml_tensor * inp_pos_bucket;    // I32 [n_batch|n_kv, n_batch]
     struct ggml_tensor * inp_embd_enc;      // F32 [n_embd, n_outputs_enc]
     struct ggml_tensor * inp_KQ_mask_cross; // F32 [n_outputs_enc, n_batch]
+    struct ggml_tensor * inp_lora_ids;       // I32 [1, n_batch]
+    struct ggml_tensor * inp_lora_scale;     // F32 [1, n_batch]
+    struct ggml_tensor * inp_lora_ids_out;   // I32 [1, n_outputs]
+    struct ggml_tensor * inp_lora_scale_out; // F32 [1, n_outputs]
 };
 
 struct llama_lora_weight {
@@ -3424,13 +3726,456 @@ static ggml_backend_buffer_type_t select_buft(const llama_model::buft_list_t & b
 // kv cache helpers
 //
 
+static size_t llama_model_max_nodes(const llama_model & model);
+
+//
+// per-sequence index
+//
+// the positions and the sequences of the cells must only be changed through the
+// llama_kv_cache_cell_* helpers below, so that cache.seq_pos, the cell ranges and
+// the mask rows stay in sync
+//
+
+static void llama_kv_cache_seq_index_reset(struct llama_kv_cache & cache) {
+    for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        cache.seq_pos[s].clear();
+        cache.seq_cell_beg[s] = cache.size;
+        cache.seq_cell_end[s] = 0;
+        cache.seq_mask[s] = std::vector<ggml_fp16_t>();
+    }
+}
+
+// recompute the cell ranges and the mask rows of the sequences, after the cells have been moved
+static void llama_kv_cache_seq_index_update_cells(struct llama_kv_cache & cache) {
+    for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        cache.seq_cell_beg[s] = cache.size;
+        cache.seq_cell_end[s] = 0;
+        std::fill(cache.seq_mask[s].begin(), cache.seq_mask[s].end(), ggml_fp32_to_fp16(-INFINITY));
+    }
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        cache.cells[i].seq_id.for_each([&](llama_seq_id s) {
+            cache.seq_cell_beg[s] = std::min(cache.seq_cell_beg[s], i);
+            cache.seq_cell_end[s] = i + 1;
+            cache.seq_mask[s][i] = ggml_fp32_to_fp16(0.0f);
+        });
+    }
+}
+
+static void llama_kv_cache_seq_mask_set(struct llama_kv_cache & cache, llama_seq_id seq_id, uint32_t i) {
+    auto & row = cache.seq_mask[seq_id];
+    if (row.empty()) {
+        row.resize(cache.size, ggml_fp32_to_fp16(-INFINITY));
+    }
+    row[i] = ggml_fp32_to_fp16(0.0f);
+}
+
+static void llama_kv_cache_seq_mask_reset(struct llama_kv_cache & cache, llama_seq_id seq_id, uint32_t i) {
+    if (cache.seq_pos[seq_id].empty()) {
+        // release the row of the sequences that are gone
+        cache.seq_mask[seq_id] = std::vector<ggml_fp16_t>();
+    } else {
+        cache.seq_mask[seq_id][i] = ggml_fp32_to_fp16(-INFINITY);
+    }
+}
+
+static void llama_kv_cache_seq_index_add(struct llama_kv_cache & cache, llama_seq_id seq_id, llama_pos pos, uint32_t i) {
+    cache.seq_pos[seq_id].add(pos);
+    cache.seq_cell_beg[seq_id] = std::min(cache.seq_cell_beg[seq_id], i);
+    cache.seq_cell_end[seq_id] = std::max(cache.seq_cell_end[seq_id], i + 1);
+}
+
+static void llama_kv_cache_seq_index_rm(struct llama_kv_cache & cache, llama_seq_id seq_id, llama_pos pos) {
+    auto & seq_pos = cache.seq_pos[seq_id];
+
+    const bool found = seq_pos.rm(pos);
+    GGML_ASSERT(found && "KV cache sequence index is out of sync");
+
+    if (seq_pos.empty()) {
+        cache.seq_cell_beg[seq_id] = cache.size;
+        cache.seq_cell_end[seq_id] = 0;
+    }
+}
+
+// the range of cells [c0, c1) that contains all the cells of a sequence (can be empty)
+static void llama_kv_cache_seq_cells(const struct llama_kv_cache & cache, llama_seq_id seq_id, uint32_t & c0, uint32_t & c1) {
+    if (seq_id < 0 || seq_id >= LLAMA_MAX_SEQ) {
+        c0 = 0;
+        c1 = 0;
+    } else if (cache.recurrent) {
+        // the cells of recurrent models are swapped around without updating the ranges
+        c0 = 0;
+        c1 = cache.size;
+    } else {
+        c0 = cache.seq_cell_beg[seq_id];
+        c1 = cache.seq_cell_end[seq_id];
+    }
+}
+
+static void llama_kv_cache_cell_seq_add(struct llama_kv_cache & cache, uint32_t i, llama_seq_id seq_id) {
+    llama_kv_cell & cell = cache.cells[i];
+    if (!cell.has_seq_id(seq_id)) {
+        cell.seq_id.set(seq_id);
+        llama_kv_cache_seq_index_add(cache, seq_id, cell.pos, i);
+        llama_kv_cache_seq_mask_set (cache, seq_id, i);
+    }
+}
+
+static void llama_kv_cache_cell_seq_rm(struct llama_kv_cache & cache, uint32_t i, llama_seq_id seq_id) {
+    llama_kv_cell & cell = cache.cells[i];
+    if (cell.has_seq_id(seq_id)) {
+        cell.seq_id.reset(seq_id);
+        llama_kv_cache_seq_index_rm  (cache, seq_id, cell.pos);
+        llama_kv_cache_seq_mask_reset(cache, seq_id, i);
+    }
+}
+
+static void llama_kv_cache_cell_seq_clear(struct llama_kv_cache & cache, uint32_t i) {
+    llama_kv_cell & cell = cache.cells[i];
+    cell.seq_id.for_each([&](llama_seq_id s) {
+        llama_kv_cache_seq_index_rm  (cache, s, cell.pos);
+        llama_kv_cache_seq_mask_reset(cache, s, i);
+    });
+    cell.seq_id.clear();
+}
+
+static void llama_kv_cache_cell_pos_set(struct llama_kv_cache & cache, uint32_t i, llama_pos pos) {
+    llama_kv_cell & cell = cache.cells[i];
+    if (cell.pos == pos) {
+        return;
+    }
+    cell.seq_id.for_each([&](llama_seq_id s) {
+        llama_kv_cache_seq_index_rm (cache, s, cell.pos);
+        llama_kv_cache_seq_index_add(cache, s, pos, i);
+    });
+    cell.pos = pos;
+}
+
+// add a pending K-shift to a cell, applied by llama_kv_cache_update
+static void llama_kv_cache_cell_shift(struct llama_kv_cache & cache, uint32_t i, llama_pos delta) {
+    if (!cache.has_shift) {
+        cache.has_shift = true;
+        cache.shift_beg = i;
+        cache.shift_end = i + 1;
+    } else {
+        cache.shift_beg = std::min(cache.shift_beg, i);
+        cache.shift_end = std::max(cache.shift_end, i + 1);
+    }
+    cache.cells[i].delta += delta;
+}
+
+// returns the first free cell of block ib, or -1 if the block is full
+static int32_t llama_kv_cache_block_find_free(const struct llama_kv_cache & cache, uint32_t ib) {
+    const uint32_t c0 = ib*cache.block_size;
+    const uint32_t c1 = std::min(cache.size, c0 + cache.block_size);
+
+    for (uint32_t i = c0; i < c1; ++i) {
+        if (cache.cells[i].pos < 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static bool llama_kv_cache_block_is_free(const struct llama_kv_cache & cache, uint32_t ib) {
+    const uint32_t c0 = ib*cache.block_size;
+    const uint32_t c1 = std::min(cache.size, c0 + cache.block_size);
+
+    for (uint32_t i = c0; i < c1; ++i) {
+        if (cache.cells[i].pos >= 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// rebuild the block tables after the cells have been moved: each sequence gets the blocks that hold its cells,
+// ordered by their last position, so that its new tokens still go to the block of its latest tokens
+static void llama_kv_cache_block_table_update(struct llama_kv_cache & cache) {
+    if (cache.block_size == 0) {
+        return;
+    }
+
+    std::unordered_map<llama_seq_id, std::map<uint32_t, llama_pos>> pos_max; // block -> last position, per sequence
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        const llama_kv_cell & cell = cache.cells[i];
+        cell.seq_id.for_each([&](llama_seq_id s) {
+            if (cache.block_table.find(s) != cache.block_table.end()) {
+                llama_pos & p = pos_max[s].emplace(i/cache.block_size, cell.pos).first->second;
+                p = std::max(p, cell.pos);
+            }
+        });
+    }
+
+    for (auto & it : cache.block_table) {
+        std::vector<std::pair<llama_pos, uint32_t>> blocks;
+        for (const auto & b : pos_max[it.first]) {
+            blocks.emplace_back(b.second, b.first);
+        }
+        std::sort(blocks.begin(), blocks.end());
+
+        it.second.clear();
+        for (const auto & b : blocks) {
+            it.second.push_back(b.second);
+        }
+    }
+}
+
+// free cells and blocks that can receive the copies of llama_kv_cache_cell_unshare
+// collected once per seq_add/seq_div instead of scanning the cache for each shared cell
+// the source cells of pending copies cannot be reused before the copy, even when they are empty
+struct llama_kv_cache_cow_free {
+    bool init = false;
+
+    std::vector<uint32_t> cells;  // taken from the back, the nearest to the head first
+    std::vector<uint32_t> blocks; // only the blocks of block_size cells
+
+    std::unordered_map<uint32_t, uint32_t> moved; // cells copied with their block -> copy
+
+    void collect(const struct llama_kv_cache & cache) {
+        init = true;
+
+        for (uint32_t n = 0; n < cache.size; ++n) {
+            const uint32_t k = (cache.head + n) % cache.size;
+            if (cache.cells[k].pos < 0 && cache.cow_src.find(k) == cache.cow_src.end()) {
+                cells.push_back(k);
+            }
+        }
+        std::reverse(cells.begin(), cells.end());
+
+        if (cache.block_size > 0) {
+            const uint32_t n_blocks = cache.size/cache.block_size;
+            for (uint32_t n = 0; n < n_blocks; ++n) {
+                const uint32_t ib = (cache.head/cache.block_size + n) % n_blocks;
+                const uint32_t c0 = ib*cache.block_size;
+                const auto it = cache.cow_src.lower_bound(c0);
+                if (llama_kv_cache_block_is_free(cache, ib) && (it == cache.cow_src.end() || it->first >= c0 + cache.block_size)) {
+                    blocks.push_back(ib);
+                }
+            }
+            std::reverse(blocks.begin(), blocks.end());
+        }
+    }
+
+    // the entries are checked when they are taken, the previous copies may have used them
+    int32_t take_cell(const struct llama_kv_cache & cache) {
+        if (!init) {
+            collect(cache);
+        }
+        while (!cells.empty()) {
+            const uint32_t k = cells.back();
+            cells.pop_back();
+            if (cache.cells[k].pos < 0) {
+                return k;
+            }
+        }
+        return -1;
+    }
+
+    int32_t take_block(const struct llama_kv_cache & cache) {
+        if (!init) {
+            collect(cache);
+        }
+        while (!blocks.empty()) {
+            const uint32_t ib = blocks.back();
+            blocks.pop_back();
+            if (llama_kv_cache_block_is_free(cache, ib)) {
+                return ib;
+            }
+        }
+        return -1;
+    }
+
+    // the cell that holds the sequence now, if cell i was copied with its block
+    uint32_t find(uint32_t i) const {
+        const auto it = moved.find(i);
+        return it != moved.end() ? it->second : i;
+    }
+};
+
+// move seq_id from cell i to the free cell j, the copy of the K and V data is left to llama_kv_cache_update
+static void llama_kv_cache_cell_copy(struct llama_kv_cache & cache, uint32_t i, uint32_t j, llama_seq_id seq_id) {
+    const llama_kv_cell & cell = cache.cells[i];
+
+    // a cell that is itself a pending copy has not received its data yet - copy from its source instead
+    const auto it = cache.cow_dst.find(i);
+    const uint32_t i_src = it != cache.cow_dst.end() ? it->second : i;
+
+    // a previous copy to cell j, that was removed before being made, is replaced
+    const auto it_old = cache.cow_dst.find(j);
+    if (it_old != cache.cow_dst.end()) {
+        if (--cache.cow_src[it_old->second] == 0) {
+            cache.cow_src.erase(it_old->second);
+        }
+        cache.cow_dst.erase(it_old);
+    }
+
+    cache.cow_dst[j] = i_src;
+    cache.cow_src[i_src]++;
+
+    llama_kv_cache_cell_pos_set(cache, j, cell.pos);
+    cache.cells[j].delta = 0;
+    if (cell.delta != 0) {
+        // the pending K-shift of the source cell also applies to the copy
+        llama_kv_cache_cell_shift(cache, j, cell.delta);
+    }
+
+    llama_kv_cache_cell_seq_rm (cache, i, seq_id);
+    llama_kv_cache_cell_seq_add(cache, j, seq_id);
+    cache.used++;
+}
+
+// copy-on-write: before the position of cell i is changed for seq_id, move seq_id to a copy of the cell
+// if the cell is also used by other sequences, so that their positions are not changed
+// in paged mode, all the shared cells of seq_id in the block of cell i are copied to a free block, at the same
+// offsets, and the block is replaced in the block table of seq_id - a single cell is copied only when no block is free
+// returns the cell that now holds seq_id (i if the cell is not shared or if the cache is full)
+static uint32_t llama_kv_cache_cell_unshare(struct llama_kv_cache & cache, uint32_t i, llama_seq_id seq_id, llama_kv_cache_cow_free & cow_free) {
+    if (cache.recurrent || cache.cells[i].seq_id.size() <= 1) {
+        return i;
+    }
+
+    const int32_t ib_dst = cache.block_size > 0 ? cow_free.take_block(cache) : -1;
+
+    if (ib_dst >= 0) {
+        const uint32_t ib = i/cache.block_size;
+        const uint32_t c0 = ib*cache.block_size;
+        const uint32_t c1 = std::min(cache.size, c0 + cache.block_size);
+
+        bool keep = false; // seq_id still has cells of its own in block ib
+
+        for (uint32_t c = c0; c < c1; ++c) {
+            if (!cache.cells[c].has_seq_id(seq_id)) {
+                continue;
+            }
+            if (cache.cells[c].seq_id.size() <= 1) {
+                keep = true;
+                continue;
+            }
+            const uint32_t j = ib_dst*cache.block_size + (c - c0);
+            llama_kv_cache_cell_copy(cache, c, j, seq_id);
+            cow_free.moved[c] = j;
+        }
+
+        auto & table = cache.block_table[seq_id];
+        const auto it = std::find(table.begin(), table.end(), ib);
+        if (it == table.end()) {
+            table.push_back(ib_dst);
+        } else if (keep) {
+            table.insert(it + 1, ib_dst);
+        } else {
+            *it = ib_dst;
+        }
+
+        return cow_free.moved[i];
+    }
+
+    const int32_t j = cow_free.take_cell(cache);
+
+    if (j < 0) {
+        LLAMA_LOG_WARN("%s: no free KV cell to copy a cell shared by sequence %d, the other sequences are affected\n", __func__, seq_id);
+        return i;
+    }
+
+    llama_kv_cache_cell_copy(cache, i, j, seq_id);
+
+    return j;
+}
+
+// create the K and V tensors of each layer for kv_size cells in the buffer type of the layer and allocate them
+// the layers with n_embd_k_l[il] == 0 are skipped, their tensors are nullptr
+// replaces the tensors and the buffers of the cache
+static bool llama_kv_cache_alloc(
+             struct llama_kv_cache & cache,
+    const std::vector<ggml_backend_buffer_type_t> & buft_l,
+              const std::vector<int64_t> & n_embd_k_l,
+              const std::vector<int64_t> & n_embd_v_l,
+                          uint32_t   kv_size) {
+    const int64_t n_layer = buft_l.size();
+
+    cache.k_l.clear();
+    cache.v_l.clear();
+    cache.ctxs.clear();
+    cache.bufs.clear();
+
+    // create a context for each buffer type
+    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+    auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
+        auto it = ctx_map.find(buft);
+        if (it == ctx_map.end()) {
+            struct ggml_init_params params = {
+                /*.mem_size   =*/ size_t(2u*n_layer*ggml_tensor_overhead()),
+                /*.mem_buffer =*/ NULL,
+                /*.no_alloc   =*/ true,
+            };
+            ggml_context * ctx = ggml_init(params);
+            if (!ctx) {
+                return nullptr;
+            }
+            ctx_map[buft] = ctx;
+            cache.ctxs.emplace_back(ctx);
+            return ctx;
+        }
+        return it->second;
+    };
+
+    cache.k_l.reserve(n_layer);
+    cache.v_l.reserve(n_layer);
+
+    for (int i = 0; i < (int) n_layer; i++) {
+        if (n_embd_k_l[i] == 0) {
+            // the layer is not stored in this cache
+            cache.k_l.push_back(nullptr);
+            cache.v_l.push_back(nullptr);
+            continue;
+        }
+
+        ggml_context * ctx = ctx_for_buft(buft_l[i]);
+
+        if (!ctx) {
+            LLAMA_LOG_ERROR("%s: failed to create ggml context for kv cache\n", __func__);
+            return false;
+        }
+
+        ggml_tensor * k = ggml_new_tensor_1d(ctx, cache.type_k, n_embd_k_l[i]*kv_size);
+        ggml_tensor * v = ggml_new_tensor_1d(ctx, cache.type_v, n_embd_v_l[i]*kv_size);
+        ggml_format_name(k, "cache_k_l%d", i);
+        ggml_format_name(v, "cache_v_l%d", i);
+        cache.k_l.push_back(k);
+        cache.v_l.push_back(v);
+    }
+
+    // allocate tensors and initialize the buffers to avoid NaNs in the padding
+    for (auto it : ctx_map) {
+        auto * buft = it.first;
+        auto * ctx  = it.second;
+
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+        if (!buf) {
+            LLAMA_LOG_ERROR("%s: failed to allocate buffer for kv cache\n", __func__);
+            return false;
+        }
+        ggml_backend_buffer_clear(buf, 0);
+        cache.bufs.emplace_back(buf);
+    }
+
+    return true;
+}
+
+// layer_filter: the layers stored in the cache (default: all)
+// n_swa > 0: sliding window cache, see llama_kv_cache::n_swa
 static bool llama_kv_cache_init(
              struct llama_kv_cache & cache,
                const llama_context * ctx,
                          ggml_type   type_k,
                          ggml_type   type_v,
                           uint32_t   kv_size,
-                              bool   offload) {
+                              bool   offload,
+    const std::function<bool(int32_t)> & layer_filter = nullptr,
+                          uint32_t   n_swa = 0) {
     const llama_model & model = ctx->model;
     const llama_cparams & cparams = ctx->cparams;
 
@@ -3438,100 +4183,396 @@ static bool llama_kv_cache_init(
 
     const int64_t  n_layer = hparams.n_layer;
 
-    cache.has_shift = false;
+    cache.has_shift = false;
+
+    cache.recurrent = llama_model_is_recurrent(&model);
+    // a quantized V cannot be transposed (the blocks run along the embedding), so it is stored per token
+    // and the non-FA attention multiplies it with ggml_out_prod instead (see llm_build_kqv)
+    cache.v_trans   = !cache.recurrent && !cparams.flash_attn && !ggml_is_quantized(type_v);
+
+    cache.n_swa = n_swa;
+
+    // with lazy allocation, start with enough steps for a ubatch and grow up to kv_size (see llama_kv_cache_grow)
+    // the sliding window cache has a fixed size
+    cache.size_step = cache.recurrent || n_swa > 0 ? 0 : std::min(cparams.kv_size_step, kv_size);
+    cache.size_max  = kv_size;
+
+    cache.head = 0;
+    cache.size = cache.size_step > 0 ? std::min(kv_size, (cparams.n_ubatch + cache.size_step - 1)/cache.size_step*cache.size_step) : kv_size;
+    cache.used = 0;
+
+    cache.type_k = type_k;
+    cache.type_v = type_v;
+
+    cache.block_size = cache.recurrent || n_swa > 0 ? 0 : std::min(cparams.kv_block_size, kv_size);
+
+    // each run of a ubatch adds ~8 nodes per layer to the graph (see llm_build_kv_store)
+    // allow them to take at most half of the graph
+    cache.n_runs_max = std::max<uint32_t>(1, llama_model_max_nodes(model)/(2*8*n_layer));
+
+    cache.block_table.clear();
+    cache.runs.clear();
+
+    cache.cells.clear();
+    cache.cells.resize(cache.size);
+
+    llama_kv_cache_seq_index_reset(cache);
+
+    std::vector<ggml_backend_buffer_type_t> buft_l(n_layer);
+    std::vector<int64_t> n_embd_k_l(n_layer);
+    std::vector<int64_t> n_embd_v_l(n_layer);
+
+    for (int i = 0; i < (int) n_layer; i++) {
+        if (layer_filter && !layer_filter(i)) {
+            n_embd_k_l[i] = 0;
+            n_embd_v_l[i] = 0;
+            continue;
+        }
+
+        n_embd_k_l[i] = hparams.n_embd_k_gqa(i) + hparams.n_embd_k_s();
+        n_embd_v_l[i] = hparams.n_embd_v_gqa(i) + hparams.n_embd_v_s();
+
+        if (offload) {
+            auto * dev = model.dev_layer.at(i).dev;
+            buft_l[i] = ggml_backend_dev_buffer_type(dev);
+        } else {
+            buft_l[i] = ggml_backend_cpu_buffer_type();
+        }
+    }
+
+    if (!llama_kv_cache_alloc(cache, buft_l, n_embd_k_l, n_embd_v_l, cache.size)) {
+        return false;
+    }
+
+    for (auto & buf : cache.bufs) {
+        LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf.get()), ggml_backend_buffer_get_size(buf.get())/1024.0/1024.0);
+    }
+
+    return true;
+}
+
+// number of layers stored in the cache
+static uint32_t llama_kv_cache_n_layer(const struct llama_kv_cache & cache) {
+    uint32_t n = 0;
+    for (const auto * k : cache.k_l) {
+        n += k != nullptr;
+    }
+    return n;
+}
+
+// the buffer types and the row sizes of the layers of the cache, in the format of llama_kv_cache_alloc
+static void llama_kv_cache_get_layers(
+        const struct llama_kv_cache & cache,
+        std::vector<ggml_backend_buffer_type_t> & buft_l,
+        std::vector<int64_t> & n_embd_k_l,
+        std::vector<int64_t> & n_embd_v_l) {
+    const size_t n_layer = cache.k_l.size();
+
+    buft_l.assign(n_layer, nullptr);
+    n_embd_k_l.assign(n_layer, 0);
+    n_embd_v_l.assign(n_layer, 0);
+
+    for (size_t il = 0; il < n_layer; ++il) {
+        if (cache.k_l[il]) {
+            buft_l[il]     = ggml_backend_buffer_get_type(cache.k_l[il]->buffer);
+            n_embd_k_l[il] = cache.k_l[il]->ne[0]/cache.size;
+            n_embd_v_l[il] = cache.v_l[il]->ne[0]/cache.size;
+        }
+    }
+}
+
+// grow a lazily allocated cache by one step, keeping the contents of the cells
+// returns false if the cache cannot grow
+static bool llama_kv_cache_grow(struct llama_context & lctx) {
+    auto & cache = lctx.kv_self;
+
+    if (cache.size_step == 0 || cache.size >= cache.size_max) {
+        return false;
+    }
+
+    const uint32_t size_old = cache.size;
+    const uint32_t size_new = std::min(cache.size_max, size_old + cache.size_step);
+
+    const size_t n_layer = cache.k_l.size();
+
+    std::vector<ggml_backend_buffer_type_t> buft_l;
+    std::vector<int64_t> n_embd_k_l;
+    std::vector<int64_t> n_embd_v_l;
+    llama_kv_cache_get_layers(cache, buft_l, n_embd_k_l, n_embd_v_l);
+
+    // the previous ubatches may still be using the old buffers
+    ggml_backend_sched_synchronize(lctx.sched.get());
+
+    // keep the old tensors until their contents have been copied
+    auto k_l_old  = std::move(cache.k_l);
+    auto v_l_old  = std::move(cache.v_l);
+    auto ctxs_old = std::move(cache.ctxs);
+    auto bufs_old = std::move(cache.bufs);
+
+    if (!llama_kv_cache_alloc(cache, buft_l, n_embd_k_l, n_embd_v_l, size_new)) {
+        LLAMA_LOG_WARN("%s: failed to grow the KV cache from %u to %u cells\n", __func__, size_old, size_new);
+        cache.k_l  = std::move(k_l_old);
+        cache.v_l  = std::move(v_l_old);
+        cache.ctxs = std::move(ctxs_old);
+        cache.bufs = std::move(bufs_old);
+        cache.size_max = size_old; // do not try again
+        return false;
+    }
+
+    std::vector<uint8_t> buf;
+
+    for (size_t il = 0; il < n_layer; ++il) {
+        if (!k_l_old[il]) {
+            continue;
+        }
+
+        // the cells are the rows of K, the old cells are a prefix of the new tensor
+        const size_t k_size = ggml_nbytes(k_l_old[il]);
+        buf.resize(k_size);
+        ggml_backend_tensor_get(k_l_old[il], buf.data(), 0, k_size);
+        ggml_backend_tensor_set(cache.k_l[il], buf.data(), 0, k_size);
+
+        const size_t v_size = ggml_nbytes(v_l_old[il]);
+        buf.resize(v_size);
+        ggml_backend_tensor_get(v_l_old[il], buf.data(), 0, v_size);
+
+        if (!cache.v_trans) {
+            ggml_backend_tensor_set(cache.v_l[il], buf.data(), 0, v_size);
+        } else {
+            // the cells are the columns of the transposed V, move each row to the new stride
+            const size_t v_size_el = ggml_type_size(cache.v_l[il]->type);
+            for (int64_t j = 0; j < n_embd_v_l[il]; ++j) {
+                ggml_backend_tensor_set(cache.v_l[il], buf.data() + j*size_old*v_size_el, j*size_new*v_size_el, size_old*v_size_el);
+            }
+        }
+    }
+
+    cache.size = size_new;
+    cache.cells.resize(size_new);
+
+    for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        if (cache.seq_pos[s].empty()) {
+            cache.seq_cell_beg[s] = size_new;
+        } else {
+            cache.seq_mask[s].resize(size_new, ggml_fp32_to_fp16(-INFINITY));
+        }
+    }
+
+    LLAMA_LOG_INFO("%s: KV cache grown from %u to %u cells, %.2f MiB\n", __func__, size_old, size_new, cache.total_size()/1024.0/1024.0);
+
+    return true;
+}
+
+// release the memory of an empty lazily allocated cache, down to its initial size
+static void llama_kv_cache_shrink(struct llama_context & lctx) {
+    auto & cache = lctx.kv_self;
+
+    if (cache.size_step == 0 || cache.used > 0) {
+        return;
+    }
+
+    // same as the initial size, see llama_kv_cache_init
+    const uint32_t size_min = std::min(cache.size_max, (lctx.cparams.n_ubatch + cache.size_step - 1)/cache.size_step*cache.size_step);
+
+    if (cache.size <= size_min) {
+        return;
+    }
+
+    std::vector<ggml_backend_buffer_type_t> buft_l;
+    std::vector<int64_t> n_embd_k_l;
+    std::vector<int64_t> n_embd_v_l;
+    llama_kv_cache_get_layers(cache, buft_l, n_embd_k_l, n_embd_v_l);
+
+    ggml_backend_sched_synchronize(lctx.sched.get());
+
+    // keep the old buffers in case the new ones cannot be allocated
+    auto k_l_old  = std::move(cache.k_l);
+    auto v_l_old  = std::move(cache.v_l);
+    auto ctxs_old = std::move(cache.ctxs);
+    auto bufs_old = std::move(cache.bufs);
+
+    if (!llama_kv_cache_alloc(cache, buft_l, n_embd_k_l, n_embd_v_l, size_min)) {
+        LLAMA_LOG_ERROR("%s: failed to shrink the KV cache from %u to %u cells, keeping the current buffers\n", __func__, cache.size, size_min);
+        cache.k_l  = std::move(k_l_old);
+        cache.v_l  = std::move(v_l_old);
+        cache.ctxs = std::move(ctxs_old);
+        cache.bufs = std::move(bufs_old);
+        return;
+    }
+
+    cache.head = 0;
+    cache.size = size_min;
+
+    cache.has_shift = false;
+
+    cache.block_table.clear();
+
+    cache.cow_dst.clear();
+    cache.cow_src.clear();
+
+    cache.cells.clear();
+    cache.cells.resize(cache.size);
+
+    llama_kv_cache_seq_index_reset(cache);
+}
+
+// a structure holds information about the slot found in llama_kv_cache_find_slot
+struct llama_kv_cache_slot_info {
+    std::vector<std::pair<uint32_t, uint32_t>> boundaries; // cell ranges of the slot [begin, end)
+    bool found = false;                                    // the slot was found
+
+    explicit llama_kv_cache_slot_info(bool found_) : found{found_} {}
+    llama_kv_cache_slot_info(uint32_t begin, uint32_t end) : boundaries{{begin, end}}, found{true} {}
+    explicit llama_kv_cache_slot_info(const std::vector<llama_kv_cache_run> & runs) : found{true} {
+        for (const auto & run : runs) {
+            boundaries.emplace_back(run.i_cell, run.i_cell + run.n);
+        }
+    }
+
+    operator bool() const { return found; }
+};
+static const llama_kv_cache_slot_info llama_kv_cache_slot_info_failed{false};
+
+// empty a range of cells, ignoring the sequences they belong to
+static void llama_kv_cache_clear_cells(struct llama_kv_cache & cache, uint32_t c0, uint32_t c1) {
+    for (uint32_t i = c0; i < c1; ++i) {
+        llama_kv_cell & cell = cache.cells[i];
+        if (cell.pos >= 0) {
+            cache.used--;
+        }
+        llama_kv_cache_cell_seq_clear(cache, i);
+        cell.pos = -1;
+        cell.src = -1;
+    }
+}
+
+// paged version of llama_kv_cache_find_slot
+// each token goes to the last block of its sequence if it has room, otherwise to a free block
+// as a last resort, any free cell is used, so a slot can be found as long as enough cells are free
+static struct llama_kv_cache_slot_info llama_kv_cache_find_slot_paged(
+           struct llama_kv_cache & cache,
+       const struct llama_ubatch & batch) {
+    const uint32_t n_tokens     = batch.n_tokens;
+    const uint32_t n_seqs       = batch.n_seqs;
+    const uint32_t n_seq_tokens = batch.n_seq_tokens;
+
+    const uint32_t n_blocks = (cache.size + cache.block_size - 1)/cache.block_size;
+
+    cache.runs.clear();
+
+    if (n_tokens == 0) {
+        return llama_kv_cache_slot_info(cache.head, cache.head);
+    }
+
+    if (cache.used + n_tokens > cache.size) {
+        return llama_kv_cache_slot_info_failed;
+    }
+
+    uint32_t ib_next  = (cache.head/cache.block_size) % n_blocks; // where to look for the next free block
+    uint32_t ic_next  = cache.head;                               // where to look for the next free cell
+    bool     has_free = true;                                     // are there free blocks left?
+
+    std::vector<uint32_t> n_pushed(n_seqs, 0); // blocks added to each block table, undone on failure
+
+    for (uint32_t s = 0; s < n_seqs; s++) {
+        auto & table = cache.block_table[batch.seq_id[s][0]];
 
-    cache.recurrent = llama_model_is_recurrent(&model);
-    cache.v_trans   = !cache.recurrent && !cparams.flash_attn;
+        for (uint32_t i = 0; i < n_seq_tokens; ++i) {
+            const uint32_t k = s*n_seq_tokens + i;
 
-    cache.head = 0;
-    cache.size = kv_size;
-    cache.used = 0;
+            int32_t ic = table.empty() ? -1 : llama_kv_cache_block_find_free(cache, table.back());
 
-    cache.type_k = type_k;
-    cache.type_v = type_v;
+            if (ic < 0 && table.size() >= n_blocks) {
+                // drop the blocks that no longer hold this sequence
+                const llama_seq_id seq_id = batch.seq_id[s][0];
 
-    cache.cells.clear();
-    cache.cells.resize(kv_size);
+                uint32_t s0;
+                uint32_t s1;
+                llama_kv_cache_seq_cells(cache, seq_id, s0, s1);
 
-    // create a context for each buffer type
-    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
-    auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
-        auto it = ctx_map.find(buft);
-        if (it == ctx_map.end()) {
-            struct ggml_init_params params = {
-                /*.mem_size   =*/ size_t(2u*n_layer*ggml_tensor_overhead()),
-                /*.mem_buffer =*/ NULL,
-                /*.no_alloc   =*/ true,
-            };
-            ggml_context * ctx = ggml_init(params);
-            if (!ctx) {
-                return nullptr;
+                table.erase(std::remove_if(table.begin(), table.end(), [&](uint32_t ib) {
+                    const uint32_t c1 = std::min(s1, (ib + 1)*cache.block_size);
+                    for (uint32_t c = std::max(s0, ib*cache.block_size); c < c1; ++c) {
+                        if (cache.cells[c].has_seq_id(seq_id)) {
+                            return false;
+                        }
+                    }
+                    return true;
+                }), table.end());
+            }
+
+            if (ic < 0 && has_free) {
+                has_free = false;
+                for (uint32_t j = 0; j < n_blocks; ++j) {
+                    const uint32_t ib = (ib_next + j) % n_blocks;
+                    if (llama_kv_cache_block_is_free(cache, ib)) {
+                        table.push_back(ib);
+                        n_pushed[s]++;
+                        ic       = ib*cache.block_size;
+                        ib_next  = (ib + 1) % n_blocks;
+                        has_free = true;
+                        break;
+                    }
+                }
             }
-            ctx_map[buft] = ctx;
-            cache.ctxs.emplace_back(ctx);
-            return ctx;
-        }
-        return it->second;
-    };
 
-    cache.k_l.reserve(n_layer);
-    cache.v_l.reserve(n_layer);
+            if (ic < 0) {
+                for (uint32_t j = 0; j < cache.size; ++j) {
+                    const uint32_t jc = (ic_next + j) % cache.size;
+                    if (cache.cells[jc].pos < 0) {
+                        ic = jc;
+                        break;
+                    }
+                }
+                GGML_ASSERT(ic >= 0 && "KV cache used cell count is wrong");
 
-    for (int i = 0; i < (int) n_layer; i++) {
-        const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(i) + hparams.n_embd_k_s();
-        const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(i) + hparams.n_embd_v_s();
+                ic_next = ic + 1;
+                table.push_back(ic/cache.block_size);
+                n_pushed[s]++;
+            }
 
-        ggml_backend_buffer_type_t buft;
-        if (offload) {
-            auto * dev = model.dev_layer.at(i).dev;
-            buft = ggml_backend_dev_buffer_type(dev);
-        } else {
-            buft = ggml_backend_cpu_buffer_type();
-        }
-        ggml_context * ctx = ctx_for_buft(buft);
+            llama_kv_cache_cell_pos_set(cache, ic, batch.pos[k]);
+            for (int32_t j = 0; j < batch.n_seq_id[s]; j++) {
+                llama_kv_cache_cell_seq_add(cache, ic, batch.seq_id[s][j]);
+            }
+            cache.used++;
 
-        if (!ctx) {
-            LLAMA_LOG_ERROR("%s: failed to create ggml context for kv cache\n", __func__);
-            return false;
+            if (!cache.runs.empty() && cache.runs.back().i_cell + cache.runs.back().n == (uint32_t) ic) {
+                cache.runs.back().n++;
+            } else {
+                cache.runs.push_back({ k, (uint32_t) ic, 1 });
+            }
         }
-
-        ggml_tensor * k = ggml_new_tensor_1d(ctx, type_k, n_embd_k_gqa*kv_size);
-        ggml_tensor * v = ggml_new_tensor_1d(ctx, type_v, n_embd_v_gqa*kv_size);
-        ggml_format_name(k, "cache_k_l%d", i);
-        ggml_format_name(v, "cache_v_l%d", i);
-        cache.k_l.push_back(k);
-        cache.v_l.push_back(v);
     }
 
-    // allocate tensors and initialize the buffers to avoid NaNs in the padding
-    for (auto it : ctx_map) {
-        auto * buft = it.first;
-        auto * ctx  = it.second;
+    if (cache.runs.size() > cache.n_runs_max) {
+        // too scattered to be stored in a single graph - the caller should retry with a smaller batch
+        for (const auto & run : cache.runs) {
+            llama_kv_cache_clear_cells(cache, run.i_cell, run.i_cell + run.n);
+        }
+        cache.runs.clear();
 
-        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
-        if (!buf) {
-            LLAMA_LOG_ERROR("%s: failed to allocate buffer for kv cache\n", __func__);
-            return false;
+        // the blocks added above hold cells of their sequence, so the pruning never removed them
+        // and they are still the last entries of the tables
+        for (uint32_t s = 0; s < n_seqs; s++) {
+            auto & table = cache.block_table[batch.seq_id[s][0]];
+            table.resize(table.size() - n_pushed[s]);
         }
-        ggml_backend_buffer_clear(buf, 0);
-        LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1024.0/1024.0);
-        cache.bufs.emplace_back(buf);
+
+        return llama_kv_cache_slot_info_failed;
     }
 
-    return true;
-}
+    cache.head = cache.runs[0].i_cell;
 
-// a structure holds information about the slot found in llama_kv_cache_find_slot
-struct llama_kv_cache_slot_info {
-    std::pair<uint32_t, uint32_t> boundaries; // slot boundaries [begin, end)
-    bool found = false;                       // the slot was found
+    llama_kv_cache_slot_info res(cache.runs);
 
-    explicit llama_kv_cache_slot_info(bool found_) : found{found_} {}
-    llama_kv_cache_slot_info(uint32_t begin, uint32_t end) : boundaries{begin, end}, found{true} {}
+    if (cache.runs.size() == 1) {
+        // contiguous - nothing special to do when storing the ubatch
+        cache.runs.clear();
+    }
 
-    operator bool() const { return found; }
-};
-static const llama_kv_cache_slot_info llama_kv_cache_slot_info_failed{false};
+    return res;
+}
 
 // find an empty slot of size "n_tokens" in the cache
 // updates the cache head
@@ -3574,7 +4615,7 @@ static struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
                         llama_kv_cell & cell = cache.cells[seq.tail];
                         // clear cells from seq_ids that become shared
                         // (should not normally happen, but let's handle it anyway)
-                        cell.seq_id.erase(seq_id);
+                        llama_kv_cache_cell_seq_rm(cache, seq.tail, seq_id);
                         seq.tail = -1;
                         if (cell.seq_id.empty()) {
                             cell.pos = -1;
@@ -3592,12 +4633,12 @@ static struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
             tails_verif.assign(cache.size, -1);
             for (uint32_t i = 0; i < cache.size; ++i) {
                 llama_kv_cell & cell = cache.cells[i];
-                for (llama_seq_id seq_id : cell.seq_id) {
+                cell.seq_id.for_each([&](llama_seq_id seq_id) {
                     if (tails_verif[seq_id] != -1) {
                         LLAMA_LOG_ERROR("%s: duplicate tail for seq_id %d in cell %d and %d\n", __func__, seq_id, i, tails_verif[seq_id]);
                     }
                     tails_verif[seq_id] = i;
-                }
+                });
             }
             for (uint32_t i = 0; i < cache.size; ++i) {
                 if (tails_verif[i] != cache.cells[i].tail) {
@@ -3634,10 +4675,10 @@ static struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
                 // copy old tail into the empty cell
                 if (seq_meta.tail >= 0) {
                     llama_kv_cell & orig_cell = cache.cells[seq_meta.tail];
-                    empty_cell.pos = orig_cell.pos;
+                    llama_kv_cache_cell_pos_set(cache, next_empty_cell, orig_cell.pos);
                     empty_cell.src = orig_cell.src;
-                    orig_cell.seq_id.erase(seq_id);
-                    empty_cell.seq_id.insert(seq_id); // will be overwritten
+                    llama_kv_cache_cell_seq_rm (cache, seq_meta.tail, seq_id);
+                    llama_kv_cache_cell_seq_add(cache, next_empty_cell, seq_id); // will be overwritten
                 }
                 seq_meta.tail = next_empty_cell;
                 // find next empty cell
@@ -3668,12 +4709,12 @@ static struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
                 std::swap(dst_cell.seq_id, src_cell.seq_id);
 
                 // swap tails (assuming they NEVER overlap)
-                for (const llama_seq_id seq_id : src_cell.seq_id) {
+                src_cell.seq_id.for_each([&](llama_seq_id seq_id) {
                     cache.cells[seq_id].tail = src_id;
-                }
-                for (const llama_seq_id seq_id : dst_cell.seq_id) {
+                });
+                dst_cell.seq_id.for_each([&](llama_seq_id seq_id) {
                     cache.cells[seq_id].tail = dst_id;
-                }
+                });
             }
         }
 
@@ -3689,11 +4730,11 @@ static struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
                 LLAMA_LOG_WARN("%s: non-consecutive token position %d after %d for sequence %d with %u new tokens\n",
                     __func__, last_pos, cell.pos, batch.seq_id[s][0], n_seq_tokens);
             }
+            llama_kv_cache_cell_seq_clear(cache, cell_id);
             cell.pos = last_pos;
-            cell.seq_id.clear();
             for (int32_t j = 0; j < batch.n_seq_id[s]; ++j) {
                 const llama_seq_id seq_id = batch.seq_id[s][j];
-                cell.seq_id.insert(seq_id);
+                llama_kv_cache_cell_seq_add(cache, cell_id, seq_id);
                 cache.cells[seq_id].tail = cell_id;
             }
         }
@@ -3714,6 +4755,10 @@ static struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
         return llama_kv_cache_slot_info_failed;
     }
 
+    if (cache.block_size > 0) {
+        return llama_kv_cache_find_slot_paged(cache, batch);
+    }
+
     uint32_t n_tested = 0;
 
     while (true) {
@@ -3746,10 +4791,10 @@ static struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
     for (uint32_t s = 0; s < n_seqs; s++) {
         for (uint32_t i = 0; i < n_seq_tokens; ++i) {
             uint32_t k = s*n_seq_tokens + i;
-            cache.cells[cache.head + k].pos = batch.pos[k];
+            llama_kv_cache_cell_pos_set(cache, cache.head + k, batch.pos[k]);
 
             for (int32_t j = 0; j < batch.n_seq_id[s]; j++) {
-                cache.cells[cache.head + k].seq_id.insert(batch.seq_id[s][j]);
+                llama_kv_cache_cell_seq_add(cache, cache.head + k, batch.seq_id[s][j]);
             }
         }
     }
@@ -3759,6 +4804,25 @@ static struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
     return llama_kv_cache_slot_info(cache.head, cache.head + n_tokens);
 }
 
+// find a slot for the ubatch, growing a lazily allocated cache when it does not fit
+static struct llama_kv_cache_slot_info llama_kv_cache_find_slot_grow(
+           struct llama_context & lctx,
+       const struct llama_ubatch & batch) {
+    auto & cache = lctx.kv_self;
+
+    // make room for the tokens first, llama_kv_cache_find_slot reports a ubatch larger than the cache as an error
+    while (cache.used + batch.n_tokens > cache.size && llama_kv_cache_grow(lctx)) {}
+
+    auto slot = llama_kv_cache_find_slot(cache, batch);
+
+    // the free cells can be too fragmented for the ubatch
+    while (!slot && llama_kv_cache_grow(lctx)) {
+        slot = llama_kv_cache_find_slot(cache, batch);
+    }
+
+    return slot;
+}
+
 // find how many cells are currently in use
 static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
     for (uint32_t i = cache.size; i > 0; --i) {
@@ -3782,6 +4846,13 @@ static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     cache.head = 0;
     cache.used = 0;
 
+    llama_kv_cache_seq_index_reset(cache);
+
+    cache.block_table.clear();
+
+    cache.cow_dst.clear();
+    cache.cow_src.clear();
+
     for (auto & buf : cache.bufs) {
         ggml_backend_buffer_clear(buf.get(), 0);
     }
@@ -3824,12 +4895,28 @@ static bool llama_kv_cache_seq_rm(
         }
     }
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
+    uint32_t c0 = 0;
+    uint32_t c1 = cache.size;
+
+    if (seq_id >= 0) {
+        llama_kv_cache_seq_cells(cache, seq_id, c0, c1);
+
+        // nothing to remove
+        if (c0 < c1) {
+            const auto & seq_pos = cache.seq_pos[seq_id];
+            const auto it = seq_pos.lower_bound(p0);
+            if (it == seq_pos.end() || it->first >= p1) {
+                c1 = c0;
+            }
+        }
+    }
+
+    for (uint32_t i = c0; i < c1; ++i) {
         if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
+                llama_kv_cache_cell_seq_clear(cache, i);
             } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
+                llama_kv_cache_cell_seq_rm(cache, i, seq_id);
             } else {
                 continue;
             }
@@ -3844,6 +4931,14 @@ static bool llama_kv_cache_seq_rm(
         }
     }
 
+    if (p0 == 0 && p1 == std::numeric_limits<llama_pos>::max()) {
+        if (seq_id < 0) {
+            cache.block_table.clear();
+        } else {
+            cache.block_table.erase(seq_id);
+        }
+    }
+
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
 
@@ -3867,7 +4962,7 @@ static void llama_kv_cache_seq_cp(
                 // clear destination seq_id if it wasn't empty
                 llama_kv_cell & cell_dst = cache.cells[tail_dst.tail];
 
-                cell_dst.seq_id.erase(seq_id_dst);
+                llama_kv_cache_cell_seq_rm(cache, tail_dst.tail, seq_id_dst);
                 tail_dst.tail = -1;
                 if (cell_dst.seq_id.empty()) {
                     cell_dst.pos = -1;
@@ -3877,9 +4972,7 @@ static void llama_kv_cache_seq_cp(
                 }
             }
             if (tail_src.tail >= 0) {
-                llama_kv_cell & cell_src = cache.cells[tail_src.tail];
-
-                cell_src.seq_id.insert(seq_id_dst);
+                llama_kv_cache_cell_seq_add(cache, tail_src.tail, seq_id_dst);
                 tail_dst.tail = tail_src.tail;
             }
         }
@@ -3890,13 +4983,39 @@ static void llama_kv_cache_seq_cp(
 
     cache.head = 0;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
+    if (seq_id_dst < 0 || seq_id_dst >= LLAMA_MAX_SEQ) {
+        return;
+    }
+
+    uint32_t c0;
+    uint32_t c1;
+    llama_kv_cache_seq_cells(cache, seq_id_src, c0, c1);
+
+    for (uint32_t i = c0; i < c1; ++i) {
         if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+            llama_kv_cache_cell_seq_add(cache, i, seq_id_dst);
         }
     }
 }
 
+// replace the cells of seq_id_dst with the cells of seq_id_src in [p0, p1)
+// the cells are shared until one of the sequences changes their position (see llama_kv_cache_cell_unshare)
+// in paged mode, the forked sequence starts with the block table of the source sequence
+static void llama_kv_cache_seq_fork(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id_src,
+                 llama_seq_id   seq_id_dst,
+                    llama_pos   p0,
+                    llama_pos   p1) {
+    llama_kv_cache_seq_rm(cache, seq_id_dst, -1, -1);
+    llama_kv_cache_seq_cp(cache, seq_id_src, seq_id_dst, p0, p1);
+
+    const auto it = cache.block_table.find(seq_id_src);
+    if (cache.block_size > 0 && it != cache.block_table.end()) {
+        cache.block_table[seq_id_dst] = it->second;
+    }
+}
+
 static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
     uint32_t new_head = cache.size;
 
@@ -3906,16 +5025,20 @@ static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id
         }
         if (!cache.cells[i].has_seq_id(seq_id)) {
             if (cache.cells[i].pos >= 0) cache.used--;
+            llama_kv_cache_cell_seq_clear(cache, i);
             cache.cells[i].pos = -1;
             cache.cells[i].src = -1;
-            cache.cells[i].seq_id.clear();
             if (new_head == cache.size) new_head = i;
         } else {
-            cache.cells[i].seq_id.clear();
-            cache.cells[i].seq_id.insert(seq_id);
+            llama_kv_cache_cell_seq_clear(cache, i);
+            llama_kv_cache_cell_seq_add(cache, i, seq_id);
         }
     }
 
+    for (auto it = cache.block_table.begin(); it != cache.block_table.end();) {
+        it = it->first == seq_id ? std::next(it) : cache.block_table.erase(it);
+    }
+
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
 }
@@ -3940,29 +5063,45 @@ static void llama_kv_cache_seq_add(
             if (tail_id >= 0) {
                 llama_kv_cell & cell = cache.cells[tail_id];
                 if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
-                    cell.pos += delta;
+                    llama_kv_cache_cell_pos_set(cache, tail_id, cell.pos + delta);
                 }
             }
         }
         return;
     }
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
+    uint32_t c0;
+    uint32_t c1;
+    llama_kv_cache_seq_cells(cache, seq_id, c0, c1);
+
+    // collect the cells first, the copies of the shared cells can be anywhere in the cache
+    std::vector<uint32_t> ids;
+    for (uint32_t i = c0; i < c1; ++i) {
         if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.has_shift = true;
-            cache.cells[i].pos   += delta;
-            cache.cells[i].delta += delta;
+            ids.push_back(i);
+        }
+    }
 
-            if (cache.cells[i].pos < 0) {
-                if (!cache.cells[i].is_empty()) {
-                    cache.used--;
-                }
-                cache.cells[i].pos = -1;
-                cache.cells[i].seq_id.clear();
-                if (new_head == cache.size) {
-                    new_head = i;
-                }
+    llama_kv_cache_cow_free cow_free;
+
+    for (uint32_t i : ids) {
+        i = cow_free.find(i);
+        if (cache.cells[i].pos + delta < 0) {
+            if (cache.cells[i].seq_id.size() > 1) {
+                // the other sequences keep the cell
+                llama_kv_cache_cell_seq_rm(cache, i, seq_id);
+                continue;
             }
+            cache.used--;
+            llama_kv_cache_cell_seq_clear(cache, i);
+            cache.cells[i].pos = -1;
+            if (new_head == cache.size) {
+                new_head = i;
+            }
+        } else {
+            i = llama_kv_cache_cell_unshare(cache, i, seq_id, cow_free);
+            llama_kv_cache_cell_shift(cache, i, delta);
+            llama_kv_cache_cell_pos_set(cache, i, cache.cells[i].pos + delta);
         }
     }
 
@@ -3989,36 +5128,65 @@ static void llama_kv_cache_seq_div(
             if (tail_id >= 0) {
                 llama_kv_cell & cell = cache.cells[tail_id];
                 if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
-                    cell.pos /= d;
+                    llama_kv_cache_cell_pos_set(cache, tail_id, cell.pos / d);
                 }
             }
         }
         return;
     }
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.has_shift = true;
+    uint32_t c0;
+    uint32_t c1;
+    llama_kv_cache_seq_cells(cache, seq_id, c0, c1);
 
-            {
-                llama_pos p_old = cache.cells[i].pos;
-                cache.cells[i].pos   /= d;
-                cache.cells[i].delta += cache.cells[i].pos - p_old;
-            }
+    std::vector<uint32_t> ids;
+    for (uint32_t i = c0; i < c1; ++i) {
+        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+            ids.push_back(i);
         }
     }
+
+    llama_kv_cache_cow_free cow_free;
+
+    for (uint32_t i : ids) {
+        i = llama_kv_cache_cell_unshare(cache, cow_free.find(i), seq_id, cow_free);
+
+        const llama_pos p_old = cache.cells[i].pos;
+        llama_kv_cache_cell_pos_set(cache, i, p_old / d);
+        llama_kv_cache_cell_shift(cache, i, cache.cells[i].pos - p_old);
+    }
 }
 
 static llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama_seq_id seq_id) {
-    llama_pos result = 0;
+    if (seq_id < 0 || seq_id >= LLAMA_MAX_SEQ || cache.seq_pos[seq_id].empty()) {
+        return 0;
+    }
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id)) {
-            result = std::max(result, cache.cells[i].pos);
-        }
+    return std::max(0, cache.seq_pos[seq_id].max());
+}
+
+// returns -1 if the sequence has no cells
+static llama_pos llama_kv_cache_seq_pos_min(const struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    if (seq_id < 0 || seq_id >= LLAMA_MAX_SEQ || cache.seq_pos[seq_id].empty()) {
+        return -1;
     }
 
-    return result;
+    return cache.seq_pos[seq_id].min();
+}
+
+// remove the cells of a sequence that are out of the sliding window of a token at position pos
+// the tokens of the sequence at pos or later do not attend them (see the SWA mask in llama_set_inputs)
+static void llama_kv_cache_swa_evict(struct llama_kv_cache & cache, llama_seq_id seq_id, llama_pos pos) {
+    if (cache.n_swa == 0 || pos < (llama_pos) cache.n_swa) {
+        return;
+    }
+
+    const llama_pos p1 = pos - cache.n_swa + 1;
+    const llama_pos p_min = llama_kv_cache_seq_pos_min(cache, seq_id);
+
+    if (p_min >= 0 && p_min < p1) {
+        llama_kv_cache_seq_rm(cache, seq_id, -1, p1);
+    }
 }
 
 static void llama_kv_cache_defrag(struct llama_kv_cache & cache) {
@@ -4055,8 +5223,10 @@ struct llama_kv_slot_restorer {
     void save(const struct llama_kv_cache_slot_info & slot) {
         if (slot) {
             do_restore = true;
-            if (slot.boundaries.first != slot.boundaries.second) {
-                slot_boundaries.push_back(slot.boundaries);
+            for (const auto & boundaries : slot.boundaries) {
+                if (boundaries.first != boundaries.second) {
+                    slot_boundaries.push_back(boundaries);
+                }
             }
         }
     }
@@ -4070,6 +5240,11 @@ struct llama_kv_slot_restorer {
 
             if (cache.recurrent) { // recurrent models like Mamba or RWKV can't have a state partially erased
                 llama_kv_cache_seq_rm(cache, -1, -1, -1);
+            } else if (cache.block_size > 0) {
+                // paged slots are not contiguous - release the exact cells that were taken
+                for (auto & slot : slot_boundaries) {
+                    llama_kv_cache_clear_cells(cache, slot.first, slot.second);
+                }
             } else {
                 for (auto & slot : slot_boundaries) {
                     llama_kv_cache_seq_rm(cache, -1, slot.first, slot.second);
@@ -5178,12 +6353,8 @@ struct llama_batch_allocr {
         GGML_ASSERT(batch.n_tokens > 0);
         if (!batch.pos) {
             // determine the last position in KV cache
-            llama_pos last_pos = -1;
-            for (const auto & cell : ctx.kv_self.cells) {
-                if (cell.has_seq_id(batch_default_seq_id)) {
-                    last_pos = std::max(last_pos, cell.pos);
-                }
-            }
+            const auto & seq_pos = ctx.kv_self.seq_pos[batch_default_seq_id];
+            llama_pos last_pos = seq_pos.empty() ? -1 : seq_pos.max();
             last_pos++; // next position
             pos.resize(batch.n_tokens);
             for (int32_t i = 0; i < batch.n_tokens; i++) {
@@ -5421,6 +6592,7 @@ static void llm_load_hparams(
     std::fill(hparams.n_head_arr.begin(),    hparams.n_head_arr.end(),    0);
     std::fill(hparams.n_head_kv_arr.begin(), hparams.n_head_kv_arr.end(), 0);
     std::fill(hparams.n_ff_arr.begin(),      hparams.n_ff_arr.end(),      0);
+    std::fill(hparams.swa_layers.begin(),    hparams.swa_layers.end(),    false);
 
     ml.get_key_or_arr(LLM_KV_FEED_FORWARD_LENGTH,  hparams.n_ff_arr,   hparams.n_layer);
     ml.get_key_or_arr(LLM_KV_ATTENTION_HEAD_COUNT, hparams.n_head_arr, hparams.n_layer);
@@ -5741,6 +6913,9 @@ static void llm_load_hparams(
                 if (!found_swa && hparams.n_swa == 0) {
                     throw std::runtime_error("invalid value for sliding_window");
                 }
+
+                // all layers use SWA
+                std::fill(hparams.swa_layers.begin(), hparams.swa_layers.begin() + hparams.n_layer, true);
             } break;
         case LLM_ARCH_PLAMO:
             {
@@ -5802,6 +6977,11 @@ static void llm_load_hparams(
             {
                 hparams.n_swa = 4096; // default value of gemma 2
                 ml.get_key(LLM_KV_ATTENTION_SLIDING_WINDOW, hparams.n_swa, false);
+
+                // (il % 2) layers use SWA
+                for (uint32_t il = 0; il < hparams.n_layer; il += 2) {
+                    hparams.swa_layers[il] = true;
+                }
                 ml.get_key(LLM_KV_ATTENTION_LAYERNORM_RMS_EPS, hparams.f_norm_rms_eps);
                 ml.get_key(LLM_KV_ATTN_LOGIT_SOFTCAPPING, hparams.f_attn_logit_softcapping, false);
                 ml.get_key(LLM_KV_FINAL_LOGIT_SOFTCAPPING, hparams.f_final_logit_softcapping, false);
@@ -9416,12 +10596,50 @@ static void llm_build_kv_store(
                     int32_t   kv_head,
          const llm_build_cb & cb,
                     int64_t   il) {
-    const int64_t n_ctx = cparams.n_ctx;
+    // the cache can be smaller than n_ctx when it is grown on demand (see llama_kv_cache_grow)
+    const int64_t kv_size = kv.size;
 
     const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
     const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
-    GGML_ASSERT(kv.size == n_ctx);
+    if (kv.runs.size() > 1) {
+        // paged KV cache: the ubatch is split over several runs of cells
+        if (!ggml_is_contiguous(k_cur)) {
+            k_cur = ggml_cont(ctx, k_cur);
+        }
+        k_cur = ggml_reshape_2d(ctx, k_cur, n_embd_k_gqa, n_tokens);
+
+        if (v_cur->ne[0] != n_embd_v_gqa) {
+            v_cur = ggml_reshape_2d(ctx, ggml_cont(ctx, v_cur), n_embd_v_gqa, n_tokens);
+        }
+
+        for (const auto & run : kv.runs) {
+            struct ggml_tensor * k_run = ggml_view_2d(ctx, k_cur, n_embd_k_gqa, run.n, k_cur->nb[1], run.i_token*k_cur->nb[1]);
+            struct ggml_tensor * v_run = ggml_view_2d(ctx, v_cur, n_embd_v_gqa, run.n, v_cur->nb[1], run.i_token*v_cur->nb[1]);
+
+            struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], run.n*n_embd_k_gqa, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*run.i_cell);
+            cb(k_cache_view, "k_cache_view", il);
+
+            ggml_build_forward_expand(graph, ggml_cpy(ctx, k_run, k_cache_view));
+
+            struct ggml_tensor * v_cache_view = nullptr;
+
+            if (!kv.v_trans) {
+                v_cache_view = ggml_view_1d(ctx, kv.v_l[il], run.n*n_embd_v_gqa, ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa)*run.i_cell);
+            } else {
+                v_cache_view = ggml_view_2d(ctx, kv.v_l[il], run.n, n_embd_v_gqa,
+                        (   kv_size)*ggml_element_size(kv.v_l[il]),
+                        (run.i_cell)*ggml_element_size(kv.v_l[il]));
+
+                v_run = ggml_transpose(ctx, v_run);
+            }
+            cb(v_cache_view, "v_cache_view", il);
+
+            ggml_build_forward_expand(graph, ggml_cpy(ctx, v_run, v_cache_view));
+        }
+
+        return;
+    }
 
     struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*kv_head);
     cb(k_cache_view, "k_cache_view", il);
@@ -9433,12 +10651,12 @@ static void llm_build_kv_store(
 
     struct ggml_tensor * v_cache_view = nullptr;
 
-    if (cparams.flash_attn) {
+    if (!kv.v_trans) {
         v_cache_view = ggml_view_1d(ctx, kv.v_l[il], n_tokens*n_embd_v_gqa, ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa)*kv_head);
     } else {
-        // note: the V cache is transposed when not using flash attention
+        // note: the V cache is transposed when not using flash attention, unless it is quantized
         v_cache_view = ggml_view_2d(ctx, kv.v_l[il], n_tokens, n_embd_v_gqa,
-                (  n_ctx)*ggml_element_size(kv.v_l[il]),
+                (kv_size)*ggml_element_size(kv.v_l[il]),
                 (kv_head)*ggml_element_size(kv.v_l[il]));
 
         v_cur = ggml_transpose(ctx, v_cur);
@@ -9470,6 +10688,42 @@ static struct ggml_tensor * llm_build_lora_mm(
         ab_cur = ggml_scale(ctx0, ab_cur, scale);
         res = ggml_add(ctx0, res, ab_cur);
     }
+
+    // per-sequence adapters: a grouped matmul of each row with the adapter of its sequence
+    const llama_lora_seq::stack * stack = lctx.lora_seq.stack_for(w);
+    if (stack != nullptr && cur->ne[2] == 1 && cur->ne[3] == 1) {
+        const int64_t n_rows = cur->ne[1];
+
+        // the rows are either all the tokens of the ubatch, or only its outputs after the last layer
+        struct ggml_tensor ** ids   = nullptr;
+        struct ggml_tensor ** scale = nullptr;
+        if (n_rows == lctx.lora_seq.n_tokens) {
+            ids   = &lctx.inp_lora_ids;
+            scale = &lctx.inp_lora_scale;
+        } else if (n_rows == lctx.lora_seq.n_outputs) {
+            ids   = &lctx.inp_lora_ids_out;
+            scale = &lctx.inp_lora_scale_out;
+        }
+
+        if (ids != nullptr) {
+            if (*ids == nullptr) {
+                *ids = ggml_new_tensor_2d(ctx0, GGML_TYPE_I32, 1, n_rows);
+                ggml_set_input(*ids);
+                *scale = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 1, n_rows);
+                ggml_set_input(*scale);
+            }
+
+            struct ggml_tensor * x = ggml_reshape_3d(ctx0, ggml_is_contiguous(cur) ? cur : ggml_cont(ctx0, cur), cur->ne[0], 1, n_rows);
+            struct ggml_tensor * ab_cur = ggml_mul_mat_id(
+                ctx0, stack->b,
+                ggml_mul_mat_id(ctx0, stack->a, x, *ids),
+                *ids
+            );
+            ab_cur = ggml_reshape_2d(ctx0, ab_cur, ab_cur->ne[0], n_rows);
+            ab_cur = ggml_mul(ctx0, ab_cur, *scale);
+            res = ggml_add(ctx0, res, ab_cur);
+        }
+    }
     return res;
 }
 
@@ -9760,6 +11014,39 @@ static struct ggml_tensor * llm_build_moe_ffn(
     return moe_out;
 }
 
+// multiply the soft-maxed kq [n_kv, n_tokens, n_head] with the cached v, result is [n_embd_head_v, n_tokens, n_head]
+static struct ggml_tensor * llm_build_kqv_v(
+        struct ggml_context * ctx,
+       const llama_kv_cache & kv,
+         struct ggml_tensor * kq,
+                    int32_t   n_kv,
+                    int64_t   n_embd_head_v,
+                    int64_t   n_head_kv,
+                    int       il) {
+    if (!kv.v_trans) {
+        // the quantized V cache is stored per token - accumulate the outer products of the V rows and the kq columns,
+        // so that each row is dequantized once instead of transposing the whole cache
+        struct ggml_tensor * v =
+            ggml_view_3d(ctx, kv.v_l[il],
+                    n_embd_head_v, n_kv, n_head_kv,
+                    ggml_row_size(kv.v_l[il]->type, n_embd_head_v*n_head_kv),
+                    ggml_row_size(kv.v_l[il]->type, n_embd_head_v),
+                    0);
+
+        return ggml_out_prod(ctx, v, ggml_transpose(ctx, kq));
+    }
+
+    // split cached v into n_head heads
+    struct ggml_tensor * v =
+        ggml_view_3d(ctx, kv.v_l[il],
+                n_kv, n_embd_head_v, n_head_kv,
+                ggml_element_size(kv.v_l[il])*kv.size,
+                ggml_element_size(kv.v_l[il])*kv.size*n_embd_head_v,
+                0);
+
+    return ggml_mul_mat(ctx, v, kq);
+}
+
 static struct ggml_tensor * llm_build_kqv(
         struct ggml_context * ctx,
        struct llama_context & lctx,
@@ -9778,7 +11065,7 @@ static struct ggml_tensor * llm_build_kqv(
     const llama_hparams & hparams = lctx.model.hparams;
     const llama_cparams & cparams = lctx.cparams;
 
-    const int64_t n_ctx         = cparams.n_ctx;
+    const int64_t kv_size       = kv.size;
     const int64_t n_head        = hparams.n_head(il);
     const int64_t n_head_kv     = hparams.n_head_kv(il);
     const int64_t n_embd_head_k = hparams.n_embd_head_k;
@@ -9801,7 +11088,7 @@ static struct ggml_tensor * llm_build_kqv(
 
     if (cparams.flash_attn) {
         GGML_UNUSED(model);
-        GGML_UNUSED(n_ctx);
+        GGML_UNUSED(kv_size);
 
         // split cached v into n_head heads (not transposed)
         struct ggml_tensor * v =
@@ -9846,18 +11133,7 @@ static struct ggml_tensor * llm_build_kqv(
         kq = ggml_soft_max_ext(ctx, kq, kq_mask, kq_scale, hparams.f_max_alibi_bias);
         cb(kq, "kq_soft_max_ext", il);
 
-        GGML_ASSERT(kv.size == n_ctx);
-
-        // split cached v into n_head heads
-        struct ggml_tensor * v =
-            ggml_view_3d(ctx, kv.v_l[il],
-                    n_kv, n_embd_head_v, n_head_kv,
-                    ggml_element_size(kv.v_l[il])*n_ctx,
-                    ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head_v,
-                    0);
-        cb(v, "v", il);
-
-        struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
+        struct ggml_tensor * kqv = llm_build_kqv_v(ctx, kv, kq, n_kv, n_embd_head_v, n_head_kv, il);
         cb(kqv, "kqv", il);
 
         struct ggml_tensor * kqv_merged = ggml_permute(ctx, kqv, 0, 2, 1, 3);
@@ -10260,6 +11536,7 @@ struct llm_build_context {
     const llama_cparams  & cparams;
     const llama_ubatch   & ubatch;
     const llama_kv_cache & kv_self;
+    const llama_kv_cache & kv_swa;
 
     const int64_t n_embd;
     const int64_t n_layer;
@@ -10288,9 +11565,12 @@ struct llm_build_context {
     const int32_t n_outputs;
     const int32_t n_outputs_enc;
     const int32_t kv_head;  // index of where we store new KV data in the cache
+    const int32_t n_kv_swa;    // same as n_kv and kv_head, for the SWA layers stored in kv_swa
+    const int32_t kv_head_swa;
     const int32_t n_ctx_orig;
 
     const bool flash_attn;
+    const bool kq_mask_f16;
 
     const enum llama_pooling_type pooling_type;
     const enum llama_rope_type    rope_type;
@@ -10313,6 +11593,7 @@ struct llm_build_context {
         cparams          (lctx.cparams),
         ubatch           (ubatch),
         kv_self          (lctx.kv_self),
+        kv_swa           (lctx.kv_swa),
         n_embd           (hparams.n_embd),
         n_layer          (hparams.n_layer),
         n_rot            (hparams.n_rot),
@@ -10338,8 +11619,11 @@ struct llm_build_context {
         n_outputs        (worst_case ? n_tokens : lctx.n_outputs),
         n_outputs_enc    (worst_case ? n_tokens : lctx.embd_enc.size() / hparams.n_embd),
         kv_head          (worst_case ? (kv_self.recurrent ? 0 : kv_self.size - n_tokens) : kv_self.head),
+        n_kv_swa         (worst_case ? kv_swa.size : kv_swa.n),
+        kv_head_swa      (worst_case ? kv_swa.size - n_tokens : kv_swa.head),
         n_ctx_orig       (cparams.n_ctx_orig_yarn),
         flash_attn       (cparams.flash_attn),
+        kq_mask_f16      (cparams.kq_mask_f16),
         pooling_type     (cparams.pooling_type),
         rope_type        (hparams.rope_type),
         cb               (cb),
@@ -10363,6 +11647,7 @@ struct llm_build_context {
         lctx.inp_KQ_mask     = nullptr;
         lctx.inp_KQ_mask_swa = nullptr;
         lctx.inp_K_shift     = nullptr;
+        lctx.inp_K_shift_swa = nullptr;
         lctx.inp_mean        = nullptr;
         lctx.inp_cls         = nullptr;
         lctx.inp_s_copy      = nullptr;
@@ -10371,6 +11656,10 @@ struct llm_build_context {
         lctx.inp_pos_bucket    = nullptr;
         lctx.inp_embd_enc      = nullptr;
         lctx.inp_KQ_mask_cross = nullptr;
+        lctx.inp_lora_ids       = nullptr;
+        lctx.inp_lora_scale     = nullptr;
+        lctx.inp_lora_ids_out   = nullptr;
+        lctx.inp_lora_scale_out = nullptr;
     }
 
     void free() {
@@ -10378,25 +11667,29 @@ struct llm_build_context {
         ctx0 = nullptr;
     }
 
-    struct ggml_cgraph * build_k_shift() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
-
-        GGML_ASSERT(kv_self.size == n_ctx);
+    // rotate the cells of the cache with a pending shift, for the layers stored in the cache
+    void build_k_shift_cache(struct ggml_cgraph * gf, const llama_kv_cache & kv, struct ggml_tensor *& inp_K_shift, const char * name) {
+        // only the cells with a pending shift are rotated, so that small shifts of a sequence stay cheap
+        const int64_t n_shift = kv.shift_end - kv.shift_beg;
 
-        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_ctx);
-        cb(lctx.inp_K_shift, "K_shift", -1);
-        ggml_set_input(lctx.inp_K_shift);
+        inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_shift);
+        cb(inp_K_shift, name, -1);
+        ggml_set_input(inp_K_shift);
 
         for (int il = 0; il < n_layer; ++il) {
+            if (kv.k_l[il] == nullptr) {
+                continue;
+            }
+
             const int64_t n_head_kv = hparams.n_head_kv(il);
             const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
             struct ggml_tensor * rope_factors = build_rope_factors(il);
             struct ggml_tensor * k =
-                ggml_view_3d(ctx0, kv_self.k_l[il],
-                    n_embd_head_k, n_head_kv, n_ctx,
-                    ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
-                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                    0);
+                ggml_view_3d(ctx0, kv.k_l[il],
+                    n_embd_head_k, n_head_kv, n_shift,
+                    ggml_row_size(kv.k_l[il]->type, n_embd_head_k),
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*kv.shift_beg);
 
             struct ggml_tensor * tmp;
             if (ggml_is_quantized(k->type)) {
@@ -10405,89 +11698,110 @@ struct llm_build_context {
                 cb(tmp, "K_f32", il);
                 for (auto & backend : lctx.backends) {
                     // Figure out which backend KV cache belongs to
-                    if (ggml_backend_supports_buft(backend.get(), ggml_backend_buffer_get_type(kv_self.k_l[il]->buffer))) {
+                    if (ggml_backend_supports_buft(backend.get(), ggml_backend_buffer_get_type(kv.k_l[il]->buffer))) {
                         ggml_backend_sched_set_tensor_backend(lctx.sched.get(), tmp, backend.get());
                         break;
                     }
                 }
                 tmp = ggml_rope_ext_inplace(ctx0, tmp,
-                        lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                        inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(tmp, "K_shifted_f32", il);
                 tmp = ggml_cpy(ctx0, tmp, k);
             } else {
                 // we rotate only the first n_rot dimensions
                 tmp = ggml_rope_ext_inplace(ctx0, k,
-                        lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                        inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
             }
             cb(tmp, "K_shifted", il);
             ggml_build_forward_expand(gf, tmp);
         }
-
-        return gf;
     }
 
-    struct ggml_cgraph * build_defrag(const std::vector<uint32_t> & ids) {
+    struct ggml_cgraph * build_k_shift() {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
-        for (uint32_t i = 0; i < ids.size(); ++i) {
-            const uint32_t id = ids[i];
+        if (kv_self.has_shift) {
+            build_k_shift_cache(gf, kv_self, lctx.inp_K_shift, "K_shift");
+        }
 
-            if (i == id || id == ids.size()) {
+        if (kv_swa.has_shift) {
+            build_k_shift_cache(gf, kv_swa, lctx.inp_K_shift_swa, "K_shift_swa");
+        }
+
+        return gf;
+    }
+
+    // copy the K and V data of the cells [i_src, i_src + n) to [i_dst, i_dst + n)
+    void build_kv_cpy(struct ggml_cgraph * gf, const llama_kv_cache & kv, uint32_t i_src, uint32_t i_dst, uint32_t n) {
+        for (int il = 0; il < n_layer; ++il) {
+            if (kv.k_l[il] == nullptr) {
                 continue;
             }
 
-            uint32_t nm = 1;
+            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+            const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+
+            ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv.k_l[il],
+                    n_embd_k_gqa, n,
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa*i_src));
+
+            ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv.k_l[il],
+                    n_embd_k_gqa, n,
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa*i_dst));
+
+            ggml_tensor * view_v_src;
+            ggml_tensor * view_v_dst;
+
+            if (!kv.v_trans) {
+                // NOTE: the V cache is not transposed when using flash attention or when it is quantized
+                view_v_src = ggml_view_2d(ctx0, kv.v_l[il],
+                        n_embd_v_gqa, n,
+                        ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                        ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa*i_src));
+
+                view_v_dst = ggml_view_2d(ctx0, kv.v_l[il],
+                        n_embd_v_gqa, n,
+                        ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                        ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa*i_dst));
+            } else {
+                view_v_src = ggml_view_2d(ctx0, kv.v_l[il],
+                        n, n_embd_v_gqa,
+                        ggml_row_size(kv.v_l[il]->type, kv.size),
+                        ggml_row_size(kv.v_l[il]->type, i_src));
 
-            while (i + nm < ids.size() && ids[i + nm] == id + nm) {
-                nm++;
+                view_v_dst = ggml_view_2d(ctx0, kv.v_l[il],
+                        n, n_embd_v_gqa,
+                        ggml_row_size(kv.v_l[il]->type, kv.size),
+                        ggml_row_size(kv.v_l[il]->type, i_dst));
             }
 
-            for (int il = 0; il < n_layer; ++il) {
-                const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
-                const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
-
-                ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv_self.k_l[il],
-                        n_embd_k_gqa, nm,
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*i));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_k_src, view_k_dst));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_v_src, view_v_dst));
+        }
+    }
 
-                ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv_self.k_l[il],
-                        n_embd_k_gqa, nm,
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*id));
+    struct ggml_cgraph * build_defrag(const llama_kv_cache & kv, const std::vector<uint32_t> & ids) {
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
-                ggml_tensor * view_v_src;
-                ggml_tensor * view_v_dst;
+        for (uint32_t i = 0; i < ids.size(); ++i) {
+            const uint32_t id = ids[i];
 
-                if (flash_attn) {
-                    // NOTE: the V cache is not transposed when using flash attention
-                    view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
-                            n_embd_v_gqa, nm,
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*i));
+            if (i == id || id == ids.size()) {
+                continue;
+            }
 
-                    view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
-                            n_embd_v_gqa, nm,
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*id));
-                } else {
-                    view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
-                            nm, n_embd_v_gqa,
-                            ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                            ggml_row_size(kv_self.v_l[il]->type, i));
-
-                    view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
-                            nm, n_embd_v_gqa,
-                            ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                            ggml_row_size(kv_self.v_l[il]->type, id));
-                }
+            uint32_t nm = 1;
 
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_k_src, view_k_dst));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_v_src, view_v_dst));
+            while (i + nm < ids.size() && ids[i + nm] == id + nm) {
+                nm++;
             }
 
+            build_kv_cpy(gf, kv, i, id, nm);
+
             i += nm - 1;
         }
 
@@ -10496,6 +11810,16 @@ struct llm_build_context {
         return gf;
     }
 
+    struct ggml_cgraph * build_kv_copy(const llama_kv_cache & kv, const std::vector<llama_kv_cache_copy> & copies) {
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+
+        for (const auto & cpy : copies) {
+            build_kv_cpy(gf, kv, cpy.i_src, cpy.i_dst, cpy.n);
+        }
+
+        return gf;
+    }
+
     struct ggml_tensor * build_inp_pos() {
         lctx.inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
         cb(lctx.inp_pos, "inp_pos", -1);
@@ -10525,26 +11849,35 @@ struct llm_build_context {
         return lctx.inp_out_ids;
     }
 
+    // the mask only holds 0.0f and -INFINITY, unless ALiBi is used, so it is stored as F16 when the soft_max
+    // of all the backends takes it - the flash attention kernels need an F16 mask in any case
+    ggml_type kq_mask_type() const {
+        return flash_attn || (kq_mask_f16 && !hparams.use_alibi) ? GGML_TYPE_F16 : GGML_TYPE_F32;
+    }
+
     struct ggml_tensor * build_inp_KQ_mask(bool causal = true) {
         lctx.inp_KQ_mask = causal
-            ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv,     GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
-            : ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_tokens, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
+            ? ggml_new_tensor_2d(ctx0, kq_mask_type(), n_kv,     GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
+            : ggml_new_tensor_2d(ctx0, kq_mask_type(), n_tokens, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
         cb(lctx.inp_KQ_mask, "KQ_mask", -1);
         ggml_set_input(lctx.inp_KQ_mask);
 
-        return flash_attn ? ggml_cast(ctx0, lctx.inp_KQ_mask, GGML_TYPE_F16) : lctx.inp_KQ_mask;
+        return lctx.inp_KQ_mask;
     }
 
     struct ggml_tensor * build_inp_KQ_mask_swa(bool causal = true) {
         GGML_ASSERT(hparams.n_swa > 0);
 
+        // with a separate sliding window cache, the SWA layers attend its cells
+        const int64_t n_kv_l = kv_swa.size > 0 ? n_kv_swa : n_kv;
+
         lctx.inp_KQ_mask_swa = causal
-            ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv,     GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
-            : ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_tokens, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
+            ? ggml_new_tensor_2d(ctx0, kq_mask_type(), n_kv_l,   GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
+            : ggml_new_tensor_2d(ctx0, kq_mask_type(), n_tokens, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
         cb(lctx.inp_KQ_mask_swa, "KQ_mask_swa", -1);
         ggml_set_input(lctx.inp_KQ_mask_swa);
 
-        return flash_attn ? ggml_cast(ctx0, lctx.inp_KQ_mask_swa, GGML_TYPE_F16) : lctx.inp_KQ_mask_swa;
+        return lctx.inp_KQ_mask_swa;
     }
 
     struct ggml_tensor * build_inp_mean() {
@@ -13915,8 +15248,10 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask_swa = build_inp_KQ_mask_swa(true);
 
         for (int il = 0; il < n_layer; ++il) {
-            // (il % 2) layers use SWA
-            struct ggml_tensor * KQ_mask_l = (il % 2 == 0) ? KQ_mask_swa : KQ_mask;
+            struct ggml_tensor * KQ_mask_l = hparams.is_swa(il) ? KQ_mask_swa : KQ_mask;
+
+            // the SWA layers can be stored in their own cache
+            const bool use_kv_swa = hparams.is_swa(il) && kv_swa.size > 0;
 
             // norm
             cur = llm_build_norm(ctx0, inpL, hparams,
@@ -13957,9 +15292,11 @@ struct llm_build_context {
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, lctx, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, use_kv_swa ? kv_swa : kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens, kv_head, n_kv, 1.0f, cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens,
+                        use_kv_swa ? kv_head_swa : kv_head,
+                        use_kv_swa ? n_kv_swa    : n_kv, 1.0f, cb, il);
             }
 
             cur = llm_build_norm(ctx0, cur, hparams,
@@ -15697,14 +17034,6 @@ struct llm_build_context {
                             0);
                 cb(k, "k", il);
 
-                struct ggml_tensor * v =
-                    ggml_view_3d(ctx0, kv_self.v_l[il],
-                            n_kv, n_embd_head_v, n_head_kv,
-                            ggml_element_size(kv_self.v_l[il])*n_ctx,
-                            ggml_element_size(kv_self.v_l[il])*n_ctx*n_embd_head_v,
-                            0);
-                cb(v, "v", il);
-
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
                 struct ggml_tensor * q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
@@ -15720,7 +17049,7 @@ struct llm_build_context {
                 kq = ggml_soft_max_ext(ctx0, kq_b, KQ_mask_dec, 1.0f, hparams.f_max_alibi_bias);
                 cb(kq, "kq_soft_max_ext", il);
 
-                struct ggml_tensor * kqv = ggml_mul_mat(ctx0, v, kq);
+                struct ggml_tensor * kqv = llm_build_kqv_v(ctx0, kv_self, kq, n_kv, n_embd_head_v, n_head_kv, il);
                 cb(kqv, "kqv", il);
 
                 struct ggml_tensor * kqv_merged = ggml_permute(ctx0, kqv, 0, 2, 1, 3);
@@ -16594,7 +17923,24 @@ struct llm_build_context {
     }
 };
 
-static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const std::vector<uint32_t> & ids) {
+static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const llama_kv_cache & kv, const std::vector<uint32_t> & ids) {
+    llama_ubatch dummy = {};
+    dummy.equal_seqs = true;
+
+    llm_build_cb cb = [&](struct ggml_tensor * , const char * , int ) { };
+
+    struct llm_build_context llm(lctx, dummy, cb, false);
+
+    llm.init();
+
+    struct ggml_cgraph * result = llm.build_defrag(kv, ids);
+
+    llm.free();
+
+    return result;
+}
+
+static struct ggml_cgraph * llama_build_graph_kv_copy(llama_context & lctx, const llama_kv_cache & kv, const std::vector<llama_kv_cache_copy> & copies) {
     llama_ubatch dummy = {};
     dummy.equal_seqs = true;
 
@@ -16604,7 +17950,7 @@ static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const
 
     llm.init();
 
-    struct ggml_cgraph * result = llm.build_defrag(ids);
+    struct ggml_cgraph * result = llm.build_kv_copy(kv, copies);
 
     llm.free();
 
@@ -16668,6 +18014,25 @@ static struct ggml_cgraph * llama_build_graph(
 
     struct ggml_cgraph * result = NULL;
 
+    // the per-sequence LoRA adapters are applied only if a row of the ubatch selects one
+    {
+        auto & lora_seq = lctx.lora_seq;
+
+        lora_seq.active    = false;
+        lora_seq.n_tokens  = ubatch.n_tokens;
+        lora_seq.n_outputs = worst_case ? ubatch.n_tokens : lctx.n_outputs;
+
+        if (!lora_seq.stacks.empty()) {
+            lora_seq.active = worst_case;
+            for (uint32_t s = 0; s < ubatch.n_seqs && !lora_seq.active; ++s) {
+                if (ubatch.n_seq_id[s] > 0) {
+                    auto it = lora_seq.seqs.find(ubatch.seq_id[s][0]);
+                    lora_seq.active = it != lora_seq.seqs.end() && it->second.second != 0.0f;
+                }
+            }
+        }
+    }
+
     struct llm_build_context llm(lctx, ubatch, cb, worst_case);
 
     llm.init();
@@ -16876,15 +18241,22 @@ static struct ggml_cgraph * llama_build_graph(
 }
 
 static void llama_set_k_shift(llama_context & lctx) {
-    const int64_t kv_size = lctx.kv_self.size;
+    auto set_k_shift = [](const llama_kv_cache & kv, struct ggml_tensor * inp_K_shift) {
+        if (!inp_K_shift) {
+            return;
+        }
 
-    assert(ggml_backend_buffer_is_host(lctx.inp_K_shift->buffer));
+        assert(ggml_backend_buffer_is_host(inp_K_shift->buffer));
 
-    int32_t * data = (int32_t *) lctx.inp_K_shift->data;
+        int32_t * data = (int32_t *) inp_K_shift->data;
 
-    for (int i = 0; i < kv_size; ++i) {
-        data[i] = lctx.kv_self.cells[i].delta;
-    }
+        for (uint32_t i = kv.shift_beg; i < kv.shift_end; ++i) {
+            data[i - kv.shift_beg] = kv.cells[i].delta;
+        }
+    };
+
+    set_k_shift(lctx.kv_self, lctx.inp_K_shift);
+    set_k_shift(lctx.kv_swa,  lctx.inp_K_shift_swa);
 }
 
 static void llama_set_s_copy(llama_context & lctx) {
@@ -16923,6 +18295,416 @@ static int32_t llama_relative_position_bucket(llama_pos x, llama_pos y, uint64_t
     return relative_bucket;
 }
 
+// host data of a KQ mask input, stored as F32 or F16
+struct llama_kq_mask_data {
+    float       * f32 = nullptr;
+    ggml_fp16_t * f16 = nullptr;
+
+    ggml_fp16_t f16_zero = ggml_fp32_to_fp16(0.0f);
+    ggml_fp16_t f16_ninf = ggml_fp32_to_fp16(-INFINITY);
+
+    llama_kq_mask_data() = default;
+
+    explicit llama_kq_mask_data(struct ggml_tensor * t) {
+        GGML_ASSERT(ggml_backend_buffer_is_host(t->buffer));
+        if (t->type == GGML_TYPE_F16) {
+            f16 = (ggml_fp16_t *) t->data;
+        } else {
+            GGML_ASSERT(t->type == GGML_TYPE_F32);
+            f32 = (float *) t->data;
+        }
+    }
+
+    explicit operator bool() const { return f32 || f16; }
+
+    void set(int64_t i, float f) {
+        if (f16) {
+            f16[i] = f == 0.0f ? f16_zero : f == -INFINITY ? f16_ninf : ggml_fp32_to_fp16(f);
+        } else {
+            f32[i] = f;
+        }
+    }
+
+    // set the values in [i0, i1) to -INFINITY
+    void fill_ninf(int64_t i0, int64_t i1) {
+        if (f16) {
+            std::fill(f16 + i0, f16 + i1, f16_ninf);
+        } else {
+            std::fill(f32 + i0, f32 + i1, -INFINITY);
+        }
+    }
+};
+
+// fill the causal KQ masks of the ubatch for the cells of a cache
+// data and data_swa can be empty, to fill only one of the masks
+static void llama_set_kq_mask_causal(
+        const llama_context & lctx,
+         const llama_ubatch & ubatch,
+       const llama_kv_cache & kv_self,
+           llama_kq_mask_data data,
+           llama_kq_mask_data data_swa) {
+    const auto & hparams = lctx.model.hparams;
+
+    const int64_t n_kv         = kv_self.n;
+    const int64_t n_tokens     = ubatch.n_tokens;
+    const int64_t n_seq_tokens = ubatch.n_seq_tokens;
+    const int64_t n_seqs       = ubatch.n_seqs;
+
+    // The cells of the ubatch tokens, grouped by sequence.
+    // When they are the only cells of their sequence at their positions or later, the mask row
+    // of a token is the cached row of the sequence (kv_self.seq_mask), with the cells of the
+    // later tokens of the ubatch hidden. Otherwise, the row is computed from the cells.
+    std::unordered_map<llama_seq_id, std::vector<std::pair<llama_pos, uint32_t>>> seq_ubatch_cells;
+
+    if (data.f16 && !hparams.use_alibi && !kv_self.recurrent) {
+        std::vector<uint32_t> ubatch_cells(n_tokens);
+        for (int64_t k = 0; k < n_tokens; ++k) {
+            ubatch_cells[k] = kv_self.head + k;
+        }
+        for (const auto & run : kv_self.runs) {
+            for (uint32_t k = 0; k < run.n; ++k) {
+                ubatch_cells[run.i_token + k] = run.i_cell + k;
+            }
+        }
+
+        for (int s = 0; s < n_seqs; ++s) {
+            for (int j = 0; j < n_seq_tokens; ++j) {
+                const int64_t k = s*n_seq_tokens + j;
+                seq_ubatch_cells[ubatch.seq_id[s][0]].emplace_back(ubatch.pos[k], ubatch_cells[k]);
+            }
+        }
+
+        for (auto it = seq_ubatch_cells.begin(); it != seq_ubatch_cells.end();) {
+            llama_pos p_min = std::numeric_limits<llama_pos>::max();
+            for (const auto & pc : it->second) {
+                p_min = std::min(p_min, pc.first);
+            }
+
+            const auto & seq_pos = kv_self.seq_pos[it->first];
+
+            size_t n_later = 0;
+            for (auto ip = seq_pos.lower_bound(p_min); ip != seq_pos.end(); ++ip) {
+                n_later += ip->second;
+            }
+
+            it = n_later == it->second.size() ? std::next(it) : seq_ubatch_cells.erase(it);
+        }
+    }
+
+    // For causal attention, use only the previous KV cells
+    // of the correct sequence for each token of the ubatch.
+    // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
+    for (int h = 0; h < 1; ++h) {
+        for (int s = 0; s < n_seqs; ++s) {
+            const llama_seq_id seq_id = ubatch.seq_id[s][0];
+
+            // only the cells in [c0, c1) can belong to the sequence
+            uint32_t c0;
+            uint32_t c1;
+            llama_kv_cache_seq_cells(kv_self, seq_id, c0, c1);
+            c1 = std::min<uint32_t>(c1, n_kv);
+            c0 = std::min(c0, c1);
+
+            const auto it_ubatch = seq_ubatch_cells.find(seq_id);
+            const bool use_row   = it_ubatch != seq_ubatch_cells.end();
+
+            for (int j = 0; j < n_seq_tokens; ++j) {
+                const llama_pos pos = ubatch.pos[s*n_seq_tokens + j];
+
+                const int64_t i_row = h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv;
+
+                if (use_row) {
+                    ggml_fp16_t * row = data.f16 + i_row;
+                    memcpy(row, kv_self.seq_mask[seq_id].data(), n_kv*sizeof(ggml_fp16_t));
+                    for (const auto & pc : it_ubatch->second) {
+                        if (pc.first > pos) {
+                            row[pc.second] = data.f16_ninf;
+                        }
+                    }
+
+                    if (!data_swa) {
+                        continue;
+                    }
+                } else if (data) {
+                    data.fill_ninf(i_row,      i_row + c0);
+                    data.fill_ninf(i_row + c1, i_row + n_kv);
+                }
+
+                if (data_swa) {
+                    data_swa.fill_ninf(i_row,      i_row + c0);
+                    data_swa.fill_ninf(i_row + c1, i_row + n_kv);
+                }
+
+                for (int i = c0; i < (int) c1; ++i) {
+                    float f;
+                    if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
+                        f = -INFINITY;
+                    } else {
+                        if (hparams.use_alibi) {
+                            f = -std::abs(kv_self.cells[i].pos - pos);
+                        } else {
+                            f = 0.0f;
+                        }
+                    }
+
+                    if (data && !use_row) {
+                        data.set(i_row + i, f);
+                    }
+
+                    // may need to cut off old tokens for sliding window
+                    if (data_swa) {
+                        if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
+                            f = -INFINITY;
+                        }
+                        data_swa.set(i_row + i, f);
+                    }
+                }
+            }
+        }
+
+        if (data) {
+            data.fill_ninf(h*(n_kv*n_tokens) + n_tokens*n_kv, h*(n_kv*n_tokens) + GGML_PAD(n_tokens, GGML_KQ_MASK_PAD)*n_kv);
+        }
+
+        if (data_swa) {
+            data_swa.fill_ninf(h*(n_kv*n_tokens) + n_tokens*n_kv, h*(n_kv*n_tokens) + GGML_PAD(n_tokens, GGML_KQ_MASK_PAD)*n_kv);
+        }
+    }
+}
+
+// reserve the compute buffers for a worst-case graph
+static void llama_graph_reserve(llama_context & lctx) {
+    uint32_t n_seqs = 1; // TODO: worst-case number of sequences
+    uint32_t n_tokens = std::min(lctx.cparams.n_ctx, lctx.cparams.n_ubatch);
+    llama_token token = llama_token_bos(&lctx.model); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
+    llama_ubatch ubatch = { true, n_tokens, n_tokens / n_seqs, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
+    ggml_cgraph * gf = llama_build_graph(lctx, ubatch, true);
+
+    // initialize scheduler with the worst-case graph
+    ggml_backend_sched_reset(lctx.sched.get());
+    if (!ggml_backend_sched_reserve(lctx.sched.get(), gf)) {
+        LLAMA_LOG_ERROR("%s: failed to allocate compute buffers\n", __func__);
+    }
+}
+
+// write the slices of the adapters selected since the last decode in the stacks of the per-sequence LoRA adapters
+// the stacks are only reallocated when they are out of slices, or for the weights of an adapter that they do not
+// cover - with room for twice as many adapters, and the slices already written copied within the backend
+static bool llama_lora_seq_update(llama_context & lctx) {
+    auto & lora_seq = lctx.lora_seq;
+    if (lora_seq.pending.empty()) {
+        return true;
+    }
+
+    // the base tensors with a LoRA in any of the adapters, and the largest rank for each of them
+    // the expert tensors of MoE models are only supported by the adapters of the whole context
+    std::map<std::string, std::pair<struct ggml_tensor *, int64_t>> bases;
+    for (auto * adapter : lora_seq.adapters) {
+        if (adapter == nullptr) {
+            continue;
+        }
+        for (auto & it : adapter->ab_map) {
+            struct ggml_tensor * w = llama_get_model_tensor(const_cast<llama_model *>(&lctx.model), it.first.c_str());
+            if (w == nullptr || ggml_n_dims(w) != 2) {
+                continue;
+            }
+            auto & base = bases[it.first];
+            base.first  = w;
+            base.second = std::max(base.second, it.second.a->ne[1]);
+        }
+    }
+
+    const int64_t n_adapters = lora_seq.adapters.size();
+
+    bool realloc = n_adapters > lora_seq.n_max;
+    for (auto & it : bases) {
+        auto st = lora_seq.stacks.find(it.second.first);
+        realloc = realloc || st == lora_seq.stacks.end() || st->second.a->ne[1] < it.second.second;
+    }
+
+    // the stacks whose slices are all written again, because their rank changed
+    std::set<const struct ggml_tensor *> restack;
+
+    if (realloc) {
+        // the capacity only doubles when the adapters do not fit, a larger rank keeps it
+        const int64_t n_max = n_adapters > lora_seq.n_max ? std::max(n_adapters, 2*lora_seq.n_max) : lora_seq.n_max;
+
+        // the stacks keep their rank, so that their slices can be copied - those of the base tensors that no adapter
+        // uses anymore are dropped
+        for (auto & it : lora_seq.stacks) {
+            if (bases.find(it.second.name) == bases.end()) {
+                continue;
+            }
+            auto & base = bases.at(it.second.name);
+            base.second = std::max(base.second, it.second.a->ne[1]);
+        }
+
+        std::unordered_map<const struct ggml_tensor *, llama_lora_seq::stack> stacks;
+        std::vector<ggml_context_ptr> ctxs;
+        std::vector<ggml_backend_buffer_ptr> bufs;
+
+        // create a context for each buffer type
+        std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+        auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
+            auto it = ctx_map.find(buft);
+            if (it == ctx_map.end()) {
+                struct ggml_init_params params = {
+                    /*.mem_size   =*/ 2*bases.size()*ggml_tensor_overhead(),
+                    /*.mem_buffer =*/ NULL,
+                    /*.no_alloc   =*/ true,
+                };
+                ggml_context * ctx = ggml_init(params);
+                if (!ctx) {
+                    return nullptr;
+                }
+                ctx_map[buft] = ctx;
+                ctxs.emplace_back(ctx);
+                return ctx;
+            }
+            return it->second;
+        };
+
+        for (auto & it : bases) {
+            struct ggml_tensor * w = it.second.first;
+            const int64_t rank = it.second.second;
+
+            ggml_context * ctx = ctx_for_buft(ggml_backend_buffer_get_type(w->buffer));
+            if (!ctx) {
+                LLAMA_LOG_ERROR("%s: failed to allocate context for the LoRA adapters of the sequences\n", __func__);
+                return false;
+            }
+
+            llama_lora_seq::stack & stack = stacks[w];
+            stack.name = it.first;
+            stack.a = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, w->ne[0], rank, n_max);
+            stack.b = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, rank, w->ne[1], n_max);
+        }
+
+        bufs.reserve(ctx_map.size());
+        for (auto it : ctx_map) {
+            ggml_backend_buffer_type_t buft = it.first;
+            ggml_context * ctx = it.second;
+            ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+            if (!buf) {
+                LLAMA_LOG_ERROR("%s: failed to allocate buffer for the LoRA adapters of the sequences\n", __func__);
+                return false;
+            }
+            // the padding of the ranks, and the slices of the free indices
+            ggml_backend_buffer_clear(buf, 0);
+            LLAMA_LOG_INFO("%s: %10s LoRA buffer size = %8.2f MiB (%d adapters)\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1024.0/1024.0, (int) n_max);
+            bufs.emplace_back(buf);
+        }
+
+        // the slices of the previous stacks with the same rank are copied as they are
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ 2*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+        };
+        for (auto & it : stacks) {
+            auto prev = lora_seq.stacks.find(it.first);
+            if (prev == lora_seq.stacks.end()) {
+                continue;
+            }
+            if (prev->second.a->ne[1] != it.second.a->ne[1]) {
+                restack.insert(it.first);
+                continue;
+            }
+
+            ggml_context_ptr ctx_view(ggml_init(params));
+            for (auto t : { std::make_pair(prev->second.a, it.second.a), std::make_pair(prev->second.b, it.second.b) }) {
+                struct ggml_tensor * view = ggml_view_3d(ctx_view.get(), t.second, t.first->ne[0], t.first->ne[1], t.first->ne[2], t.second->nb[1], t.second->nb[2], 0);
+                ggml_backend_view_init(view);
+                ggml_backend_tensor_copy(t.first, view);
+            }
+        }
+
+        lora_seq.stacks = std::move(stacks);
+        lora_seq.bufs   = std::move(bufs);
+        lora_seq.ctxs   = std::move(ctxs);
+        lora_seq.n_max  = n_max;
+    }
+
+    // copy the weights of each new adapter in its slice of the stacks, converted to F16 and padded with zeros to the
+    // rank of the stack
+    std::vector<uint8_t>     read_buf;
+    std::vector<float>       src;
+    std::vector<float>       dst;
+    std::vector<ggml_fp16_t> dst_f16;
+
+    auto get_f32 = [&](const struct ggml_tensor * t) {
+        read_buf.resize(ggml_nbytes(t));
+        ggml_backend_tensor_get(t, read_buf.data(), 0, read_buf.size());
+        src.resize(ggml_nelements(t));
+        if (t->type == GGML_TYPE_F32) {
+            memcpy(src.data(), read_buf.data(), read_buf.size());
+        } else {
+            ggml_get_type_traits(t->type)->to_float(read_buf.data(), src.data(), src.size());
+        }
+    };
+
+    auto set_slice = [&](struct ggml_tensor * t, int64_t i) {
+        dst_f16.resize(dst.size());
+        ggml_fp32_to_fp16_row(dst.data(), dst_f16.data(), dst.size());
+        ggml_backend_tensor_set(t, dst_f16.data(), i*t->nb[2], dst_f16.size()*sizeof(ggml_fp16_t));
+    };
+
+    for (auto & it : lora_seq.stacks) {
+        const llama_lora_seq::stack & stack = it.second;
+
+        const int64_t n_in  = stack.a->ne[0];
+        const int64_t rank  = stack.a->ne[1];
+        const int64_t n_out = stack.b->ne[1];
+
+        std::set<int32_t> ids = lora_seq.pending;
+        if (restack.count(it.first)) {
+            for (int32_t i = 0; i < n_adapters; ++i) {
+                if (lora_seq.adapters[i] != nullptr) {
+                    ids.insert(i);
+                }
+            }
+        }
+
+        for (const int32_t i : ids) {
+            struct llama_lora_adapter * adapter = lora_seq.adapters[i];
+
+            auto lw = adapter->ab_map.find(stack.name);
+
+            // A: the rows of the adapter, then zeros
+            dst.assign(n_in*rank, 0.0f);
+            if (lw != adapter->ab_map.end()) {
+                get_f32(lw->second.a);
+                std::copy(src.begin(), src.end(), dst.begin());
+            }
+            set_slice(stack.a, i);
+
+            // B: each row padded to the rank, scaled like in llm_build_lora_mm()
+            dst.assign(rank*n_out, 0.0f);
+            if (lw != adapter->ab_map.end()) {
+                const int64_t rank_i = lw->second.b->ne[0];
+                const float   scale  = adapter->alpha ? adapter->alpha / rank_i : 1.0f;
+
+                get_f32(lw->second.b);
+                for (int64_t o = 0; o < n_out; ++o) {
+                    for (int64_t j = 0; j < rank_i; ++j) {
+                        dst[o*rank + j] = src[o*rank_i + j] * scale;
+                    }
+                }
+            }
+            set_slice(stack.b, i);
+        }
+    }
+
+    lora_seq.pending.clear();
+
+    // the worst-case graph now applies the stacks: the compute buffers are reserved for it again
+    if (realloc) {
+        llama_graph_reserve(lctx);
+    }
+
+    return true;
+}
+
 static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch) {
     //
     // set input data
@@ -16979,6 +18761,52 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch)
         }
     }
 
+    if (lctx.inp_lora_ids || lctx.inp_lora_ids_out) {
+        const int64_t n_tokens = ubatch.n_tokens;
+
+        // adapter index and scale of the rows, from their sequence
+        std::vector<int32_t> ids(n_tokens, 0);
+        std::vector<float>   scale(n_tokens, 0.0f);
+
+        for (int64_t i = 0; i < n_tokens; ++i) {
+            const int64_t s = i / ubatch.n_seq_tokens;
+            if (ubatch.n_seq_id[s] == 0) {
+                continue;
+            }
+
+            auto it = lctx.lora_seq.seqs.find(ubatch.seq_id[s][0]);
+            if (it != lctx.lora_seq.seqs.end()) {
+                ids[i]   = it->second.first;
+                scale[i] = it->second.second;
+            }
+        }
+
+        if (lctx.inp_lora_ids) {
+            ggml_backend_tensor_set(lctx.inp_lora_ids,   ids.data(),   0, n_tokens*ggml_element_size(lctx.inp_lora_ids));
+            ggml_backend_tensor_set(lctx.inp_lora_scale, scale.data(), 0, n_tokens*ggml_element_size(lctx.inp_lora_scale));
+        }
+
+        if (lctx.inp_lora_ids_out) {
+            // same rows as inp_out_ids
+            const int64_t n_outputs = lctx.inp_lora_ids_out->ne[1];
+
+            std::vector<int32_t> ids_out;
+            std::vector<float>   scale_out;
+
+            for (int64_t i = 0; i < n_tokens; ++i) {
+                const bool output = n_outputs == n_tokens ? true : ubatch.output ? ubatch.output[i] != 0 : i == n_tokens - 1;
+                if (output) {
+                    ids_out.push_back(ids[i]);
+                    scale_out.push_back(scale[i]);
+                }
+            }
+            GGML_ASSERT((int64_t) ids_out.size() == n_outputs);
+
+            ggml_backend_tensor_set(lctx.inp_lora_ids_out,   ids_out.data(),   0, n_outputs*ggml_element_size(lctx.inp_lora_ids_out));
+            ggml_backend_tensor_set(lctx.inp_lora_scale_out, scale_out.data(), 0, n_outputs*ggml_element_size(lctx.inp_lora_scale_out));
+        }
+    }
+
     GGML_ASSERT(
         // (!a || b) is a logical implication (a -> b)
         // !hparams.causal_attn -> !cparams.causal_attn
@@ -16989,77 +18817,23 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch)
     if (lctx.inp_KQ_mask || lctx.inp_KQ_mask_swa) {
         // NOTE: hparams.causal_attn indicates the model is capable of generation and uses the kv cache.
         if (cparams.causal_attn && !lctx.is_encoding) {
-            const int64_t n_kv         = kv_self.n;
-            const int64_t n_tokens     = ubatch.n_tokens;
-            const int64_t n_seq_tokens = ubatch.n_seq_tokens;
-            const int64_t n_seqs       = ubatch.n_seqs;
-
-
-            float * data     = nullptr;
-            float * data_swa = nullptr;
+            llama_kq_mask_data data;
+            llama_kq_mask_data data_swa;
 
             if (lctx.inp_KQ_mask) {
-                GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_KQ_mask->buffer));
-                data = (float *) lctx.inp_KQ_mask->data;
+                data = llama_kq_mask_data(lctx.inp_KQ_mask);
             }
 
             if (lctx.inp_KQ_mask_swa) {
-                GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_KQ_mask_swa->buffer));
-                data_swa = (float *) lctx.inp_KQ_mask_swa->data;
+                data_swa = llama_kq_mask_data(lctx.inp_KQ_mask_swa);
             }
 
-            // For causal attention, use only the previous KV cells
-            // of the correct sequence for each token of the ubatch.
-            // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
-            for (int h = 0; h < 1; ++h) {
-                for (int s = 0; s < n_seqs; ++s) {
-                    const llama_seq_id seq_id = ubatch.seq_id[s][0];
-
-                    for (int j = 0; j < n_seq_tokens; ++j) {
-                        const llama_pos pos = ubatch.pos[s*n_seq_tokens + j];
-
-                        for (int i = 0; i < n_kv; ++i) {
-                            float f;
-                            if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                                f = -INFINITY;
-                            } else {
-                                if (hparams.use_alibi) {
-                                    f = -std::abs(kv_self.cells[i].pos - pos);
-                                } else {
-                                    f = 0.0f;
-                                }
-                            }
-
-                            if (data) {
-                                data[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
-                            }
-
-                            // may need to cut off old tokens for sliding window
-                            if (data_swa) {
-                                if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
-                                    f = -INFINITY;
-                                }
-                                data_swa[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
-                            }
-                        }
-                    }
-                }
-
-                if (data) {
-                    for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                        for (int j = 0; j < n_kv; ++j) {
-                            data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                        }
-                    }
-                }
-
-                if (data_swa) {
-                    for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                        for (int j = 0; j < n_kv; ++j) {
-                            data_swa[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                        }
-                    }
-                }
+            if (lctx.kv_swa.size > 0) {
+                // the SWA layers are stored in their own cache
+                llama_set_kq_mask_causal(lctx, ubatch, kv_self,     data, llama_kq_mask_data());
+                llama_set_kq_mask_causal(lctx, ubatch, lctx.kv_swa, llama_kq_mask_data(), data_swa);
+            } else {
+                llama_set_kq_mask_causal(lctx, ubatch, kv_self, data, data_swa);
             }
         } else {
             const int64_t n_tokens     = ubatch.n_tokens;
@@ -17068,9 +18842,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch)
             // when using kv cache, the mask needs to match the kv cache size
             const int64_t n_stride = hparams.causal_attn && !lctx.is_encoding ? kv_self.n : n_tokens;
 
-            GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_KQ_mask->buffer));
-
-            float * data = (float *) lctx.inp_KQ_mask->data;
+            llama_kq_mask_data data(lctx.inp_KQ_mask);
 
             for (int h = 0; h < 1; ++h) {
                 for (int s1 = 0; s1 < n_seqs; ++s1) {
@@ -17095,13 +18867,11 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch)
                                     }
                                 }
 
-                                data[h*(n_tokens*n_tokens) + tj*n_stride + ti] = f;
+                                data.set(h*(n_tokens*n_tokens) + tj*n_stride + ti, f);
                             }
                         }
 
-                        for (int i = n_tokens; i < n_stride; ++i) {
-                            data[h*(n_tokens*n_tokens) + tj*n_stride + i] = -INFINITY;
-                        }
+                        data.fill_ninf(h*(n_tokens*n_tokens) + tj*n_stride + n_tokens, h*(n_tokens*n_tokens) + tj*n_stride + n_stride);
                     }
                 }
             }
@@ -17462,6 +19232,8 @@ static enum ggml_status llama_graph_compute(
     return status;
 }
 
+static bool llama_kv_cache_defrag_internal(struct llama_context & lctx, struct llama_kv_cache & kv_self);
+
 // decode a batch of tokens by evaluating the transformer
 // in case of unsuccessful decoding (error or warning),
 // the kv_cache state will be returned to its original state
@@ -17505,6 +19277,17 @@ static int llama_decode_internal(
         }
     }
 
+    if (batch.seq_id) {
+        for (uint32_t i = 0; i < n_tokens_all; ++i) {
+            for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+                if (batch.seq_id[i][s] < 0 || batch.seq_id[i][s] >= LLAMA_MAX_SEQ) {
+                    LLAMA_LOG_ERROR("%s: invalid seq_id[%d][%d] = %d >= %d\n", __func__, i, s, batch.seq_id[i][s], LLAMA_MAX_SEQ);
+                    return -1;
+                }
+            }
+        }
+    }
+
     GGML_ASSERT(n_tokens_all <= cparams.n_batch);
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
@@ -17516,6 +19299,10 @@ static int llama_decode_internal(
 
     auto & kv_self = lctx.kv_self;
     llama_kv_slot_restorer kv_slot_restorer(kv_self);
+    llama_kv_slot_restorer kv_swa_slot_restorer(lctx.kv_swa);
+
+    // with a sliding window cache: the range of positions of each sequence in the ubatch
+    std::map<llama_seq_id, std::pair<llama_pos, llama_pos>> seq_pos_range;
 
     const int64_t n_embd  = hparams.n_embd;
     const int64_t n_vocab = hparams.n_vocab;
@@ -17552,6 +19339,10 @@ static int llama_decode_internal(
         return -2;
     };
 
+    if (!llama_lora_seq_update(lctx)) {
+        return -2;
+    }
+
     while (lctx.sbatch.n_tokens > 0) {
         llama_ubatch ubatch;
         if (kv_self.recurrent) {
@@ -17600,8 +19391,52 @@ static int llama_decode_internal(
                 kv_self.head = 0;
             }
 
-            const auto slot = llama_kv_cache_find_slot(kv_self, ubatch);
+            // the range of positions of each sequence in the ubatch
+            // the cells out of the window of the next tokens are evicted once the ubatch has been computed,
+            // so that a ubatch that does not fit leaves the sequences as they were
+            if (kv_self.n_swa > 0 || lctx.kv_swa.n_swa > 0) {
+                seq_pos_range.clear();
+                for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+                    for (uint32_t j = 0; j < ubatch.n_seq_tokens; ++j) {
+                        const llama_pos pos = ubatch.pos[s*ubatch.n_seq_tokens + j];
+                        for (int32_t k = 0; k < ubatch.n_seq_id[s]; ++k) {
+                            auto it = seq_pos_range.emplace(ubatch.seq_id[s][k], std::make_pair(pos, pos)).first;
+                            it->second.first  = std::min(it->second.first,  pos);
+                            it->second.second = std::max(it->second.second, pos);
+                        }
+                    }
+                }
+            }
+
+            if (lctx.kv_swa.size > 0) {
+                auto & kv_swa = lctx.kv_swa;
+
+                if (kv_swa.head > kv_swa.used + 2*n_tokens) {
+                    kv_swa.head = 0;
+                }
+
+                auto slot_swa = llama_kv_cache_find_slot(kv_swa, ubatch);
+                if (!slot_swa && kv_swa.used + n_tokens <= kv_swa.size) {
+                    // the evicted cells leave holes in the sliding window cache - compact it one bounded step at a time,
+                    // only until the ubatch fits
+                    kv_swa.do_defrag = true;
+                    while (!slot_swa && kv_swa.do_defrag && llama_kv_cache_defrag_internal(lctx, kv_swa)) {
+                        slot_swa = llama_kv_cache_find_slot(kv_swa, ubatch);
+                    }
+                    kv_swa.do_defrag = false;
+                }
+                if (!slot_swa) {
+                    return 1;
+                }
+                kv_swa_slot_restorer.save(slot_swa);
+            }
+
+            const auto slot = llama_kv_cache_find_slot_grow(lctx, ubatch);
             if (!slot) {
+                // keep both caches in sync: release the cells taken in the sliding window cache for the ubatch
+                if (lctx.kv_swa.size > 0) {
+                    llama_kv_cache_clear_cells(lctx.kv_swa, lctx.kv_swa.head, lctx.kv_swa.head + n_tokens);
+                }
                 return 1;
             }
             kv_slot_restorer.save(slot);
@@ -17613,6 +19448,10 @@ static int llama_decode_internal(
                 const uint32_t pad = llama_kv_cache_get_padding(cparams);
                 kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_self), pad)));
                 //kv_self.n = llama_kv_cache_cell_max(kv_self);
+
+                if (lctx.kv_swa.size > 0) {
+                    lctx.kv_swa.n = std::min(lctx.kv_swa.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(lctx.kv_swa), pad)));
+                }
             }
         }
 
@@ -17651,9 +19490,15 @@ static int llama_decode_internal(
 
         llama_set_inputs(lctx, ubatch);
 
+        // the placement of the ubatch is now part of the graph and of its inputs
+        const uint32_t head_next = kv_self.runs.empty() ? kv_self.head + n_tokens : kv_self.runs.back().i_cell + kv_self.runs.back().n;
+        kv_self.runs.clear();
+        lctx.kv_swa.runs.clear();
+
         const auto compute_status = llama_graph_compute(lctx, gf, n_threads, threadpool);
         if (compute_status != GGML_STATUS_SUCCESS) {
             kv_slot_restorer.restore(kv_self);
+            kv_swa_slot_restorer.restore(lctx.kv_swa);
             switch (compute_status) {
                 case GGML_STATUS_ABORTED:
                     return 2;
@@ -17667,12 +19512,27 @@ static int llama_decode_internal(
 
         // update the kv ring buffer
         {
-            kv_self.head += n_tokens;
+            kv_self.head = head_next;
 
             // Ensure kv cache head points to a valid index.
             if (kv_self.head >= kv_self.size) {
                 kv_self.head = 0;
             }
+
+            if (lctx.kv_swa.size > 0) {
+                lctx.kv_swa.head += n_tokens;
+                if (lctx.kv_swa.head >= lctx.kv_swa.size) {
+                    lctx.kv_swa.head = 0;
+                }
+            }
+
+            // the next tokens of the sequences come after the ubatch, so that the sliding window cache
+            // only needs to hold the last n_swa positions of each sequence between the ubatches
+            for (auto * kv : { &kv_self, &lctx.kv_swa }) {
+                for (const auto & sp : seq_pos_range) {
+                    llama_kv_cache_swa_evict(*kv, sp.first, sp.second.second + 1);
+                }
+            }
         }
 
         // plot the computation graph in dot format (for debugging purposes)
@@ -17859,6 +19719,10 @@ static int llama_encode_internal(
         return -2;
     };
 
+    if (!llama_lora_seq_update(lctx)) {
+        return -2;
+    }
+
     for (uint32_t i = 0; i < n_tokens; ++i) {
         lctx.output_ids[i] = i;
     }
@@ -17988,9 +19852,11 @@ static int llama_encode_internal(
 }
 
 // find holes from the beginning of the KV cache and fill them by moving data from the end of the cache
-static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
-    auto & kv_self = lctx.kv_self;
-
+// one defragmentation step: fills the holes with the cells at the end of the cache, moving at most defrag_max_cells cells
+// when the step is cut short, kv_self.do_defrag stays set and the next llama_kv_cache_update continues from there, so a
+// large defragmentation is spread over several decodes instead of stalling one of them
+// returns true if cells were moved
+static bool llama_kv_cache_defrag_internal(struct llama_context & lctx, struct llama_kv_cache & kv_self) {
     const auto & hparams = lctx.model.hparams;
 
     const uint32_t n_layer = hparams.n_layer;
@@ -18002,9 +19868,16 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
     //const int64_t t_start = ggml_time_us();
 
-    // number of cells moved
+    // number of (continuous blocks of) cells moved
     uint32_t n_moves = 0;
 
+    // number of cells moved and the limit for this step
+    uint32_t n_cells = 0;
+
+    const uint32_t max_cells = lctx.cparams.defrag_max_cells > 0 ? lctx.cparams.defrag_max_cells : n_kv;
+
+    kv_self.do_defrag = false;
+
     // each move requires 6*n_layer tensors (see build_defrag)
     //   - source view, destination view, copy operation
     //   - x2 for keys and values
@@ -18038,6 +19911,9 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
             nh++;
         }
 
+        // fill only the part of the hole that fits in the cells left for this step
+        nh = std::min(nh, max_cells - n_cells);
+
         uint32_t nf = 0;
         uint32_t is = n_kv - 1;
 
@@ -18100,13 +19976,16 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
             }
 
             nf++;
+            n_cells++;
 
             if (nf == nh) {
                 break;
             }
         }
 
-        if (stop || n_moves == max_moves) {
+        if (stop || n_moves == max_moves || n_cells == max_cells) {
+            // continue with the remaining holes on the next update
+            kv_self.do_defrag = true;
             break;
         }
 
@@ -18116,9 +19995,15 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     }
 
     if (n_moves == 0) {
-        return;
+        kv_self.do_defrag = false;
+        return false;
     }
 
+    // the cells have moved to other blocks
+    llama_kv_cache_block_table_update(kv_self);
+
+    llama_kv_cache_seq_index_update_cells(kv_self);
+
     //LLAMA_LOG_INFO("(tmp log) KV defrag cell moves: %u\n", n_moves);
 
     //LLAMA_LOG_INFO("expected gf nodes: %u\n", 6*n_moves*n_layer);
@@ -18198,7 +20083,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
     ggml_backend_sched_reset(lctx.sched.get());
 
-    ggml_cgraph * gf = llama_build_graph_defrag(lctx, ids);
+    ggml_cgraph * gf = llama_build_graph_defrag(lctx, kv_self, ids);
 
     llama_graph_compute(lctx, gf, lctx.cparams.n_threads, lctx.threadpool);
 #endif
@@ -18206,13 +20091,79 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     //const int64_t t_end = ggml_time_us();
 
     //LLAMA_LOG_INFO("(tmp log) KV defrag time: %.3f ms\n", (t_end - t_start)/1000.0);
+
+    return true;
+}
+
+// make the pending copies of the cells that are no longer shared (see llama_kv_cache_cell_unshare)
+static void llama_kv_cache_cow_internal(struct llama_context & lctx, struct llama_kv_cache & kv) {
+    const uint32_t n_layer = lctx.model.hparams.n_layer;
+
+    // same limit as the moves of llama_kv_cache_defrag_internal
+    const uint32_t max_copies = (llama_model_max_nodes(lctx.model) - 2*n_layer)/(6*n_layer);
+
+    std::vector<llama_kv_cache_copy> copies;
+
+    auto compute = [&]() {
+        ggml_backend_sched_reset(lctx.sched.get());
+
+        ggml_cgraph * gf = llama_build_graph_kv_copy(lctx, kv, copies);
+
+        llama_graph_compute(lctx, gf, lctx.cparams.n_threads, lctx.threadpool);
+
+        copies.clear();
+    };
+
+    // the source cells are never destinations, so the copies can be made in any order
+    for (const auto & it : kv.cow_dst) {
+        if (!copies.empty()) {
+            auto & last = copies.back();
+            if (last.i_dst + last.n == it.first && last.i_src + last.n == it.second) {
+                last.n++;
+                continue;
+            }
+        }
+
+        if (copies.size() == max_copies) {
+            compute();
+        }
+
+        copies.push_back({ it.second, it.first, 1 });
+    }
+
+    if (!copies.empty()) {
+        compute();
+    }
+
+    kv.cow_dst.clear();
+    kv.cow_src.clear();
+}
+
+// returns true if any copy was made
+static bool llama_kv_cache_cow_apply(struct llama_context & lctx) {
+    bool res = false;
+
+    for (auto * kv : { &lctx.kv_self, &lctx.kv_swa }) {
+        if (!kv->cow_dst.empty()) {
+            llama_kv_cache_cow_internal(lctx, *kv);
+
+            res = true;
+        }
+    }
+
+    return res;
 }
 
 static void llama_kv_cache_update_internal(struct llama_context & lctx) {
     bool need_reserve = false;
 
+    // copy the cells that are no longer shared, before they are shifted
+    if (llama_kv_cache_cow_apply(lctx)) {
+        need_reserve = true;
+    }
+
     // apply K-shift if needed
-    if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && lctx.kv_self.has_shift) {
+    if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && (lctx.kv_self.has_shift || lctx.kv_swa.has_shift)) {
         if (!llama_kv_cache_can_shift(&lctx)) {
             GGML_ABORT("Deepseek2 does not support K-shift");
         }
@@ -18231,41 +20182,45 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
             need_reserve = true;
         }
 
-        {
-            auto & kv_self = lctx.kv_self;
+        for (auto * kv : { &lctx.kv_self, &lctx.kv_swa }) {
+            if (!kv->has_shift) {
+                continue;
+            }
 
-            kv_self.has_shift = false;
+            kv->has_shift = false;
 
-            for (uint32_t i = 0; i < kv_self.size; ++i) {
-                kv_self.cells[i].delta = 0;
+            for (uint32_t i = kv->shift_beg; i < kv->shift_end; ++i) {
+                kv->cells[i].delta = 0;
             }
         }
     }
 
-    // defragment the KV cache if needed
-    if (lctx.kv_self.do_defrag) {
-        llama_kv_cache_defrag_internal(lctx);
+    // defragment the KV cache if needed (one step, see llama_kv_cache_defrag_internal)
+    // the defrag graph only copies views of the cache, so the worst-case graph is reserved again only if it made the
+    // scheduler grow the compute buffers - not after each step
+    auto sched_size = [&lctx]() {
+        size_t size = 0;
+        for (auto & backend : lctx.backends) {
+            size += ggml_backend_sched_get_buffer_size(lctx.sched.get(), backend.get());
+        }
+        return size;
+    };
+
+    for (auto * kv : { &lctx.kv_self, &lctx.kv_swa }) {
+        if (!kv->do_defrag) {
+            continue;
+        }
 
-        need_reserve = true;
+        const size_t size_prev = sched_size();
 
-        lctx.kv_self.do_defrag = false;
+        if (llama_kv_cache_defrag_internal(lctx, *kv) && sched_size() != size_prev) {
+            need_reserve = true;
+        }
     }
 
     // reserve a worst case graph again
     if (need_reserve) {
-        // TODO: extract to a function
-        // build worst-case graph
-        uint32_t n_seqs = 1; // TODO: worst-case number of sequences
-        uint32_t n_tokens = std::min(lctx.cparams.n_ctx, lctx.cparams.n_ubatch);
-        llama_token token = llama_token_bos(&lctx.model); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
-        llama_ubatch ubatch = { true, n_tokens, n_tokens / n_seqs, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
-        ggml_cgraph * gf = llama_build_graph(lctx, ubatch, true);
-
-        // initialize scheduler with the worst-case graph
-        ggml_backend_sched_reset(lctx.sched.get());
-        if (!ggml_backend_sched_reserve(lctx.sched.get(), gf)) {
-            LLAMA_LOG_ERROR("%s: failed to allocate compute buffers\n", __func__);
-        }
+        llama_graph_reserve(lctx);
     }
 }
 
@@ -19352,6 +21307,53 @@ void llama_lora_adapter_clear(struct llama_context * ctx) {
     ctx->lora_adapters.clear();
 }
 
+int32_t llama_lora_adapter_seq_set(
+            struct llama_context * ctx,
+            struct llama_lora_adapter * adapter,
+            llama_seq_id seq_id,
+            float scale) {
+    if (ctx->cparams.flash_attn) {
+        LLAMA_LOG_ERROR("%s: flash_attn is not compatible with LoRA\n", __func__);
+        return -1;
+    }
+    if (seq_id < 0 || seq_id >= LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: invalid seq_id = %d\n", __func__, seq_id);
+        return -1;
+    }
+
+    auto & lora_seq = ctx->lora_seq;
+
+    auto it = std::find(lora_seq.adapters.begin(), lora_seq.adapters.end(), adapter);
+    if (it == lora_seq.adapters.end()) {
+        // the slices of the adapter are written by the next decode, at the first free index
+        it = std::find(lora_seq.adapters.begin(), lora_seq.adapters.end(), nullptr);
+        if (it == lora_seq.adapters.end()) {
+            it = lora_seq.adapters.insert(lora_seq.adapters.end(), nullptr);
+        }
+        *it = adapter;
+        lora_seq.pending.insert(it - lora_seq.adapters.begin());
+    }
+
+    lora_seq.seqs[seq_id] = std::make_pair((int32_t) (it - lora_seq.adapters.begin()), scale);
+
+    // the previous adapter of the sequence
+    lora_seq.release_unused();
+
+    return 0;
+}
+
+void llama_lora_adapter_seq_clear(struct llama_context * ctx, llama_seq_id seq_id) {
+    auto & lora_seq = ctx->lora_seq;
+
+    if (seq_id >= 0) {
+        lora_seq.seqs.erase(seq_id);
+        lora_seq.release_unused();
+        return;
+    }
+
+    lora_seq.clear();
+}
+
 void llama_lora_adapter_free(struct llama_lora_adapter * adapter) {
     delete adapter;
 }
@@ -19402,6 +21404,9 @@ struct llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.defrag_max_cells            =*/ 0,
+        /*.kv_block_size               =*/ 0,
+        /*.kv_size_step                =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
@@ -19411,6 +21416,8 @@ struct llama_context_params llama_context_default_params() {
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
         /*.no_perf                     =*/ true,
+        /*.kv_shrink                   =*/ false,
+        /*.swa_ring                    =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
     };
@@ -19448,6 +21455,10 @@ size_t llama_max_devices(void) {
     return 16;
 }
 
+size_t llama_max_parallel_sequences(void) {
+    return LLAMA_MAX_SEQ;
+}
+
 bool llama_supports_mmap(void) {
     return llama_mmap::SUPPORTED;
 }
@@ -19651,8 +21662,9 @@ struct llama_context * llama_new_context_with_model(
         params.flash_attn = false;
     }
 
-    if (ggml_is_quantized(params.type_v) && !params.flash_attn) {
-        LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+    if (params.n_seq_max > LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: n_seq_max = %u is larger than the number of sequences the KV cache supports (%d)\n",
+                __func__, params.n_seq_max, LLAMA_MAX_SEQ);
         return nullptr;
     }
 
@@ -19669,10 +21681,14 @@ struct llama_context * llama_new_context_with_model(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.defrag_max_cells = params.defrag_max_cells;
+    cparams.kv_block_size    = params.kv_block_size;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
     cparams.no_perf          = params.no_perf;
+    cparams.kv_shrink        = params.kv_shrink;
+    cparams.swa_ring         = params.swa_ring;
     cparams.pooling_type     = params.pooling_type;
 
     cparams.n_ctx            = params.n_ctx           == 0    ? hparams.n_ctx_train           : params.n_ctx;
@@ -19681,6 +21697,7 @@ struct llama_context * llama_new_context_with_model(
 
     // this is necessary due to kv_self.n being padded later during inference
     cparams.n_ctx            = GGML_PAD(cparams.n_ctx, llama_kv_cache_get_padding(cparams));
+    cparams.kv_size_step     = GGML_PAD(params.kv_size_step, llama_kv_cache_get_padding(cparams));
 
     // with causal attention, the batch size is limited by the context size
     cparams.n_batch          = hparams.causal_attn ? std::min(cparams.n_ctx, params.n_batch) : params.n_batch;
@@ -19823,22 +21840,97 @@ struct llama_context * llama_new_context_with_model(
             }
         }
 
-        if (!llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, kv_size, cparams.offload_kqv)) {
+        // with swa_ring, the layers using sliding window attention only keep the cells of the last n_swa positions
+        // of each sequence, so that they can be stored in a cache much smaller than the context
+        uint32_t kv_size_swa = 0;
+        uint32_t n_layer_swa = 0;
+
+        for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+            n_layer_swa += hparams.is_swa(il);
+        }
+
+        if (cparams.swa_ring && !llama_model_is_recurrent(model) && n_layer_swa > 0) {
+            const uint32_t pad = llama_kv_cache_get_padding(cparams);
+
+            kv_size_swa = (cparams.n_seq_max*hparams.n_swa + cparams.n_ubatch + pad - 1)/pad*pad;
+
+            if (kv_size_swa >= kv_size) {
+                LLAMA_LOG_INFO("%s: the sliding window does not fit in less than n_ctx cells, disabling swa_ring\n", __func__);
+                kv_size_swa = 0;
+            }
+        }
+
+        bool ok = true;
+
+        if (kv_size_swa > 0 && n_layer_swa == hparams.n_layer) {
+            // all the layers use the sliding window
+            ok = llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, kv_size_swa, cparams.offload_kqv, nullptr, hparams.n_swa);
+        } else if (kv_size_swa > 0) {
+            ok = llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, kv_size,     cparams.offload_kqv,
+                    [&](int32_t il) { return !hparams.is_swa(il); }) &&
+                 llama_kv_cache_init(ctx->kv_swa,  ctx, type_k, type_v, kv_size_swa, cparams.offload_kqv,
+                    [&](int32_t il) { return  hparams.is_swa(il); }, hparams.n_swa);
+        } else {
+            ok = llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, kv_size, cparams.offload_kqv);
+        }
+
+        if (!ok) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
         }
 
+        if (kv_size_swa > 0) {
+            LLAMA_LOG_INFO("%s: SWA layers: %u, window = %u, cache size = %u cells\n", __func__, n_layer_swa, hparams.n_swa, kv_size_swa);
+        }
+
+        // without flash attention, a quantized V cache is multiplied with ggml_out_prod (see llm_build_kqv_v),
+        // which not all the backends support - check it on the device of each V buffer
+        if (ggml_is_quantized(type_v) && !cparams.flash_attn) {
+            for (const auto * kv : { &ctx->kv_self, &ctx->kv_swa }) {
+                for (size_t il = 0; il < kv->v_l.size(); ++il) {
+                    if (kv->v_l[il] == nullptr) {
+                        continue;
+                    }
+
+                    ggml_backend_buffer_type_t buft = ggml_backend_buffer_get_type(kv->v_l[il]->buffer);
+                    ggml_backend_dev_t         dev  = ggml_backend_buft_get_device(buft);
+                    if (dev == nullptr && ggml_backend_buft_is_host(buft)) {
+                        // the CPU buffer type has no device
+                        dev = ggml_backend_get_device(ctx->backend_cpu);
+                    }
+
+                    const int64_t n_head_kv = std::max<int64_t>(1, hparams.n_head_kv(il));
+                    const int64_t n_head    = std::max<int64_t>(n_head_kv, hparams.n_head(il));
+
+                    auto fn = [&](ggml_context * ctx_op) {
+                        ggml_tensor * v  = ggml_new_tensor_3d(ctx_op, type_v,        hparams.n_embd_head_v, 256, n_head_kv);
+                        ggml_tensor * kq = ggml_new_tensor_3d(ctx_op, GGML_TYPE_F32, 256, cparams.n_ubatch, n_head);
+                        return ggml_out_prod(ctx_op, v, ggml_transpose(ctx_op, kq));
+                    };
+
+                    if (dev == nullptr || !buft_supported(buft, dev, fn)) {
+                        LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn on the %s backend\n", __func__,
+                                dev ? ggml_backend_dev_name(dev) : ggml_backend_buft_name(buft));
+                        llama_free(ctx);
+                        return nullptr;
+                    }
+                }
+            }
+        }
+
         {
             size_t memory_size_k = 0;
             size_t memory_size_v = 0;
 
-            for (auto & k : ctx->kv_self.k_l) {
-                memory_size_k += ggml_nbytes(k);
-            }
+            for (const auto * kv : { &ctx->kv_self, &ctx->kv_swa }) {
+                for (auto & k : kv->k_l) {
+                    memory_size_k += k ? ggml_nbytes(k) : 0;
+                }
 
-            for (auto & v : ctx->kv_self.v_l) {
-                memory_size_v += ggml_nbytes(v);
+                for (auto & v : kv->v_l) {
+                    memory_size_v += v ? ggml_nbytes(v) : 0;
+                }
             }
 
             LLAMA_LOG_INFO("%s: KV self size  = %7.2f MiB, K (%s): %7.2f MiB, V (%s): %7.2f MiB\n", __func__,
@@ -19861,6 +21953,31 @@ struct llama_context * llama_new_context_with_model(
                     ggml_backend_buffer_get_size(ctx->buf_output.get()) / 1024.0 / 1024.0);
         }
 
+        // without flash attention, the KQ mask is applied by ggml_soft_max_ext, which some backends
+        // only support with an F32 mask - use an F32 mask if any of them would run it
+        cparams.kq_mask_f16 = true;
+
+        if (!cparams.flash_attn) {
+            ggml_init_params params_op = {
+                /*.mem_size   =*/ ggml_tensor_overhead()*8,
+                /*.mem_buffer =*/ NULL,
+                /*.no_alloc   =*/ true,
+            };
+            ggml_context_ptr ctx_op { ggml_init(params_op) };
+
+            ggml_tensor * kq = ggml_new_tensor_2d(ctx_op.get(), GGML_TYPE_F32, 256, GGML_KQ_MASK_PAD);
+
+            ggml_tensor * op_f32 = ggml_soft_max_ext(ctx_op.get(), kq, ggml_new_tensor_2d(ctx_op.get(), GGML_TYPE_F32, 256, GGML_KQ_MASK_PAD), 1.0f, 0.0f);
+            ggml_tensor * op_f16 = ggml_soft_max_ext(ctx_op.get(), kq, ggml_new_tensor_2d(ctx_op.get(), GGML_TYPE_F16, 256, GGML_KQ_MASK_PAD), 1.0f, 0.0f);
+
+            for (auto & backend : ctx->backends) {
+                if (ggml_backend_supports_op(backend.get(), op_f32) && !ggml_backend_supports_op(backend.get(), op_f16)) {
+                    LLAMA_LOG_INFO("%s: the %s backend does not support an F16 KQ mask, using an F32 mask\n", __func__, ggml_backend_name(backend.get()));
+                    cparams.kq_mask_f16 = false;
+                }
+            }
+        }
+
         // scheduler and compute buffers
         {
             // buffer types used for the compute buffer of each backend
@@ -19992,6 +22109,20 @@ uint32_t llama_n_seq_max(const struct llama_context * ctx) {
     return ctx->kv_self.size;
 }
 
+uint64_t llama_context_size(const struct llama_context * ctx) {
+    uint64_t size = ctx->kv_self.total_size() + ctx->kv_swa.total_size();
+    if (ctx->buf_output) {
+        size += ggml_backend_buffer_get_size(ctx->buf_output.get());
+    }
+    for (auto & buf : ctx->lora_seq.bufs) {
+        size += ggml_backend_buffer_get_size(buf.get());
+    }
+    for (auto & backend : ctx->backends) {
+        size += ggml_backend_sched_get_buffer_size(ctx->sched.get(), backend.get());
+    }
+    return size;
+}
+
 enum llama_vocab_type llama_vocab_type(const struct llama_model * model) {
     return model->vocab.type;
 }
@@ -20016,6 +22147,10 @@ int32_t llama_n_head(const struct llama_model * model) {
     return model->hparams.n_head();
 }
 
+int32_t llama_n_swa(const struct llama_model * model) {
+    return model->hparams.n_swa;
+}
+
 const struct llama_model * llama_get_model(const struct llama_context * ctx) {
     return &ctx->model;
 }
@@ -20373,13 +22508,12 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
         }
 
         int seq_idx = 0;
-        for (const llama_seq_id it : kv_cells[i].seq_id) {
-            if (seq_idx >= view->n_seq_max) {
-                break;
+        kv_cells[i].seq_id.for_each([&](llama_seq_id it) {
+            if (seq_idx < view->n_seq_max) {
+                cs_curr[seq_idx] = it;
+                seq_idx++;
             }
-            cs_curr[seq_idx] = it;
-            seq_idx++;
-        }
+        });
         if (seq_idx != 0) {
             used_cells++;
         }
@@ -20417,9 +22551,21 @@ int32_t llama_get_kv_cache_used_cells(const struct llama_context * ctx) {
 
 void llama_kv_cache_clear(struct llama_context * ctx) {
     llama_kv_cache_clear(ctx->kv_self);
+
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_clear(ctx->kv_swa);
+    }
+
+    if (ctx->cparams.kv_shrink) {
+        llama_kv_cache_shrink(*ctx);
+    }
 }
 
 bool llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_rm(ctx->kv_swa, seq_id, p0, p1);
+    }
+
     return llama_kv_cache_seq_rm(ctx->kv_self, seq_id, p0, p1);
 }
 
@@ -20428,10 +22574,29 @@ void llama_kv_cache_seq_cp(struct llama_context * ctx, llama_seq_id seq_id_src,
         return;
     }
     llama_kv_cache_seq_cp(ctx->kv_self, seq_id_src, seq_id_dst, p0, p1);
+
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_cp(ctx->kv_swa, seq_id_src, seq_id_dst, p0, p1);
+    }
+}
+
+void llama_kv_cache_seq_fork(struct llama_context * ctx, llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
+    if (seq_id_src == seq_id_dst) {
+        return;
+    }
+    llama_kv_cache_seq_fork(ctx->kv_self, seq_id_src, seq_id_dst, p0, p1);
+
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_fork(ctx->kv_swa, seq_id_src, seq_id_dst, p0, p1);
+    }
 }
 
 void llama_kv_cache_seq_keep(struct llama_context * ctx, llama_seq_id seq_id) {
     llama_kv_cache_seq_keep(ctx->kv_self, seq_id);
+
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_keep(ctx->kv_swa, seq_id);
+    }
 }
 
 void llama_kv_cache_seq_add(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
@@ -20440,6 +22605,10 @@ void llama_kv_cache_seq_add(struct llama_context * ctx, llama_seq_id seq_id, lla
     }
 
     llama_kv_cache_seq_add(ctx->kv_self, seq_id, p0, p1, delta);
+
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_add(ctx->kv_swa, seq_id, p0, p1, delta);
+    }
 }
 
 void llama_kv_cache_seq_div(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
@@ -20448,14 +22617,36 @@ void llama_kv_cache_seq_div(struct llama_context * ctx, llama_seq_id seq_id, lla
     }
 
     llama_kv_cache_seq_div(ctx->kv_self, seq_id, p0, p1, d);
+
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_div(ctx->kv_swa, seq_id, p0, p1, d);
+    }
 }
 
 llama_pos llama_kv_cache_seq_pos_max(struct llama_context * ctx, llama_seq_id seq_id) {
     return llama_kv_cache_seq_pos_max(ctx->kv_self, seq_id);
 }
 
+llama_pos llama_kv_cache_seq_pos_min(struct llama_context * ctx, llama_seq_id seq_id) {
+    llama_pos p_min = llama_kv_cache_seq_pos_min(ctx->kv_self, seq_id);
+
+    if (ctx->kv_swa.size > 0) {
+        p_min = std::max(p_min, llama_kv_cache_seq_pos_min(ctx->kv_swa, seq_id));
+    }
+
+    return p_min;
+}
+
 void llama_kv_cache_defrag(struct llama_context * ctx) {
     llama_kv_cache_defrag(ctx->kv_self);
+
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_defrag(ctx->kv_swa);
+    }
+}
+
+bool llama_kv_cache_defrag_pending(const struct llama_context * ctx) {
+    return ctx->kv_self.do_defrag || ctx->kv_swa.do_defrag;
 }
 
 void llama_kv_cache_update(struct llama_context * ctx) {
@@ -20583,29 +22774,35 @@ struct llama_data_write {
                 write(&n_seq_id, sizeof(n_seq_id));
 
                 if (n_seq_id) {
-                    for (auto seq_id : cell.seq_id) {
+                    cell.seq_id.for_each([&](llama_seq_id seq_id) {
                         write(&seq_id, sizeof(seq_id));
-                    }
+                    });
                 }
             }
         }
     }
 
-    void write_kv_cache_data(const struct llama_context * ctx, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) {
-        const struct llama_kv_cache & kv_self = ctx->kv_self;
+    void write_kv_cache_data(const struct llama_context * ctx, const llama_kv_cache & kv_self, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) {
         const struct llama_hparams & hparams = ctx->model.hparams;
 
         const uint32_t v_trans = kv_self.v_trans ? 1 : 0;
         const uint32_t n_layer = hparams.n_layer;
 
-        write(&v_trans, sizeof(v_trans));
-        write(&n_layer, sizeof(n_layer));
+        // only the layers stored in this cache are written
+        const uint32_t n_layer_kv = llama_kv_cache_n_layer(kv_self);
+
+        write(&v_trans,    sizeof(v_trans));
+        write(&n_layer_kv, sizeof(n_layer_kv));
 
         std::vector<uint8_t> tmp_buf;
 
         // Iterate and write all the keys first, each row is a cell
         // Get whole range at a time
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (kv_self.k_l[il] == nullptr) {
+                continue;
+            }
+
             const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
 
             // Write key type
@@ -20626,6 +22823,10 @@ struct llama_data_write {
 
         if (!kv_self.v_trans) {
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (kv_self.v_l[il] == nullptr) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Write value type
@@ -20647,6 +22848,10 @@ struct llama_data_write {
             // When v is transposed, we also need the element size and get the element ranges from each row
             const uint32_t kv_size = kv_self.size;
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (kv_self.v_l[il] == nullptr) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Write value type
@@ -20674,8 +22879,7 @@ struct llama_data_write {
         }
     }
 
-    void write_kv_cache(const struct llama_context * ctx, llama_seq_id seq_id = -1) {
-        const struct llama_kv_cache & kv_self = ctx->kv_self;
+    void write_kv_cache(const struct llama_context * ctx, const llama_kv_cache & kv_self, llama_seq_id seq_id = -1) {
         std::vector<std::pair<uint32_t, uint32_t>> cell_ranges; // ranges, from inclusive, to exclusive
         uint32_t cell_count = 0;
 
@@ -20710,7 +22914,16 @@ struct llama_data_write {
         write(&cell_count, sizeof(cell_count));
 
         write_kv_cache_meta(kv_self, cell_ranges, seq_id);
-        write_kv_cache_data(ctx, cell_ranges);
+        write_kv_cache_data(ctx, kv_self, cell_ranges);
+    }
+
+    void write_kv_cache(const struct llama_context * ctx, llama_seq_id seq_id = -1) {
+        write_kv_cache(ctx, ctx->kv_self, seq_id);
+
+        // the SWA layers stored in their own cache follow
+        if (ctx->kv_swa.size > 0) {
+            write_kv_cache(ctx, ctx->kv_swa, seq_id);
+        }
     }
 };
 
@@ -20802,8 +23015,9 @@ struct llama_data_read {
         }
     }
 
-    bool read_kv_cache_meta(struct llama_context * ctx, uint32_t cell_count, llama_seq_id dest_seq_id = -1) {
-        struct llama_kv_cache & kv_self = ctx->kv_self;
+    bool read_kv_cache_meta(struct llama_context * ctx, llama_kv_cache & kv_self, uint32_t cell_count, llama_seq_id dest_seq_id = -1) {
+        // only the main cache can grow
+        const bool can_grow = &kv_self == &ctx->kv_self;
 
         if (dest_seq_id != -1) {
             // single sequence
@@ -20831,21 +23045,28 @@ struct llama_data_read {
             }
             batch.n_seq_id[0] = 1;
             batch.seq_id[0] = &dest_seq_id;
-            if (!llama_kv_cache_find_slot(kv_self, batch)) {
+            if (!(can_grow ? llama_kv_cache_find_slot_grow(*ctx, batch) : llama_kv_cache_find_slot(kv_self, batch))) {
                 LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
                 return false;
             }
 
-            // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
-            // Assume that this is one contiguous block of cells
-            GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
-            GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-            GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+            if (kv_self.runs.empty() && cell_count > 0) {
+                kv_self.runs.push_back({ 0, kv_self.head, cell_count });
+            }
+
+            // DEBUG CHECK: each run should start and end with the expected cells (verify seq_id and pos values)
+            for (const auto & run : kv_self.runs) {
+                GGML_ASSERT(run.i_cell + run.n <= kv_self.size);
+                GGML_ASSERT(kv_self.cells[run.i_cell].pos == batch.pos[run.i_token]);
+                GGML_ASSERT(kv_self.cells[run.i_cell + run.n - 1].pos == batch.pos[run.i_token + run.n - 1]);
+                GGML_ASSERT(kv_self.cells[run.i_cell].has_seq_id(dest_seq_id));
+                GGML_ASSERT(kv_self.cells[run.i_cell + run.n - 1].has_seq_id(dest_seq_id));
+            }
         } else {
             // whole KV cache restore
 
+            while (can_grow && cell_count > kv_self.size && llama_kv_cache_grow(*ctx)) {}
+
             if (cell_count > kv_self.size) {
                 LLAMA_LOG_ERROR("%s: not enough cells in kv cache\n", __func__);
                 return false;
@@ -20854,15 +23075,13 @@ struct llama_data_read {
             llama_kv_cache_clear(kv_self);
 
             for (uint32_t i = 0; i < cell_count; ++i) {
-                llama_kv_cell & cell = kv_self.cells[i];
-
                 llama_pos pos;
                 uint32_t  n_seq_id;
 
                 read_to(&pos,      sizeof(pos));
                 read_to(&n_seq_id, sizeof(n_seq_id));
 
-                cell.pos = pos;
+                llama_kv_cache_cell_pos_set(kv_self, i, pos);
 
                 for (uint32_t j = 0; j < n_seq_id; ++j) {
                     llama_seq_id seq_id;
@@ -20873,7 +23092,7 @@ struct llama_data_read {
                         return false;
                     }
 
-                    cell.seq_id.insert(seq_id);
+                    llama_kv_cache_cell_seq_add(kv_self, i, seq_id);
 
                     if (kv_self.recurrent) {
                         int32_t & tail = kv_self.cells[seq_id].tail;
@@ -20888,6 +23107,10 @@ struct llama_data_read {
 
             kv_self.head = 0;
             kv_self.used = cell_count;
+
+            if (cell_count > 0) {
+                kv_self.runs.push_back({ 0, 0, cell_count });
+            }
         }
 
         if (kv_self.recurrent) {
@@ -20901,16 +23124,16 @@ struct llama_data_read {
         return true;
     }
 
-    bool read_kv_cache_data(struct llama_context * ctx, uint32_t cell_count) {
+    bool read_kv_cache_data(struct llama_context * ctx, llama_kv_cache & kv_self, uint32_t cell_count) {
         const struct llama_hparams & hparams = ctx->model.hparams;
-        struct llama_kv_cache & kv_self = ctx->kv_self;
+        const uint32_t n_layer = hparams.n_layer;
         uint32_t v_trans;
-        uint32_t n_layer;
-        read_to(&v_trans, sizeof(v_trans));
-        read_to(&n_layer, sizeof(n_layer));
+        uint32_t n_layer_kv;
+        read_to(&v_trans,    sizeof(v_trans));
+        read_to(&n_layer_kv, sizeof(n_layer_kv));
 
-        if (n_layer != hparams.n_layer) {
-            LLAMA_LOG_ERROR("%s: mismatched layer count (%u instead of %u)\n", __func__, n_layer, hparams.n_layer);
+        if (n_layer_kv != llama_kv_cache_n_layer(kv_self)) {
+            LLAMA_LOG_ERROR("%s: mismatched layer count (%u instead of %u)\n", __func__, n_layer_kv, llama_kv_cache_n_layer(kv_self));
             return false;
         }
         if (cell_count > kv_self.size) {
@@ -20924,6 +23147,10 @@ struct llama_data_read {
 
         // For each layer, read the keys for each cell, one row is one cell, read as one contiguous block
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (kv_self.k_l[il] == nullptr) {
+                continue;
+            }
+
             const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
 
             // Read type of key
@@ -20946,12 +23173,19 @@ struct llama_data_read {
 
             if (cell_count) {
                 // Read and set the keys for the whole cell range
-                ggml_backend_tensor_set(kv_self.k_l[il], read(cell_count * k_size_row), kv_self.head * k_size_row, cell_count * k_size_row);
+                const uint8_t * src = read(cell_count * k_size_row);
+                for (const auto & run : kv_self.runs) {
+                    ggml_backend_tensor_set(kv_self.k_l[il], src + run.i_token * k_size_row, run.i_cell * k_size_row, run.n * k_size_row);
+                }
             }
         }
 
         if (!kv_self.v_trans) {
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (kv_self.v_l[il] == nullptr) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Read type of value
@@ -20974,12 +23208,19 @@ struct llama_data_read {
 
                 if (cell_count) {
                     // Read and set the values for the whole cell range
-                    ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_row), kv_self.head * v_size_row, cell_count * v_size_row);
+                    const uint8_t * src = read(cell_count * v_size_row);
+                    for (const auto & run : kv_self.runs) {
+                        ggml_backend_tensor_set(kv_self.v_l[il], src + run.i_token * v_size_row, run.i_cell * v_size_row, run.n * v_size_row);
+                    }
                 }
             }
         } else {
             // For each layer, read the values for each cell (transposed)
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (kv_self.v_l[il] == nullptr) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Read type of value
@@ -21011,8 +23252,11 @@ struct llama_data_read {
                 if (cell_count) {
                     // For each row in the transposed matrix, read the values for the whole cell range
                     for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                        const size_t dst_offset = (kv_self.head + j * kv_self.size) * v_size_el;
-                        ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+                        const uint8_t * src = read(cell_count * v_size_el);
+                        for (const auto & run : kv_self.runs) {
+                            const size_t dst_offset = (run.i_cell + j * kv_self.size) * v_size_el;
+                            ggml_backend_tensor_set(kv_self.v_l[il], src + run.i_token * v_size_el, dst_offset, run.n * v_size_el);
+                        }
                     }
                 }
             }
@@ -21020,11 +23264,23 @@ struct llama_data_read {
         return true;
     }
 
-    void read_kv_cache(struct llama_context * ctx, llama_seq_id seq_id = -1) {
+    bool read_kv_cache(struct llama_context * ctx, llama_kv_cache & kv_self, llama_seq_id seq_id) {
         uint32_t cell_count;
         read_to(&cell_count, sizeof(cell_count));
 
-        bool res = read_kv_cache_meta(ctx, cell_count, seq_id) && read_kv_cache_data(ctx, cell_count);
+        bool res = read_kv_cache_meta(ctx, kv_self, cell_count, seq_id) && read_kv_cache_data(ctx, kv_self, cell_count);
+
+        kv_self.runs.clear();
+
+        return res;
+    }
+
+    void read_kv_cache(struct llama_context * ctx, llama_seq_id seq_id = -1) {
+        bool res = read_kv_cache(ctx, ctx->kv_self, seq_id);
+
+        if (res && ctx->kv_swa.size > 0) {
+            res = read_kv_cache(ctx, ctx->kv_swa, seq_id);
+        }
 
         if (!res) {
             if (seq_id == -1) {
@@ -21176,6 +23432,9 @@ struct llama_data_read_file : llama_data_read {
 static size_t llama_state_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx) {
     llama_synchronize(ctx);
 
+    // the copies of the cells that are no longer shared must have their data before it is saved
+    llama_kv_cache_cow_apply(*ctx);
+
     data_ctx.write_model_info(ctx);
 
     // copy outputs
@@ -21316,6 +23575,8 @@ bool llama_state_save_file(struct llama_context * ctx, const char * path_session
 static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx, llama_seq_id seq_id) {
     llama_synchronize(ctx);
 
+    llama_kv_cache_cow_apply(*ctx);
+
     data_ctx.write_kv_cache(ctx, seq_id);
 
     return data_ctx.get_size_written();
@@ -21339,6 +23600,9 @@ size_t llama_state_seq_get_data(struct llama_context * ctx, uint8_t * dst, size_
 static size_t llama_state_seq_set_data_internal(struct llama_context * ctx, llama_data_read & data_ctx, llama_seq_id dest_seq_id) {
     llama_synchronize(ctx);
 
+    // the free cells that are the source of pending copies must not be overwritten
+    llama_kv_cache_cow_apply(*ctx);
+
     data_ctx.read_kv_cache(ctx, dest_seq_id);
 
     return data_ctx.get_size_read();
@@ -0,0 +1,95 @@
+#include "random-model.h"
+
+#include "ggml.h"
+
+#include <random>
+#include <string>
+
+void make_random_model(const char * fname_vocab, const char * fname_out, const char * name, const random_model_params & hp) {
+    struct ggml_context * ctx_vocab = nullptr;
+    struct gguf_init_params params_vocab = { /*.no_alloc =*/ true, /*.ctx =*/ &ctx_vocab };
+
+    struct gguf_context * src = gguf_init_from_file(fname_vocab, params_vocab);
+    TEST_ASSERT(src != nullptr);
+
+    struct gguf_context * dst = gguf_init_empty();
+    gguf_set_kv(dst, src);
+
+    const int n_vocab = gguf_get_arr_n(src, gguf_find_key(src, "tokenizer.ggml.tokens"));
+
+    const int n_embd    = hp.n_embd;
+    const int n_layer   = hp.n_layer;
+    const int n_ff      = hp.n_ff;
+    const int n_embd_kv = hp.n_embd/hp.n_head*hp.n_head_kv;
+
+    const std::string arch = hp.n_swa > 0 ? "gemma2" : "llama";
+
+    gguf_set_val_str(dst, "general.architecture", arch.c_str());
+    gguf_set_val_str(dst, "general.name", name);
+    gguf_set_val_u32(dst, "general.file_type", 0);
+    gguf_set_val_u32(dst, (arch + ".context_length").c_str(), 4096);
+    gguf_set_val_u32(dst, (arch + ".embedding_length").c_str(), n_embd);
+    gguf_set_val_u32(dst, (arch + ".block_count").c_str(), n_layer);
+    gguf_set_val_u32(dst, (arch + ".feed_forward_length").c_str(), n_ff);
+    gguf_set_val_u32(dst, (arch + ".attention.head_count").c_str(), hp.n_head);
+    gguf_set_val_u32(dst, (arch + ".attention.head_count_kv").c_str(), hp.n_head_kv);
+    gguf_set_val_u32(dst, (arch + ".rope.dimension_count").c_str(), n_embd/hp.n_head);
+    gguf_set_val_f32(dst, (arch + ".attention.layer_norm_rms_epsilon").c_str(), 1e-5f);
+    if (hp.n_swa > 0) {
+        gguf_set_val_u32(dst, (arch + ".attention.sliding_window").c_str(), hp.n_swa);
+    }
+
+    const size_t n_weights = 2*(size_t) n_vocab*n_embd + n_embd + (size_t) n_layer*(2*n_embd*n_embd + 2*n_embd*n_embd_kv + 3*n_embd*n_ff + 2*n_embd);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ n_weights*sizeof(float) + 256*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 0.2f);
+
+    auto add = [&](const std::string & name, int64_t ne0, int64_t ne1) {
+        struct ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            data[i] = ne1 > 0 ? dist(rng) : 1.0f; // norms are 1
+        }
+        gguf_add_tensor(dst, t);
+    };
+
+    add("token_embd.weight",  n_embd, n_vocab);
+    add("output_norm.weight", n_embd, 0);
+    if (hp.n_swa == 0) {
+        add("output.weight", n_embd, n_vocab); // gemma2 shares it with token_embd
+    }
+
+    for (int il = 0; il < n_layer; ++il) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+
+        add(blk + "attn_norm.weight",   n_embd, 0);
+        add(blk + "attn_q.weight",      n_embd, n_embd);
+        add(blk + "attn_k.weight",      n_embd, n_embd_kv);
+        add(blk + "attn_v.weight",      n_embd, n_embd_kv);
+        add(blk + "attn_output.weight", n_embd, n_embd);
+        add(blk + "ffn_norm.weight",    n_embd, 0);
+        add(blk + "ffn_gate.weight",    n_embd, n_ff);
+        add(blk + "ffn_up.weight",      n_embd, n_ff);
+        add(blk + "ffn_down.weight",    n_ff,   n_embd);
+        if (hp.n_swa > 0) {
+            add(blk + "post_attention_norm.weight", n_embd, 0);
+            add(blk + "post_ffw_norm.weight",       n_embd, 0);
+        }
+    }
+
+    gguf_write_to_file(dst, fname_out, false);
+
+    ggml_free(ctx);
+    gguf_free(dst);
+    gguf_free(src);
+    ggml_free(ctx_vocab);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+#define TEST_ASSERT(x) \
+    do { \
+        if (!(x)) { \
+            fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #x); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+// the hyperparameters of a tiny model with random weights
+struct random_model_params {
+    int n_embd    = 64;
+    int n_layer   = 4;
+    int n_head    = 4;
+    int n_head_kv = 2;
+    int n_ff      = 128;
+    int n_swa     = 0; // > 0: a gemma2 model, whose even layers use sliding window attention, instead of llama
+};
+
+// write a model with random weights and the vocab of fname_vocab
+void make_random_model(const char * fname_vocab, const char * fname_out, const char * name, const random_model_params & hp);
@@ -68,8 +68,12 @@ int main(void) {
     argv = {"binary_name", "-sm", "hello"};
     assert(false == common_params_parse(argv.size(), list_str_to_char(argv).data(), params, LLAMA_EXAMPLE_COMMON));
 
-    // non-existence arg in specific example (--draft cannot be used outside llama-speculative)
-    argv = {"binary_name", "--draft", "123"};
+    // more parallel sequences than the KV cache supports
+    argv = {"binary_name", "-np", "1000"};
+    assert(false == common_params_parse(argv.size(), list_str_to_char(argv).data(), params, LLAMA_EXAMPLE_COMMON));
+
+    // non-existence arg in specific example (--p-split cannot be used outside llama-speculative)
+    argv = {"binary_name", "--p-split", "0.5"};
     assert(false == common_params_parse(argv.size(), list_str_to_char(argv).data(), params, LLAMA_EXAMPLE_SERVER));
 
 
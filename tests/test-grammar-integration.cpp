@@ -731,6 +731,44 @@ static void test_failure_left_recursion() {
     fprintf(stderr, "  ✅︎ Passed\n");
 }
 
+static void test_clone_and_reset() {
+    fprintf(stderr, "⚫ Testing clone and reset:\n");
+
+    llama_grammar * grammar = build_grammar(R"""(root ::= "a" [bc] "d")""");
+    assert(grammar != nullptr);
+
+    const llama_grammar_stacks stacks_org = llama_grammar_get_stacks(grammar);
+
+    assert(!match_string("a", grammar));
+    const llama_grammar_stacks stacks_a = llama_grammar_get_stacks(grammar);
+    assert(stacks_a != stacks_org);
+
+    // the clone shares the rules and the initial stacks, and starts from the stacks of its source
+    llama_grammar * clone = llama_grammar_clone_impl(*grammar);
+    assert(clone->rules       == grammar->rules);
+    assert(clone->stacks_init == grammar->stacks_init);
+    assert(llama_grammar_get_stacks(clone) == stacks_a);
+
+    // the clone and its source advance independently
+    assert(match_string("bd", clone));
+    assert(llama_grammar_get_stacks(grammar) == stacks_a);
+    assert(match_string("cd", grammar));
+
+    // a reset goes back to the initial stacks, of the source and of the clone
+    llama_grammar_reset_impl(*grammar);
+    assert(llama_grammar_get_stacks(grammar) == stacks_org);
+    llama_grammar_reset_impl(*clone);
+    assert(llama_grammar_get_stacks(clone) == stacks_org);
+
+    assert(match_string("abd", grammar));
+    assert(!match_string("ad", clone));
+
+    llama_grammar_free_impl(clone);
+    llama_grammar_free_impl(grammar);
+
+    fprintf(stderr, "  ✅︎ Passed\n");
+}
+
 static void test_json_schema() {
     // Note that this is similar to the regular grammar tests,
     //  but we convert each json schema to a grammar before parsing.
@@ -1304,6 +1342,7 @@ int main() {
     test_failure_missing_root();
     test_failure_missing_reference();
     test_failure_left_recursion();
+    test_clone_and_reset();
     test_json_schema();
     fprintf(stdout, "All tests passed.\n");
     return 0;
@@ -0,0 +1,537 @@
+// tests of the KV cache bookkeeping, run on tiny llama and gemma2 (sliding window attention) models with random weights
+// the models are built from the vocab file given on the command line
+
+#include "llama.h"
+#include "random-model.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static const char * fname_model = "test-kv-cache.gguf";
+
+static llama_context * make_context(llama_model * model, llama_context_params cparams) {
+    cparams.n_threads       = 2;
+    cparams.n_threads_batch = 2;
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    TEST_ASSERT(ctx != nullptr);
+
+    return ctx;
+}
+
+static llama_context_params default_cparams(uint32_t n_ctx, uint32_t n_seq_max = 1) {
+    llama_context_params cparams = llama_context_default_params();
+
+    cparams.n_ctx     = n_ctx;
+    cparams.n_batch   = n_ctx;
+    cparams.n_ubatch  = n_ctx;
+    cparams.n_seq_max = n_seq_max;
+
+    return cparams;
+}
+
+static llama_token tok(llama_pos pos, llama_seq_id seq_id) {
+    return 100 + (pos*7 + seq_id*13) % 1000;
+}
+
+// decode n tokens of seq_id starting at pos p0, with logits for the last one
+static int decode(llama_context * ctx, llama_seq_id seq_id, llama_pos p0, int n) {
+    llama_batch batch = llama_batch_init(n, 0, 1);
+
+    for (int i = 0; i < n; ++i) {
+        batch.token   [i]    = tok(p0 + i, seq_id);
+        batch.pos     [i]    = p0 + i;
+        batch.n_seq_id[i]    = 1;
+        batch.seq_id  [i][0] = seq_id;
+        batch.logits  [i]    = i == n - 1;
+    }
+    batch.n_tokens = n;
+
+    const int ret = llama_decode(ctx, batch);
+
+    llama_batch_free(batch);
+
+    return ret;
+}
+
+static std::vector<float> logits(llama_context * ctx, const llama_model * model) {
+    const float * data = llama_get_logits_ith(ctx, -1);
+    return std::vector<float>(data, data + llama_n_vocab(model));
+}
+
+static bool logits_match(const std::vector<float> & a, const std::vector<float> & b, float tol = 1e-3f) {
+    TEST_ASSERT(a.size() == b.size());
+
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (std::fabs(a[i] - b[i]) > tol) {
+            fprintf(stderr, "logit %zu differs: %f vs %f\n", i, a[i], b[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// the cells of seq_id, in cache order
+static std::vector<int> seq_cells(llama_context * ctx, llama_seq_id seq_id) {
+    llama_kv_cache_view view = llama_kv_cache_view_init(ctx, 4);
+    llama_kv_cache_view_update(ctx, &view);
+
+    std::vector<int> res;
+    for (int i = 0; i < view.n_cells; ++i) {
+        for (int j = 0; j < view.n_seq_max; ++j) {
+            if (view.cells_sequences[i*view.n_seq_max + j] == seq_id) {
+                res.push_back(i);
+            }
+        }
+    }
+
+    llama_kv_cache_view_free(&view);
+
+    return res;
+}
+
+// interleaved sequences give the same logits with and without paging
+static void test_paged_logits(llama_model * model) {
+    std::vector<float> ref[2];
+
+    for (uint32_t block_size : { 0u, 16u }) {
+        llama_context_params cparams = default_cparams(512, 2);
+        cparams.kv_block_size = block_size;
+
+        llama_context * ctx = make_context(model, cparams);
+
+        for (int step = 0; step < 8; ++step) {
+            for (llama_seq_id s = 0; s < 2; ++s) {
+                TEST_ASSERT(decode(ctx, s, step*10, 10) == 0);
+            }
+        }
+
+        for (llama_seq_id s = 0; s < 2; ++s) {
+            TEST_ASSERT(decode(ctx, s, 80, 1) == 0);
+
+            if (block_size == 0) {
+                ref[s] = logits(ctx, model);
+            } else {
+                TEST_ASSERT(logits_match(ref[s], logits(ctx, model)));
+            }
+        }
+
+        llama_free(ctx);
+    }
+}
+
+// a ubatch that is too scattered to be stored fails without leaving entries in the block tables
+static void test_paged_rollback(llama_model * model) {
+    const int n_ctx = 1024;
+
+    std::vector<int> cells[2];
+
+    for (int fail = 0; fail < 2; ++fail) {
+        llama_context_params cparams = default_cparams(n_ctx, 2);
+        cparams.kv_block_size = 4;
+
+        llama_context * ctx = make_context(model, cparams);
+
+        // every other cell is free and no block is free
+        TEST_ASSERT(decode(ctx, 0, 0, n_ctx) == 0);
+        for (llama_pos p = 1; p < n_ctx; p += 2) {
+            TEST_ASSERT(llama_kv_cache_seq_rm(ctx, 0, p, p + 1));
+        }
+
+        if (fail) {
+            // one run per token - more than a single graph can store
+            TEST_ASSERT(decode(ctx, 1, 0, 300) == 1);
+            TEST_ASSERT(llama_get_kv_cache_used_cells(ctx) == n_ctx/2);
+        }
+
+        TEST_ASSERT(decode(ctx, 1, 0, 3) == 0);
+
+        cells[fail] = seq_cells(ctx, 1);
+
+        llama_free(ctx);
+    }
+
+    TEST_ASSERT(cells[0] == cells[1]);
+}
+
+// closing the gap left by removed tokens by moving the tokens after it back, or by moving the tokens
+// before it forward, gives the same logits (the rolling context shift of the server moves the smaller side)
+static void test_shift_sides(llama_model * model) {
+    const int n_keep    = 4;
+    const int n_discard = 16;
+    const int n_past    = 100;
+
+    std::vector<float> res[2];
+
+    for (int move_kept = 0; move_kept < 2; ++move_kept) {
+        // F32 K cache, so that the rounding of the re-roped cells does not hide a difference
+        llama_context_params cparams = default_cparams(256, 1);
+        cparams.type_k = GGML_TYPE_F32;
+
+        llama_context * ctx = make_context(model, cparams);
+
+        TEST_ASSERT(decode(ctx, 0, 0, n_past) == 0);
+
+        for (int shift = 0; shift < 3; ++shift) {
+            // the positions of the sequence start at p0 once the kept tokens have been moved
+            const llama_pos p0 = move_kept ? shift*n_discard : 0;
+
+            TEST_ASSERT(llama_kv_cache_seq_rm(ctx, 0, p0 + n_keep, p0 + n_keep + n_discard));
+
+            if (move_kept) {
+                llama_kv_cache_seq_add(ctx, 0, p0, p0 + n_keep, n_discard);
+            } else {
+                llama_kv_cache_seq_add(ctx, 0, n_keep + n_discard, -1, -n_discard);
+            }
+        }
+
+        const llama_pos p_next = llama_kv_cache_seq_pos_max(ctx, 0) + 1;
+        TEST_ASSERT(p_next == (move_kept ? n_past : n_past - 3*n_discard));
+
+        llama_batch batch = llama_batch_init(1, 0, 1);
+        batch.token   [0]    = tok(n_past, 0);
+        batch.pos     [0]    = p_next;
+        batch.n_seq_id[0]    = 1;
+        batch.seq_id  [0][0] = 0;
+        batch.logits  [0]    = true;
+        batch.n_tokens       = 1;
+        TEST_ASSERT(llama_decode(ctx, batch) == 0);
+        llama_batch_free(batch);
+
+        res[move_kept] = logits(ctx, model);
+
+        llama_free(ctx);
+    }
+
+    TEST_ASSERT(logits_match(res[0], res[1]));
+}
+
+// decode a single token with logits
+static int decode_token(llama_context * ctx, llama_token token, llama_pos pos, llama_seq_id seq_id) {
+    llama_batch batch = llama_batch_init(1, 0, 1);
+    batch.token   [0]    = token;
+    batch.pos     [0]    = pos;
+    batch.n_seq_id[0]    = 1;
+    batch.seq_id  [0][0] = seq_id;
+    batch.logits  [0]    = true;
+    batch.n_tokens       = 1;
+
+    const int ret = llama_decode(ctx, batch);
+
+    llama_batch_free(batch);
+
+    return ret;
+}
+
+// shifting a forked sequence copies the shared cells (whole blocks in paged mode)
+// and gives the same logits as shifting the source sequence, which is not affected
+static void test_fork_shift(llama_model * model) {
+    const int n_past = 20;
+    const int p_beg  = 6;
+    const int delta  = 5;
+
+    const llama_token token = tok(0, 2);
+
+    std::vector<float> ref_src;
+    std::vector<float> ref_dst;
+    {
+        llama_context * ctx = make_context(model, default_cparams(128, 1));
+
+        TEST_ASSERT(decode(ctx, 0, 0, n_past) == 0);
+        TEST_ASSERT(decode_token(ctx, token, n_past, 0) == 0);
+        ref_src = logits(ctx, model);
+
+        TEST_ASSERT(llama_kv_cache_seq_rm(ctx, 0, n_past, -1));
+        llama_kv_cache_seq_add(ctx, 0, p_beg, -1, delta);
+        TEST_ASSERT(decode_token(ctx, token, n_past + delta, 0) == 0);
+        ref_dst = logits(ctx, model);
+
+        llama_free(ctx);
+    }
+
+    for (uint32_t block_size : { 0u, 4u }) {
+        llama_context_params cparams = default_cparams(128, 2);
+        cparams.kv_block_size = block_size;
+
+        llama_context * ctx = make_context(model, cparams);
+
+        TEST_ASSERT(decode(ctx, 0, 0, n_past) == 0);
+
+        llama_kv_cache_seq_fork(ctx, 0, 1, -1, -1);
+        TEST_ASSERT(llama_get_kv_cache_used_cells(ctx) == n_past);
+
+        llama_kv_cache_seq_add(ctx, 1, p_beg, -1, delta);
+
+        // in paged mode, the blocks that hold [p_beg, n_past) are copied whole
+        const int n_copied = block_size ? n_past - p_beg/block_size*block_size : n_past - p_beg;
+        TEST_ASSERT(llama_get_kv_cache_used_cells(ctx) == n_past + n_copied);
+        TEST_ASSERT(seq_cells(ctx, 1).size() == (size_t) n_past);
+
+        TEST_ASSERT(decode_token(ctx, token, n_past + delta, 1) == 0);
+        TEST_ASSERT(logits_match(logits(ctx, model), ref_dst));
+
+        // the copies make the KV view longer than in the reference, which changes the rounding of the F16 sums
+        TEST_ASSERT(decode_token(ctx, token, n_past, 0) == 0);
+        TEST_ASSERT(logits_match(logits(ctx, model), ref_src, 1e-2f));
+
+        llama_free(ctx);
+    }
+}
+
+// the defragmentation is split in steps of defrag_max_cells cells, the sequences keep their logits and their new
+// tokens go after the compacted cells
+static void test_defrag_steps(llama_model * model) {
+    const int n_step  = 8;
+    const int n_past  = 4*n_step;
+    const int n_extra = 10;
+
+    std::vector<float> ref;
+    {
+        llama_context * ctx = make_context(model, default_cparams(256, 1));
+
+        for (int p = 0; p < n_past; p += n_step) {
+            TEST_ASSERT(decode(ctx, 1, p, n_step) == 0);
+        }
+        TEST_ASSERT(decode(ctx, 1, n_past, n_extra) == 0);
+        ref = logits(ctx, model);
+
+        llama_free(ctx);
+    }
+
+    for (uint32_t block_size : { 0u, 8u }) {
+        llama_context_params cparams = default_cparams(256, 2);
+        cparams.kv_block_size    = block_size;
+        cparams.defrag_max_cells = n_step;
+
+        llama_context * ctx = make_context(model, cparams);
+
+        for (int p = 0; p < n_past; p += n_step) {
+            TEST_ASSERT(decode(ctx, 0, p, n_step) == 0);
+            TEST_ASSERT(decode(ctx, 1, p, n_step) == 0);
+        }
+
+        TEST_ASSERT(llama_kv_cache_seq_rm(ctx, 0, -1, -1));
+
+        llama_kv_cache_defrag(ctx);
+
+        int n_steps = 0;
+        do {
+            llama_kv_cache_update(ctx);
+            n_steps++;
+        } while (llama_kv_cache_defrag_pending(ctx));
+
+        // the holes of seq 0 in [0, n_past) hold 2*n_step cells of seq 1
+        TEST_ASSERT(n_steps >= 2);
+
+        std::vector<int> cells = seq_cells(ctx, 1);
+        TEST_ASSERT(cells.size() == (size_t) n_past && cells.back() == n_past - 1);
+
+        TEST_ASSERT(decode(ctx, 1, n_past, n_extra) == 0);
+        TEST_ASSERT(logits_match(logits(ctx, model), ref));
+
+        cells = seq_cells(ctx, 1);
+        TEST_ASSERT(cells.size() == (size_t) (n_past + n_extra) && cells.back() == n_past + n_extra - 1);
+
+        llama_free(ctx);
+    }
+}
+
+// n_seq_max is limited by the sequence sets of the cells
+static void test_max_seq(llama_model * model) {
+    const int n_seq_max = llama_max_parallel_sequences();
+
+    llama_context_params cparams = default_cparams(2*n_seq_max, n_seq_max + 1);
+    TEST_ASSERT(llama_new_context_with_model(model, cparams) == nullptr);
+
+    cparams.n_seq_max = n_seq_max;
+    llama_context * ctx = make_context(model, cparams);
+
+    // two tokens in each sequence
+    for (int s = 0; s < n_seq_max; ++s) {
+        TEST_ASSERT(decode(ctx, s, 0, 2) == 0);
+    }
+    TEST_ASSERT(llama_kv_cache_seq_pos_max(ctx, n_seq_max - 1) == 1);
+    TEST_ASSERT(llama_get_kv_cache_used_cells(ctx) == 2*n_seq_max);
+
+    llama_free(ctx);
+}
+
+// the per-sequence index follows removals at both ends and in the middle, and re-insertions
+static void test_seq_index(llama_model * model) {
+    llama_context * ctx = make_context(model, default_cparams(256, 1));
+
+    TEST_ASSERT(decode(ctx, 0, 0, 100) == 0);
+    TEST_ASSERT(llama_kv_cache_seq_pos_min(ctx, 0) == 0);
+    TEST_ASSERT(llama_kv_cache_seq_pos_max(ctx, 0) == 99);
+
+    // nothing in range
+    TEST_ASSERT(llama_kv_cache_seq_rm(ctx, 0, 200, 300));
+    TEST_ASSERT(llama_get_kv_cache_used_cells(ctx) == 100);
+
+    for (llama_pos p = 0; p < 70; ++p) {
+        TEST_ASSERT(llama_kv_cache_seq_rm(ctx, 0, p, p + 1));
+        TEST_ASSERT(llama_kv_cache_seq_pos_min(ctx, 0) == p + 1);
+    }
+    TEST_ASSERT(llama_kv_cache_seq_rm(ctx, 0, 80, 90));
+    TEST_ASSERT(llama_kv_cache_seq_rm(ctx, 0, 95, -1));
+    TEST_ASSERT(llama_kv_cache_seq_pos_min(ctx, 0) == 70);
+    TEST_ASSERT(llama_kv_cache_seq_pos_max(ctx, 0) == 94);
+    TEST_ASSERT(llama_get_kv_cache_used_cells(ctx) == 15);
+
+    // back to a full sequence, inserted before, between and after the remaining positions
+    TEST_ASSERT(decode(ctx, 0, 80, 10) == 0);
+    TEST_ASSERT(decode(ctx, 0, 0, 70) == 0);
+    TEST_ASSERT(decode(ctx, 0, 95, 5) == 0);
+    TEST_ASSERT(llama_kv_cache_seq_pos_min(ctx, 0) == 0);
+    TEST_ASSERT(llama_kv_cache_seq_pos_max(ctx, 0) == 99);
+    TEST_ASSERT(llama_get_kv_cache_used_cells(ctx) == 100);
+
+    TEST_ASSERT(llama_kv_cache_seq_rm(ctx, 0, -1, -1));
+    TEST_ASSERT(llama_kv_cache_seq_pos_min(ctx, 0) == -1);
+    TEST_ASSERT(llama_get_kv_cache_used_cells(ctx) == 0);
+
+    llama_free(ctx);
+}
+
+// a sequence saved with llama_state_seq_get_data() and restored after its cells were
+// reused by another sequence gives the same logits (this is how the server spills idle slots)
+static void test_seq_state_restore(llama_model * model) {
+    for (uint32_t block_size : { 0u, 4u }) {
+        llama_context_params cparams = default_cparams(256, 2);
+        cparams.kv_block_size = block_size;
+
+        llama_context * ctx = make_context(model, cparams);
+
+        for (int step = 0; step < 4; ++step) {
+            for (llama_seq_id s = 0; s < 2; ++s) {
+                TEST_ASSERT(decode(ctx, s, step*10, 10) == 0);
+            }
+        }
+
+        std::vector<uint8_t> state(llama_state_seq_get_size(ctx, 0));
+        TEST_ASSERT(llama_state_seq_get_data(ctx, state.data(), state.size(), 0) == state.size());
+
+        TEST_ASSERT(decode(ctx, 0, 40, 1) == 0);
+        const std::vector<float> ref = logits(ctx, model);
+
+        TEST_ASSERT(llama_kv_cache_seq_rm(ctx, 0, -1, -1));
+        TEST_ASSERT(decode(ctx, 1, 40, 30) == 0);
+
+        TEST_ASSERT(llama_state_seq_set_data(ctx, state.data(), state.size(), 0) == state.size());
+        TEST_ASSERT(llama_kv_cache_seq_pos_max(ctx, 0) == 39);
+
+        TEST_ASSERT(decode(ctx, 0, 40, 1) == 0);
+        TEST_ASSERT(logits_match(ref, logits(ctx, model)));
+
+        llama_free(ctx);
+    }
+}
+
+// with swa_ring, the cells out of the window of the largest position of a ubatch are evicted once it is computed:
+// a sequence continued from its last position keeps its window, but tokens decoded past the position it continues
+// from and removed again (the rejected drafts of speculative decoding) leave the window short, so the server
+// does not draft with swa_ring
+static void test_swa_ring_rollback(llama_model * model) {
+    const int n_swa = llama_n_swa(model);
+    TEST_ASSERT(n_swa > 0);
+
+    const int n_prompt = 3*n_swa;
+    const int n_draft  = 4;
+
+    // the cache of the SWA layers holds n_swa + n_ubatch cells, fewer than n_ctx
+    llama_context_params cparams = default_cparams(256, 1);
+    cparams.n_ubatch = 32;
+
+    std::vector<float> ref;
+    {
+        llama_context * ctx = make_context(model, cparams);
+
+        TEST_ASSERT(decode(ctx, 0, 0, n_prompt) == 0);
+        TEST_ASSERT(decode(ctx, 0, n_prompt, 1) == 0);
+        ref = logits(ctx, model);
+
+        llama_free(ctx);
+    }
+
+    cparams.swa_ring = true;
+
+    for (int n_rollback : { 0, n_draft }) {
+        llama_context * ctx = make_context(model, cparams);
+
+        TEST_ASSERT(decode(ctx, 0, 0, n_prompt) == 0);
+        if (n_rollback > 0) {
+            TEST_ASSERT(decode(ctx, 0, n_prompt, n_rollback) == 0);
+            TEST_ASSERT(llama_kv_cache_seq_rm(ctx, 0, n_prompt, -1));
+        }
+
+        const llama_pos pos_min = llama_kv_cache_seq_pos_min(ctx, 0);
+
+        if (n_rollback == 0) {
+            TEST_ASSERT(n_prompt - n_swa + 1 >= pos_min);
+
+            // the SWA layers attend fewer cells in another order
+            TEST_ASSERT(decode(ctx, 0, n_prompt, 1) == 0);
+            TEST_ASSERT(logits_match(ref, logits(ctx, model), 1e-2f));
+        } else {
+            // the window of position n_prompt is missing the cells evicted for the removed tokens
+            TEST_ASSERT(pos_min - (n_prompt - n_swa + 1) == n_rollback);
+        }
+
+        llama_free(ctx);
+    }
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <vocab-file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    make_random_model(argv[1], fname_model, "test-kv-cache", random_model_params());
+
+    llama_backend_init();
+
+    llama_log_set([](ggml_log_level level, const char * text, void * /*user_data*/) {
+        if (level == GGML_LOG_LEVEL_ERROR) {
+            fputs(text, stderr);
+        }
+    }, nullptr);
+
+    llama_model_params mparams = llama_model_default_params();
+    llama_model * model = llama_load_model_from_file(fname_model, mparams);
+    TEST_ASSERT(model != nullptr);
+
+    test_paged_logits(model);
+    test_paged_rollback(model);
+    test_seq_state_restore(model);
+    test_max_seq(model);
+    test_shift_sides(model);
+    test_fork_shift(model);
+    test_defrag_steps(model);
+    test_seq_index(model);
+
+    llama_free_model(model);
+
+    random_model_params hp_swa;
+    hp_swa.n_layer = 26; // the layer count of gemma2 2B, the graph of gemma2 depends on the model size
+    hp_swa.n_swa   = 16;
+
+    make_random_model(argv[1], fname_model, "test-kv-cache-swa", hp_swa);
+
+    model = llama_load_model_from_file(fname_model, mparams);
+    TEST_ASSERT(model != nullptr);
+
+    test_swa_ring_rollback(model);
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    remove(fname_model);
+
+    fprintf(stderr, "OK\n");
+
+    return 0;
+}
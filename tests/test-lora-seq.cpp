@@ -0,0 +1,274 @@
+// tests of the LoRA adapters selected per sequence, run on a tiny llama model with random weights
+// the model is built from the vocab file given on the command line, the adapters are random too
+
+#include "llama.h"
+#include "random-model.h"
+#include "ggml.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static const char * fname_model = "test-lora-seq.gguf";
+
+static const int n_embd    = 64;
+static const int n_layer   = 2;
+static const int n_head    = 4;
+static const int n_head_kv = 2;
+static const int n_ff      = 128;
+
+static const int n_embd_kv = n_embd/n_head*n_head_kv;
+
+// write a LoRA adapter with random weights of the given rank, for the given weights of each layer
+static void make_lora(const char * fname_out, int seed, int64_t rank, const std::vector<std::string> & names) {
+    struct gguf_context * dst = gguf_init_empty();
+
+    gguf_set_val_str(dst, "general.architecture", "llama");
+    gguf_set_val_str(dst, "general.type", "adapter");
+    gguf_set_val_str(dst, "adapter.type", "lora");
+    gguf_set_val_f32(dst, "adapter.lora.alpha", (float) rank/2);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ (size_t) n_layer*names.size()*2*rank*n_ff*sizeof(float) + 256*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist(0.0f, 0.2f);
+
+    auto add = [&](const std::string & name, int64_t ne0, int64_t ne1) {
+        struct ggml_tensor * t = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+        ggml_set_name(t, name.c_str());
+
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            data[i] = dist(rng);
+        }
+        gguf_add_tensor(dst, t);
+    };
+
+    for (int il = 0; il < n_layer; ++il) {
+        for (const auto & name : names) {
+            const int64_t n_in  = name == "ffn_down" ? n_ff : n_embd;
+            const int64_t n_out = name == "ffn_down" ? n_embd : name == "ffn_up" ? n_ff : name == "attn_v" ? n_embd_kv : n_embd;
+
+            const std::string base = "blk." + std::to_string(il) + "." + name + ".weight";
+
+            add(base + ".lora_a", n_in, rank);
+            add(base + ".lora_b", rank, n_out);
+        }
+    }
+
+    gguf_write_to_file(dst, fname_out, false);
+
+    ggml_free(ctx);
+    gguf_free(dst);
+}
+
+static llama_context * make_context(llama_model * model, uint32_t n_seq_max) {
+    llama_context_params cparams = llama_context_default_params();
+
+    cparams.n_ctx           = 256;
+    cparams.n_batch         = 256;
+    cparams.n_ubatch        = 256;
+    cparams.n_seq_max       = n_seq_max;
+    cparams.n_threads       = 2;
+    cparams.n_threads_batch = 2;
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    TEST_ASSERT(ctx != nullptr);
+
+    return ctx;
+}
+
+static llama_token tok(llama_pos pos, llama_seq_id seq_id) {
+    return 100 + (pos*7 + seq_id*13) % 1000;
+}
+
+// decode n tokens of each of the sequences in one batch, and return the logits of the last token of each
+static std::vector<std::vector<float>> decode(llama_context * ctx, const llama_model * model, const std::vector<llama_seq_id> & seq_ids, int n) {
+    llama_batch batch = llama_batch_init(n*seq_ids.size(), 0, 1);
+
+    for (size_t s = 0; s < seq_ids.size(); ++s) {
+        for (int i = 0; i < n; ++i) {
+            const int j = s*n + i;
+            batch.token   [j]    = tok(i, seq_ids[s]);
+            batch.pos     [j]    = i;
+            batch.n_seq_id[j]    = 1;
+            batch.seq_id  [j][0] = seq_ids[s];
+            batch.logits  [j]    = i == n - 1;
+        }
+    }
+    batch.n_tokens = n*seq_ids.size();
+
+    TEST_ASSERT(llama_decode(ctx, batch) == 0);
+
+    std::vector<std::vector<float>> res;
+    for (size_t s = 0; s < seq_ids.size(); ++s) {
+        const float * data = llama_get_logits_ith(ctx, (s + 1)*n - 1);
+        res.emplace_back(data, data + llama_n_vocab(model));
+    }
+
+    llama_batch_free(batch);
+
+    return res;
+}
+
+static float max_diff(const std::vector<float> & a, const std::vector<float> & b) {
+    TEST_ASSERT(a.size() == b.size());
+
+    float res = 0.0f;
+    for (size_t i = 0; i < a.size(); ++i) {
+        res = std::max(res, std::fabs(a[i] - b[i]));
+    }
+
+    return res;
+}
+
+// the logits of seq_id with the adapter applied to the whole context, the reference for the per-sequence adapters
+static std::vector<float> reference(llama_model * model, llama_lora_adapter * adapter, float scale, llama_seq_id seq_id, int n) {
+    llama_context * ctx = make_context(model, seq_id + 1);
+
+    if (adapter != nullptr) {
+        TEST_ASSERT(llama_lora_adapter_set(ctx, adapter, scale) == 0);
+    }
+
+    std::vector<float> res = decode(ctx, model, { seq_id }, n)[0];
+
+    llama_free(ctx);
+
+    return res;
+}
+
+// the stacks hold the adapters in F16
+static const float tol = 1e-2f;
+
+// the sequences of a batch with different adapters give the same logits as the adapters applied to the whole context
+static void test_seq_matches_context(llama_model * model, llama_lora_adapter * la, llama_lora_adapter * lb) {
+    const int n = 12;
+
+    const std::vector<float> ref_a    = reference(model, la,      0.7f, 0, n);
+    const std::vector<float> ref_b    = reference(model, lb,      1.0f, 1, n);
+    const std::vector<float> ref_none = reference(model, nullptr, 0.0f, 2, n);
+
+    // the adapters make a difference
+    TEST_ASSERT(max_diff(ref_a, reference(model, nullptr, 0.0f, 0, n)) > 0.1f);
+    TEST_ASSERT(max_diff(ref_b, reference(model, nullptr, 0.0f, 1, n)) > 0.1f);
+
+    llama_context * ctx = make_context(model, 3);
+
+    TEST_ASSERT(llama_lora_adapter_seq_set(ctx, la, 0, 0.7f) == 0);
+    TEST_ASSERT(llama_lora_adapter_seq_set(ctx, lb, 1, 1.0f) == 0);
+
+    const auto res = decode(ctx, model, { 0, 1, 2 }, n);
+
+    TEST_ASSERT(max_diff(res[0], ref_a)    < tol);
+    TEST_ASSERT(max_diff(res[1], ref_b)    < tol);
+    TEST_ASSERT(max_diff(res[2], ref_none) < tol);
+
+    llama_free(ctx);
+}
+
+// a sequence that switches through many adapters, with ranks that grow and shrink, while another one keeps its adapter
+// the freed slices of the stacks are reused, and the slices of the adapters in use survive their reallocation
+static void test_seq_switch(llama_model * model, llama_lora_adapter * la, const std::vector<llama_lora_adapter *> & adapters) {
+    const int n = 8;
+
+    const std::vector<float> ref_a = reference(model, la, 1.0f, 1, n);
+
+    llama_context * ctx = make_context(model, 2);
+
+    TEST_ASSERT(llama_lora_adapter_seq_set(ctx, la, 1, 1.0f) == 0);
+
+    for (int round = 0; round < 2; ++round) {
+        for (auto * adapter : adapters) {
+            llama_kv_cache_clear(ctx);
+
+            TEST_ASSERT(llama_lora_adapter_seq_set(ctx, adapter, 0, 1.0f) == 0);
+
+            const auto res = decode(ctx, model, { 0, 1 }, n);
+
+            TEST_ASSERT(max_diff(res[0], reference(model, adapter, 1.0f, 0, n)) < tol);
+            TEST_ASSERT(max_diff(res[1], ref_a) < tol);
+        }
+    }
+
+    // without an adapter
+    llama_kv_cache_clear(ctx);
+    llama_lora_adapter_seq_clear(ctx, 0);
+
+    const auto res = decode(ctx, model, { 0, 1 }, n);
+
+    TEST_ASSERT(max_diff(res[0], reference(model, nullptr, 0.0f, 0, n)) < tol);
+    TEST_ASSERT(max_diff(res[1], ref_a) < tol);
+
+    llama_free(ctx);
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <vocab-file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    random_model_params hp;
+    hp.n_embd    = n_embd;
+    hp.n_layer   = n_layer;
+    hp.n_head    = n_head;
+    hp.n_head_kv = n_head_kv;
+    hp.n_ff      = n_ff;
+
+    make_random_model(argv[1], fname_model, "test-lora-seq", hp);
+
+    const std::vector<std::pair<int64_t, std::vector<std::string>>> loras = {
+        { 4,  { "attn_q", "ffn_up" } },
+        { 8,  { "attn_q", "attn_v", "ffn_down" } },
+        { 2,  { "attn_output" } },
+        { 16, { "attn_q", "ffn_up" } },
+        { 4,  { "attn_v", "ffn_down" } },
+    };
+
+    std::vector<std::string> fname_loras;
+    for (size_t i = 0; i < loras.size(); ++i) {
+        fname_loras.push_back("test-lora-seq-" + std::to_string(i) + ".gguf");
+        make_lora(fname_loras.back().c_str(), 100 + i, loras[i].first, loras[i].second);
+    }
+
+    llama_backend_init();
+
+    llama_log_set([](ggml_log_level level, const char * text, void * /*user_data*/) {
+        if (level == GGML_LOG_LEVEL_ERROR) {
+            fputs(text, stderr);
+        }
+    }, nullptr);
+
+    llama_model_params mparams = llama_model_default_params();
+    llama_model * model = llama_load_model_from_file(fname_model, mparams);
+    TEST_ASSERT(model != nullptr);
+
+    std::vector<llama_lora_adapter *> adapters;
+    for (const auto & fname : fname_loras) {
+        adapters.push_back(llama_lora_adapter_init(model, fname.c_str()));
+        TEST_ASSERT(adapters.back() != nullptr);
+    }
+
+    test_seq_matches_context(model, adapters[0], adapters[1]);
+    test_seq_switch(model, adapters[0], { adapters[1], adapters[2], adapters[3], adapters[4], adapters[0] });
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    remove(fname_model);
+    for (const auto & fname : fname_loras) {
+        remove(fname.c_str());
+    }
+
+    fprintf(stderr, "OK\n");
+
+    return 0;
+}
@@ -0,0 +1,112 @@
+// compare the CPU ggml_out_prod of a quantized src0 broadcast over the heads (GQA), as used by the attention
+// with a quantized V cache and no flash attention, with a naive product of the dequantized rows
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+static float frand(void) {
+    return 2.0f*(float)rand()/(float)RAND_MAX - 1.0f;
+}
+
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
+    struct ggml_cplan plan = ggml_graph_plan(graph, n_threads, nullptr);
+
+    if (plan.work_size > 0) {
+        buf.resize(plan.work_size);
+        plan.work_data = buf.data();
+    }
+
+    ggml_graph_compute(graph, &plan);
+}
+
+// v: [n_embd_head, n_kv, n_head_kv], kq: [n_kv, n_tokens, n_head], result: [n_embd_head, n_tokens, n_head]
+static bool test_out_prod_q(ggml_type type, int64_t n_embd_head, int64_t n_kv, int64_t n_tokens, int64_t n_head_kv, int64_t n_head, int n_threads) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 16*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    std::vector<float> v_f32(n_embd_head*n_kv*n_head_kv);
+    for (auto & x : v_f32) {
+        x = frand();
+    }
+
+    struct ggml_tensor * v  = ggml_new_tensor_3d(ctx, type,          n_embd_head, n_kv,     n_head_kv);
+    struct ggml_tensor * kq = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_kv,        n_tokens, n_head);
+
+    ggml_quantize_chunk(type, v_f32.data(), v->data, 0, n_kv*n_head_kv, n_embd_head, nullptr);
+
+    float * kq_data = (float *) kq->data;
+    for (int64_t i = 0; i < ggml_nelements(kq); ++i) {
+        kq_data[i] = frand();
+    }
+
+    struct ggml_tensor * out = ggml_out_prod(ctx, v, ggml_transpose(ctx, kq));
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    std::vector<uint8_t> work_buffer;
+    ggml_graph_compute_helper(work_buffer, gf, n_threads);
+
+    // reference: the rows of v dequantized, each head of kq uses the kv head h/(n_head/n_head_kv)
+    std::vector<float> v_deq(v_f32.size());
+    ggml_get_type_traits(type)->to_float(v->data, v_deq.data(), v_deq.size());
+
+    const float * out_data = (const float *) out->data;
+
+    double max_err = 0.0;
+
+    for (int64_t h = 0; h < n_head; ++h) {
+        const int64_t h_kv = h/(n_head/n_head_kv);
+        for (int64_t t = 0; t < n_tokens; ++t) {
+            for (int64_t e = 0; e < n_embd_head; ++e) {
+                double ref = 0.0;
+                for (int64_t k = 0; k < n_kv; ++k) {
+                    ref += (double) v_deq[(h_kv*n_kv + k)*n_embd_head + e] * kq_data[(h*n_tokens + t)*n_kv + k];
+                }
+                const double err = std::fabs(ref - out_data[(h*n_tokens + t)*n_embd_head + e]);
+                max_err = std::max(max_err, err);
+            }
+        }
+    }
+
+    ggml_free(ctx);
+
+    const bool ok = max_err < 1e-4*n_kv;
+
+    printf("%s: type = %-6s, n_head_kv = %lld, n_head = %2lld, n_tokens = %2lld, n_threads = %d: max error = %g %s\n", __func__,
+            ggml_type_name(type), (long long) n_head_kv, (long long) n_head, (long long) n_tokens, n_threads, max_err, ok ? "OK" : "FAILED");
+
+    return ok;
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    srand(1234);
+
+    bool ok = true;
+
+    for (ggml_type type : { GGML_TYPE_Q8_0, GGML_TYPE_Q4_0, GGML_TYPE_Q4_1, GGML_TYPE_Q5_0, GGML_TYPE_Q5_1, GGML_TYPE_IQ4_NL }) {
+        for (int n_threads : { 1, 3 }) {
+            ok = test_out_prod_q(type, 64, 48, 1, 2, 8, n_threads) && ok;
+            ok = test_out_prod_q(type, 64, 48, 7, 2, 8, n_threads) && ok;
+            ok = test_out_prod_q(type, 64, 48, 7, 4, 4, n_threads) && ok;
+            ok = test_out_prod_q(type, 64, 48, 7, 1, 6, n_threads) && ok;
+        }
+    }
+
+    return ok ? 0 : 1;
+}